@@ -0,0 +1,382 @@
+// Kernel micro-benchmarks: bench [-p nproc] [name ...]
+// Runs the named benchmarks, or all of them, and prints one
+// line for each, for scripts to collect and compare:
+//   bench name iterations cycles-per-op
+// Times are rdtsc cycles; a first line
+//   bench tsc ticks cycles-per-tick
+// relates them to the timer.  The file benchmarks use the
+// current directory, so cd /tmp to measure the tmpfs.
+//
+// With -p, each benchmark runs in nproc processes at once,
+// each in a directory of its own, and the line is
+//   bench par name nproc ops-per-second
+// for the throughput of all of them; see bench.pl.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "x86.h"
+
+#define FILESZ  (64*1024)  // of the read and write benchmarks
+#define CHUNK   4096       // bytes per read or write
+#define HZ      100        // timer ticks per second
+
+char buf[CHUNK] __attribute__((aligned(4096)));  // pipes can hand pages over
+char *self;  // argv[0], for exec
+int quiet;   // one of several running at once: no report
+
+// n / d, without libgcc's 64-bit division.
+uint
+div64(uint64 n, uint d)
+{
+  uint64 q, r;
+  int i;
+
+  q = r = 0;
+  for(i = 63; i >= 0; i--){
+    r = r << 1 | ((n >> i) & 1);
+    q <<= 1;
+    if(r >= d){
+      r -= d;
+      q |= 1;
+    }
+  }
+  return q;
+}
+
+void
+report(char *name, int n, uint64 t)
+{
+  if(quiet)
+    return;
+  printf(1, "bench %s %d %d\n", name, n, div64(t, n));
+}
+
+void
+fail(char *what)
+{
+  printf(2, "bench: %s failed\n", what);
+  exit();
+}
+
+// Cycles per timer tick, over a few ticks.
+void
+calibrate(void)
+{
+  uint64 t;
+  int t0, n;
+
+  n = 10;
+  t0 = uptime();
+  while(uptime() == t0)
+    ;
+  t0 = uptime();
+  t = rdtsc();
+  while(uptime() < t0 + n)
+    ;
+  report("tsc", n, rdtsc() - t);
+}
+
+void
+bnull(char *name, int n)
+{
+  uint64 t;
+  int i;
+
+  t = rdtsc();
+  for(i = 0; i < n; i++)
+    _getpid();
+  report(name, n, rdtsc() - t);
+}
+
+void
+bfork(char *name, int n)
+{
+  uint64 t;
+  int i, pid;
+
+  t = rdtsc();
+  for(i = 0; i < n; i++){
+    if((pid = fork()) < 0)
+      fail("fork");
+    if(pid == 0)
+      exit();
+    wait();
+  }
+  report(name, n, rdtsc() - t);
+}
+
+void
+bexec(char *name, int n)
+{
+  char *argv[] = { self, "-x", 0 };
+  uint64 t;
+  int i, pid;
+
+  t = rdtsc();
+  for(i = 0; i < n; i++){
+    if((pid = fork()) < 0)
+      fail("fork");
+    if(pid == 0){
+      exec(self, argv);
+      fail("exec");
+    }
+    wait();
+  }
+  report(name, n, rdtsc() - t);
+}
+
+// Round trips of a byte between two processes.
+void
+bpipelat(char *name, int n)
+{
+  uint64 t;
+  int i, pid, p[2], q[2];
+  char c;
+
+  if(pipe(p) < 0 || pipe(q) < 0)
+    fail("pipe");
+  if((pid = fork()) < 0)
+    fail("fork");
+  if(pid == 0){
+    for(i = 0; i < n; i++){
+      if(read(p[0], &c, 1) != 1)
+        break;
+      write(q[1], &c, 1);
+    }
+    exit();
+  }
+  t = rdtsc();
+  for(i = 0; i < n; i++){
+    write(p[1], "x", 1);
+    if(read(q[0], &c, 1) != 1)
+      fail("pipe read");
+  }
+  t = rdtsc() - t;
+  wait();
+  close(p[0]);
+  close(p[1]);
+  close(q[0]);
+  close(q[1]);
+  report(name, n, t);
+}
+
+// CHUNK-byte writes from one process to another.
+void
+bpipebw(char *name, int n)
+{
+  uint64 t;
+  int i, m, pid, p[2];
+
+  if(pipe(p) < 0)
+    fail("pipe");
+  if((pid = fork()) < 0)
+    fail("fork");
+  if(pid == 0){
+    close(p[1]);
+    while(read(p[0], buf, sizeof(buf)) > 0)
+      ;
+    exit();
+  }
+  close(p[0]);
+  t = rdtsc();
+  for(i = 0; i < n; i++)
+    for(m = 0; m < CHUNK; )
+      m += write(p[1], buf + m, CHUNK - m);
+  close(p[1]);
+  wait();
+  report(name, n, rdtsc() - t);
+}
+
+// Grow by a page, touch it, and shrink again.
+void
+bsbrk(char *name, int n)
+{
+  uint64 t;
+  int i;
+  char *a;
+
+  t = rdtsc();
+  for(i = 0; i < n; i++){
+    if((a = sbrk(4096)) == (char*)-1)
+      fail("sbrk");
+    *a = 1;
+    sbrk(-4096);
+  }
+  report(name, n, rdtsc() - t);
+}
+
+void
+bcreate(char *name, int n)
+{
+  uint64 t;
+  int i, fd;
+
+  t = rdtsc();
+  for(i = 0; i < n; i++){
+    if((fd = open("bench.f", O_CREATE|O_RDWR)) < 0)
+      fail("create");
+    close(fd);
+    unlink("bench.f");
+  }
+  report(name, n, rdtsc() - t);
+}
+
+// Write a FILESZ file, then n times read or write a CHUNK of
+// it; in order, or at random CHUNK-aligned offsets.
+void
+brw(char *name, int n, int random, int writing)
+{
+  uint64 t;
+  uint x;
+  int i, fd, off, nchunk;
+
+  nchunk = FILESZ / CHUNK;
+  if((fd = open("bench.f", O_CREATE|O_RDWR)) < 0)
+    fail("create");
+  for(i = 0; i < nchunk; i++)
+    if(write(fd, buf, CHUNK) != CHUNK)
+      fail("write");
+  x = 1;
+  t = rdtsc();
+  for(i = 0; i < n; i++){
+    off = i % nchunk;
+    if(random){
+      x = x * 1103515245 + 12345;
+      off = (x >> 16) % nchunk;
+    }
+    if(writing){
+      if(pwrite(fd, buf, CHUNK, off * CHUNK) != CHUNK)
+        fail("pwrite");
+    } else if(pread(fd, buf, CHUNK, off * CHUNK) != CHUNK)
+      fail("pread");
+  }
+  t = rdtsc() - t;
+  close(fd);
+  unlink("bench.f");
+  report(name, n, t);
+}
+
+void bseqread(char *name, int n) { brw(name, n, 0, 0); }
+void bseqwrite(char *name, int n) { brw(name, n, 0, 1); }
+void brandread(char *name, int n) { brw(name, n, 1, 0); }
+void brandwrite(char *name, int n) { brw(name, n, 1, 1); }
+
+// stat() of a file four directories down.
+void
+blookup(char *name, int n)
+{
+  struct stat st;
+  uint64 t;
+  int i, fd;
+
+  if(mkdir("bench.d") < 0 || mkdir("bench.d/a") < 0 ||
+     mkdir("bench.d/a/b") < 0 || mkdir("bench.d/a/b/c") < 0 ||
+     (fd = open("bench.d/a/b/c/f", O_CREATE|O_RDWR)) < 0)
+    fail("mkdir");
+  close(fd);
+  t = rdtsc();
+  for(i = 0; i < n; i++)
+    if(stat("bench.d/a/b/c/f", &st) < 0)
+      fail("stat");
+  t = rdtsc() - t;
+  unlink("bench.d/a/b/c/f");
+  unlink("bench.d/a/b/c");
+  unlink("bench.d/a/b");
+  unlink("bench.d/a");
+  unlink("bench.d");
+  report(name, n, t);
+}
+
+struct bench {
+  char *name;
+  void (*fn)(char*, int);
+  int n;                   // iterations
+} benches[] = {
+  { "null",      bnull,      10000 },
+  { "fork",      bfork,      100 },
+  { "exec",      bexec,      50 },
+  { "pipelat",   bpipelat,   1000 },
+  { "pipebw",    bpipebw,    256 },
+  { "sbrk",      bsbrk,      1000 },
+  { "create",    bcreate,    100 },
+  { "seqwrite",  bseqwrite,  64 },
+  { "seqread",   bseqread,   64 },
+  { "randwrite", brandwrite, 64 },
+  { "randread",  brandread,  64 },
+  { "lookup",    blookup,    1000 },
+};
+
+#define NBENCH (sizeof(benches)/sizeof(benches[0]))
+
+// Run b in np processes at once and report their throughput.
+void
+parallel(struct bench *b, int np)
+{
+  char dir[] = "bench.p0";
+  int i, t0, t;
+
+  t0 = uptime();
+  for(i = 0; i < np; i++){
+    dir[7] = '0' + i;
+    if(mkdir(dir) < 0)
+      fail("mkdir");
+    if(fork() == 0){
+      if(chdir(dir) < 0)
+        fail("chdir");
+      quiet = 1;
+      b->fn(b->name, b->n);
+      exit();
+    }
+  }
+  for(i = 0; i < np; i++)
+    wait();
+  if((t = uptime() - t0) == 0)
+    t = 1;
+  for(i = 0; i < np; i++){
+    dir[7] = '0' + i;
+    unlink(dir);
+  }
+  printf(1, "bench par %s %d %d\n", b->name, np, np * b->n * HZ / t);
+}
+
+int
+main(int argc, char *argv[])
+{
+  static char path[64];
+  int i, j, np;
+
+  if(argc > 1 && strcmp(argv[1], "-x") == 0)
+    exit();  // the exec benchmark's child
+  self = argv[0];
+  np = 0;
+  if(argc > 2 && strcmp(argv[1], "-p") == 0){
+    np = atoi(argv[2]);
+    if(np < 1 || np > 10){
+      printf(2, "bench: -p takes 1 to 10\n");
+      exit();
+    }
+    argv += 2;
+    argc -= 2;
+    if(self[0] != '/' && strlen(self) + 4 <= sizeof(path)){
+      strcpy(path, "../");  // for exec from bench.pN
+      strcpy(path + 3, self);
+      self = path;
+    }
+  }
+  calibrate();
+  for(i = 0; i < NBENCH; i++){
+    if(argc > 1){
+      for(j = 1; j < argc && strcmp(argv[j], benches[i].name) != 0; j++)
+        ;
+      if(j == argc)
+        continue;
+    }
+    if(np)
+      parallel(&benches[i], np);
+    else
+      benches[i].fn(benches[i].name, benches[i].n);
+  }
+  exit();
+}
@@ -0,0 +1,88 @@
+#!/usr/bin/perl -w
+
+# Measure how xv6 scales with the number of CPUs.
+#   perl bench.pl maxcpus "name ..." qemu [arg ...]
+# For each CPU count n from 1 to maxcpus, boots the qemu command
+# with -smp n and runs bench -p n on the named benchmarks, n
+# copies of each at once, then lockstat.  Prints the throughput
+# of each benchmark against the CPU count, with the speedup over
+# one CPU, and the contention on the locks that limit scaling.
+# The Makefile's bench target runs this.
+
+use strict;
+use IPC::Open2;
+
+my @locks = ("ptable", "bcache", "bcache.bucket", "kmem", "kcache");
+
+die "usage: bench.pl maxcpus \"name ...\" qemu [arg ...]\n" unless @ARGV >= 3;
+my ($maxcpus, $names, @qemu) = @ARGV;
+
+my %ops;   # name => [ops/s by CPU count]
+my %lock;  # lock => [[acquire, contend, kcycles] by CPU count]
+my @order;
+
+sub run {
+    my ($n) = @_;
+    my @cmd = @qemu;
+    for(my $i = 0; $i < @cmd - 1; $i++){
+        $cmd[$i+1] = $n if $cmd[$i] eq "-smp";
+    }
+    my ($out, $in);
+    my $pid = open2($out, $in, @cmd);
+    local $SIG{ALRM} = sub { kill 9, $pid; die "bench.pl: timed out with $n cpus\n"; };
+    alarm(900);
+
+    my $sent = 0;
+    my $buf = "";
+    while(1){
+        my $line;
+        if(!$sent){
+            # Wait for the shell's prompt, which has no newline.
+            my $c;
+            last unless sysread($out, $c, 1);
+            $buf .= $c;
+            next unless $buf =~ /\$ $/;
+            print $in "lockstat -r\nbench -p $n $names\nlockstat\necho BENCHDONE\n";
+            $in->flush();
+            $sent = 1;
+            next;
+        }
+        last unless defined($line = <$out>);
+        $line =~ s/\r//g;
+        last if $line =~ /^(\$ )*BENCHDONE$/;
+        if($line =~ /bench par (\S+) (\d+) (\d+)/){
+            push @order, $1 unless exists $ops{$1};
+            $ops{$1}[$n] = $3;
+        } elsif($line =~ /^(\S+)\s+(sleep|spin)\s+(\d+)\s+(\d+)\s+(\d+)/){
+            my $name = $1;
+            $lock{$name}[$n] = [$3, $4, $5] if grep { $_ eq $name } @locks;
+        }
+    }
+    alarm(0);
+    kill 9, $pid;
+    waitpid($pid, 0);
+}
+
+for my $n (1..$maxcpus){
+    print STDERR "bench.pl: $n cpus\n";
+    run($n);
+}
+
+print "cpus  benchmark      ops/s  speedup\n";
+for my $name (@order){
+    my $base = $ops{$name}[1];
+    for my $n (1..$maxcpus){
+        my $v = $ops{$name}[$n];
+        next unless defined $v;
+        printf("%4d  %-10s %9d  %7.2f\n", $n, $name, $v,
+               $base ? $v / $base : 0);
+    }
+}
+print "\ncpus  lock             acquire   contend   kcycles\n";
+for my $name (@locks){
+    for my $n (1..$maxcpus){
+        my $v = $lock{$name}[$n];
+        next unless defined $v;
+        printf("%4d  %-15s %9d %9d %9d\n", $n, $name, @$v);
+    }
+}
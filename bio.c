@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -13,83 +13,246 @@
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
 //
-// The implementation uses two state flags internally:
+// The implementation uses three state flags internally:
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+// * B_ASYNC: a read-ahead or bawrite is in progress; the disk
+//     driver releases the buffer when it completes.
+//
+// Each hash bucket has its own lock, which protects the bucket's
+// chain and the refcnt of the buffers on it, so lookups of
+// different blocks don't contend.  Unused buffers are recycled
+// with the clock algorithm: a hand sweeps a ring of all buffers,
+// giving a second chance to any buffer used since the hand last
+// passed it.  Only recycling takes bcache.lock.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "proc.h"
+#include "trace.h"
 
-struct {
+#if BSIZE % 512 != 0 || PGSIZE % BSIZE != 0
+#error "BSIZE must be a multiple of 512 and divide PGSIZE"
+#endif
+
+// About four buffers per bucket, but keep the table
+// small enough for the kernel's statically mapped memory.
+#define NBUCKET ((NBUF)/4 < 13 ? 13 : (NBUF)/4 > 4093 ? 4093 : (NBUF)/4)
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;   // hash chain, through prev/next
+};
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+struct {
+  struct spinlock lock;   // serializes recycling; protects hand
+  struct buf *hand;       // clock hand, in the ring through cnext
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static int hitstat, missstat;  // stats.c counters
+
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev*31 + blockno) % NBUCKET];
+}
+
+// Allocate NBUF buffers from physical memory, so that the
+// cache size is limited by RAM rather than by the kernel's
+// static data.  Must be called after kinit2().
 void
 binit(void)
 {
-  struct buf *b;
+  struct buf *b, *last;
+  char *hdr, *data;
+  int i, nhdr, ndata;
 
   initlock(&bcache.lock, "bcache");
+  hitstat = statalloc("bcache.hit", 1);
+  missstat = statalloc("bcache.miss", 1);
+  for(i = 0; i < NBUCKET; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  // Carve buf headers and block data out of whole pages, and
+  // link every buffer into the clock ring.  Fresh buffers
+  // belong to no bucket until bget() assigns them a block.
+  hdr = data = 0;
+  nhdr = ndata = 0;
+  last = 0;
+  for(i = 0; i < NBUF; i++){
+    if(nhdr == 0){
+      if((hdr = kalloc()) == 0)
+        panic("binit: out of memory");
+      nhdr = PGSIZE / sizeof(struct buf);
+    }
+    if(ndata == 0){
+      if((data = kalloc()) == 0)
+        panic("binit: out of memory");
+      ndata = PGSIZE / BSIZE;
+    }
+    b = (struct buf*)hdr;
+    hdr += sizeof(*b);
+    nhdr--;
+    memset(b, 0, sizeof(*b));
+    b->data = (uchar*)data;
+    data += BSIZE;
+    ndata--;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    if(last)
+      last->cnext = b;
+    else
+      bcache.hand = b;
+    last = b;
   }
+  last->cnext = bcache.hand;
+}
+
+// Find the buffer for dev/blockno on bk's chain.
+// Caller must hold bk->lock.
+static struct buf*
+blookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Advance the clock hand to an unused buffer and unhash it,
+// or return 0 if there is none.
+// Buffers with changes that aren't on disk yet are pinned
+// by log.c; B_DIRTY is only set while a write is queued.
+// Caller must hold bcache.lock.
+static struct buf*
+bvictim(void)
+{
+  struct buf *b;
+  struct bucket *bk;
+  int n;
+
+  // Two full sweeps: the first may only clear recent bits.
+  for(n = 0; n < 2*NBUF; n++){
+    b = bcache.hand;
+    bcache.hand = b->cnext;
+
+    // Peek without the bucket lock; this is only a hint.
+    if(b->refcnt != 0 || (b->flags & B_DIRTY))
+      continue;
+    if(b->recent){
+      b->recent = 0;
+      continue;
+    }
+
+    bk = bhash(b->dev, b->blockno);
+    acquire(&bk->lock);
+    if(b->refcnt != 0 || (b->flags & B_DIRTY)){
+      release(&bk->lock);
+      continue;
+    }
+    // Buffers that have never held a block are on no chain.
+    if(b->prev)
+      b->prev->next = b->next;
+    else if(bk->head == b)
+      bk->head = b->next;
+    if(b->next)
+      b->next->prev = b->prev;
+    b->prev = b->next = 0;
+    release(&bk->lock);
+    return b;
+  }
+  return 0;
+}
+
+// Recycle an unused buffer to hold dev/blockno and add it
+// to bk's chain, with one reference.  Returns 0 if every
+// buffer is in use.  Caller must hold bcache.lock and have
+// checked that the block isn't already cached.
+static struct buf*
+binsert(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = bvictim()) == 0)
+    return 0;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = 0;
+  b->refcnt = 1;
+  acquire(&bk->lock);
+  b->prev = 0;
+  b->next = bk->head;
+  if(bk->head)
+    bk->head->prev = b;
+  bk->head = b;
+  release(&bk->lock);
+  return b;
+}
+
+// Look up dev/blockno and take a reference to it if cached.
+static struct buf*
+bcached(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  acquire(&bk->lock);
+  if((b = blookup(bk, dev, blockno)) != 0){
+    b->refcnt++;
+    b->recent = 1;
+  }
+  release(&bk->lock);
+  return b;
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
-// In either case, return locked buffer.
-static struct buf*
+// In either case, return locked buffer.  Callers that are
+// going to overwrite the whole block can use bget() instead
+// of bread() to skip reading it: B_VALID tells if it was read.
+struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
+  struct bucket *bk;
 
-  acquire(&bcache.lock);
+  bk = bhash(dev, blockno);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if((b = bcached(bk, dev, blockno)) != 0)
+    statinc(hitstat);
+  else {
+    // Not cached; recycle an unused buffer.  Only one CPU
+    // recycles at a time, so two can't both insert this block;
+    // look again in case someone else did while we were unlocked.
+    acquire(&bcache.lock);
+    if((b = bcached(bk, dev, blockno)) == 0 &&
+       (b = binsert(bk, dev, blockno)) == 0)
+      panic("bget: no buffers");
+    release(&bcache.lock);
+    statinc(missstat);
   }
+  acquiresleep(&b->lock);
+  return b;
+}
 
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
-  }
-  panic("bget: no buffers");
+// Start, or do, b's transfer on the device it belongs to.
+static void
+bdevrw(struct buf *b)
+{
+  if(b->dev == RAMDEV)
+    ramdiskrw(b);
+  else
+    iderw(b);
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -97,47 +260,153 @@ struct buf*
 bread(uint dev, uint blockno)
 {
   struct buf *b;
+  struct proc *p;
 
+  if((p = myproc()) != 0)
+    p->ru.nbread++;
   b = bget(dev, blockno);
+  trace(TR_BREAD, blockno, (b->flags & B_VALID) != 0);
   if((b->flags & B_VALID) == 0) {
-    iderw(b);
+    bdevrw(b);
   }
   return b;
 }
 
+// Start reading the indicated block into the cache, if it
+// isn't there already, without waiting for the disk.  The
+// driver calls bdone() when the read completes.  Read-ahead
+// is only a hint, so quietly do nothing if no buffer is free.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+  struct bucket *bk;
+
+  bk = bhash(dev, blockno);
+  acquire(&bk->lock);
+  b = blookup(bk, dev, blockno);
+  release(&bk->lock);
+  if(b)
+    return;
+
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  b = blookup(bk, dev, blockno);
+  release(&bk->lock);
+  b = b ? 0 : binsert(bk, dev, blockno);
+  release(&bcache.lock);
+  if(b == 0)
+    return;
+
+  acquiresleep(&b->lock);
+  if(b->flags & B_VALID){
+    brelse(b);
+    return;
+  }
+  b->flags |= B_ASYNC;
+  bdevrw(b);
+}
+
+// Start writing b's contents to disk and release b without
+// waiting.  The driver unlocks b when the write is done, so
+// locking the block again (e.g. with bread) waits for it.
+// Writes queued together for consecutive blocks go to the
+// disk as one request.
+void
+bawrite(struct buf *b)
+{
+  struct proc *p;
+
+  if(!holdingsleep(&b->lock))
+    panic("bawrite");
+  if((p = myproc()) != 0)
+    p->ru.nbwrite++;
+  b->flags |= B_DIRTY|B_ASYNC;
+  trace(TR_BWRITE, b->blockno, 0);
+  bdevrw(b);
+}
+
+// Release a buffer whose asynchronous read or write has finished.
+// Called by the disk driver, usually from its interrupt
+// handler, on behalf of the process that started the read.
+void
+bdone(struct buf *b)
+{
+  struct bucket *bk;
+
+  releasesleep(&b->lock);
+
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt--;
+  release(&bk->lock);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
+  struct proc *p;
+
   if(!holdingsleep(&b->lock))
     panic("bwrite");
+  if((p = myproc()) != 0)
+    p->ru.nbwrite++;
   b->flags |= B_DIRTY;
-  iderw(b);
+  trace(TR_BWRITE, b->blockno, 0);
+  bdevrw(b);
 }
 
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// Once unreferenced it becomes a candidate for recycling.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  release(&bk->lock);
+}
+// Keep b in the cache even once nobody is using it, e.g.
+// because it holds changes that are not yet on disk.
+// Pins are counted; each bpin() needs a bunpin().
+void
+bpin(struct buf *b)
+{
+  struct bucket *bk;
+
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt++;
+  release(&bk->lock);
+}
+
+void
+bunpin(struct buf *b)
+{
+  struct bucket *bk;
+
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt--;
+  release(&bk->lock);
+}
+
+// Release b, which is not worth caching, e.g. a block of a
+// file read O_DIRECT: the clock hand recycles it on its next
+// pass rather than giving it a second chance.
+void
+bdiscard(struct buf *b)
+{
+  b->recent = 0;
+  brelse(b);
 }
 //PAGEBREAK!
 // Blank page.
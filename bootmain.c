@@ -31,10 +31,12 @@ bootmain(void)
   if(elf->magic != ELF_MAGIC)
     return;  // let bootasm.S handle error
 
-  // Load each program segment (ignores ph flags).
+  // Load each loadable program segment (ignores ph flags).
   ph = (struct proghdr*)((uchar*)elf + elf->phoff);
   eph = ph + elf->phnum;
   for(; ph < eph; ph++){
+    if(ph->type != ELF_PROG_LOAD)
+      continue;
     pa = (uchar*)ph->paddr;
     readseg(pa, ph->filesz, ph->off);
     if(ph->memsz > ph->filesz)
@@ -47,7 +49,7 @@ bootmain(void)
   entry();
 }
 
-void
+static void
 waitdisk(void)
 {
   // Wait for disk ready.
@@ -55,22 +57,39 @@ waitdisk(void)
     ;
 }
 
-// Read a single sector at offset into dst.
-void
-readsect(void *dst, uint offset)
+// Wait for a sector's data: BSY clear and DRQ set.  The status
+// may be stale for 400ns after a command or a sector, which
+// reading the alternate status four times waits out.
+static void
+waitdrq(void)
+{
+  int i;
+
+  for(i = 0; i < 4; i++)
+    inb(0x3F6);
+  while((inb(0x1F7) & 0x88) != 0x08)
+    ;
+}
+
+// Read n sectors, at most 256, starting at sector offset
+// into dst, with one command.
+static void
+readsects(uchar *dst, uint offset, uint n)
 {
   // Issue command.
   waitdisk();
-  outb(0x1F2, 1);   // count = 1
+  outb(0x1F2, n);   // count; 0 means 256
   outb(0x1F3, offset);
   outb(0x1F4, offset >> 8);
   outb(0x1F5, offset >> 16);
   outb(0x1F6, (offset >> 24) | 0xE0);
   outb(0x1F7, 0x20);  // cmd 0x20 - read sectors
 
-  // Read data.
-  waitdisk();
-  insl(0x1F0, dst, SECTSIZE/4);
+  // Read data, as each sector becomes ready.
+  for(; n > 0; n--, dst += SECTSIZE){
+    waitdrq();
+    insl(0x1F0, dst, SECTSIZE/4);
+  }
 }
 
 // Read 'count' bytes at 'offset' from kernel into physical address 'pa'.
@@ -79,6 +98,7 @@ void
 readseg(uchar* pa, uint count, uint offset)
 {
   uchar* epa;
+  uint n;
 
   epa = pa + count;
 
@@ -88,9 +108,13 @@ readseg(uchar* pa, uint count, uint offset)
   // Translate from bytes to sectors; kernel starts at sector 1.
   offset = (offset / SECTSIZE) + 1;
 
-  // If this is too slow, we could read lots of sectors at a time.
+  // Read up to 256 sectors at a time.
   // We'd write more to memory than asked, but it doesn't matter --
   // we load in increasing order.
-  for(; pa < epa; pa += SECTSIZE, offset++)
-    readsect(pa, offset);
+  for(; pa < epa; pa += n*SECTSIZE, offset += n){
+    n = (epa - pa + SECTSIZE - 1) / SECTSIZE;
+    if(n > 256)
+      n = 256;
+    readsects(pa, offset, n);
+  }
 }
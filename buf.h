@@ -4,11 +4,15 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint recent;      // used since the clock hand last passed
+  struct buf *prev; // hash chain
   struct buf *next;
+  struct buf *cnext; // clock ring of all buffers
   struct buf *qnext; // disk queue
-  uchar data[BSIZE];
+  uchar *data;      // BSIZE bytes
 };
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_ASYNC 0x8  // nobody waits for the disk; driver releases buf
+#define B_NOCACHE 0x10  // O_DIRECT data: bdiscard() once written
 
@@ -10,6 +10,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "file.h"
+#include "fcntl.h"
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
@@ -118,6 +119,7 @@ panic(char *s)
   getcallerpcs(&s, pcs);
   for(i=0; i<10; i++)
     cprintf(" %p", pcs[i]);
+  uartflush();
   panicked = 1; // freeze other CPU
   for(;;)
     ;
@@ -128,17 +130,33 @@ panic(char *s)
 #define CRTPORT 0x3d4
 static ushort *crt = (ushort*)P2V(0xb8000);  // CGA memory
 
-static void
-cgaputc(int c)
+// Cursor position: col + 80*row.
+static int
+cgagetpos(void)
 {
   int pos;
 
-  // Cursor position: col + 80*row.
   outb(CRTPORT, 14);
   pos = inb(CRTPORT+1) << 8;
   outb(CRTPORT, 15);
   pos |= inb(CRTPORT+1);
+  return pos;
+}
+
+static void
+cgasetpos(int pos)
+{
+  outb(CRTPORT, 14);
+  outb(CRTPORT+1, pos>>8);
+  outb(CRTPORT, 15);
+  outb(CRTPORT+1, pos);
+  crt[pos] = ' ' | 0x0700;
+}
 
+// Put c at cursor position pos; return the new position.
+static int
+cgaput(int pos, int c)
+{
   if(c == '\n')
     pos += 80 - pos%80;
   else if(c == BACKSPACE){
@@ -154,22 +172,29 @@ cgaputc(int c)
     pos -= 80;
     memset(crt+pos, 0, sizeof(crt[0])*(24*80 - pos));
   }
+  return pos;
+}
 
-  outb(CRTPORT, 14);
-  outb(CRTPORT+1, pos>>8);
-  outb(CRTPORT, 15);
-  outb(CRTPORT+1, pos);
-  crt[pos] = ' ' | 0x0700;
+static void
+cgaputc(int c)
+{
+  cgasetpos(cgaput(cgagetpos(), c));
 }
 
-void
-consputc(int c)
+static void
+freeze(void)
 {
   if(panicked){
     cli();
     for(;;)
       ;
   }
+}
+
+void
+consputc(int c)
+{
+  freeze();
 
   if(c == BACKSPACE){
     uartputc('\b'); uartputc(' '); uartputc('\b');
@@ -184,6 +209,7 @@ struct {
   uint r;  // Read index
   uint w;  // Write index
   uint e;  // Edit index
+  struct pollwait *pollq;  // poll() callers waiting for a line
 } input;
 
 #define C(x)  ((x)-'@')  // Control-x
@@ -221,6 +247,7 @@ consoleintr(int (*getc)(void))
         if(c == '\n' || c == C('D') || input.e == input.r+INPUT_BUF){
           input.w = input.e;
           wakeup(&input.r);
+          pollwakeup(&input.pollq);
         }
       }
       break;
@@ -229,14 +256,19 @@ consoleintr(int (*getc)(void))
   release(&cons.lock);
   if(doprocdump) {
     procdump();  // now call procdump() wo. cons.lock held
+    logdump();
+    kmdump();
   }
 }
 
+// dst is user memory, which another thread may unmap: each
+// character is copied out with copyuser() and cons.lock released.
 int
-consoleread(struct inode *ip, char *dst, int n)
+consoleread(struct inode *ip, char *dst, uint off, int n)
 {
   uint target;
   int c;
+  char ch;
 
   iunlock(ip);
   target = n;
@@ -259,8 +291,14 @@ consoleread(struct inode *ip, char *dst, int n)
       }
       break;
     }
-    *dst++ = c;
+    release(&cons.lock);
+    ch = c;
+    if(copyuser(dst++, &ch, 1) < 0){
+      ilock(ip);
+      return -1;
+    }
     --n;
+    acquire(&cons.lock);
     if(c == '\n')
       break;
   }
@@ -270,21 +308,52 @@ consoleread(struct inode *ip, char *dst, int n)
   return target - n;
 }
 
+// buf is user memory; it is copied in a chunk at a time, before
+// taking cons.lock, since another thread may unmap it.
 int
 consolewrite(struct inode *ip, char *buf, int n)
 {
-  int i;
+  char kbuf[128];
+  int i, j, m, pos;
 
   iunlock(ip);
-  acquire(&cons.lock);
-  for(i = 0; i < n; i++)
-    consputc(buf[i] & 0xff);
-  release(&cons.lock);
+  for(i = 0; i < n; i += m){
+    m = n - i < sizeof(kbuf) ? n - i : sizeof(kbuf);
+    if(copyuser(kbuf, buf + i, m) < 0){
+      ilock(ip);
+      return -1;
+    }
+    acquire(&cons.lock);
+    freeze();
+    uartwrite(kbuf, m);
+    // Move the CGA cursor once for the lot.
+    pos = cgagetpos();
+    for(j = 0; j < m; j++)
+      pos = cgaput(pos, kbuf[j] & 0xff);
+    cgasetpos(pos);
+    release(&cons.lock);
+  }
   ilock(ip);
 
   return n;
 }
 
+// Input is ready once a line is in; output never waits.
+int
+consolepoll(struct inode *ip, int events, struct pollwait *w)
+{
+  int r;
+
+  acquire(&cons.lock);
+  r = events & POLLOUT;
+  if(input.r != input.w)
+    r |= events & POLLIN;
+  if(r == 0 && w)
+    pollregister(&input.pollq, &cons.lock, w);
+  release(&cons.lock);
+  return r;
+}
+
 void
 consoleinit(void)
 {
@@ -292,6 +361,7 @@ consoleinit(void)
 
   devsw[CONSOLE].write = consolewrite;
   devsw[CONSOLE].read = consoleread;
+  devsw[CONSOLE].poll = consolepoll;
   cons.locking = 1;
 
   ioapicenable(IRQ_KBD, 0);
@@ -0,0 +1,120 @@
+// Per-CPU record rings, for the profiler and the tracer.
+//
+// Only a CPU adds to its own ring, with interrupts off, so
+// recording needs no lock or atomics: cpuringput() hands out
+// the slot for the next record and cpuringpush() publishes it.
+// cpuringctl() drains the rings under the ring's lock.  Records
+// that find their ring full are counted and dropped, so a
+// reader that keeps up sees everything.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "cpuring.h"
+
+// Set up r to use rec, NCPU*nrec records of size bytes.
+void
+cpuringinit(struct cpuring *r, char *name, void *rec, uint size, uint nrec)
+{
+  if(size > CPURINGMAX)
+    panic("cpuringinit: size");
+  initlock(&r->lock, name);
+  r->rec = rec;
+  r->size = size;
+  r->nrec = nrec;
+}
+
+static char*
+slot(struct cpuring *r, int c, uint i)
+{
+  return r->rec + (c*r->nrec + i % r->nrec) * r->size;
+}
+
+// Return the slot for this CPU's next record, or 0 if r is
+// off or the ring is full.  Call with interrupts off, and
+// cpuringpush() once the record is filled in.
+void*
+cpuringput(struct cpuring *r)
+{
+  int c;
+
+  if(!r->on)
+    return 0;
+  c = cpuid();
+  if(r->cpu[c].head - r->cpu[c].tail == r->nrec){
+    r->cpu[c].lost++;
+    return 0;
+  }
+  return slot(r, c, r->cpu[c].head);
+}
+
+void
+cpuringpush(struct cpuring *r)
+{
+  __sync_synchronize();
+  r->cpu[cpuid()].head++;
+}
+
+// Drain up to n records into user memory at dst, each CPU's
+// in order.  Each record is taken under the lock and copied
+// out after, as copyuser() may fault.  Returns the number
+// copied, or -1 if r is off and every ring is empty.
+static int
+cpuringread(struct cpuring *r, char *dst, int n)
+{
+  char rec[CPURINGMAX];
+  int c, i;
+
+  if(n > ncpu*r->nrec)
+    n = ncpu*r->nrec;
+  i = 0;
+  for(c = 0; c < ncpu && i < n; c++){
+    acquire(&r->lock);
+    while(r->cpu[c].tail != r->cpu[c].head && i < n){
+      memmove(rec, slot(r, c, r->cpu[c].tail), r->size);
+      __sync_synchronize();
+      r->cpu[c].tail++;
+      release(&r->lock);
+      if(copyuser(dst + i++*r->size, rec, r->size) < 0)
+        return -1;
+      acquire(&r->lock);
+    }
+    release(&r->lock);
+  }
+  if(i == 0 && !r->on)
+    return -1;
+  return i;
+}
+
+// Carry out command cmd, reading into dst for RING_READ.
+int
+cpuringctl(struct cpuring *r, int cmd, char *dst, int n)
+{
+  int c, lost;
+
+  switch(cmd){
+  case RING_START:
+    acquire(&r->lock);
+    r->on = 0;
+    for(c = 0; c < ncpu; c++){
+      r->cpu[c].tail = r->cpu[c].head;
+      r->cpu[c].lost = 0;
+    }
+    r->on = 1;
+    release(&r->lock);
+    return 0;
+  case RING_STOP:
+    r->on = 0;
+    lost = 0;
+    for(c = 0; c < ncpu; c++)
+      lost += r->cpu[c].lost;
+    return lost;
+  case RING_READ:
+    return cpuringread(r, dst, n);
+  }
+  return -1;
+}
@@ -0,0 +1,22 @@
+// Rings of fixed-size records, one per CPU, as the profiler
+// and the tracer keep; see cpuring.c.
+
+// cpuringctl() commands, the same as PROF_* and TRACE_*.
+#define RING_STOP  0  // stop recording; returns records lost
+#define RING_START 1  // discard old records and start recording
+#define RING_READ  2  // drain records; -1 once stopped and drained
+
+#define CPURINGMAX 128  // largest record size
+
+struct cpuring {
+  struct spinlock lock;  // serializes readers
+  volatile int on;       // recording
+  char *rec;             // each CPU's nrec records in turn
+  uint size;             // bytes per record
+  uint nrec;             // per CPU; must be a power of 2
+  struct {
+    volatile uint head;  // next record written
+    volatile uint tail;  // next record read
+    uint lost;
+  } cpu[NCPU];
+};
@@ -0,0 +1,145 @@
+// Directory name lookup cache.
+//
+// Remembers what dirlookup() found for (device, directory inode,
+// name): the inode number and offset of the entry, or that there
+// is no such entry (inum 0).  A hit lets namex() step through a
+// directory without reading its blocks.
+//
+// A directory's entries change only under its inode's sleep lock,
+// and dirlookup(), dirlink() and unlink() hold it when they use
+// the cache, so an entry can be trusted while that lock is held.
+// dirlink() and unlink() update the entry for the name they
+// change; iput() drops those of an inode it frees, whose number
+// may come back as another directory.  dclock protects the table.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "fs.h"
+
+#define NDCHASH 127
+
+struct dentry {
+  uint dev;
+  uint dir;              // directory inode number; 0 if free
+  char name[DIRSIZ];
+  uint inum;             // 0 if dir has no such entry
+  uint off;              // offset of the dirent in dir
+  int used;              // referenced since the clock hand passed
+  struct dentry *next;   // hash chain
+};
+
+static struct spinlock dclock;
+static struct dentry dentry[NDCACHE];
+static struct dentry *dchash[NDCHASH];
+static int dchand;
+
+void
+dcinit(void)
+{
+  initlock(&dclock, "dcache");
+}
+
+static uint
+dchashfn(uint dev, uint dir, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev*31 + dir;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h*31 + (uchar)name[i];
+  return h % NDCHASH;
+}
+
+// Find the entry for (dev, dir, name).  Caller holds dclock.
+static struct dentry*
+dcfind(uint dev, uint dir, char *name, uint h)
+{
+  struct dentry *d;
+
+  for(d = dchash[h]; d; d = d->next)
+    if(d->dev == dev && d->dir == dir && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// Take d off its hash chain.  Caller holds dclock.
+static void
+dcunhash(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = &dchash[dchashfn(d->dev, d->dir, d->name)]; *pp != d;
+      pp = &(*pp)->next)
+    ;
+  *pp = d->next;
+  d->dir = 0;
+}
+
+// Look up name in directory dir; on a hit set *inum, which is 0
+// if the directory has no such entry, and *off, and return 1.
+int
+dclookup(uint dev, uint dir, char *name, uint *inum, uint *off)
+{
+  struct dentry *d;
+
+  acquire(&dclock);
+  if((d = dcfind(dev, dir, name, dchashfn(dev, dir, name))) == 0){
+    release(&dclock);
+    return 0;
+  }
+  d->used = 1;
+  *inum = d->inum;
+  *off = d->off;
+  release(&dclock);
+  return 1;
+}
+
+// Record that name in directory dir is inum at offset off,
+// or that there is no such name if inum is 0.
+void
+dcenter(uint dev, uint dir, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+  uint h;
+
+  acquire(&dclock);
+  h = dchashfn(dev, dir, name);
+  if((d = dcfind(dev, dir, name, h)) == 0){
+    // Clock replacement: skip entries used since the last pass.
+    for(;;){
+      d = &dentry[dchand];
+      dchand = (dchand + 1) % NDCACHE;
+      if(d->dir == 0 || !d->used)
+        break;
+      d->used = 0;
+    }
+    if(d->dir)
+      dcunhash(d);
+    d->dev = dev;
+    d->dir = dir;
+    strncpy(d->name, name, DIRSIZ);
+    d->next = dchash[h];
+    dchash[h] = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  d->used = 1;
+  release(&dclock);
+}
+
+// Forget inode inum of dev: the entries of it as a directory
+// and those naming it.
+void
+dcpurge(uint dev, uint inum)
+{
+  struct dentry *d;
+
+  acquire(&dclock);
+  for(d = dentry; d < &dentry[NDCACHE]; d++)
+    if(d->dir && d->dev == dev && (d->dir == inum || d->inum == inum))
+      dcunhash(d);
+  release(&dclock);
+}
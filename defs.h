@@ -1,19 +1,43 @@
 struct buf;
 struct context;
+struct cpu;
+struct cpuring;
+struct fdtable;
 struct file;
 struct inode;
+struct iovec;
+struct kmcache;
+struct lockclass;
+struct lockstat;
 struct pipe;
+struct pollfd;
+struct pollwait;
 struct proc;
+struct profsample;
+struct rwsleeplock;
+struct rwspinlock;
 struct rtcdate;
 struct spinlock;
+struct seqlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct tracerec;
+struct trapframe;
+struct vdso;
+struct vma;
 
 // bio.c
 void            binit(void);
+void            bawrite(struct buf*);
+void            bdiscard(struct buf*);
+void            bdone(struct buf*);
+struct buf*     bget(uint, uint);
+void            bpin(struct buf*);
 struct buf*     bread(uint, uint);
+void            breadahead(uint, uint);
 void            brelse(struct buf*);
+void            bunpin(struct buf*);
 void            bwrite(struct buf*);
 
 // console.c
@@ -22,17 +46,47 @@ void            cprintf(char*, ...);
 void            consoleintr(int(*)(void));
 void            panic(char*) __attribute__((noreturn));
 
+// cpuring.c
+int             cpuringctl(struct cpuring*, int, char*, int);
+void            cpuringinit(struct cpuring*, char*, void*, uint, uint);
+void            cpuringpush(struct cpuring*);
+void*           cpuringput(struct cpuring*);
+
+// dcache.c
+void            dcenter(uint, uint, char*, uint, uint);
+void            dcinit(void);
+int             dclookup(uint, uint, char*, uint*, uint*);
+void            dcpurge(uint, uint);
+
 // exec.c
 int             exec(char*, char**);
 
 // file.c
+int             fdclear(struct fdtable*, int, struct file*);
+struct file*    fdget(struct fdtable*, int);
+int             fdput(struct fdtable*, struct file*);
+struct fdtable* fdtalloc(struct fdtable*);
+void            fdtclose(struct fdtable*);
+struct fdtable* fdtdup(struct fdtable*);
 struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, char*, int n);
+int             filepoll(struct file*, int, struct pollwait*);
+int             filereadv(struct file*, struct iovec*, int, int);
+int             filesplice(struct file*, struct file*, int n);
 int             filestat(struct file*, struct stat*);
+int             filesync(struct file*);
 int             filewrite(struct file*, char*, int n);
+int             filewritev(struct file*, struct iovec*, int, int);
+
+// fpu.c
+void            fpufault(void);
+void            fpufork(struct proc*);
+void            fpuinit(void);
+void            fpureset(void);
+void            fpuswitch(struct proc*);
 
 // fs.c
 void            readsb(int dev, struct superblock *sb);
@@ -50,10 +104,13 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
+int             mount(struct inode*, uint);
+int             mounted(struct inode*);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
 
 // ide.c
+extern int      ideirq;
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
@@ -68,24 +125,53 @@ char*           kalloc(void);
 void            kfree(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+int             kprezero(void);
+extern uint     phystop;
+void            kref(char*);
+int             krefcount(char*);
+char*           kzalloc(void);
 
 // kbd.c
 void            kbdintr(void);
 
 // lapic.c
+uint            cmosmem(void);
 void            cmostime(struct rtcdate *r);
 int             lapicid(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
-void            lapicstartap(uchar, uint);
+void            lapicipi(int, int);
+void            lapicstartap(uchar*, int, uint);
+uint            lapicticks(void);
+void            lapictimer(uint);
 void            microdelay(int);
 
+// lockprof.c
+struct lockclass* lockclass(char*, int);
+int             lockstatread(struct lockstat*, int);
+void            lockstatrecord(struct lockclass*, struct cpu*, uint, uint64);
+
 // log.c
 void            initlog(int dev);
 void            log_write(struct buf*);
+void            log_write_data(struct buf*);
+void            log_write_range(struct buf*, uint, uint);
+void            logdump(void);
 void            begin_op();
 void            end_op();
+int             begin_write(int);
+void            end_write(int);
+void            log_sync(void);
+uint            log_seq(void);
+
+// mmap.c
+int             mmap(uint, int, int, struct inode*, uint);
+uint            mmapbase(struct proc*);
+int             munmap(uint, uint);
+void            vmafree(struct vma*);
+struct vma*     vmalookup(struct proc*, uint);
+void            vmasync(struct proc*);
 
 // mp.c
 extern int      ismp;
@@ -96,31 +182,74 @@ void            picenable(int);
 void            picinit(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
+int             pipedrain(struct pipe*, struct file*, int);
+int             pipefill(struct pipe*, struct file*, int);
 int             piperead(struct pipe*, char*, int);
+int             pipepoll(struct pipe*, int, int, struct pollwait*);
 int             pipewrite(struct pipe*, char*, int);
 
+// poll.c
+int             poll(struct file**, struct pollfd*, int, int);
+void            pollregister(struct pollwait**, struct spinlock*, struct pollwait*);
+
+// pagecache.c
+void            pcinit(void);
+char*           pcget(struct inode*, uint, uint);
+void            pcinval(struct inode*, uint, uint);
+
+// pci.c
+int             pcifind(int, uint, uint, int*, int*);
+uint            pciread(int, int, int);
+void            pciwrite(int, int, int, uint);
+
 //PAGEBREAK: 16
 // proc.c
 int             cpuid(void);
+int             clone(uint, uint, uint);
 void            exit(void);
 int             fork(void);
+int             futexwait(uint, int);
+int             futexwake(uint, int);
 int             growproc(int);
+int             join(uint*);
 int             kill(int);
+void            kthread(char*, void (*)(void));
 struct cpu*     mycpu(void);
 struct proc*    myproc();
+int             nice(int);
 void            pinit(void);
+void            pollsleep(int);
+void            pollwakeup(struct pollwait**);
 void            procdump(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+int             schedtick(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
+char*           swappick(uint);
 void            userinit(void);
+void            vmlock(struct proc*);
+void            vmunlock(struct proc*);
+int             vmunshare(struct proc*);
 int             wait(void);
 void            wakeup(void*);
 void            yield(void);
 
+// profile.c
+int             profile(int, struct profsample*, int);
+void            profinit(void);
+void            profsample(struct trapframe*);
+
+// swap.c
+void            swapdup(uint);
+void            swapfree(uint);
+char*           swapin(uint);
+void            swapinit(int);
+int             swapout(void);
+
 // swtch.S
 void            swtch(struct context**, struct context*);
 
@@ -133,12 +262,46 @@ void            release(struct spinlock*);
 void            pushcli(void);
 void            popcli(void);
 
+// ramdisk.c
+uchar*          ramdiskblock(uint, int);
+void            ramdiskfree(uint, uchar*);
+void            ramdiskinit(void);
+void            ramdiskrw(struct buf*);
+
+// rwlock.c
+void            initrwlock(struct rwspinlock*, char*);
+void            initrwsleeplock(struct rwsleeplock*, char*);
+void            racquire(struct rwspinlock*);
+void            racquiresleep(struct rwsleeplock*);
+void            rrelease(struct rwspinlock*);
+void            rreleasesleep(struct rwsleeplock*);
+uint            seqbegin(struct seqlock*);
+void            seqinit(struct seqlock*);
+int             seqretry(struct seqlock*, uint);
+void            seqwrite(struct seqlock*);
+void            seqwritedone(struct seqlock*);
+void            wacquire(struct rwspinlock*);
+void            wacquiresleep(struct rwsleeplock*);
+void            wrelease(struct rwspinlock*);
+void            wreleasesleep(struct rwsleeplock*);
+
+// slab.c
+struct kmcache* kmcreate(char*, uint);
+void            kmdump(void);
+void*           kmalloc(struct kmcache*);
+void            kmfree(struct kmcache*, void*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// stats.c
+int             statalloc(char*, int);
+void            statinc(int);
+void            statinit(void);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -151,24 +314,43 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
-int             argstr(int, char**);
+int             argstr(int, char*, int);
+void            callhold(struct file*);
 int             fetchint(uint, int*);
-int             fetchstr(uint, char**);
+int             fetchstr(uint, char*, int);
 void            syscall(void);
+void            syscallinit(void);
 
 // timer.c
 void            timerinit(void);
 
+// trace.c
+int             ktrace(int, struct tracerec*, int);
+void            trace(int, uint, uint);
+void            traceinit(void);
+
+// trapasm.S
+void            sysentry(void);
+void            sysentryflags(void);
+int             ucopy(void*, void*, uint, uint*);
+
 // trap.c
 void            idtinit(void);
+int             sleepticks(uint);
 extern uint     ticks;
+extern struct seqlock tickseq;
+void            timercancel(void);
+uint            timerexpire(void);
+void            timerset(uint);
 void            tvinit(void);
 extern struct spinlock tickslock;
 
 // uart.c
 void            uartinit(void);
 void            uartintr(void);
+void            uartflush(void);
 void            uartputc(int);
+void            uartwrite(char*, int);
 
 // vm.c
 void            seginit(void);
@@ -179,11 +361,26 @@ int             allocuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
-int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
-pde_t*          copyuvm(pde_t*, uint);
+pde_t*          copyuvm(pde_t*);
+int             pagefault(struct proc*, uint, uint);
+struct spinlock* ptlock(pde_t*);
+void            uvmfillwait(struct proc*);
+uint            uvmend(struct proc*, uint);
+int             uvmprefault(uint, uint, int);
+void            uvmunpin(void);
+int*            uvmfutex(uint, int*);
+int             copyuser(void*, void*, uint);
+char*           uvmdirty(pde_t*, uint);
+char*           uvmexchange(uint, char*);
+char*           uvmshare(uint);
+char*           uvmswapscan(pde_t*, uint*, int*, uint);
+void            resumeuvm(struct proc*);
+extern struct vdso *vdso;
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
+void            tlbflush(pde_t*, uint, uint);
+void            tlbintr(void);
 void            clearpteu(pde_t *pgdir, char *uva);
 
 // number of elements in fixed-size array
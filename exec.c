@@ -6,55 +6,88 @@
 #include "defs.h"
 #include "x86.h"
 #include "elf.h"
+#include "vdso.h"
+#include "fcntl.h"
 
+// exec() reads the file's first page into buf, which gets the
+// ELF header and normally the program headers after it in one
+// readi(), and later builds the new user stack in buf to copy
+// out at once.  The segments themselves are not read: they are
+// mapped, and their pages come from the page cache when first
+// touched (see fillpage()).
 int
 exec(char *path, char **argv)
 {
-  char *s, *last;
-  int i, off;
-  uint argc, sz, sp, ustack[3+MAXARG+1];
+  char *s, *last, *buf, *phs;
+  int i, n;
+  uint argc, sz, sp, len, stack, ustack[3+MAXARG+1];
+  struct vma vma[NVMA], *v;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
   pde_t *pgdir, *oldpgdir;
+  int newvm;
   struct proc *curproc = myproc();
 
+  if((buf = kalloc()) == 0)
+    return -1;
   begin_op();
 
   if((ip = namei(path)) == 0){
     end_op();
+    kfree(buf);
     cprintf("exec: fail\n");
     return -1;
   }
   ilock(ip);
   pgdir = 0;
+  newvm = 0;
+  memset(vma, 0, sizeof(vma));
 
   // Check ELF header
-  if(readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf))
+  if((n = readi(ip, buf, 0, PGSIZE)) < (int)sizeof(elf))
     goto bad;
+  memmove(&elf, buf, sizeof(elf));
   if(elf.magic != ELF_MAGIC)
     goto bad;
+  if(elf.phnum > PGSIZE / sizeof(ph))
+    goto bad;
+  len = elf.phnum * sizeof(ph);
+  phs = buf + elf.phoff;
+  if(elf.phoff > n || len > n - elf.phoff){
+    if(readi(ip, buf, elf.phoff, len) != len)
+      goto bad;
+    phs = buf;
+  }
 
   if((pgdir = setupkvm()) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Map the program's segments; their pages are read in
+  // from ip when first touched.
   sz = 0;
-  for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
-    if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
-      goto bad;
+  v = vma;
+  for(i = 0; i < elf.phnum; i++){
+    memmove(&ph, phs + i*sizeof(ph), sizeof(ph));
     if(ph.type != ELF_PROG_LOAD)
       continue;
     if(ph.memsz < ph.filesz)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
-      goto bad;
-    if(ph.vaddr % PGSIZE != 0)
+    if(ph.vaddr % PGSIZE != 0 || ph.vaddr < sz)
       goto bad;
-    if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.vaddr + ph.memsz >= VDSO || v == &vma[NVMA])
       goto bad;
+    v->start = ph.vaddr;
+    v->end = ph.vaddr + ph.memsz;
+    v->ip = idup(ip);
+    v->off = ph.off;
+    v->filesz = ph.filesz;
+    v->prot = PROT_READ|PROT_WRITE;
+    v->flags = MAP_PRIVATE;
+    v++;
+    sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
@@ -67,14 +100,17 @@ exec(char *path, char **argv)
     goto bad;
   clearpteu(pgdir, (char*)(sz - 2*PGSIZE));
   sp = sz;
+  stack = sz - PGSIZE;  // buf stands for the stack page
 
   // Push argument strings, prepare rest of stack in ustack.
   for(argc = 0; argv[argc]; argc++) {
     if(argc >= MAXARG)
       goto bad;
-    sp = (sp - (strlen(argv[argc]) + 1)) & ~3;
-    if(copyout(pgdir, sp, argv[argc], strlen(argv[argc]) + 1) < 0)
+    len = strlen(argv[argc]) + 1;
+    if(len + 4 > sp - stack)
       goto bad;
+    sp = (sp - len) & ~3;
+    memmove(buf + (sp - stack), argv[argc], len);
     ustack[3+argc] = sp;
   }
   ustack[3+argc] = 0;
@@ -83,9 +119,14 @@ exec(char *path, char **argv)
   ustack[1] = argc;
   ustack[2] = sp - (argc+1)*4;  // argv pointer
 
+  if((3+argc+1) * 4 > sp - stack)
+    goto bad;
   sp -= (3+argc+1) * 4;
-  if(copyout(pgdir, sp, ustack, (3+argc+1)*4) < 0)
+  memmove(buf + (sp - stack), ustack, (3+argc+1)*4);
+  if(copyout(pgdir, sp, buf + (sp - stack), sz - sp) < 0)
     goto bad;
+  kfree(buf);
+  buf = 0;
 
   // Save program name for debugging.
   for(last=s=path; *s; s++)
@@ -93,22 +134,43 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(curproc->name, last, sizeof(curproc->name));
 
-  // Commit to the user image.
+  // Commit to the user image.  A thread leaves the old one
+  // to the others sharing it, and becomes a process.
+  if((newvm = vmunshare(curproc)) < 0)
+    goto bad;
+  if(!newvm)
+    vmasync(curproc);
   oldpgdir = curproc->pgdir;
   curproc->pgdir = pgdir;
-  curproc->sz = sz;
+  curproc->vm->sz = sz;
+  curproc->ring = 0;
+  curproc->thread = 0;
+  fpureset();
   curproc->tf->eip = elf.entry;  // main
   curproc->tf->esp = sp;
   switchuvm(curproc);
-  freevm(oldpgdir);
+  if(!newvm){
+    freevm(oldpgdir);
+    begin_op();
+    vmafree(curproc->vm->vma);
+    end_op();
+  }
+  memmove(curproc->vm->vma, vma, sizeof(vma));
   return 0;
 
  bad:
+  if(buf)
+    kfree(buf);
   if(pgdir)
     freevm(pgdir);
   if(ip){
     iunlockput(ip);
     end_op();
   }
+  if(vma[0].end){
+    begin_op();
+    vmafree(vma);
+    end_op();
+  }
   return -1;
 }
@@ -2,3 +2,30 @@
 #define O_WRONLY  0x001
 #define O_RDWR    0x002
 #define O_CREATE  0x200
+#define O_DIRECT  0x400  // don't keep the file's blocks in the buffer cache
+
+// mmap()
+#define PROT_READ    0x1
+#define PROT_WRITE   0x2
+#define MAP_SHARED   0x01
+#define MAP_PRIVATE  0x02
+#define MAP_ANON     0x20
+
+// readv(), writev()
+struct iovec {
+  void *iov_base;
+  uint iov_len;
+};
+
+// poll()
+struct pollfd {
+  int fd;
+  short events;   // POLLIN and/or POLLOUT
+  short revents;  // those ready, or POLLERR, POLLHUP, POLLNVAL
+};
+
+#define POLLIN    0x001
+#define POLLOUT   0x004
+#define POLLERR   0x008  // write end of a pipe with no reader
+#define POLLHUP   0x010  // read end of a pipe with no writer
+#define POLLNVAL  0x020  // fd not open
@@ -6,20 +6,25 @@
 #include "defs.h"
 #include "param.h"
 #include "fs.h"
+#include "stat.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "fcntl.h"
 
 struct devsw devsw[NDEV];
 struct {
-  struct spinlock lock;
-  struct file file[NFILE];
+  struct spinlock lock;  // protects file reference counts and fdtables
+  struct kmcache *cache;
+  struct kmcache *fdtcache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kmcreate("file", sizeof(struct file));
+  ftable.fdtcache = kmcreate("fdtable", sizeof(struct fdtable));
 }
 
 // Allocate a file structure.
@@ -28,16 +33,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmalloc(ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -66,9 +66,8 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  kmfree(ftable.cache, f);
 
   if(ff.type == FD_PIPE)
     pipeclose(ff.pipe, ff.writable);
@@ -79,7 +78,131 @@ fileclose(struct file *f)
   }
 }
 
+// Allocate a file table.  If t is not 0, it holds references
+// to t's files, for fork(); else it is empty.
+struct fdtable*
+fdtalloc(struct fdtable *t)
+{
+  struct fdtable *nt;
+  int fd;
+
+  if((nt = kmalloc(ftable.fdtcache)) == 0)
+    return 0;
+  memset(nt, 0, sizeof(*nt));
+  nt->ref = 1;
+  if(t){
+    acquire(&ftable.lock);
+    for(fd = 0; fd < NOFILE; fd++)
+      if((nt->ofile[fd] = t->ofile[fd]) != 0)
+        nt->ofile[fd]->ref++;
+    release(&ftable.lock);
+  }
+  return nt;
+}
+
+// Share file table t, for clone().
+struct fdtable*
+fdtdup(struct fdtable *t)
+{
+  acquire(&ftable.lock);
+  t->ref++;
+  release(&ftable.lock);
+  return t;
+}
+
+// Let go of file table t, closing its files if it was the
+// last reference.
+void
+fdtclose(struct fdtable *t)
+{
+  int fd;
+
+  acquire(&ftable.lock);
+  if(--t->ref > 0){
+    release(&ftable.lock);
+    return;
+  }
+  release(&ftable.lock);
+  for(fd = 0; fd < NOFILE; fd++)
+    if(t->ofile[fd])
+      fileclose(t->ofile[fd]);
+  kmfree(ftable.fdtcache, t);
+}
+
+// Return a new reference to the file at fd in t, or 0 if
+// there is none.  A reference, as another thread sharing t
+// may close fd meanwhile.
+struct file*
+fdget(struct fdtable *t, int fd)
+{
+  struct file *f;
+
+  if(fd < 0 || fd >= NOFILE)
+    return 0;
+  acquire(&ftable.lock);
+  if((f = t->ofile[fd]) != 0)
+    f->ref++;
+  release(&ftable.lock);
+  return f;
+}
+
+// Put f in the lowest free slot of t, which takes over the
+// caller's reference.  Returns the slot, or -1 if t is full.
+int
+fdput(struct fdtable *t, struct file *f)
+{
+  int fd;
+
+  acquire(&ftable.lock);
+  for(fd = 0; fd < NOFILE; fd++){
+    if(t->ofile[fd] == 0){
+      t->ofile[fd] = f;
+      release(&ftable.lock);
+      return fd;
+    }
+  }
+  release(&ftable.lock);
+  return -1;
+}
+
+// Empty slot fd of t if it still holds f, and pass its
+// reference to the caller.  Returns -1 if it doesn't.
+int
+fdclear(struct fdtable *t, int fd, struct file *f)
+{
+  int r;
+
+  r = -1;
+  acquire(&ftable.lock);
+  if(t->ofile[fd] == f){
+    t->ofile[fd] = 0;
+    r = 0;
+  }
+  release(&ftable.lock);
+  return r;
+}
+
 // Get metadata about file f.
+// Return which of events f is ready for.  If none, and w is
+// not 0, register w to be woken when that may change.  Files
+// and devices without a poll function never block.
+int
+filepoll(struct file *f, int events, struct pollwait *w)
+{
+  struct inode *ip;
+
+  if(f->type == FD_PIPE)
+    return pipepoll(f->pipe, f->writable, events, w);
+  if(f->type == FD_INODE){
+    ip = f->ip;
+    if(ip->type == T_DEV && ip->major >= 0 && ip->major < NDEV &&
+       devsw[ip->major].poll)
+      return devsw[ip->major].poll(ip, events, w);
+    return events & ((f->readable ? POLLIN : 0) | (f->writable ? POLLOUT : 0));
+  }
+  panic("filepoll");
+}
+
 int
 filestat(struct file *f, struct stat *st)
 {
@@ -92,66 +215,205 @@ filestat(struct file *f, struct stat *st)
   return -1;
 }
 
-// Read from file f.
+// Wait until f's data and metadata are on disk.
 int
-fileread(struct file *f, char *addr, int n)
+filesync(struct file *f)
 {
-  int r;
+  if(f->type != FD_INODE)
+    return -1;
+  log_sync();
+  return 0;
+}
+
+// Fault in the iovcnt buffers of iov with uvmprefault(), which
+// pins the process once for each until iovunpin().
+static int
+iovprefault(struct iovec *iov, int iovcnt, int write)
+{
+  int i;
+
+  for(i = 0; i < iovcnt; i++){
+    if(uvmprefault((uint)iov[i].iov_base, iov[i].iov_len, write) < 0){
+      while(i-- > 0)
+        uvmunpin();
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void
+iovunpin(int iovcnt)
+{
+  while(iovcnt-- > 0)
+    uvmunpin();
+}
+
+// Read from file f into the iovcnt buffers of iov, at offset
+// off, or at f->off (moving it on) if off is -1.  Reading a
+// pipe or device fills only the first non-empty buffer, since
+// reading on might block with data already in hand.
+int
+filereadv(struct file *f, struct iovec *iov, int iovcnt, int off)
+{
+  struct inode *ip;
+  int i, r, tot, npin;
+  uint o;
 
   if(f->readable == 0)
     return -1;
-  if(f->type == FD_PIPE)
-    return piperead(f->pipe, addr, n);
+  if(f->type == FD_PIPE){
+    if(off != -1)
+      return -1;
+    for(i = 0; i < iovcnt && iov[i].iov_len == 0; i++)
+      ;
+    if(i == iovcnt)
+      return 0;
+    return piperead(f->pipe, iov[i].iov_base, iov[i].iov_len);
+  }
   if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
-    return r;
+    ip = f->ip;
+    // Fault the buffers in first: their pages may come from ip.
+    // Not for a device, which may block for long, not pinned;
+    // the type of an open inode doesn't change.
+    npin = ip->type == T_DEV ? 0 : iovcnt;
+    if(iovprefault(iov, npin, 1) < 0)
+      return -1;
+    ilock(ip);
+    ip->nocache = f->direct;
+    o = off == -1 ? f->off : off;
+    tot = 0;
+    for(i = 0; i < iovcnt; i++){
+      if(iov[i].iov_len == 0)
+        continue;
+      if((r = readi(ip, iov[i].iov_base, o + tot, iov[i].iov_len)) < 0){
+        if(tot == 0)
+          tot = -1;
+        break;
+      }
+      tot += r;
+      if(r < iov[i].iov_len || ip->type == T_DEV)
+        break;
+    }
+    if(tot > 0 && off == -1)
+      f->off += tot;
+    ip->nocache = 0;
+    iunlock(ip);
+    iovunpin(npin);
+    return tot;
   }
   panic("fileread");
 }
 
+// Read from file f.
+int
+fileread(struct file *f, char *addr, int n)
+{
+  struct iovec iov;
+
+  iov.iov_base = addr;
+  iov.iov_len = n;
+  return filereadv(f, &iov, 1, -1);
+}
+
 //PAGEBREAK!
-// Write to file f.
+// Write the iovcnt buffers of iov to file f, at offset off,
+// or at f->off (moving it on) if off is -1.
 int
-filewrite(struct file *f, char *addr, int n)
+filewritev(struct file *f, struct iovec *iov, int iovcnt, int off)
 {
-  int r;
+  struct inode *ip;
+  int i, r, n, m, n1, max, done, tot;
+  uint o;
 
   if(f->writable == 0)
     return -1;
-  if(f->type == FD_PIPE)
-    return pipewrite(f->pipe, addr, n);
+  if(f->type == FD_PIPE){
+    if(off != -1)
+      return -1;
+    tot = 0;
+    for(i = 0; i < iovcnt; i++){
+      if(pipewrite(f->pipe, iov[i].iov_base, iov[i].iov_len) < 0)
+        return -1;
+      tot += iov[i].iov_len;
+    }
+    return tot;
+  }
   if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
-      end_op();
-
-      if(r < 0)
+    // Each transaction writes as much as begin_write()
+    // says the log has room for, from as many of the
+    // buffers as that covers.
+    ip = f->ip;
+    if(iovprefault(iov, iovcnt, 0) < 0)  // as in filereadv()
+      return -1;
+    n = 0;
+    for(i = 0; i < iovcnt; i++)
+      n += iov[i].iov_len;
+    i = 0;
+    done = 0;  // bytes of iov[i] written
+    r = 0;
+    for(tot = 0; tot < n; tot += m){
+      max = begin_write(n - tot);
+      ilock(ip);
+      ip->nocache = f->direct;
+      o = off == -1 ? f->off : off + tot;
+      for(m = 0; m < max && i < iovcnt; m += r){
+        n1 = iov[i].iov_len - done;
+        if(n1 > max - m)
+          n1 = max - m;
+        if((r = writei(ip, (char*)iov[i].iov_base + done, o + m, n1)) < 0)
+          break;
+        if(r != n1){  // disk full
+          m += r;
+          r = -1;
+          break;
+        }
+        if((done += r) == iov[i].iov_len){
+          i++;
+          done = 0;
+        }
+      }
+      if(off == -1)
+        f->off += m;
+      ip->nocache = 0;
+      iunlock(ip);
+      end_write(max);
+
+      if(r < 0){
+        tot += m;
         break;
-      if(r != n1)
-        panic("short filewrite");
-      i += r;
+      }
     }
-    return i == n ? n : -1;
+    iovunpin(iovcnt);
+    if(f->direct && tot == n)
+      log_sync();  // O_DIRECT data is on disk on return
+    return tot == n ? n : -1;
   }
   panic("filewrite");
 }
 
+// Write to file f.
+int
+filewrite(struct file *f, char *addr, int n)
+{
+  struct iovec iov;
+
+  iov.iov_base = addr;
+  iov.iov_len = n;
+  return filewritev(f, &iov, 1, -1);
+}
+
+// Move up to n bytes from file in to file out without copying
+// through user space.  One of them must be a pipe and the other
+// an ordinary file.  Returns the number of bytes moved, or -1.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+  if(in->type == FD_INODE && in->ip->type == T_FILE && out->type == FD_PIPE)
+    return pipefill(out->pipe, in, n);
+  if(in->type == FD_PIPE && out->type == FD_INODE && out->ip->type == T_FILE)
+    return pipedrain(in->pipe, out, n);
+  return -1;
+}
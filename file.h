@@ -3,35 +3,63 @@ struct file {
   int ref; // reference count
   char readable;
   char writable;
+  char direct;    // opened O_DIRECT
   struct pipe *pipe;
   struct inode *ip;
   uint off;
 };
 
+// The open files of a process, which threads made by clone()
+// share.  ftable.lock guards ref and the slots.
+struct fdtable {
+  int ref;                     // Processes using it
+  struct file *ofile[NOFILE];  // Open files
+};
+
 
 // in-memory copy of an inode
 struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // icache hash chain
+  struct inode *lprev, *lnext; // icache LRU list, while ref is 0
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint ranext;        // block a sequential readi() would read next
+  uint raend;         // first block past the read-ahead window
+  uint exbn;          // bmap() cache: file blocks exbn..exbn+exlen-1
+  uint exaddr;        // are at disk blocks exaddr..
+  uint exlen;
+  uint bgoal;         // where bmap() looks for a block to allocate
+  int nocache;        // set around readi()/writei() of an O_DIRECT file
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
+};
+
+// A poll() caller's entry on the wait queue of a pipe or
+// device; see poll.c.
+struct pollwait {
+  struct proc *proc;
+  struct pollwait **q;     // queue it is on, or 0
+  struct spinlock *lk;     // the lock protecting q
+  struct pollwait *next;
 };
 
 // table mapping major device number to
-// device functions
+// device functions; poll may be 0 (always ready)
 struct devsw {
-  int (*read)(struct inode*, char*, int);
+  int (*read)(struct inode*, char*, uint, int);
   int (*write)(struct inode*, char*, int);
+  int (*poll)(struct inode*, int, struct pollwait*);
 };
 
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define STATS   2
@@ -0,0 +1,114 @@
+// Lazy FPU and SSE state switching.
+//
+// The FPU is off (CR0.TS set) whenever a process is switched in,
+// so its first FPU or SSE instruction traps (T_DEVICE) into
+// fpufault(), which turns the FPU on and loads the process's
+// state, unless this CPU's registers hold it already.  sched()
+// calls fpuswitch() to save the state, only if the process used
+// the FPU while it ran, and turn the FPU off again.  Processes
+// that never use the FPU never pay for it.  Since the state is
+// saved at every switch, the saved copy is current whenever the
+// process is not running, so it can move to another CPU.
+//
+// The kernel itself uses no FPU or SSE instructions.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "mmu.h"
+#include "proc.h"
+#include "vdso.h"
+
+#define CPUID_FXSR (1<<24)
+#define CPUID_SSE  (1<<25)
+#define CPUID_SSE2 (1<<26)
+
+static uchar initfpu[512+16];  // state of a fresh FPU
+
+static void*
+fparea(uchar *a)
+{
+  return (void*)(((uint)a + 15) & ~15);
+}
+
+// Set up this CPU's FPU, and leave it off.
+void
+fpuinit(void)
+{
+  uint d, mxcsr;
+
+  cpuinfo(1, 0, 0, 0, &d);
+  if(!(d & CPUID_FXSR))
+    panic("fpuinit: no fxsave");
+  lcr0((rcr0() | CR0_MP | CR0_NE) & ~(CR0_EM | CR0_TS));
+  if(d & CPUID_SSE)
+    lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+  if(cpuid() == 0){
+    mxcsr = 0x1f80;  // all SIMD exceptions masked
+    asm volatile("fninit");
+    if(d & CPUID_SSE)
+      asm volatile("ldmxcsr %0" : : "m" (mxcsr));
+    fxsave(fparea(initfpu));
+    if(d & CPUID_SSE2)
+      vdso->hwcap |= HWCAP_SSE2;
+  }
+  lcr0(rcr0() | CR0_TS);
+}
+
+// T_DEVICE: the current process wants the FPU.
+void
+fpufault(void)
+{
+  struct cpu *c = mycpu();
+  struct proc *p = c->proc;
+
+  if(p == 0)
+    panic("fpufault: kernel used FPU");
+  clts();
+  if(c->fpuowner == p && p->fpucpu == c - cpus)
+    return;  // still loaded
+  fxrstor(fparea(p->fpuused ? p->fpu : initfpu));
+  p->fpuused = 1;
+  p->fpucpu = c - cpus;
+  c->fpuowner = p;
+}
+
+// p, the current process, is giving up the CPU:
+// save its FPU state if it has been using the FPU.
+// Caller must have interrupts off.
+void
+fpuswitch(struct proc *p)
+{
+  if(rcr0() & CR0_TS)
+    return;
+  fxsave(fparea(p->fpu));
+  lcr0(rcr0() | CR0_TS);
+}
+
+// Give np, a fork child, a copy of the current process's state.
+void
+fpufork(struct proc *np)
+{
+  struct proc *p = myproc();
+
+  pushcli();
+  if(!(rcr0() & CR0_TS))
+    fxsave(fparea(p->fpu));
+  popcli();
+  memmove(fparea(np->fpu), fparea(p->fpu), 512);
+  np->fpuused = p->fpuused;
+}
+
+// Start the current process over with a fresh FPU, for exec.
+void
+fpureset(void)
+{
+  struct proc *p = myproc();
+
+  pushcli();
+  p->fpuused = 0;
+  p->fpucpu = -1;
+  lcr0(rcr0() | CR0_TS);
+  popcli();
+}
@@ -17,15 +17,36 @@
 #include "proc.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "rwlock.h"
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
-// there should be one superblock per disk device, but we run with
-// only one device
-struct superblock sb; 
+
+// Per-device file system state, for the root disk and for disks
+// mounted on a directory of another file system.  The allocation
+// state is kept in memory: where the last block allocation ended,
+// the number of free blocks each bitmap block maps (counted when
+// the file system is first used) so that full ones need not be
+// read, and the lowest inode number that may be free.
+#define MAXFSSIZE (FSSIZE > RAMDISKSIZE ? FSSIZE : RAMDISKSIZE)
+
+struct fsdev {
+  int active;
+  struct superblock sb;
+  struct spinlock lock;  // protects the allocation state
+  uint bnext;
+  ushort nfree[MAXFSSIZE/BPB + 1];
+  uchar freed[MAXFSSIZE/8];  // blocks bfree()d in transaction freedseq
+  uint freedseq;
+  uint inext;
+  struct inode *mnt;     // directory mounted on; 0 for the root
+};
+
+static struct fsdev fsdev[NBDEV];
+static struct spinlock mountlock;  // protects fsdev[].active, mnt
 
 // Read the super block.
 void
@@ -38,62 +59,183 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
-// Zero a block.
+// Zero a block.  A regular file's data block is ordered data,
+// like what writei() writes into it, rather than logged; see
+// log.c.
 static void
-bzero(int dev, int bno)
+bzero(int dev, int bno, int data)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bget(dev, bno);
   memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  bp->flags |= B_VALID;
+  if(data)
+    log_write_data(bp);
+  else
+    log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Return the first bit in [start, end) that is clear in map
+// and, unless it is 0, in busy, or -1.
+static int
+bfind(uchar *map, uchar *busy, int start, int end)
+{
+  int bi, m;
+
+  for(bi = start; bi < end; bi++){
+    m = map[bi/8] | (busy ? busy[bi/8] : 0);
+    if(bi % 8 == 0 && m == 0xFF){
+      bi += 7;
+      continue;
+    }
+    if((m & (1 << (bi % 8))) == 0)
+      return bi;
+  }
+  return -1;
+}
+
+// The blocks of fs freed in the open transaction, which balloc()
+// must not hand out again until it commits, or 0 if there are
+// none.  A new owner's data is written home as ordered data
+// before the commit, so a crash before it would leave the old
+// owner, whose freeing never committed, with the new data.
+// The RAM disk doesn't outlive a crash.
+static uchar*
+bfreed(uint dev, uint b)
+{
+  struct fsdev *fs;
+
+  fs = &fsdev[dev];
+  if(dev == RAMDEV || fs->freedseq != log_seq())
+    return 0;
+  return fs->freed + b/8;
+}
+
+// Allocate a zeroed disk block, the first free one at or after
+// goal if there is one, else wrapping around; a goal of 0 means
+// where the last allocation ended.  data is set for a regular
+// file's data block.  Returns 0 if the disk is full, or for the
+// RAM disk if there is no memory for the block's page.
 static uint
-balloc(uint dev)
+balloc(uint dev, uint goal, int data)
 {
-  int b, bi, m;
+  struct fsdev *fs;
+  int i, n, bi, nbmap;
+  uint b;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  fs = &fsdev[dev];
+  if(goal == 0 || goal >= fs->sb.size)
+    goal = fs->bnext;
+  nbmap = (fs->sb.size + BPB - 1) / BPB;
+  for(i = 0; i <= nbmap; i++){
+    n = (goal/BPB + i) % nbmap;
+    if(fs->nfree[n] == 0)
+      continue;
+    b = n * BPB;
+    bp = bread(dev, BBLOCK(b, fs->sb));
+    bi = bfind(bp->data, bfreed(dev, b), i == 0 ? goal % BPB : 0,
+               min(BPB, fs->sb.size - b));
+    if(bi >= 0 && dev == RAMDEV && ramdiskblock(b + bi, 1) == 0){
+      brelse(bp);
+      return 0;
+    }
+    if(bi >= 0){
+      bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+      log_write_range(bp, bi/8, 1);
+      brelse(bp);
+      acquire(&fs->lock);
+      fs->nfree[n]--;
+      fs->bnext = b + bi + 1;
+      release(&fs->lock);
+      bzero(dev, b + bi, data);
+      return b + bi;
     }
     brelse(bp);
   }
-  panic("balloc: out of blocks");
+  return 0;
+}
+
+// Allocate a block for ip, after the last one allocated for it:
+// a data block if data is set, else an indirect block.
+// Returns 0 if there are none left.
+static uint
+bnext(struct inode *ip, int data)
+{
+  uint addr;
+
+  if((addr = balloc(ip->dev, ip->bgoal, data && ip->type == T_FILE)) != 0)
+    ip->bgoal = addr + 1;
+  return addr;
 }
 
 // Free a disk block.
 static void
 bfree(int dev, uint b)
 {
+  struct fsdev *fs;
   struct buf *bp;
   int bi, m;
+  uint seq;
 
-  bp = bread(dev, BBLOCK(b, sb));
+  fs = &fsdev[dev];
+  bp = bread(dev, BBLOCK(b, fs->sb));
   bi = b % BPB;
   m = 1 << (bi % 8);
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
-  log_write(bp);
+  log_write_range(bp, bi/8, 1);
+  if(dev == RAMDEV)
+    ramdiskfree(b, bp->data);
+  seq = log_seq();
+  acquire(&fs->lock);
+  fs->nfree[b/BPB]++;
+  if(dev != RAMDEV){  // see bfreed()
+    if(fs->freedseq != seq){
+      memset(fs->freed, 0, sizeof(fs->freed));
+      fs->freedseq = seq;
+    }
+    fs->freed[b/8] |= m;
+  }
+  release(&fs->lock);
   brelse(bp);
 }
 
+// Read dev's super block and count the free blocks in each
+// bitmap block.  Returns -1 if dev holds no file system this
+// kernel can use.
+static int
+fsread(uint dev)
+{
+  struct fsdev *fs;
+  struct buf *bp;
+  uint b;
+  int bi;
+
+  fs = &fsdev[dev];
+  readsb(dev, &fs->sb);
+  if(fs->sb.bsize != BSIZE || fs->sb.size > MAXFSSIZE ||
+     fs->sb.size < fs->sb.bmapstart)
+    return -1;
+  initlock(&fs->lock, "fsdev");
+  for(b = 0; b < fs->sb.size; b += BPB){
+    bp = bread(dev, BBLOCK(b, fs->sb));
+    fs->nfree[b/BPB] = 0;
+    for(bi = 0; bi < BPB && b + bi < fs->sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        fs->nfree[b/BPB]++;
+    brelse(bp);
+  }
+  fs->bnext = 0;
+  fs->inext = 1;
+  return 0;
+}
+
 // Inodes.
 //
 // An inode describes a single unnamed file.
@@ -130,7 +272,7 @@ bfree(int dev, uint b)
 //   cache entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid when it frees the inode on disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -154,35 +296,52 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// In-memory inodes come from a slab cache; the icache hashes them
+// by (dev, inum).  When an inode's ref drops to 0 it stays cached
+// on an LRU list, so that opening it again needs no disk read,
+// until more than NICACHE are unreferenced and it is the oldest.
+// The icache.lock reader-writer spin-lock protects the table, so
+// lookups can run in parallel.  Since ip->dev and ip->inum
+// indicate which i-node an entry holds, one must hold icache.lock
+// while using ip->ref, ip->dev, ip->inum, ip->next or the LRU
+// links.  Readers may only raise a non-zero ip->ref, atomically;
+// other changes need the lock held for writing.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NICHASH 127
+
 struct {
-  struct spinlock lock;
-  struct inode inode[NINODE];
+  struct rwspinlock lock;
+  struct inode *hash[NICHASH];
+  struct inode lru;      // head of unreferenced inodes, oldest first
+  int nlru;
+  struct kmcache *cache;
 } icache;
 
+#define IHASH(dev, inum) (((dev)*31 + (inum)) % NICHASH)
+
 void
 iinit(int dev)
 {
-  int i = 0;
-  
-  initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  struct superblock *sb;
+
+  initrwlock(&icache.lock, "icache");
+  icache.cache = kmcreate("inode", sizeof(struct inode));
+  icache.lru.lprev = icache.lru.lnext = &icache.lru;
 
-  readsb(dev, &sb);
+  initlock(&mountlock, "mount");
+
+  if(fsread(dev) < 0)
+    panic("iinit: bad file system (block size not BSIZE?)");
+  fsdev[dev].active = 1;
+  sb = &fsdev[dev].sb;
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
- inodestart %d bmap start %d\n", sb.size, sb.nblocks,
-          sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
-          sb.bmapstart);
+ inodestart %d bmap start %d\n", sb->size, sb->nblocks,
+          sb->ninodes, sb->nlog, sb->logstart, sb->inodestart,
+          sb->bmapstart);
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -194,18 +353,25 @@ static struct inode* iget(uint dev, uint inum);
 struct inode*
 ialloc(uint dev, short type)
 {
+  struct fsdev *fs;
   int inum;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
+  fs = &fsdev[dev];
+  for(inum = fs->inext; inum < fs->sb.ninodes; inum++){
+    bp = bread(dev, IBLOCK(inum, fs->sb));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
+      // mark it allocated on the disk
+      log_write_range(bp, (uchar*)dip - bp->data, sizeof(*dip));
       brelse(bp);
+      acquire(&fs->lock);
+      if(fs->inext == inum)
+        fs->inext = inum + 1;
+      release(&fs->lock);
       return iget(dev, inum);
     }
     brelse(bp);
@@ -223,7 +389,7 @@ iupdate(struct inode *ip)
   struct buf *bp;
   struct dinode *dip;
 
-  bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+  bp = bread(ip->dev, IBLOCK(ip->inum, fsdev[ip->dev].sb));
   dip = (struct dinode*)bp->data + ip->inum%IPB;
   dip->type = ip->type;
   dip->major = ip->major;
@@ -231,7 +397,7 @@ iupdate(struct inode *ip)
   dip->nlink = ip->nlink;
   dip->size = ip->size;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
-  log_write(bp);
+  log_write_range(bp, (uchar*)dip - bp->data, sizeof(*dip));
   brelse(bp);
 }
 
@@ -241,32 +407,47 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&icache.lock);
-
-  // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&icache.lock);
+  struct inode *ip;
+  uint h;
+
+  // Is the inode already cached and in use?
+  h = IHASH(dev, inum);
+  racquire(&icache.lock);
+  for(ip = icache.hash[h]; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum && ip->ref > 0){
+      __sync_fetch_and_add(&ip->ref, 1);
+      rrelease(&icache.lock);
+      return ip;
+    }
+  }
+  rrelease(&icache.lock);
+
+  // Look again, since another CPU may have added it meanwhile,
+  // or take it off the LRU list.
+  wacquire(&icache.lock);
+  for(ip = icache.hash[h]; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0){
+        ip->lprev->lnext = ip->lnext;
+        ip->lnext->lprev = ip->lprev;
+        icache.nlru--;
+      }
+      wrelease(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  // Allocate a new inode cache entry.
+  if((ip = kmalloc(icache.cache)) == 0)
     panic("iget: no inodes");
-
-  ip = empty;
+  memset(ip, 0, sizeof(*ip));
+  initsleeplock(&ip->lock, "inode");
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
-  ip->valid = 0;
-  release(&icache.lock);
+  ip->next = icache.hash[h];
+  icache.hash[h] = ip;
+  wrelease(&icache.lock);
 
   return ip;
 }
@@ -276,9 +457,9 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&icache.lock);
-  ip->ref++;
-  release(&icache.lock);
+  racquire(&icache.lock);
+  __sync_fetch_and_add(&ip->ref, 1);
+  rrelease(&icache.lock);
   return ip;
 }
 
@@ -296,7 +477,7 @@ ilock(struct inode *ip)
   acquiresleep(&ip->lock);
 
   if(ip->valid == 0){
-    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+    bp = bread(ip->dev, IBLOCK(ip->inum, fsdev[ip->dev].sb));
     dip = (struct dinode*)bp->data + ip->inum%IPB;
     ip->type = dip->type;
     ip->major = dip->major;
@@ -305,6 +486,7 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->exlen = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -322,8 +504,7 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry is freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -331,24 +512,53 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
+  struct inode **pp;
+
   acquiresleep(&ip->lock);
   if(ip->valid && ip->nlink == 0){
-    acquire(&icache.lock);
+    racquire(&icache.lock);
     int r = ip->ref;
-    release(&icache.lock);
+    rrelease(&icache.lock);
     if(r == 1){
       // inode has no links and no other references: truncate and free.
       itrunc(ip);
       ip->type = 0;
       iupdate(ip);
       ip->valid = 0;
+      dcpurge(ip->dev, ip->inum);
+      acquire(&fsdev[ip->dev].lock);
+      if(ip->inum < fsdev[ip->dev].inext)
+        fsdev[ip->dev].inext = ip->inum;
+      release(&fsdev[ip->dev].lock);
     }
   }
   releasesleep(&ip->lock);
 
-  acquire(&icache.lock);
-  ip->ref--;
-  release(&icache.lock);
+  wacquire(&icache.lock);
+  if(--ip->ref == 0){
+    if(ip->valid){
+      // Keep it, at the young end of the LRU list.
+      ip->lprev = icache.lru.lprev;
+      ip->lnext = &icache.lru;
+      ip->lprev->lnext = ip;
+      icache.lru.lprev = ip;
+      if(++icache.nlru <= NICACHE){
+        wrelease(&icache.lock);
+        return;
+      }
+      // Evict the oldest instead.
+      ip = icache.lru.lnext;
+      ip->lprev->lnext = ip->lnext;
+      ip->lnext->lprev = ip->lprev;
+      icache.nlru--;
+    }
+    for(pp = &icache.hash[IHASH(ip->dev, ip->inum)]; *pp != ip;
+        pp = &(*pp)->next)
+      ;
+    *pp = ip->next;
+    kmfree(icache.cache, ip);
+  }
+  wrelease(&icache.lock);
 }
 
 // Common idiom: unlock, then put.
@@ -365,40 +575,121 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT], and the NDINDIRECT after
+// those in the blocks listed in block ip->addrs[NDIRECT+1].
+//
+// So that mapping a big file need not read an indirect block
+// for every block, bmap() remembers the run of consecutive disk
+// blocks that the last indirect block it read maps the looked-up
+// block into; the blocks after it are usually in the same run.
+
+// Return entry i of indirect block addr, allocating a block for
+// it if necessary and alloc is set; bn is the file block it maps,
+// as a start for ip's cached run.
+static uint
+indirect(struct inode *ip, uint addr, uint i, uint bn, int alloc)
+{
+  struct buf *bp;
+  uint *a, n;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if((addr = a[i]) == 0){
+    if(!alloc){
+      brelse(bp);
+      return 0;
+    }
+    if((a[i] = addr = bnext(ip, 1)) == 0){
+      brelse(bp);
+      return 0;
+    }
+    log_write_range(bp, i*sizeof(uint), sizeof(uint));
+  }
+  for(n = 1; i+n < NINDIRECT && a[i+n] == addr+n; n++)
+    ;
+  brelse(bp);
+  ip->exbn = bn;
+  ip->exaddr = addr;
+  ip->exlen = n;
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one if alloc is set,
+// and otherwise returns 0: directories can have holes (see fs.h).
+// It also returns 0 if allocating finds the disk full.
 static uint
-bmap(struct inode *ip, uint bn)
+bmap(struct inode *ip, uint bn, int alloc)
 {
-  uint addr, *a;
+  uint addr, n, *a;
   struct buf *bp;
 
   if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+    if((addr = ip->addrs[bn]) == 0 && alloc)
+      ip->addrs[bn] = addr = bnext(ip, 1);
     return addr;
   }
-  bn -= NDIRECT;
+  if(bn - ip->exbn < ip->exlen)
+    return ip->exaddr + (bn - ip->exbn);
+  n = bn - NDIRECT;
 
-  if(bn < NINDIRECT){
+  if(n < NINDIRECT){
     // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+    if((addr = ip->addrs[NDIRECT]) == 0){
+      if(!alloc || (addr = bnext(ip, 0)) == 0)
+        return 0;
+      ip->addrs[NDIRECT] = addr;
+    }
+    return indirect(ip, addr, n, bn, alloc);
+  }
+  n -= NINDIRECT;
+
+  if(n < NDINDIRECT){
+    // Load the double-indirect block, then the indirect block.
+    if((addr = ip->addrs[NDIRECT+1]) == 0){
+      if(!alloc || (addr = bnext(ip, 0)) == 0)
+        return 0;
+      ip->addrs[NDIRECT+1] = addr;
+    }
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+    if((addr = a[n / NINDIRECT]) == 0 && alloc &&
+       (addr = bnext(ip, 0)) != 0){
+      a[n / NINDIRECT] = addr;
+      log_write_range(bp, (n / NINDIRECT)*sizeof(uint), sizeof(uint));
     }
     brelse(bp);
-    return addr;
+    if(addr == 0)
+      return 0;
+    return indirect(ip, addr, n % NINDIRECT, bn, alloc);
   }
 
   panic("bmap: out of range");
 }
 
+// Free indirect block addr and the blocks it lists;
+// depth 2 for a double-indirect block.
+static void
+freeindirect(uint dev, uint addr, int depth)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(depth > 1)
+      freeindirect(dev, a[j], depth - 1);
+    else
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, addr);
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
@@ -407,10 +698,10 @@ bmap(struct inode *ip, uint bn)
 static void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
 
+  pcinval(ip, 0, ip->size);
+  ip->exlen = 0;
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -419,16 +710,13 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
+    freeindirect(ip->dev, ip->addrs[NDIRECT], 1);
     ip->addrs[NDIRECT] = 0;
   }
+  if(ip->addrs[NDIRECT+1]){
+    freeindirect(ip->dev, ip->addrs[NDIRECT+1], 2);
+    ip->addrs[NDIRECT+1] = 0;
+  }
 
   ip->size = 0;
   iupdate(ip);
@@ -446,19 +734,63 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// readi() has just read blocks first through last of ip.
+// If that continues where the previous read left off, start
+// reading the next NREADAHEAD blocks in the background, so
+// that they are in the buffer cache by the time they are asked
+// for.  Blocks already read ahead aren't requested again.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint first, uint last)
+{
+  uint bn, end, nblocks, addr;
+
+  // Re-reading the tail of the last block counts as sequential.
+  if(first != ip->ranext && first + 1 != ip->ranext){
+    ip->ranext = last + 1;
+    ip->raend = last + 1;
+    return;
+  }
+  ip->ranext = last + 1;
+
+  nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  end = min(last + 1 + NREADAHEAD, nblocks);
+  bn = ip->raend > last ? ip->raend : last + 1;
+  for(; bn < end; bn++)
+    if((addr = bmap(ip, bn, 0)) != 0)
+      breadahead(ip->dev, addr);
+  if(bn > ip->raend)
+    ip->raend = bn;
+}
+
+// Is ip a regular file on the tmpfs (the RAM disk)?  Its data
+// is read and written in place, not through the buffer cache
+// (see ramdisk.c).  Blocks are given to files only by balloc(),
+// whose bzero() overwrites any cached copy, so no stale copy
+// of a block is ever read.
+static int
+tmpfile(struct inode *ip)
+{
+  return ip->dev == RAMDEV && ip->type == T_FILE;
+}
+
 //PAGEBREAK!
 // Read data from inode.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock.  dst may be in user memory,
+// which another thread can unmap while the disk is read,
+// so it is copied to with copyuser(); -1 if that fails.
 int
 readi(struct inode *ip, char *dst, uint off, uint n)
 {
-  uint tot, m;
+  static char zeroes[BSIZE];
+  uint tot, m, start, addr;
   struct buf *bp;
+  int r;
 
   if(ip->type == T_DEV){
     if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read)
       return -1;
-    return devsw[ip->major].read(ip, dst, n);
+    return devsw[ip->major].read(ip, dst, off, n);
   }
 
   if(off > ip->size || off + n < off)
@@ -466,22 +798,43 @@ readi(struct inode *ip, char *dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  if(n == 0)
+    return 0;
+  start = off/BSIZE;
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
-    memmove(dst, bp->data + off%BSIZE, m);
-    brelse(bp);
+    if((addr = bmap(ip, off/BSIZE, 0)) == 0){
+      if(copyuser(dst, zeroes, m) < 0)  // a hole
+        return -1;
+      continue;
+    }
+    if(tmpfile(ip)){
+      if(copyuser(dst, ramdiskblock(addr, 1) + off%BSIZE, m) < 0)
+        return -1;
+      continue;
+    }
+    bp = bread(ip->dev, addr);
+    r = copyuser(dst, bp->data + off%BSIZE, m);
+    if(ip->nocache)
+      bdiscard(bp);
+    else
+      brelse(bp);
+    if(r < 0)
+      return -1;
   }
+  if(!tmpfile(ip) && !ip->nocache)  // O_DIRECT data isn't kept to be read
+    readahead(ip, start, (off-1)/BSIZE);
   return n;
 }
 
 // PAGEBREAK!
 // Write data to inode.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock.  src may be in user memory;
+// see readi().
 int
 writei(struct inode *ip, char *src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
 
   if(ip->type == T_DEV){
@@ -492,22 +845,42 @@ writei(struct inode *ip, char *src, uint off, uint n)
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if((uint64)off + n > (uint64)MAXFILE*BSIZE)  // MAXFILE*BSIZE may not fit a uint
     return -1;
+  if(n > 0)
+    pcinval(ip, off, n);
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    if((addr = bmap(ip, off/BSIZE, 1)) == 0)
+      break;  // disk full
     m = min(n - tot, BSIZE - off%BSIZE);
-    memmove(bp->data + off%BSIZE, src, m);
-    log_write(bp);
+    if(tmpfile(ip)){
+      if(copyuser(ramdiskblock(addr, 1) + off%BSIZE, src, m) < 0)
+        break;
+      continue;
+    }
+    bp = bread(ip->dev, addr);
+    if(copyuser(bp->data + off%BSIZE, src, m) < 0){
+      brelse(bp);
+      break;
+    }
+    if(ip->type == T_FILE){
+      if(ip->nocache)
+        bp->flags |= B_NOCACHE;
+      log_write_data(bp);  // ordered, not logged; see log.c
+    }
+    else
+      log_write_range(bp, off%BSIZE, m);
     brelse(bp);
   }
 
-  if(n > 0 && off > ip->size){
+  if(tot > 0 && off > ip->size){
     ip->size = off;
     iupdate(ip);
   }
-  return n;
+  if(tot < n && tot == 0)
+    return -1;
+  return tot;
 }
 
 //PAGEBREAK!
@@ -519,41 +892,88 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
-// Look for a directory entry in a directory.
+// Search block bn of directory dp for name, or for a free entry
+// if name is 0, and set *poff to the entry's offset and *pinum
+// to its inode number.  Return 1 if found, 0 if not, and -1 if
+// the block is a hole.  Bytes past the end of a directory in its
+// last block are zero, so the whole block can be searched.
+static int
+dirsearch(struct inode *dp, uint bn, char *name, uint *poff, uint *pinum)
+{
+  struct buf *bp;
+  struct dirent *de;
+  uint addr;
+  int r;
+
+  if((addr = bmap(dp, bn, 0)) == 0)
+    return -1;
+  bp = bread(dp->dev, addr);
+  r = 0;
+  for(de = (struct dirent*)bp->data; de < (struct dirent*)(bp->data + BSIZE); de++){
+    if(name ? de->inum != 0 && namecmp(name, de->name) == 0 : de->inum == 0){
+      *poff = bn*BSIZE + ((uchar*)de - bp->data);
+      *pinum = de->inum;
+      r = 1;
+      break;
+    }
+  }
+  brelse(bp);
+  return r;
+}
+
+// Block number of the kth block of name's bucket.
+static uint
+dirblock(char *name, uint k)
+{
+  return DIRLINEAR + dirhash(name) % NDIRHASH + k*NDIRHASH;
+}
+
+// Look for a directory entry in a directory: in its linear
+// blocks, then in the name's bucket (see fs.h).
 // If found, set *poff to byte offset of entry.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
-  struct dirent de;
+  uint off, inum, bn, nb, k;
+  int r;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if(de.inum == 0)
-      continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
-    }
+  if(dclookup(dp->dev, dp->inum, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
   }
 
-  return 0;
+  nb = (dp->size + BSIZE - 1) / BSIZE;
+  r = 0;
+  for(bn = 0; bn < nb && bn < DIRLINEAR && r != 1; bn++)
+    r = dirsearch(dp, bn, name, &off, &inum);
+  for(k = 0; r != 1 && (bn = dirblock(name, k)) < nb; k++)
+    if((r = dirsearch(dp, bn, name, &off, &inum)) < 0)
+      break;
+
+  if(r != 1){
+    dcenter(dp->dev, dp->inum, name, 0, 0);
+    return 0;
+  }
+  if(poff)
+    *poff = off;
+  dcenter(dp->dev, dp->inum, name, inum, off);
+  return iget(dp->dev, inum);
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
+  uint off, bn, nb, k, x, size;
   struct dirent de;
   struct inode *ip;
+  int r;
 
   // Check that name is not present.
   if((ip = dirlookup(dp, name, 0)) != 0){
@@ -561,18 +981,40 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
+  // Look for an empty dirent in the linear blocks, which fill up
+  // first, then in name's bucket, starting a new block of it at
+  // the first hole or past the end.
+  nb = (dp->size + BSIZE - 1) / BSIZE;
+  for(bn = 0; bn < DIRLINEAR; bn++){
+    if(bn >= nb){
+      off = dp->size;
+      goto found;
+    }
+    if(dirsearch(dp, bn, 0, &off, &x) == 1)
+      goto found;
+  }
+  for(k = 0; ; k++){
+    if((bn = dirblock(name, k)) >= MAXFILE)
+      return -1;
+    if(bn >= nb || (r = dirsearch(dp, bn, 0, &off, &x)) < 0){
+      off = bn*BSIZE;
+      break;
+    }
+    if(r == 1)
       break;
   }
 
+found:
+  size = dp->size;
+  if(off > dp->size)
+    dp->size = off;  // leave a hole; writei() updates the inode
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
-  if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-    panic("dirlink");
+  if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de)){
+    dp->size = size;  // disk full
+    return -1;
+  }
+  dcenter(dp->dev, dp->inum, name, inum, off);
 
   return 0;
 }
@@ -617,6 +1059,81 @@ skipelem(char *path, char *name)
   return path;
 }
 
+// Mount the file system on dev at directory ip, which the caller
+// has locked.  Only the root disk is logged: writes to a mounted
+// disk go straight to it (see log.c), so it suits scratch data.
+int
+mount(struct inode *ip, uint dev)
+{
+  int i;
+
+  if(ip->type != T_DIR || dev >= NBDEV)
+    return -1;
+  acquire(&mountlock);
+  for(i = 0; i < NBDEV; i++)
+    if(fsdev[i].mnt == ip)
+      break;
+  if(i < NBDEV || fsdev[dev].active || ip->inum == ROOTINO){
+    release(&mountlock);
+    return -1;
+  }
+  fsdev[dev].active = 1;  // claim it
+  release(&mountlock);
+
+  if(fsread(dev) < 0){
+    fsdev[dev].active = 0;
+    return -1;
+  }
+  acquire(&mountlock);
+  fsdev[dev].mnt = idup(ip);
+  release(&mountlock);
+  return 0;
+}
+
+// Is ip a directory something is mounted on?
+int
+mounted(struct inode *ip)
+{
+  int i, r;
+
+  r = 0;
+  acquire(&mountlock);
+  for(i = 0; i < NBDEV; i++)
+    if(fsdev[i].mnt == ip)
+      r = 1;
+  release(&mountlock);
+  return r;
+}
+
+// If ip is a mount point, return the root of the file system
+// mounted on it instead; if ip is the root of a mounted file
+// system and up is set, the mount point instead.  Consumes the
+// caller's reference to ip.
+static struct inode*
+mountcross(struct inode *ip, int up)
+{
+  struct inode *next;
+  int i;
+
+  acquire(&mountlock);
+  for(i = 0; i < NBDEV; i++){
+    if(fsdev[i].mnt == 0)
+      continue;
+    if(up ? ip->dev == i && ip->inum == ROOTINO : fsdev[i].mnt == ip)
+      break;
+  }
+  if(i == NBDEV){
+    release(&mountlock);
+    return ip;
+  }
+  next = up ? idup(fsdev[i].mnt) : 0;
+  release(&mountlock);
+  if(!up)
+    next = iget(i, ROOTINO);
+  iput(ip);
+  return next;
+}
+
 // Look up and return the inode for a path name.
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
@@ -632,6 +1149,8 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    if(namecmp(name, "..") == 0)
+      ip = mountcross(ip, 1);  // look up ".." in the mount point
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
@@ -647,7 +1166,7 @@ namex(char *path, int nameiparent, char *name)
       return 0;
     }
     iunlockput(ip);
-    ip = next;
+    ip = mountcross(next, 0);
   }
   if(nameiparent){
     iput(ip);
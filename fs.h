@@ -3,7 +3,9 @@
 
 
 #define ROOTINO 1  // root i-number
-#define BSIZE 512  // block size
+#ifndef BSIZE
+#define BSIZE 512  // block size; a multiple of 512, at most a page
+#endif
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
@@ -19,11 +21,15 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint bsize;        // Block size (bytes); must match BSIZE
+  uint swapstart;    // Block number of first swap block
+  uint nswap;        // Number of swap blocks
 };
 
-#define NDIRECT 12
+#define NDIRECT 11
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -32,7 +38,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEV only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+2];   // Data, indirect and double-indirect block addresses
 };
 
 // Inodes per block.
@@ -55,3 +61,24 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// The first DIRLINEAR blocks of a directory hold entries in no
+// particular order.  Once they are full, an entry goes in one of
+// NDIRHASH buckets chosen by dirhash(name): bucket h is blocks
+// DIRLINEAR+h, DIRLINEAR+h+NDIRHASH, ... of the directory, added
+// in that order, so the directory has holes and the first hole
+// (or the end) ends a bucket.  Holes read as free entries.
+#define DIRLINEAR 4
+#define NDIRHASH 32
+
+static inline uint
+dirhash(const char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261U;  // FNV-1a
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
@@ -1,4 +1,5 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// IDE driver code: bus-master DMA through a PCI IDE
+// controller when there is one, otherwise PIO.
 
 #include "types.h"
 #include "defs.h"
@@ -12,27 +13,75 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "trace.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
 #define IDE_DRDY      0x40
 #define IDE_DF        0x20
+#define IDE_DRQ       0x08
 #define IDE_ERR       0x01
 
 #define IDE_CMD_READ  0x20
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_SETMUL 0xc6
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
+// Bus-master registers (PIIX), primary channel, relative to BAR4.
+#define BM_CMD        0x0
+#define BM_STATUS     0x2
+#define BM_PRDT       0x4
+#define BM_CMD_START  0x01
+#define BM_CMD_READ   0x08   // device to memory
+#define BM_STAT_ERR   0x02
+#define BM_STAT_INTR  0x04
+
+// Physical region descriptor: one per buf in a DMA command.
+struct prd {
+  uint addr;
+  ushort nbytes;
+  ushort flags;
+};
+#define PRD_EOT       0x8000  // last entry in the table
+
+#define IDE_MULT      16   // sectors per interrupt we ask the disks for
+#define IDE_MAXSECT   128  // most sectors one command may cover
+#define IDE_TIMEOUT   1000000  // status polls before giving up on DRQ
+
+#define SECTPERBLK    (BSIZE/SECTOR_SIZE)
+
+// idequeue holds bufs waiting for the disk, in C-LOOK elevator
+// order: those at or after idepos in increasing block order,
+// then those before it.  Adjacent bufs for consecutive blocks
+// of one disk in the same direction are issued as one command.
+// idebatch is the list (through qnext) of bufs covered by the
+// command in progress, of which idexfered sectors have been
+// moved so far.
 // You must hold idelock while manipulating queue.
 
 static struct spinlock idelock;
 static struct buf *idequeue;
+static struct buf *idebatch;
+static int idensect;
+static int idexfered;
+static uint idepos;
+static int reqstat;  // stats.c counter of commands
+
+int ideirq = IRQ_IDE;
 
 static int havedisk1;
-static void idestart(struct buf*);
+static int idemult[2];  // sectors per DRQ block, per disk
+
+// PRD tables must be dword aligned and not cross 64KB.
+static ushort bmbase;   // bus-master I/O base, or 0 for PIO
+static struct prd prdt[IDE_MAXSECT/SECTPERBLK]
+  __attribute__((aligned(sizeof(struct prd)*IDE_MAXSECT/SECTPERBLK)));
+static void idestart(void);
+static void idedmaprep(void);
+static void idedone(void);
 
 // Wait for IDE disk to become ready.
 static int
@@ -47,12 +96,43 @@ idewait(int checkerr)
   return 0;
 }
 
+// Look for a PCI IDE controller that can do bus-master DMA
+// (class 01, subclass 01, programming interface bit 7), turn on
+// its bus mastering, and remember its bus-master registers.
+static void
+idedmainit(void)
+{
+  int dev, func;
+  uint bar;
+
+  if(pcifind(0x08, 0xffff8000, 0x01018000, &dev, &func) < 0)
+    return;
+  bar = pciread(dev, func, 0x20);
+  if((bar & 1) == 0 || (bar & ~3) == 0)  // not an I/O BAR
+    return;
+  pciwrite(dev, func, 0x04, pciread(dev, func, 0x04) | 0x5);  // I/O + master
+  bmbase = bar & 0xfffc;
+}
+
+// Ask disk d to transfer IDE_MULT sectors per interrupt.
+// Disks that refuse get one sector per interrupt.
+static void
+idesetmult(int d)
+{
+  idewait(0);
+  outb(0x1f2, IDE_MULT);
+  outb(0x1f6, 0xe0 | (d<<4));
+  outb(0x1f7, IDE_CMD_SETMUL);
+  idemult[d] = idewait(1) < 0 ? 1 : IDE_MULT;
+}
+
 void
 ideinit(void)
 {
   int i;
 
   initlock(&idelock, "ide");
+  reqstat = statalloc("ide.req", 1);
   ioapicenable(IRQ_IDE, ncpu - 1);
   idewait(0);
 
@@ -65,75 +145,236 @@ ideinit(void)
     }
   }
 
+  idesetmult(0);
+  if(havedisk1)
+    idesetmult(1);
+  idedmainit();
+
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Move the next n sectors of the command in progress
+// between the disk and the bufs in idebatch.
 static void
-idestart(struct buf *b)
+idexfer(int n)
 {
-  if(b == 0)
+  struct buf *b;
+  int i, s;
+
+  for(i = 0; i < n; i++, idexfered++){
+    b = idebatch;
+    for(s = idexfered; s >= SECTPERBLK; s -= SECTPERBLK)
+      b = b->qnext;
+    if(b->flags & B_DIRTY)
+      outsl(0x1f0, b->data + s*SECTOR_SIZE, SECTOR_SIZE/4);
+    else
+      insl(0x1f0, b->data + s*SECTOR_SIZE, SECTOR_SIZE/4);
+  }
+}
+
+// Start a command for the buf at the head of idequeue and
+// any bufs queued right behind it that continue the same
+// transfer.  Caller must hold idelock.
+static void
+idestart(void)
+{
+  struct buf *b, *last, *nb;
+  int sector, mult, n, i, r;
+
+  if((b = idequeue) == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
+  if(b->blockno >= FSSIZE + SWAPSIZE)
     panic("incorrect blockno");
-  int sector_per_block =  BSIZE/SECTOR_SIZE;
-  int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  if (SECTPERBLK > IDE_MAXSECT) panic("idestart");
 
-  if (sector_per_block > 7) panic("idestart");
+  last = b;
+  idensect = SECTPERBLK;
+  while((nb = last->qnext) != 0 && nb->dev == b->dev &&
+        nb->blockno == last->blockno + 1 && nb->blockno < FSSIZE + SWAPSIZE &&
+        (nb->flags & B_DIRTY) == (b->flags & B_DIRTY) &&
+        idensect + SECTPERBLK <= IDE_MAXSECT){
+    last = nb;
+    idensect += SECTPERBLK;
+  }
+  idequeue = last->qnext;
+  last->qnext = 0;
+  statinc(reqstat);
+  idebatch = b;
+  idexfered = 0;
+  idepos = last->blockno + 1;
 
+  sector = b->blockno * SECTPERBLK;
+  mult = idemult[b->dev&1];
+  if(bmbase)
+    idedmaprep();
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, idensect & 0xff);  // number of sectors (0 means 256)
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
-  if(b->flags & B_DIRTY){
-    outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+  if(bmbase){
+    // One interrupt when the whole transfer is done.
+    outb(0x1f7, (b->flags & B_DIRTY) ? IDE_CMD_WRDMA : IDE_CMD_RDDMA);
+    outb(bmbase+BM_CMD, inb(bmbase+BM_CMD) | BM_CMD_START);
+  } else if(b->flags & B_DIRTY){
+    outb(0x1f7, mult > 1 ? IDE_CMD_WRMUL : IDE_CMD_WRITE);
+    // The first block of data goes out before any interrupt.
+    // A disk that never asks for it fails the command, as
+    // idepiointr() does on an error.
+    for(i = 0; ((r = inb(0x1f7)) & (IDE_BSY|IDE_DRQ)) != IDE_DRQ; i++){
+      if(i == IDE_TIMEOUT || (!(r & IDE_BSY) && (r & (IDE_DF|IDE_ERR)))){
+        cprintf("ide: disk %d not ready for block %d\n", b->dev, b->blockno);
+        idedone();
+        return;
+      }
+    }
+    n = idensect < mult ? idensect : mult;
+    idexfer(n);
   } else {
-    outb(0x1f7, read_cmd);
+    outb(0x1f7, mult > 1 ? IDE_CMD_RDMUL : IDE_CMD_READ);
   }
 }
 
+// Point the PRD table at the bufs in idebatch, and set up the
+// bus-master engine for the transfer.  Caller must hold idelock.
+static void
+idedmaprep(void)
+{
+  struct buf *b;
+  struct prd *p;
+
+  p = prdt;
+  for(b = idebatch; b; b = b->qnext, p++){
+    p->addr = V2P(b->data);
+    p->nbytes = BSIZE;
+    p->flags = b->qnext ? 0 : PRD_EOT;
+  }
+  outl(bmbase+BM_PRDT, V2P(prdt));
+  outb(bmbase+BM_STATUS, BM_STAT_ERR|BM_STAT_INTR);  // write 1 to clear
+  outb(bmbase+BM_CMD, (idebatch->flags & B_DIRTY) ? 0 : BM_CMD_READ);
+}
+
+// Finish a DMA transfer.  Returns 0 if it went well, else
+// puts the batch back on the queue, falls back to PIO for
+// good, and returns -1.  Caller must hold idelock.
+static int
+idedmadone(void)
+{
+  struct buf *last;
+  int st;
+
+  st = inb(bmbase+BM_STATUS);
+  outb(bmbase+BM_CMD, 0);
+  outb(bmbase+BM_STATUS, BM_STAT_ERR|BM_STAT_INTR);
+  if(idewait(1) >= 0 && (st & BM_STAT_ERR) == 0)
+    return 0;
+
+  cprintf("ide: DMA error, using PIO\n");
+  bmbase = 0;
+  for(last = idebatch; last->qnext; last = last->qnext)
+    ;
+  last->qnext = idequeue;
+  idequeue = idebatch;
+  idebatch = 0;
+  return -1;
+}
+
+// Handle an interrupt for a PIO command.  The disk interrupts
+// after each block of up to idemult sectors: move the next one.
+// Reads finish with the interrupt for their last block, writes
+// with the one after it.  Returns 1 if the command is done.
+// Caller must hold idelock.
+static int
+idepiointr(void)
+{
+  int n;
+
+  n = idensect - idexfered;
+  if(idewait(1) < 0 || n == 0)
+    return 1;
+  if(n > idemult[idebatch->dev&1])
+    n = idemult[idebatch->dev&1];
+  idexfer(n);
+  return idexfered == idensect && (idebatch->flags & B_DIRTY) == 0;
+}
+
+// Finish the command in progress, whether or not the disk
+// managed it, and start the next.  Caller must hold idelock.
+static void
+idedone(void)
+{
+  struct buf *b, *nb;
+
+  for(b = idebatch; b; b = nb){
+    nb = b->qnext;
+    b->qnext = 0;
+
+    trace(TR_DISKDONE, b->blockno, (b->flags & B_DIRTY) != 0);
+    // Wake process waiting for this buf, or release
+    // it if nobody is waiting (read-ahead, bawrite).
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->flags & B_ASYNC){
+      b->flags &= ~B_ASYNC;
+      bdone(b);
+    } else
+      wakeup(b);
+  }
+  idebatch = 0;
+
+  // Start disk on next buf in queue.
+  if(idequeue != 0)
+    idestart();
+}
+
 // Interrupt handler.
 void
 ideintr(void)
 {
-  struct buf *b;
-
-  // First queued buffer is the active request.
+  // idebatch is the active request.
   acquire(&idelock);
 
-  if((b = idequeue) == 0){
+  if(idebatch == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
-
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  if(bmbase){
+    if(idedmadone() < 0){
+      idestart();  // again, with PIO
+      release(&idelock);
+      return;
+    }
+  } else if(!idepiointr()){
+    release(&idelock);
+    return;
+  }
+  idedone();
+  release(&idelock);
+}
 
-  // Start disk on next buf in queue.
-  if(idequeue != 0)
-    idestart(idequeue);
+// Does a belong before b in the elevator order?
+static int
+idebefore(struct buf *a, struct buf *b)
+{
+  int awrap, bwrap;
 
-  release(&idelock);
+  awrap = a->blockno < idepos;
+  bwrap = b->blockno < idepos;
+  if(awrap != bwrap)
+    return bwrap;
+  return a->blockno < b->blockno;
 }
 
 //PAGEBREAK!
 // Sync buf with disk.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
+// If B_ASYNC is set, return without waiting; ideintr() releases
+// the buf when the transfer is done.
 void
 iderw(struct buf *b)
 {
@@ -148,17 +389,22 @@ iderw(struct buf *b)
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
+  // Insert b into idequeue in elevator order.
+  for(pp=&idequeue; *pp && !idebefore(b, *pp); pp=&(*pp)->qnext)  //DOC:insert-queue
     ;
+  b->qnext = *pp;
   *pp = b;
+  trace(TR_DISKSTART, b->blockno, (b->flags & B_DIRTY) != 0);
 
   // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  if(idebatch == 0)
+    idestart();
 
   // Wait for request to finish.
+  if(b->flags & B_ASYNC){
+    release(&idelock);
+    return;
+  }
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
     sleep(b, &idelock);
   }
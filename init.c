@@ -4,6 +4,7 @@
 #include "stat.h"
 #include "user.h"
 #include "fcntl.h"
+#include "param.h"
 
 char *argv[] = { "sh", 0 };
 
@@ -19,6 +20,13 @@ main(void)
   dup(0);  // stdout
   dup(0);  // stderr
 
+  mknod("stats", 2, 0);  // event counters; fails if already there
+
+  // Scratch files go in /tmp, a tmpfs on the RAM disk.
+  mkdir("tmp");
+  if(mount("tmp", RAMDEV) < 0)
+    printf(1, "init: mount tmp failed\n");
+
   for(;;){
     printf(1, "init: starting sh\n");
     pid = fork();
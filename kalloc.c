@@ -1,6 +1,18 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
 // and pipe buffers. Allocates 4096-byte pages.
+//
+// Each CPU keeps a cache of free pages so that kalloc() and kfree()
+// do not usually touch the global free list; caches are refilled
+// from it and drained to it KBATCH pages at a time.  A CPU whose
+// cache is empty when the global list also is steals from the
+// caches of other CPUs.
+//
+// Idle CPUs also zero free pages from the global list into a
+// pool of up to NZPAGE, for kzalloc(), so that page tables and
+// fresh user pages need not be zeroed by the process waiting
+// for them.  A zeroed page's first word is its link in the pool,
+// cleared again when it is taken.
 
 #include "types.h"
 #include "defs.h"
@@ -8,6 +20,8 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "spinlock.h"
+#include "proc.h"
+#include "trace.h"
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
@@ -17,21 +31,49 @@ struct run {
   struct run *next;
 };
 
+uint phystop;  // end of the physical memory in use
+
+// Reference counts of physical pages, for pages shared
+// copy-on-write.  kalloc() sets a page's count to 1, and
+// kfree() frees it only when the count drops to 0.
+static ushort pageref[PHYSTOP/PGSIZE];
+#define PAGEREF(v) pageref[V2P(v)/PGSIZE]
+
+struct kcache {
+  struct spinlock lock;  // only other CPUs' stealing contends
+  struct run *freelist;
+  int n;
+};
+
 struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  struct run *zfree;     // zeroed pages, but for their links
+  int nzero;
+  struct kcache cache[NCPU];
 } kmem;
 
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
-// the pages mapped by entrypgdir on free list.
+// the pages mapped by entrypgdir on free list.  It also finds out
+// how much memory there is, up to the PHYSTOP the kernel can map.
 // 2. main() calls kinit2() with the rest of the physical pages
 // after installing a full page table that maps them on all cores.
 void
 kinit1(void *vstart, void *vend)
 {
+  int i;
+
+  phystop = PGROUNDDOWN(cmosmem());
+  if(phystop > PHYSTOP)
+    phystop = PHYSTOP;
+  if(phystop < V2P(vend))
+    panic("kinit1: too little memory");
+
   initlock(&kmem.lock, "kmem");
+  for(i = 0; i < NCPU; i++)
+    initlock(&kmem.cache[i].lock, "kcache");
   kmem.use_lock = 0;
   freerange(vstart, vend);
 }
@@ -48,9 +90,57 @@ freerange(void *vstart, void *vend)
 {
   char *p;
   p = (char*)PGROUNDUP((uint)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)vend; p += PGSIZE){
+    PAGEREF(p) = 1;
     kfree(p);
+  }
+}
+
+// Add a reference to page v, which kalloc() returned.
+void
+kref(char *v)
+{
+  if(__sync_fetch_and_add(&PAGEREF(v), 1) == 0)
+    panic("kref");
+}
+
+// Return the number of references to page v.
+int
+krefcount(char *v)
+{
+  return PAGEREF(v);
 }
+// Detach up to n pages from the front of list *lp.
+// Returns them as a list and sets *np to how many there are.
+static struct run*
+take(struct run **lp, int n, int *np)
+{
+  struct run *first, *r;
+  int i;
+
+  *np = 0;
+  if((first = *lp) == 0)
+    return 0;
+  for(r = first, i = 1; i < n && r->next; i++)
+    r = r->next;
+  *lp = r->next;
+  r->next = 0;
+  *np = i;
+  return first;
+}
+
+// Prepend a list of pages to list *lp.
+static void
+put(struct run **lp, struct run *list)
+{
+  struct run *r;
+
+  for(r = list; r->next; r = r->next)
+    ;
+  r->next = *lp;
+  *lp = list;
+}
+
 //PAGEBREAK: 21
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
@@ -59,21 +149,89 @@ freerange(void *vstart, void *vend)
 void
 kfree(char *v)
 {
-  struct run *r;
+  struct run *r, *drain;
+  struct kcache *c;
+  int n;
 
-  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+  if((uint)v % PGSIZE || v < end || V2P(v) >= phystop)
     panic("kfree");
 
+  if(PAGEREF(v) == 0)
+    panic("kfree: free page");
+  if(__sync_sub_and_fetch(&PAGEREF(v), 1) > 0)
+    return;
+
+  trace(TR_KFREE, (uint)v, 0);
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
+  if(!kmem.use_lock){
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+    return;
+  }
+
+  pushcli();
+  c = &kmem.cache[cpuid()];
+  acquire(&c->lock);
+  r->next = c->freelist;
+  c->freelist = r;
+  drain = 0;
+  if(++c->n >= 2*KBATCH){
+    drain = take(&c->freelist, KBATCH, &n);
+    c->n -= n;
+  }
+  release(&c->lock);
+  popcli();
+
+  if(drain){
+    acquire(&kmem.lock);
+    put(&kmem.freelist, drain);
     release(&kmem.lock);
+  }
+}
+
+// Refill CPU cache c, which is empty, and return one page.
+// Called with interrupts off, so we stay on c's CPU.
+static struct run*
+refill(struct kcache *c)
+{
+  struct run *list, *r;
+  struct kcache *v;
+  int n;
+
+  acquire(&kmem.lock);
+  list = take(&kmem.freelist, KBATCH, &n);
+  release(&kmem.lock);
+
+  // Global list is empty: steal half the pages of a peer.
+  for(v = kmem.cache; list == 0 && v < &kmem.cache[ncpu]; v++){
+    if(v == c || v->n == 0)
+      continue;
+    acquire(&v->lock);
+    list = take(&v->freelist, (v->n+1)/2, &n);
+    v->n -= n;
+    release(&v->lock);
+  }
+  // Nothing free but zeroed pages.
+  if(list == 0){
+    acquire(&kmem.lock);
+    list = take(&kmem.zfree, KBATCH, &n);
+    kmem.nzero -= n;
+    release(&kmem.lock);
+  }
+  if(list == 0)
+    return 0;
+
+  r = list;
+  if((list = r->next) != 0){
+    acquire(&c->lock);
+    put(&c->freelist, list);
+    c->n += n-1;
+    release(&c->lock);
+  }
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -83,14 +241,90 @@ char*
 kalloc(void)
 {
   struct run *r;
+  struct kcache *c;
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
+  if(!kmem.use_lock){
+    r = kmem.freelist;
+    if(r){
+      kmem.freelist = r->next;
+      PAGEREF(r) = 1;
+    }
+    return (char*)r;
+  }
+
+  pushcli();
+  c = &kmem.cache[cpuid()];
+  if(mycpu()->proc)
+    mycpu()->proc->ru.npage++;
+  acquire(&c->lock);
+  r = c->freelist;
+  if(r){
+    c->freelist = r->next;
+    c->n--;
+  }
+  release(&c->lock);
+  if(r == 0)
+    r = refill(c);
+  popcli();
   if(r)
-    kmem.freelist = r->next;
-  if(kmem.use_lock)
+    PAGEREF(r) = 1;
+  trace(TR_KALLOC, (uint)r, 0);
+  return (char*)r;
+}
+
+// Allocate a zeroed page, one that kprezero() made if there
+// is one.  Returns 0 if the memory cannot be allocated.
+char*
+kzalloc(void)
+{
+  struct run *r;
+
+  r = 0;
+  if(kmem.use_lock && kmem.zfree){
+    acquire(&kmem.lock);
+    if((r = kmem.zfree) != 0){
+      kmem.zfree = r->next;
+      kmem.nzero--;
+    }
     release(&kmem.lock);
+  }
+  if(r == 0){
+    if((r = (struct run*)kalloc()) != 0)
+      memset(r, 0, PGSIZE);
+    return (char*)r;
+  }
+  r->next = 0;
+  PAGEREF(r) = 1;
+  pushcli();
+  if(mycpu()->proc)
+    mycpu()->proc->ru.npage++;
+  popcli();
+  trace(TR_KALLOC, (uint)r, 0);
   return (char*)r;
 }
 
+// Zero a page from the global free list for kzalloc(), unless
+// NZPAGE are zeroed already.  Called by idle CPUs, one page at a
+// time so as to look for work in between.  Returns 1 if it
+// zeroed a page.
+int
+kprezero(void)
+{
+  struct run *r;
+
+  if(!kmem.use_lock || kmem.nzero >= NZPAGE || kmem.freelist == 0)
+    return 0;
+  acquire(&kmem.lock);
+  if((r = kmem.freelist) != 0)
+    kmem.freelist = r->next;
+  release(&kmem.lock);
+  if(r == 0)
+    return 0;
+  memset(r, 0, PGSIZE);
+  acquire(&kmem.lock);
+  r->next = kmem.zfree;
+  kmem.zfree = r;
+  kmem.nzero++;
+  release(&kmem.lock);
+  return 1;
+}
@@ -0,0 +1,63 @@
+// Print the kernel's event counters (see the kernel's stats.c).
+// kstat n prints each one's rate per second over n seconds.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "stats.h"
+
+#define NENT  96
+#define HZ    100  // timer ticks per second
+
+struct statent st0[NENT], st1[NENT];
+
+int
+readstats(int fd, struct statent *st)
+{
+  int n;
+
+  if((n = pread(fd, st, sizeof(st0), 0)) < 0){
+    printf(2, "kstat: read failed\n");
+    exit();
+  }
+  return n / sizeof(*st);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, i, j, n, secs;
+  uint v;
+
+  secs = 0;
+  if(argc > 2 || (argc == 2 && (secs = atoi(argv[1])) <= 0)){
+    printf(2, "usage: kstat [seconds]\n");
+    exit();
+  }
+  if((fd = open("/stats", O_RDONLY)) < 0){
+    printf(2, "kstat: cannot open /stats\n");
+    exit();
+  }
+  n = readstats(fd, st0);
+  if(secs){
+    sleep(secs * HZ);
+    n = readstats(fd, st1);
+  }
+  for(i = 0; i < n; i++){
+    v = secs ? (st1[i].count - st0[i].count) / secs : st0[i].count;
+    // Of a set, such as the calls by number, show only those used.
+    if(st0[i].n > 1 && v == 0)
+      continue;
+    printf(1, "%s", st0[i].name);
+    j = strlen(st0[i].name);
+    if(st0[i].n > 1){
+      printf(1, "[%d]", st0[i].i);
+      j += 3 + (st0[i].i >= 10) + (st0[i].i >= 100);
+    }
+    for(; j < 18; j++)
+      printf(1, " ");
+    printf(1, "%d%s\n", v, secs ? "/s" : "");
+  }
+  exit();
+}
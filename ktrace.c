@@ -0,0 +1,94 @@
+// Kernel event tracing.
+//   ktrace file cmd [arg ...]   run cmd, saving the trace in file
+//   ktrace -p file              print a saved trace
+// Records are saved as read, so each CPU's are in time order
+// but the CPUs' are not merged.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "trace.h"
+
+#define NREC 128
+#define NELEM(x) (sizeof(x)/sizeof((x)[0]))
+
+struct tracerec r[NREC];
+
+char *evname[] = {
+[TR_SYSCALL]   "syscall",
+[TR_SYSRET]    "sysret",
+[TR_SWITCH]    "switch",
+[TR_SWITCHOUT] "switchout",
+[TR_BREAD]     "bread",
+[TR_BWRITE]    "bwrite",
+[TR_DISKSTART] "diskstart",
+[TR_DISKDONE]  "diskdone",
+[TR_BEGINOP]   "beginop",
+[TR_ENDOP]     "endop",
+[TR_KALLOC]    "kalloc",
+[TR_KFREE]     "kfree",
+};
+
+int tracefd;
+
+// Save a batch of records in the trace file.
+int
+put(void *buf, int n)
+{
+  if(write(tracefd, buf, n*sizeof(r[0])) != n*sizeof(r[0])){
+    printf(2, "ktrace: write failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Print a saved trace, with times in cycles since the first record.
+void
+print(char *file)
+{
+  int fd, i, n;
+  uint64 t0;
+  char *ev;
+
+  if((fd = open(file, O_RDONLY)) < 0){
+    printf(2, "ktrace: cannot open %s\n", file);
+    return;
+  }
+  t0 = 0;
+  while((n = read(fd, r, sizeof(r))) > 0){
+    for(i = 0; i < n/sizeof(r[0]); i++){
+      if(t0 == 0)
+        t0 = r[i].tsc;
+      ev = r[i].ev < NELEM(evname) && evname[r[i].ev] ? evname[r[i].ev] : "?";
+      printf(1, "%d cpu%d pid %d %s %x %d\n", (uint)(r[i].tsc - t0),
+             r[i].cpu, r[i].pid, ev, r[i].a, r[i].b);
+    }
+  }
+  close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int lost;
+
+  if(argc == 3 && strcmp(argv[1], "-p") == 0){
+    print(argv[2]);
+    exit();
+  }
+  if(argc < 3){
+    printf(2, "usage: ktrace file cmd [arg ...] | ktrace -p file\n");
+    exit();
+  }
+  if((tracefd = open(argv[1], O_CREATE|O_WRONLY)) < 0){
+    printf(2, "ktrace: cannot create %s\n", argv[1]);
+    exit();
+  }
+  lost = ringrun((int(*)(int, void*, int))ktrace, r, NREC, put, argv+2);
+  if(lost < 0)
+    printf(2, "ktrace: cannot start tracing\n");
+  if(lost > 0)
+    printf(2, "ktrace: %d records lost\n", lost);
+  exit();
+}
@@ -41,8 +41,13 @@
 #define TCCR    (0x0390/4)   // Timer Current Count
 #define TDCR    (0x03E0/4)   // Timer Divide Configuration
 
+#define TICKLEN 10000000     // timer counts per tick
+
 volatile uint *lapic;  // Initialized in mp.c
 
+static uint64 tsc0;       // TSC at boot
+static uint tscpertick;   // TSC cycles per tick
+
 //PAGEBREAK!
 static void
 lapicw(int index, int value)
@@ -60,13 +65,22 @@ lapicinit(void)
   // Enable local APIC; set spurious interrupt vector.
   lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
 
-  // The timer repeatedly counts down at bus frequency
-  // from lapic[TICR] and then issues an interrupt.
-  // If xv6 cared more about precise timekeeping,
-  // TICR would be calibrated using an external time source.
+  // The timer counts down once at bus frequency from
+  // lapic[TICR] and then issues an interrupt.  lapictimer()
+  // arms it for the next preemption or sleep() deadline, so
+  // an idle CPU takes no timer interrupts.  Time is kept by
+  // the TSC instead, measured against one countdown.
   lapicw(TDCR, X1);
-  lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-  lapicw(TICR, 10000000);
+  if(tscpertick == 0){
+    lapicw(TIMER, MASKED);
+    tsc0 = rdtsc();
+    lapicw(TICR, TICKLEN);
+    while(lapic[TCCR] != 0)
+      ;
+    tscpertick = rdtsc() - tsc0;
+  }
+  lapicw(TIMER, T_IRQ0 + IRQ_TIMER);
+  lapicw(TICR, 0);
 
   // Disable logical interrupt lines.
   lapicw(LINT0, MASKED);
@@ -113,6 +127,51 @@ lapiceoi(void)
     lapicw(EOI, 0);
 }
 
+// Interrupt this CPU in n ticks, or never if n is 0.
+void
+lapictimer(uint n)
+{
+  if(!lapic)
+    return;
+  if(n > 0xFFFFFFFF / TICKLEN)
+    n = 0xFFFFFFFF / TICKLEN;  // early, but the handler will rearm
+  lapicw(TICR, n * TICKLEN);
+}
+
+// Ticks since boot, by the TSC.
+uint
+lapicticks(void)
+{
+  uint64 t;
+  uint hi, lo, q;
+
+  if(tscpertick == 0)
+    return 0;
+  // 64-by-32 bit division, keeping the low 32 bits of the quotient.
+  t = rdtsc() - tsc0;
+  hi = (uint)(t >> 32) % tscpertick;
+  lo = t;
+  asm("divl %2" : "=a" (q), "+d" (hi) : "r" (tscpertick), "a" (lo));
+  return q;
+}
+
+// Send the command icr to the CPU with the given apicid.
+static void
+lapicicr(int apicid, uint icr)
+{
+  lapicw(ICRHI, apicid<<24);
+  lapicw(ICRLO, icr);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+}
+
+// Send interrupt vector to the CPU with the given apicid.
+void
+lapicipi(int apicid, int vector)
+{
+  lapicicr(apicid, FIXED | ASSERT | vector);
+}
+
 // Spin for a given number of microseconds.
 // On real hardware would want to tune this dynamically.
 void
@@ -123,12 +182,14 @@ microdelay(int us)
 #define CMOS_PORT    0x70
 #define CMOS_RETURN  0x71
 
-// Start additional processor running entry code at addr.
+// Start the n processors apicid[0..n-1] running entry code at
+// addr, all at once: each step goes to every one of them before
+// the delay that follows it, so the delays are paid only once.
 // See Appendix B of MultiProcessor Specification.
 void
-lapicstartap(uchar apicid, uint addr)
+lapicstartap(uchar *apicid, int n, uint addr)
 {
-  int i;
+  int i, j;
   ushort *wrv;
 
   // "The BSP must initialize CMOS shutdown code to 0AH
@@ -142,10 +203,11 @@ lapicstartap(uchar apicid, uint addr)
 
   // "Universal startup algorithm."
   // Send INIT (level-triggered) interrupt to reset other CPU.
-  lapicw(ICRHI, apicid<<24);
-  lapicw(ICRLO, INIT | LEVEL | ASSERT);
+  for(j = 0; j < n; j++)
+    lapicicr(apicid[j], INIT | LEVEL | ASSERT);
   microdelay(200);
-  lapicw(ICRLO, INIT | LEVEL);
+  for(j = 0; j < n; j++)
+    lapicicr(apicid[j], INIT | LEVEL);
   microdelay(100);    // should be 10ms, but too slow in Bochs!
 
   // Send startup IPI (twice!) to enter code.
@@ -154,8 +216,8 @@ lapicstartap(uchar apicid, uint addr)
   // should be ignored, but it is part of the official Intel algorithm.
   // Bochs complains about the second one.  Too bad for Bochs.
   for(i = 0; i < 2; i++){
-    lapicw(ICRHI, apicid<<24);
-    lapicw(ICRLO, STARTUP | (addr>>12));
+    for(j = 0; j < n; j++)
+      lapicicr(apicid[j], STARTUP | (addr>>12));
     microdelay(200);
   }
 }
@@ -191,6 +253,21 @@ fill_rtcdate(struct rtcdate *r)
   r->year   = cmos_read(YEAR);
 }
 
+// Bytes of memory, from the BIOS's count in the CMOS: KB above
+// 1MB at 0x30, and 64KB units above 16MB at 0x34 (which qemu
+// stops at the PCI hole below 4GB).
+uint
+cmosmem(void)
+{
+  uint n;
+
+  n = cmos_read(0x34) | cmos_read(0x35) << 8;
+  if(n)
+    return 16*1024*1024 + n*64*1024;
+  n = cmos_read(0x30) | cmos_read(0x31) << 8;
+  return 1024*1024 + n*1024;
+}
+
 // qemu seems to use 24-hour GWT and the values are BCD encoded
 void
 cmostime(struct rtcdate *r)
@@ -0,0 +1,149 @@
+// Lock contention profiling.
+//
+// Locks are counted by name, so that e.g. all the "buffer"
+// sleep locks add up to one entry: initlock() and
+// initsleeplock() point each lock at its name's lockclass.
+// Each class keeps a set of counters per CPU, updated with
+// interrupts off and without atomics; lockstatread() merges
+// them.  Only contended acquisitions read the TSC.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "lockstat.h"
+
+struct lcpu {
+  uint nacquire;
+  uint ncontend;
+  uint64 wait;
+  uint pc[NLOCKPC];
+  uint npc[NLOCKPC];
+};
+
+struct lockclass {
+  char *name;
+  int sleep;
+  struct lcpu cpu[NCPU];
+};
+
+static struct {
+  uint busy;  // can't be a spinlock: initlock() uses it
+  int n;
+  struct lockclass class[NLOCKCLASS];
+} ltable;
+
+// Return the class for locks called name, or 0 if the table
+// is full.
+struct lockclass*
+lockclass(char *name, int sleep)
+{
+  struct lockclass *c;
+
+  while(xchg(&ltable.busy, 1) != 0)
+    pause();
+  for(c = ltable.class; c < &ltable.class[ltable.n]; c++)
+    if(c->sleep == sleep && strncmp(c->name, name, 16) == 0)
+      goto out;
+  if(ltable.n == NLOCKCLASS){
+    c = 0;
+    goto out;
+  }
+  c = &ltable.class[ltable.n++];
+  c->name = name;
+  c->sleep = sleep;
+out:
+  __sync_synchronize();
+  ltable.busy = 0;
+  return c;
+}
+
+// Count an acquisition on CPU cpu of a lock of class c by the
+// caller at pc that waited wait cycles, or none if wait is 0.
+// Caller must have interrupts off.
+void
+lockstatrecord(struct lockclass *c, struct cpu *cpu, uint pc, uint64 wait)
+{
+  struct lcpu *l;
+  int i, min;
+
+  if(c == 0)
+    return;
+  l = &c->cpu[cpu - cpus];
+  l->nacquire++;
+  if(wait == 0)
+    return;
+  l->ncontend++;
+  l->wait += wait;
+  // Keep the most frequent contended callers: an unknown pc
+  // replaces the least frequent one.
+  min = 0;
+  for(i = 0; i < NLOCKPC; i++){
+    if(l->pc[i] == pc){
+      l->npc[i]++;
+      return;
+    }
+    if(l->npc[i] < l->npc[min])
+      min = i;
+  }
+  l->pc[min] = pc;
+  l->npc[min] = 1;
+}
+
+static void
+addpc(struct lockstat *s, uint pc, uint n)
+{
+  int i, min;
+
+  min = 0;
+  for(i = 0; i < NLOCKPC; i++){
+    if(s->pc[i] == pc){
+      s->npc[i] += n;
+      return;
+    }
+    if(s->npc[i] < s->npc[min])
+      min = i;
+  }
+  if(n > s->npc[min]){
+    s->pc[min] = pc;
+    s->npc[min] = n;
+  }
+}
+
+// Copy the statistics of up to n lock classes to st, or reset
+// them all if st is 0.  Returns the number of classes copied.
+int
+lockstatread(struct lockstat *st, int n)
+{
+  struct lockclass *c;
+  struct lockstat ks, *s;
+  struct lcpu *l;
+  int i, j;
+
+  if(st == 0){
+    for(c = ltable.class; c < &ltable.class[ltable.n]; c++)
+      memset(c->cpu, 0, sizeof(c->cpu));
+    return 0;
+  }
+  for(i = 0; i < n && i < ltable.n; i++){
+    c = &ltable.class[i];
+    s = &ks;
+    memset(s, 0, sizeof(*s));
+    safestrcpy(s->name, c->name, sizeof(s->name));
+    s->sleep = c->sleep;
+    for(l = c->cpu; l < &c->cpu[ncpu]; l++){
+      s->nacquire += l->nacquire;
+      s->ncontend += l->ncontend;
+      s->wait += l->wait;
+      for(j = 0; j < NLOCKPC; j++)
+        if(l->npc[j])
+          addpc(s, l->pc[j], l->npc[j]);
+    }
+    if(copyuser(&st[i], s, sizeof(*s)) < 0)
+      return -1;
+  }
+  return i;
+}
@@ -0,0 +1,54 @@
+// Print lock contention statistics, most waited-for first.
+// lockstat -r resets them.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "lockstat.h"
+
+struct lockstat st[NLOCKCLASS];
+
+int
+main(int argc, char *argv[])
+{
+  struct lockstat t;
+  int i, j, n;
+
+  if(argc > 1 && strcmp(argv[1], "-r") == 0){
+    lockstat(0, 0);
+    exit();
+  }
+  if(argc > 1){
+    printf(2, "usage: lockstat [-r]\n");
+    exit();
+  }
+  if((n = lockstat(st, NLOCKCLASS)) < 0){
+    printf(2, "lockstat: failed\n");
+    exit();
+  }
+  for(i = 0; i < n; i++){
+    for(j = i+1; j < n; j++){
+      if(st[j].wait > st[i].wait){
+        t = st[i];
+        st[i] = st[j];
+        st[j] = t;
+      }
+    }
+  }
+
+  printf(1, "name             type  acquire  contend  kcycles  callers\n");
+  for(i = 0; i < n; i++){
+    if(st[i].nacquire == 0)
+      continue;
+    printf(1, "%s", st[i].name);
+    for(j = strlen(st[i].name); j < 17; j++)
+      printf(1, " ");
+    printf(1, "%s  %d  %d  %d ", st[i].sleep ? "sleep" : "spin ",
+           st[i].nacquire, st[i].ncontend, (uint)(st[i].wait >> 10));
+    for(j = 0; j < NLOCKPC; j++)
+      if(st[i].npc[j])
+        printf(1, " %x:%d", st[i].pc[j], st[i].npc[j]);
+    printf(1, "\n");
+  }
+  exit();
+}
@@ -0,0 +1,15 @@
+// Lock contention statistics, per lock name,
+// as returned by the lockstat() system call.
+
+#define NLOCKCLASS 64  // lock names kept
+#define NLOCKPC 4      // contended callers kept per lock name
+
+struct lockstat {
+  char name[16];
+  int sleep;          // 1 for sleep locks, 0 for spinlocks
+  uint nacquire;      // acquisitions
+  uint ncontend;      // acquisitions that had to wait
+  uint64 wait;        // TSC cycles spent waiting
+  uint pc[NLOCKPC];   // callers that waited most often
+  uint npc[NLOCKPC];  // ... and how often
+};
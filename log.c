@@ -5,12 +5,15 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "trace.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. The logging system only closes a transaction when
+// there are no FS system calls active in it. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
@@ -18,67 +21,214 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the running transaction has been closed.
+// begin_op() reserves room for MAXOPBLOCKS logged blocks.  A
+// system call that writes file data uses begin_write() and
+// end_write() instead, which reserve log blocks for the metadata
+// the write may change, and ordered data blocks (see below) for
+// its data: as many as the write needs, up to what the open
+// transaction has left, so a large write goes in a few large
+// transactions rather than many small ones.
+//
+// Group commit: the end_op() that closes a transaction copies
+// the transaction's blocks into the log's buffers and then,
+// while it writes them out, lets new system calls start the
+// next transaction.  System calls that end while a commit is
+// in progress join that next transaction, which the committer
+// commits as soon as it is done with the previous one, so one
+// commit carries the updates of many system calls.  Because
+// commit works from its copies, the next transaction is free
+// to modify blocks that are still being committed.
 //
-// The log is a physical re-do log containing disk blocks.
+// The log is a physical re-do log of byte ranges of disk blocks.
+// log_write_range() records which bytes of a block a system call
+// changed; repeated writes to a block in one transaction are
+// absorbed into one range covering them all.  Commit packs just
+// those ranges into the log, so a small inode or bitmap update
+// costs a few bytes of log rather than a whole block.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
-// Log appends are synchronous.
+//   header block, containing block #, offset and length
+//     for ranges A, B, C, ..., and a checksum of their bytes
+//   the bytes of A, B, C, ..., back to back
+// Log appends are synchronous, but the header need not wait for
+// the log blocks: commit() writes it alongside them, and waits
+// for all of it.  A crash can then leave a header whose blocks
+// never made it, which recovery tells by the checksum and
+// ignores, as if the header hadn't been written either.
+// Installing the blocks at their home locations is left to the
+// checkpoint thread, so end_op() only pays for the log writes;
+// the next commit waits until the checkpoint has freed the log.
+// mkfs chooses the log's size; the kernel uses up to LOGSIZE
+// data blocks of it.
+//
+// Ordered data: writei() hands the data blocks of regular files
+// to log_write_data() rather than logging them, as does balloc()
+// when it zeroes a new data block for one.  Commit writes
+// them to their home locations, waiting for them along with the
+// log blocks, before it writes the header; so an inode or bitmap
+// update never commits ahead of the data it refers to, and file
+// data is written once instead of twice.  A crash can leave a
+// file with some of its new data but not the new size.  Commit
+// writes data only once the previous transaction is installed
+// and erased from the log, so recovery can't replay an old copy
+// of a reused block over new data.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
+  uint sum;        // of the logged bytes; see logsum()
   int block[LOGSIZE];
+  ushort off[LOGSIZE];
+  ushort len[LOGSIZE];
 };
 
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int max;         // most blocks in one transaction
+  int nbmap;       // bitmap blocks of the file system
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks reserved by them
+  int dreserved;   // ordered data blocks reserved by them
+  int committing;  // a commit is in progress.
+  int copying;     // commit is copying blocks; please wait.
+  int installing;  // clh is committed but not yet installed.
   int dev;
-  struct logheader lh;
+  struct logheader lh;       // the open transaction
+  struct buf *pinned[LOGSIZE]; // its blocks, pinned in the cache
+  struct logheader clh;      // the transaction being committed
+  struct buf *cpinned[LOGSIZE];
+  int cblocks;     // log blocks clh's ranges take up
+  int ndata;       // ordered data blocks of the open transaction
+  struct buf *data[NLOGDATA];
+  int cndata;      // ... and of the one being committed
+  struct buf *cdata[NLOGDATA];
+  uint seq;        // number of the open transaction
+  uint done;       // number of the last transaction committed
+
+  // Statistics, for logdump().
+  uint nwrite;     // log_write_range() calls
+  uint nabsorb;    // ... that hit a block already in the transaction
+  uint ncommit;
+  uint nrange;     // ranges committed
+  uint nbyte;      // bytes of ranges committed
+  uint nblock;     // log blocks written
+  uint ndblock;    // ordered data blocks written
 };
 struct log log;
+static int commitstat;  // stats.c counter
+
+// Private bufs holding committed copies of the blocks, for writing
+// to their home locations; the cache buffers may have moved on since.
+static struct buf shadow[LOGSIZE];
+static uchar shadowdata[LOGSIZE][BSIZE];
 
 static void recover_from_log(void);
 static void commit();
+static void checkpoint(void);
+
+// Add n bytes at p to checksum sum.
+static uint
+logsum(uint sum, uchar *p, int n)
+{
+  while (n-- > 0)
+    sum = sum*33 + *p++;
+  return sum;
+}
 
 void
 initlog(int dev)
 {
+  int i;
+
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
 
   struct superblock sb;
   initlock(&log.lock, "log");
+  commitstat = statalloc("log.commit", 1);
   readsb(dev, &sb);
   log.start = sb.logstart;
   log.size = sb.nlog;
+  log.max = log.size - 1 < LOGSIZE ? log.size - 1 : LOGSIZE;
+  log.nbmap = (sb.size + BPB - 1) / BPB;
+  if (log.max < MAXOPBLOCKS)
+    panic("initlog: log too small");
   log.dev = dev;
+  log.seq = 1;
+  for (i = 0; i < LOGSIZE; i++) {
+    initsleeplock(&shadow[i].lock, "shadow");
+    shadow[i].data = shadowdata[i];
+  }
   recover_from_log();
+  kthread("checkpoint", checkpoint);
+}
+
+// Is the transaction in log.lh all in the log?  Reads the
+// log blocks into the cache, all at once, for install_trans().
+static int
+check_trans(void)
+{
+  struct buf *lbuf;
+  int i, nb, pos;
+  uint sum;
+
+  pos = 0;
+  for (i = 0; i < log.lh.n; i++)
+    pos += log.lh.len[i];
+  nb = (pos + BSIZE - 1) / BSIZE;
+  if (nb > log.size - 1)
+    return 0;
+  for (i = 0; i < nb; i++)
+    breadahead(log.dev, log.start+1+i);
+  sum = 0;
+  for (i = 0; i < nb; i++, pos -= BSIZE) {
+    lbuf = bread(log.dev, log.start+1+i);
+    sum = logsum(sum, lbuf->data, min(pos, BSIZE));
+    brelse(lbuf);
+  }
+  return sum == log.lh.sum;
 }
 
 // Copy committed blocks from log to their home location
+// when recovering: nothing else is using the cache yet.
+// The destination blocks are read, and then written, in
+// batches that the disk driver can merge.
 static void
 install_trans(void)
 {
-  int tail;
+  struct buf *lbuf, *dbuf;
+  int tail, pos, n, m;
+  uchar *p;
 
+  for (tail = 0; tail < log.lh.n; tail++)
+    if (log.lh.len[tail] < BSIZE)
+      breadahead(log.dev, log.lh.block[tail]);
+  lbuf = 0;
+  pos = 0;
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
+    if (log.lh.len[tail] == BSIZE)
+      dbuf = bget(log.dev, log.lh.block[tail]); // all overwritten
+    else
+      dbuf = bread(log.dev, log.lh.block[tail]); // read dst
+    p = dbuf->data + log.lh.off[tail];
+    for (n = log.lh.len[tail]; n > 0; n -= m, pos += m, p += m) {
+      if (pos % BSIZE == 0) {
+        if (lbuf)
+          brelse(lbuf);
+        lbuf = bread(log.dev, log.start+1+pos/BSIZE); // read log block
+      }
+      m = min(n, BSIZE - pos%BSIZE);
+      memmove(p, lbuf->data + pos%BSIZE, m);  // copy range to dst
+    }
+    bawrite(dbuf);  // start writing dst to disk
   }
+  if (lbuf)
+    brelse(lbuf);
+  for (tail = 0; tail < log.lh.n; tail++)
+    brelse(bread(log.dev, log.lh.block[tail])); // wait for the write
 }
 
 // Read the log header from disk into the in-memory log header
@@ -89,36 +239,73 @@ read_head(void)
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
   log.lh.n = lh->n;
+  log.lh.sum = lh->sum;
+  if (log.lh.n < 0 || log.lh.n > LOGSIZE)
+    log.lh.n = 0;  // not a header we wrote
   for (i = 0; i < log.lh.n; i++) {
     log.lh.block[i] = lh->block[i];
+    log.lh.off[i] = lh->off[i];
+    log.lh.len[i] = lh->len[i];
   }
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write an in-memory log header to disk, waiting for it
+// if wait is set.  This is the true point at which the
+// transaction commits.
 static void
-write_head(void)
+write_head(struct logheader *h, int wait)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = h->n;
+  hb->sum = h->sum;
+  for (i = 0; i < h->n; i++) {
+    hb->block[i] = h->block[i];
+    hb->off[i] = h->off[i];
+    hb->len[i] = h->len[i];
+  }
+  if (!wait) {
+    bawrite(buf);
+    return;
   }
   bwrite(buf);
   brelse(buf);
 }
 
+// An empty log, the usual case after a clean shutdown,
+// needs no writes at all.
 static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(); // if committed, copy from log to disk
+  if (log.lh.n == 0)
+    return;
+  if (check_trans())
+    install_trans(); // committed: copy from log to disk
   log.lh.n = 0;
-  write_head(); // clear the log
+  write_head(&log.lh, 1); // clear the log
+}
+
+// Add an FS system call that reserves nlog log blocks and
+// ndata ordered data blocks.  Caller holds log.lock.
+static void
+reserve(int nlog, int ndata)
+{
+  log.outstanding += 1;
+  log.reserved += nlog;
+  log.dreserved += ndata;
+  trace(TR_BEGINOP, log.outstanding, 0);
+}
+
+// Log blocks left for another system call to reserve.
+static int
+logroom(void)
+{
+  if (log.copying)
+    return 0;
+  return log.max - log.lh.n - log.reserved;
 }
 
 // called at the start of each FS system call.
@@ -126,109 +313,406 @@ void
 begin_op(void)
 {
   acquire(&log.lock);
-  while(1){
-    if(log.committing){
-      sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
-      sleep(&log, &log.lock);
-    } else {
-      log.outstanding += 1;
-      release(&log.lock);
+  while(logroom() < MAXOPBLOCKS)
+    sleep(&log, &log.lock);  // wait for commit
+  reserve(MAXOPBLOCKS, 0);
+  release(&log.lock);
+}
+
+// Ordered data blocks that a write of n bytes may touch:
+// one more than it covers, for a partial block at each end.
+static int
+datablocks(int n)
+{
+  return (n + BSIZE - 1) / BSIZE + 1;
+}
+
+// Log blocks that a write of ndata data blocks may change: the
+// inode, four indirect blocks (the single one, the double one
+// and two under it), and a bitmap block for each block it
+// allocates, the ndata and the indirect ones, up to how many
+// bitmap blocks there are.  The data blocks themselves are
+// ordered data, not logged.
+static int
+writelog(int ndata)
+{
+  return 1 + 4 + min(ndata + 4, log.nbmap);
+}
+
+// Call at the start of an FS system call that writes up to n
+// bytes of file data, instead of begin_op().  Returns how many
+// bytes it may write in this transaction: as much of n as the
+// open transaction has room for, in ordered data blocks and in
+// log blocks for the metadata, and at least the smaller of n
+// and MAXOPBLOCKS-1 blocks, waiting for a commit if need be.
+// Pass the return value to end_write().
+int
+begin_write(int n)
+{
+  int room, want, least;
+
+  want = datablocks(n);
+  least = min(want, MAXOPBLOCKS);
+  acquire(&log.lock);
+  for(;;){
+    room = NLOGDATA - log.ndata - log.dreserved;
+    if(room >= least && logroom() >= writelog(least))
       break;
-    }
+    sleep(&log, &log.lock);
   }
+  if(want > room)
+    want = room;
+  while(writelog(want) > logroom())
+    want--;
+  if(want < datablocks(n))
+    n = (want - 1) * BSIZE;
+  reserve(writelog(want), want);
+  release(&log.lock);
+  return n;
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
-void
-end_op(void)
+// commits if this was the last outstanding operation
+// and no commit is already in progress.
+static void
+finish(int nlog, int ndata)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
+  log.reserved -= nlog;
+  log.dreserved -= ndata;
+  trace(TR_ENDOP, log.outstanding, 0);
+  if(log.copying)
+    panic("log.copying");
+  if(log.outstanding == 0 && !log.committing){
     log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+    commit();
+    log.committing = 0;
   }
+  // begin_op() may be waiting for log space,
+  // and decrementing log.outstanding has decreased
+  // the amount of reserved space.
+  wakeup(&log);
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+void
+end_op(void)
+{
+  finish(MAXOPBLOCKS, 0);
+}
+
+// End a system call begun with begin_write(), which returned n.
+void
+end_write(int n)
+{
+  finish(writelog(datablocks(n)), datablocks(n));
+}
+
+// Number of the open transaction, which a system call between
+// begin_op() and end_op() is part of.
+uint
+log_seq(void)
+{
+  uint seq;
+
+  acquire(&log.lock);
+  seq = log.seq;
+  release(&log.lock);
+  return seq;
+}
+
+// Close the open transaction: copy its blocks from the cache,
+// pack their changed ranges into log buffers, and start writing
+// those to the log.  Called with log.lock held and no FS system
+// calls active; begin_op() waits until the copies are made.
+static void
+copy_log(void)
+{
+  struct buf *from, *to;
+  int tail, pos, n, m;
+  uchar *p;
+
+  log.copying = 1;
+  log.clh = log.lh;
+  memmove(log.cpinned, log.pinned, sizeof(log.pinned));
+  log.lh.n = 0;
+  log.cndata = log.ndata;
+  memmove(log.cdata, log.data, sizeof(log.data));
+  log.ndata = 0;
+  log.seq++;
+  release(&log.lock);
+
+  to = 0;
+  pos = 0;
+  log.clh.sum = 0;
+  for (tail = 0; tail < log.clh.n; tail++) {
+    from = bread(log.dev, log.clh.block[tail]); // cache block
+    memmove(shadow[tail].data, from->data, BSIZE);
+    brelse(from);
+    p = shadow[tail].data + log.clh.off[tail];
+    log.clh.sum = logsum(log.clh.sum, p, log.clh.len[tail]);
+    for (n = log.clh.len[tail]; n > 0; n -= m, pos += m, p += m) {
+      if (pos % BSIZE == 0)
+        to = bget(log.dev, log.start+1+pos/BSIZE); // log block
+      m = min(n, BSIZE - pos%BSIZE);
+      memmove(to->data + pos%BSIZE, p, m);
+      if ((pos+m) % BSIZE == 0)
+        bawrite(to);  // start writing the log
+    }
+  }
+  if (pos % BSIZE)
+    bawrite(to);
+  log.cblocks = (pos+BSIZE-1) / BSIZE;
+
+  log.ncommit++;
+  log.nrange += log.clh.n;
+  log.nbyte += pos;
+  log.nblock += log.cblocks;
+  log.ndblock += log.cndata;
+
+  acquire(&log.lock);
+  log.copying = 0;
+  wakeup(&log);
+}
+
+// Wait for the log writes started by copy_log() to finish.
+static void
+wait_log(void)
+{
+  int i;
+
+  for (i = 0; i < log.cblocks; i++)
+    brelse(bread(log.dev, log.start+1+i));
+}
+
+// Start writing the ordered data blocks of the transaction
+// being committed to their home locations.
+static void
+write_data(void)
+{
+  struct buf *b;
+  int i;
+
+  for (i = 0; i < log.cndata; i++) {
+    b = log.cdata[i];
+    bawrite(bread(b->dev, b->blockno));
   }
 }
 
-// Copy modified blocks from cache to log.
+// Wait for the writes started by write_data(), and let the
+// data blocks' buffers be evicted; O_DIRECT ones first.
 static void
-write_log(void)
+wait_data(void)
 {
+  struct buf *b;
+  int i;
+
+  for (i = 0; i < log.cndata; i++) {
+    b = bread(log.cdata[i]->dev, log.cdata[i]->blockno);
+    if (b->flags & B_NOCACHE) {
+      b->flags &= ~B_NOCACHE;
+      bdiscard(b);
+    } else
+      brelse(b);
+    bunpin(b);
+  }
+}
+
+// Write the committed copies to the blocks' home locations,
+// then allow the blocks' cache buffers to be evicted.
+static void
+install_copies(void)
+{
+  struct buf *s;
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = 0; tail < log.clh.n; tail++) {
+    s = &shadow[tail];
+    acquiresleep(&s->lock);
+    s->dev = log.dev;
+    s->blockno = log.clh.block[tail];
+    s->refcnt = 1;
+    s->flags = B_DIRTY|B_ASYNC;
+    iderw(s);
+  }
+  for (tail = 0; tail < log.clh.n; tail++) {
+    acquiresleep(&shadow[tail].lock); // wait for the write
+    releasesleep(&shadow[tail].lock);
+    bunpin(log.cpinned[tail]);
   }
 }
 
+// Commit the open transaction, and keep committing the next
+// one as long as the system calls in it have all finished.
+// The checkpoint thread installs each committed transaction.
+// Called and returns with log.lock held; releases it while
+// doing disk writes.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  while (log.outstanding == 0 && (log.lh.n > 0 || log.ndata > 0)) {
+    if (log.installing) {  // previous transaction still in the log
+      // System calls can join the transaction meanwhile: if
+      // they have not all ended when we wake, leave it to
+      // the last of them to commit.
+      sleep(&log, &log.lock);
+      continue;
+    }
+    copy_log();
+    release(&log.lock);
+    statinc(commitstat);
+    write_data();
+    wait_data();
+    if (log.clh.n > 0)
+      write_head(&log.clh, 0); // Write header to disk -- the real commit
+    wait_log();
+    if (log.clh.n > 0)
+      brelse(bread(log.dev, log.start)); // wait for the header
+    acquire(&log.lock);
+    if (log.clh.n > 0) {
+      log.installing = 1;
+      wakeup(&log.installing);
+    }
+    log.done = log.seq - 1;
+    wakeup(&log.done);
   }
 }
 
-// Caller has modified b->data and is done with the buffer.
-// Record the block number and pin in the cache with B_DIRTY.
-// commit()/write_log() will do the disk write.
+// Wait until everything FS system calls have finished
+// writing is committed: for fsync() and sync().  end_op()
+// commits, but a call that ends while others are still
+// running has its changes committed later, with theirs.
+void
+log_sync(void)
+{
+  uint seq;
+
+  acquire(&log.lock);
+  if (log.lh.n > 0 || log.ndata > 0)
+    seq = log.seq;      // the open transaction
+  else
+    seq = log.seq - 1;  // the last closed; maybe still committing
+  while (log.done < seq)
+    sleep(&log.done, &log.lock);
+  release(&log.lock);
+}
+
+// Kernel thread that installs committed transactions at their
+// home locations, then frees the log for the next commit.
+static void
+checkpoint(void)
+{
+  for (;;) {
+    acquire(&log.lock);
+    while (!log.installing)
+      sleep(&log.installing, &log.lock);
+    release(&log.lock);
+
+    install_copies();     // Now install writes to home locations
+    log.clh.n = 0;
+    write_head(&log.clh, 1); // Erase the transaction from the log
+
+    acquire(&log.lock);
+    log.installing = 0;
+    wakeup(&log);
+    release(&log.lock);
+  }
+}
+
+// Caller has modified n bytes of b->data starting at off and is
+// done with the buffer.  Record the range and pin the block in the
+// cache; commit()/copy_log() will do the disk write.
 //
-// log_write() replaces bwrite(); a typical use is:
+// log_write_range() replaces bwrite(); a typical use is:
 //   bp = bread(...)
 //   modify bp->data[]
-//   log_write(bp)
+//   log_write_range(bp, offset, length)
 //   brelse(bp)
 void
-log_write(struct buf *b)
+log_write_range(struct buf *b, uint off, uint n)
 {
   int i;
+  uint end;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.max)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
+  if (off + n > BSIZE || n == 0)
+    panic("log_write_range");
+  if (b->dev != log.dev) {
+    bwrite(b);  // only the root disk is logged
+    return;
+  }
 
   acquire(&log.lock);
+  log.nwrite++;
   for (i = 0; i < log.lh.n; i++) {
     if (log.lh.block[i] == b->blockno)   // log absorbtion
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n)
+  if (i == log.lh.n) {
+    log.lh.block[i] = b->blockno;
+    log.lh.off[i] = off;
+    log.lh.len[i] = n;
+    log.pinned[i] = b;
+    bpin(b);  // prevent eviction
     log.lh.n++;
-  b->flags |= B_DIRTY; // prevent eviction
+  } else {
+    log.nabsorb++;
+    end = log.lh.off[i] + log.lh.len[i];
+    if (off + n > end)
+      end = off + n;
+    if (off < log.lh.off[i])
+      log.lh.off[i] = off;
+    log.lh.len[i] = end - log.lh.off[i];
+  }
   release(&log.lock);
 }
 
+// Caller has modified b, a data block of a regular file, and is
+// done with it.  Pin it until commit() writes it ahead of the
+// metadata; see "Ordered data" above.
+void
+log_write_data(struct buf *b)
+{
+  int i;
+
+  if (log.outstanding < 1)
+    panic("log_write_data outside of trans");
+  if (b->dev != log.dev) {
+    b->flags &= ~B_NOCACHE;
+    bwrite(b);
+    return;
+  }
+
+  acquire(&log.lock);
+  for (i = 0; i < log.ndata; i++)
+    if (log.data[i] == b)  // buffers are pinned, so one per block
+      break;
+  if (i == log.ndata) {
+    if (log.ndata >= NLOGDATA)
+      panic("too much ordered data");
+    log.data[log.ndata++] = b;
+    bpin(b);
+  }
+  release(&log.lock);
+}
+
+// Log a write of the whole of b.
+void
+log_write(struct buf *b)
+{
+  log_write_range(b, 0, BSIZE);
+}
+
+// Print logging statistics to the console, for ^P.
+void
+logdump(void)
+{
+  cprintf("log: %d writes, %d absorbed, %d commits, "
+          "%d ranges, %d bytes, %d log blocks, %d data blocks\n",
+          log.nwrite, log.nabsorb, log.ncommit,
+          log.nrange, log.nbyte, log.nblock, log.ndblock);
+}
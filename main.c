@@ -5,6 +5,7 @@
 #include "mmu.h"
 #include "proc.h"
 #include "x86.h"
+#include "vdso.h"
 
 static void startothers(void);
 static void mpmain(void)  __attribute__((noreturn));
@@ -20,19 +21,29 @@ main(void)
   kinit1(end, P2V(4*1024*1024)); // phys page allocator
   kvmalloc();      // kernel page table
   mpinit();        // detect other processors
+  vdso->ncpu = ncpu;
   lapicinit();     // interrupt controller
   seginit();       // segment descriptors
+  fpuinit();       // floating point unit
   picinit();       // disable pic
   ioapicinit();    // another interrupt controller
   consoleinit();   // console hardware
   uartinit();      // serial port
+  statinit();      // event counters
   pinit();         // process table
   tvinit();        // trap vectors
-  binit();         // buffer cache
+  syscallinit();   // system call counters
+  profinit();      // sampling profiler
+  traceinit();     // event tracing
   fileinit();      // file table
+  dcinit();        // directory name cache
+  pipeinit();      // pipes
   ideinit();       // disk 
   startothers();   // start other processors
-  kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
+  kinit2(P2V(4*1024*1024), P2V(phystop)); // must come after startothers()
+  binit();         // buffer cache; must come after kinit2()
+  pcinit();        // page cache
+  ramdiskinit();   // RAM disk
   userinit();      // first user process
   mpmain();        // finish this processor's setup
 }
@@ -43,6 +54,7 @@ mpenter(void)
 {
   switchkvm();
   seginit();
+  fpuinit();
   lapicinit();
   mpmain();
 }
@@ -59,14 +71,17 @@ mpmain(void)
 
 pde_t entrypgdir[];  // For entry.S
 
-// Start the non-boot (AP) processors.
+// Kernel stacks for the APs, taken in the order they arrive.
+static char *apstack[NCPU];
+
+// Start the non-boot (AP) processors, all at once.
 static void
 startothers(void)
 {
   extern uchar _binary_entryother_start[], _binary_entryother_size[];
-  uchar *code;
+  uchar *code, apicid[NCPU];
   struct cpu *c;
-  char *stack;
+  int n;
 
   // Write entry code to unused memory at 0x7000.
   // The linker has placed the image of entryother.S in
@@ -74,24 +89,31 @@ startothers(void)
   code = P2V(0x7000);
   memmove(code, _binary_entryother_start, (uint)_binary_entryother_size);
 
+  n = 0;
   for(c = cpus; c < cpus+ncpu; c++){
     if(c == mycpu())  // We've started already.
       continue;
+    apstack[n] = kalloc() + KSTACKSIZE;
+    apicid[n++] = c->apicid;
+  }
+  if(n == 0)
+    return;
 
-    // Tell entryother.S what stack to use, where to enter, and what
-    // pgdir to use. We cannot use kpgdir yet, because the AP processor
-    // is running in low  memory, so we use entrypgdir for the APs too.
-    stack = kalloc();
-    *(void**)(code-4) = stack + KSTACKSIZE;
-    *(void(**)(void))(code-8) = mpenter;
-    *(int**)(code-12) = (void *) V2P(entrypgdir);
+  // Tell entryother.S what stacks to use, where to enter, and what
+  // pgdir to use. We cannot use kpgdir yet, because the AP processor
+  // is running in low  memory, so we use entrypgdir for the APs too.
+  // Each AP takes the next stack by adding 4 to the offset at code-16.
+  *(char***)(code-4) = apstack;
+  *(void(**)(void))(code-8) = mpenter;
+  *(int**)(code-12) = (void *) V2P(entrypgdir);
+  *(uint*)(code-16) = 0;
 
-    lapicstartap(c->apicid, V2P(code));
+  lapicstartap(apicid, n, V2P(code));
 
-    // wait for cpu to finish mpmain()
-    while(c->started == 0)
+  // wait for the cpus to finish mpmain()
+  for(c = cpus; c < cpus+ncpu; c++)
+    while(c != mycpu() && c->started == 0)
       ;
-  }
 }
 
 // The boot page table used in entry.S and entryother.S.
@@ -15,6 +15,8 @@
 
 extern uchar _binary_fs_img_start[], _binary_fs_img_size[];
 
+int ideirq = IRQ_IDE;  // never raised
+
 static int disksize;
 static uchar *memdisk;
 
@@ -57,4 +59,8 @@ iderw(struct buf *b)
   } else
     memmove(b->data, p, BSIZE);
   b->flags |= B_VALID;
+  if(b->flags & B_ASYNC){
+    b->flags &= ~B_ASYNC;
+    bdone(b);
+  }
 }
@@ -4,8 +4,11 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <dirent.h>
 
+typedef struct dirent hostdirent;
 #define stat xv6_stat  // avoid clash with host struct stat
+#define dirent xv6_dirent  // and with host struct dirent
 #include "types.h"
 #include "fs.h"
 #include "stat.h"
@@ -18,19 +21,22 @@
 #define NINODES 200
 
 // Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
+// [ boot block | sb block | log | inode blocks | free bit map | data blocks | swap ]
+// The swap blocks are not part of the file system's size.
+// The image is built in memory, in img, and written at the end.
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = LOGSIZE+1;  // the header and all LOGSIZE blocks the kernel uses
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
+uchar *img;
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
+uint nbucket[NINODES][NDIRHASH];  // entries in each directory's buckets
 
 
 void balloc(int);
@@ -38,8 +44,13 @@ void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
+uchar* sect(uint sec);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void iwrite(uint inum, uint off, void *p, int n);
+void dirappend(uint dir, char *name, uint inum);
+void dirfix(uint dir);
+void import(uint dir, char *path, char *name);
 
 // convert to intel byte order
 ushort
@@ -67,19 +78,24 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
-  char buf[BSIZE];
-  struct dinode din;
+  int i, n, m;
+  uint rootino;
+  char *name, *p;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  if(argc > 2 && strcmp(argv[1], "-l") == 0){
+    nlog = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+  if(argc < 2 || nlog < MAXOPBLOCKS+1){
+    fprintf(stderr, "Usage: mkfs [-l nlog] fs.img files-or-dirs...\n");
     exit(1);
   }
+  if(nlog > LOGSIZE+1)
+    fprintf(stderr, "mkfs: kernel uses only %d log blocks\n", LOGSIZE+1);
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
@@ -89,8 +105,11 @@ main(int argc, char *argv[])
     perror(argv[1]);
     exit(1);
   }
+  if((img = calloc(FSSIZE + SWAPSIZE, BSIZE)) == 0){
+    perror("calloc");
+    exit(1);
+  }
 
-  // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
   nblocks = FSSIZE - nmeta;
 
@@ -101,83 +120,123 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.bsize = xint(BSIZE);
+  sb.swapstart = xint(FSSIZE);
+  sb.nswap = xint(SWAPSIZE);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d swap %d\n",
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE, SWAPSIZE);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
-
-  memset(buf, 0, sizeof(buf));
-  memmove(buf, &sb, sizeof(sb));
-  wsect(1, buf);
+  memmove(img + BSIZE, &sb, sizeof(sb));
 
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  dirappend(rootino, ".", rootino);
+  dirappend(rootino, "..", rootino);
 
+  // Each argument goes in the root under its last path
+  // element; a directory brings the tree under it along.
   for(i = 2; i < argc; i++){
-    assert(index(argv[i], '/') == 0);
-
-    if((fd = open(argv[i], 0)) < 0){
-      perror(argv[i]);
-      exit(1);
-    }
+    for(n = strlen(argv[i]); n > 1 && argv[i][n-1] == '/'; n--)
+      argv[i][n-1] = 0;
+    name = (p = strrchr(argv[i], '/')) && p[1] ? p + 1 : argv[i];
 
     // Skip leading _ in name when writing to file system.
     // The binaries are named _rm, _cat, etc. to keep the
     // build operating system from trying to execute them
     // in place of system binaries like rm and cat.
-    if(argv[i][0] == '_')
-      ++argv[i];
-
-    inum = ialloc(T_FILE);
-
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, argv[i], DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    if(name[0] == '_')
+      ++name;
 
-    while((cc = read(fd, buf, sizeof(buf))) > 0)
-      iappend(inum, buf, cc);
-
-    close(fd);
+    import(rootino, argv[i], name);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  dirfix(rootino);
 
   balloc(freeblock);
 
+  for(n = 0; n < (FSSIZE + SWAPSIZE) * BSIZE; n += m){
+    if((m = write(fsfd, img + n, (FSSIZE + SWAPSIZE) * BSIZE - n)) <= 0){
+      perror("write");
+      exit(1);
+    }
+  }
+  close(fsfd);
+
   exit(0);
 }
 
+// Add the host file or directory tree at path to directory dir
+// as name, as the kernel's create() would.
 void
-wsect(uint sec, void *buf)
+import(uint dir, char *path, char *name)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
-    perror("lseek");
-    exit(1);
+  static char buf[64*1024];
+  hostdirent **de;
+  struct dinode din;
+  uint inum;
+  char *child;
+  int i, n, fd, cc;
+  DIR *d;
+
+  if((d = opendir(path)) == 0){
+    if((fd = open(path, 0)) < 0){
+      perror(path);
+      exit(1);
+    }
+    inum = ialloc(T_FILE);
+    dirappend(dir, name, inum);
+    while((cc = read(fd, buf, sizeof(buf))) > 0)
+      iappend(inum, buf, cc);
+    close(fd);
+    return;
   }
-  if(write(fsfd, buf, BSIZE) != BSIZE){
-    perror("write");
+  closedir(d);
+
+  inum = ialloc(T_DIR);
+  dirappend(dir, name, inum);
+  dirappend(inum, ".", inum);
+  dirappend(inum, "..", dir);
+  rinode(dir, &din);  // for ".."
+  din.nlink = xshort(xshort(din.nlink) + 1);
+  winode(dir, &din);
+
+  // In sorted order, so that the same tree makes the same image.
+  if((n = scandir(path, &de, 0, alphasort)) < 0){
+    perror(path);
     exit(1);
   }
+  for(i = 0; i < n; i++){
+    if(strcmp(de[i]->d_name, ".") != 0 && strcmp(de[i]->d_name, "..") != 0){
+      if((child = malloc(strlen(path) + strlen(de[i]->d_name) + 2)) == 0){
+        perror("malloc");
+        exit(1);
+      }
+      sprintf(child, "%s/%s", path, de[i]->d_name);
+      import(inum, child, de[i]->d_name);
+      free(child);
+    }
+    free(de[i]);
+  }
+  free(de);
+  dirfix(inum);
+}
+
+// The block holding sector sec in the image.
+uchar*
+sect(uint sec)
+{
+  assert(sec < FSSIZE + SWAPSIZE);
+  return img + sec * BSIZE;
+}
+
+void
+wsect(uint sec, void *buf)
+{
+  memmove(sect(sec), buf, BSIZE);
 }
 
 void
@@ -210,14 +269,7 @@ rinode(uint inum, struct dinode *ip)
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
-    perror("lseek");
-    exit(1);
-  }
-  if(read(fsfd, buf, BSIZE) != BSIZE){
-    perror("read");
-    exit(1);
-  }
+  memmove(buf, sect(sec), BSIZE);
 }
 
 uint
@@ -226,6 +278,7 @@ ialloc(ushort type)
   uint inum = freeinode++;
   struct dinode din;
 
+  assert(inum < NINODES);
   bzero(&din, sizeof(din));
   din.type = xshort(type);
   din.nlink = xshort(1);
@@ -237,34 +290,42 @@ ialloc(ushort type)
 void
 balloc(int used)
 {
-  uchar buf[BSIZE];
+  uchar *bp;
   int i;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
+  assert(used <= FSSIZE);
   for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    bp = sect(xint(sb.bmapstart) + i/BPB);
+    bp[(i%BPB)/8] |= 0x1 << (i%8);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
+  printf("balloc: wrote bitmap blocks at sector %d\n", xint(sb.bmapstart));
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
 void
 iappend(uint inum, void *xp, int n)
+{
+  struct dinode din;
+
+  rinode(inum, &din);
+  iwrite(inum, xint(din.size), xp, n);
+}
+
+// Write n bytes at off, which may be past the end of the file:
+// blocks in between stay unallocated.
+void
+iwrite(uint inum, uint off, void *xp, int n)
 {
   char *p = (char*)xp;
-  uint fbn, off, n1;
+  uint fbn, n1;
   struct dinode din;
-  char buf[BSIZE];
   uint indirect[NINDIRECT];
-  uint x;
+  uint x, b;
 
   rinode(inum, &din);
-  off = xint(din.size);
-  // printf("append inum %d at off %d sz %d\n", inum, off, n);
+  // printf("write inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
@@ -273,7 +334,7 @@ iappend(uint inum, void *xp, int n)
         din.addrs[fbn] = xint(freeblock++);
       }
       x = xint(din.addrs[fbn]);
-    } else {
+    } else if(fbn < NDIRECT + NINDIRECT){
       if(xint(din.addrs[NDIRECT]) == 0){
         din.addrs[NDIRECT] = xint(freeblock++);
       }
@@ -283,15 +344,71 @@ iappend(uint inum, void *xp, int n)
         wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
       }
       x = xint(indirect[fbn-NDIRECT]);
+    } else {
+      b = fbn - NDIRECT - NINDIRECT;
+      if(xint(din.addrs[NDIRECT+1]) == 0){
+        din.addrs[NDIRECT+1] = xint(freeblock++);
+      }
+      rsect(xint(din.addrs[NDIRECT+1]), (char*)indirect);
+      if(indirect[b / NINDIRECT] == 0){
+        indirect[b / NINDIRECT] = xint(freeblock++);
+        wsect(xint(din.addrs[NDIRECT+1]), (char*)indirect);
+      }
+      x = xint(indirect[b / NINDIRECT]);
+      rsect(x, (char*)indirect);
+      if(indirect[b % NINDIRECT] == 0){
+        indirect[b % NINDIRECT] = xint(freeblock++);
+        wsect(x, (char*)indirect);
+      }
+      x = xint(indirect[b % NINDIRECT]);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
-    rsect(x, buf);
-    bcopy(p, buf + off - (fbn * BSIZE), n1);
-    wsect(x, buf);
+    bcopy(p, sect(x) + off - (fbn * BSIZE), n1);
     n -= n1;
     off += n1;
     p += n1;
   }
-  din.size = xint(off);
+  if(off > xint(din.size))
+    din.size = xint(off);
   winode(inum, &din);
 }
+
+// Add (name, inum) to directory dir where the kernel's dirlink()
+// would (see fs.h).  mkfs never removes entries, so bucket h of
+// dir has nbucket[dir][h] entries, in order.
+void
+dirappend(uint dir, char *name, uint inum)
+{
+  struct dinode din;
+  struct dirent de;
+  uint h, n, per;
+
+  bzero(&de, sizeof(de));
+  de.inum = xshort(inum);
+  strncpy(de.name, name, DIRSIZ);
+
+  rinode(dir, &din);
+  if(xint(din.size) < DIRLINEAR*BSIZE){
+    iappend(dir, &de, sizeof(de));
+    return;
+  }
+  h = dirhash(de.name) % NDIRHASH;
+  n = nbucket[dir][h]++;
+  per = BSIZE / sizeof(de);
+  iwrite(dir, (DIRLINEAR + h + n/per*NDIRHASH)*BSIZE + n%per*sizeof(de),
+         &de, sizeof(de));
+}
+
+// Round dir's size up past its last block, as mkfs always has.
+void
+dirfix(uint dir)
+{
+  struct dinode din;
+  uint off;
+
+  rinode(dir, &din);
+  off = xint(din.size);
+  off = ((off/BSIZE) + 1) * BSIZE;
+  din.size = xint(off);
+  winode(dir, &din);
+}
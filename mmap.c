@@ -0,0 +1,219 @@
+// Memory-mapped files and anonymous memory.
+//
+// Each mapping is a vma of the process.  mmap() only records it;
+// pagefault() fills the pages in when they are first touched,
+// file pages from the page cache.  MAP_PRIVATE file pages are
+// mapped copy-on-write; MAP_SHARED ones are mapped writable, and
+// msync-on-unmap semantics apply: munmap(), exec() and exit()
+// write the pages the process dirtied back to the file.
+// Mappings are placed below VDSO, the newest lowest, and the
+// heap may not grow into them.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "x86.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "vdso.h"
+
+// Return the vma of p that va falls in, or 0.
+struct vma*
+vmalookup(struct proc *p, uint va)
+{
+  struct vma *v;
+
+  for(v = p->vm->vma; v < &p->vm->vma[NVMA]; v++)
+    if(v->end && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Lowest address of p's mappings above its heap, or VDSO.
+uint
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint base;
+
+  base = VDSO;
+  for(v = p->vm->vma; v < &p->vm->vma[NVMA]; v++)
+    if(v->end && v->start >= p->vm->sz && v->start < base)
+      base = v->start;
+  return base;
+}
+
+// Map len bytes of ip from offset off, or anonymous zeroed
+// memory if ip is 0, into the current process.
+// Returns the address of the mapping, or -1.
+int
+mmap(uint len, int prot, int flags, struct inode *ip, uint off)
+{
+  struct proc *p = myproc();
+  struct vma *v, nv;
+  uint base;
+
+  if(len == 0 || len >= VDSO || off % PGSIZE != 0)
+    return -1;
+  if((flags & (MAP_SHARED|MAP_PRIVATE)) == 0 ||
+     (flags & (MAP_SHARED|MAP_PRIVATE)) == (MAP_SHARED|MAP_PRIVATE))
+    return -1;
+  len = PGROUNDUP(len);
+  vmlock(p);
+  for(v = p->vm->vma; v < &p->vm->vma[NVMA] && v->end; v++)
+    ;
+  base = mmapbase(p);
+  if(v == &p->vm->vma[NVMA] || base - PGROUNDUP(p->vm->sz) < len){
+    vmunlock(p);
+    return -1;
+  }
+
+  nv.start = base - len;
+  nv.end = base;
+  nv.off = off;
+  nv.prot = prot;
+  nv.flags = flags;
+  nv.filesz = 0;
+  nv.ip = 0;
+  if(ip){
+    nv.ip = idup(ip);
+    ilock(ip);
+    if(off < ip->size)
+      nv.filesz = ip->size - off < len ? ip->size - off : len;
+    iunlock(ip);
+  }
+  acquire(ptlock(p->pgdir));  // for pagefault()
+  *v = nv;
+  release(ptlock(p->pgdir));
+  vmunlock(p);
+  return nv.start;
+}
+
+// Write the pages of [start, end) of vma v that p dirtied back
+// to v's file, if it is a writable shared file mapping.
+static void
+writeback(struct proc *p, struct vma *v, uint start, uint end)
+{
+  uint a, n, i, m;
+  char *mem;
+
+  if(v->ip == 0 || !(v->flags & MAP_SHARED) || !(v->prot & PROT_WRITE))
+    return;
+  for(a = start; a < end && a - v->start < v->filesz; a += PGSIZE){
+    if((mem = uvmdirty(p->pgdir, a)) == 0)
+      continue;
+    n = v->filesz - (a - v->start);
+    if(n > PGSIZE)
+      n = PGSIZE;
+    for(i = 0; i < n; i += m){
+      m = begin_write(n - i);
+      ilock(v->ip);
+      writei(v->ip, mem + i, v->off + (a - v->start) + i, m);
+      iunlock(v->ip);
+      end_write(m);
+    }
+  }
+}
+
+// Write back all of p's shared file mappings.
+void
+vmasync(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vm->vma; v < &p->vm->vma[NVMA]; v++)
+    if(v->end)
+      writeback(p, v, v->start, v->end);
+}
+
+// Unmap [addr, addr+len) from the current process.  Mappings
+// partly in the range are trimmed, or split in two.  The vmas
+// change first, so that a thread's pagefault() can't fill the
+// range in again once deallocuvm() has emptied it.
+int
+munmap(uint addr, uint len)
+{
+  struct proc *p = myproc();
+  struct vma *v, *w, old;
+  uint end, s, e;
+
+  if(addr % PGSIZE != 0 || len == 0 || addr + len < addr)
+    return -1;
+  end = PGROUNDUP(addr + len);
+  vmlock(p);
+  for(v = p->vm->vma; v < &p->vm->vma[NVMA]; v++){
+    if(v->end == 0 || v->start < p->vm->sz || v->end <= addr || end <= v->start)
+      continue;
+    s = addr > v->start ? addr : v->start;
+    e = end < v->end ? end : v->end;
+    w = 0;
+    if(s > v->start && e < v->end){
+      // Split: w keeps the part above the hole.
+      for(w = p->vm->vma; w < &p->vm->vma[NVMA] && w->end; w++)
+        ;
+      if(w == &p->vm->vma[NVMA]){
+        vmunlock(p);
+        return -1;
+      }
+      if(v->ip)
+        idup(v->ip);
+    }
+
+    old = *v;
+    acquire(ptlock(p->pgdir));
+    if(w){
+      *w = *v;
+      w->start = e;
+      w->off += e - v->start;
+      w->filesz = v->filesz > e - v->start ? v->filesz - (e - v->start) : 0;
+    }
+    if(s == v->start && e == v->end){
+      v->end = 0;
+      v->ip = 0;
+    } else if(s == v->start){
+      v->filesz = v->filesz > e - v->start ? v->filesz - (e - v->start) : 0;
+      v->off += e - v->start;
+      v->start = e;
+    } else {
+      if(v->filesz > s - v->start)
+        v->filesz = s - v->start;
+      v->end = s;
+    }
+    p->vm->gen++;
+    release(ptlock(p->pgdir));
+
+    writeback(p, &old, s, e);
+    deallocuvm(p->pgdir, e, s);
+    if(v->end == 0 && old.ip){
+      uvmfillwait(p);
+      begin_op();
+      iput(old.ip);
+      end_op();
+    }
+  }
+  vmunlock(p);
+  return 0;
+}
+
+// Drop the files behind the regions in vma[NVMA].
+// Must be called inside a transaction.
+void
+vmafree(struct vma *vma)
+{
+  struct vma *v;
+
+  for(v = vma; v < &vma[NVMA]; v++){
+    if(v->end){
+      if(v->ip)
+        iput(v->ip);
+      v->end = 0;
+      v->ip = 0;
+    }
+  }
+}
@@ -0,0 +1,15 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+int
+main(int argc, char *argv[])
+{
+  if(argc != 3){
+    printf(2, "usage: mount dir dev\n");
+    exit();
+  }
+  if(mount(argv[1], atoi(argv[2])) < 0)
+    printf(2, "mount: %s on %s failed\n", argv[2], argv[1]);
+  exit();
+}
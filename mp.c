@@ -13,6 +13,7 @@
 
 struct cpu cpus[NCPU];
 int ncpu;
+struct cpu *apiccpu[256];
 uchar ioapicid;
 
 static uchar
@@ -108,6 +109,7 @@ mpinit(void)
       proc = (struct mpproc*)p;
       if(ncpu < NCPU) {
         cpus[ncpu].apicid = proc->apicid;  // apicid may differ from ncpu
+        apiccpu[proc->apicid] = &cpus[ncpu];
         ncpu++;
       }
       p += sizeof(struct mpproc);
@@ -0,0 +1,166 @@
+// Page cache: physical pages holding file contents, shared by
+// every process that maps them.
+//
+// pagefault() maps pages of a file-backed vma from here,
+// read-only and copy-on-write, so that all the processes running
+// a program share one copy of each of its pages that they have
+// not written.  An entry is named by the file and the offset and
+// length of the file data in the page; the rest of the page is
+// zero.  Entries are hashed by file, so that looking one up,
+// or invalidating a file's, visits only that file's bucket.
+// The cache holds a reference to each of its pages, and
+// recycles entries with a clock sweep.  writei() and itrunc()
+// invalidate entries whose file data changes; processes that
+// already map a page keep the old contents, as they would had
+// they read the file into private memory.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+#define NPCHASH 31
+
+struct pcpage {
+  uint dev;
+  uint inum;
+  uint off;     // file offset of the page's first byte
+  uint n;       // bytes of file data in the page
+  char *page;   // 0 if the entry is free
+  int recent;   // clock bit
+  struct pcpage *hnext;  // next in its hash bucket
+};
+
+static struct {
+  struct spinlock lock;
+  struct pcpage page[NPAGECACHE];
+  struct pcpage *hash[NPCHASH];  // entries in use, by file
+  int hand;
+  uint gen;     // bumped by every pcinval()
+} pcache;
+
+void
+pcinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+}
+
+static struct pcpage**
+pchash(uint dev, uint inum)
+{
+  return &pcache.hash[(dev*31 + inum) % NPCHASH];
+}
+
+static struct pcpage*
+pclookup(uint dev, uint inum, uint off, uint n)
+{
+  struct pcpage *e;
+
+  for(e = *pchash(dev, inum); e; e = e->hnext)
+    if(e->dev == dev && e->inum == inum && e->off == off && e->n == n)
+      return e;
+  return 0;
+}
+
+// Free entry e, at *pp in its bucket.
+static void
+pcfree(struct pcpage **pp, struct pcpage *e)
+{
+  *pp = e->hnext;
+  kfree(e->page);
+  e->page = 0;
+}
+
+// Return a page holding n bytes of ip's data from offset off,
+// followed by zeros, with a reference for the caller.
+// Returns 0 if out of memory or the read fails.
+// Reads the file, so caller must not hold ip->lock or spinlocks.
+char*
+pcget(struct inode *ip, uint off, uint n)
+{
+  struct pcpage *e, **pp;
+  char *mem;
+  uint gen;
+
+  acquire(&pcache.lock);
+  if((e = pclookup(ip->dev, ip->inum, off, n)) != 0){
+    e->recent = 1;
+    kref(e->page);
+    release(&pcache.lock);
+    return e->page;
+  }
+  gen = pcache.gen;
+  release(&pcache.lock);
+
+  if((mem = kzalloc()) == 0)
+    return 0;
+  ilock(ip);
+  if(readi(ip, mem, off, n) != n){
+    iunlock(ip);
+    kfree(mem);
+    return 0;
+  }
+  iunlock(ip);
+
+  acquire(&pcache.lock);
+  if((e = pclookup(ip->dev, ip->inum, off, n)) != 0){
+    // Someone else read it meanwhile: use theirs.
+    e->recent = 1;
+    kref(e->page);
+    release(&pcache.lock);
+    kfree(mem);
+    return e->page;
+  }
+  if(gen != pcache.gen){
+    // The file may have changed under the read; don't cache.
+    release(&pcache.lock);
+    return mem;
+  }
+  for(;;){
+    e = &pcache.page[pcache.hand];
+    pcache.hand = (pcache.hand + 1) % NPAGECACHE;
+    if(e->page == 0)
+      break;
+    if(!e->recent){
+      for(pp = pchash(e->dev, e->inum); *pp != e; pp = &(*pp)->hnext)
+        ;
+      pcfree(pp, e);
+      break;
+    }
+    e->recent = 0;
+  }
+  e->dev = ip->dev;
+  e->inum = ip->inum;
+  e->off = off;
+  e->n = n;
+  e->page = mem;
+  e->recent = 1;
+  pp = pchash(ip->dev, ip->inum);
+  e->hnext = *pp;
+  *pp = e;
+  kref(mem);
+  release(&pcache.lock);
+  return mem;
+}
+
+// Forget cached pages holding any of ip's data in [off, off+n).
+void
+pcinval(struct inode *ip, uint off, uint n)
+{
+  struct pcpage *e, **pp;
+
+  acquire(&pcache.lock);
+  pcache.gen++;
+  for(pp = pchash(ip->dev, ip->inum); (e = *pp) != 0; ){
+    if(e->dev == ip->dev && e->inum == ip->inum &&
+       e->off < off + n && off < e->off + e->n)
+      pcfree(pp, e);
+    else
+      pp = &e->hnext;
+  }
+  release(&pcache.lock);
+}
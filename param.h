@@ -1,14 +1,35 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC      4096  // maximum number of processes
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
+#define STEALMIN      1  // idle CPUs steal from run queues at least this long
+#define SLEEPSPIN  1000  // pause()s acquiresleep() spins for a running holder
+#define NPRIO         4  // MLFQ priority levels; level l runs 1<<l ticks
+#define BOOSTTICKS  100  // MLFQ raises every queued process this often
+#define KBATCH       32  // pages moved between per-CPU and global free lists
+#define NZPAGE       64  // free pages idle CPUs keep zeroed for kzalloc()
+#define NVMA         16  // ELF segments and mmap()s per process
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
+#define NSTAT        96  // per-CPU event counters; see stats.c
 #define ROOTDEV       1  // device number of file system root disk
+#define RAMDEV        2  // device number of the RAM disk
+#define NBDEV         3  // block devices: IDE disks 0 and 1, RAM disk
+#define RAMDISKSIZE 4096  // size of the RAM disk (/tmp) in blocks
 #define MAXARG       32  // max exec arguments
+#define MAXPATH     128  // max path name length, with the nul
+#define MAXIOV       16  // max buffers for readv() and writev()
+#define NPOLL        16  // max fds for one poll()
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define LOGSIZE      (MAXOPBLOCKS*6)  // max data blocks the kernel logs at once
+#define NLOGDATA     (LOGSIZE*2)  // max file data blocks written by one commit
+#ifndef NBUF
+#define NBUF         (LOGSIZE*3+NLOGDATA*2+MAXOPBLOCKS*2)  // size of disk block cache
+#endif
+#define FSSIZE       2000  // size of file system in blocks
+#define SWAPSIZE     (1024*1024/BSIZE)  // blocks of swap space after the file system
+#define NPAGECACHE  128  // pages of file data shared by exec()ed programs
+#define NICACHE     64  // unreferenced inodes kept in the inode cache
+#define NDCACHE    256  // directory entries remembered by the name cache
+#define NREADAHEAD   8  // blocks read ahead of sequential readi()
+#define PIPESIZE  16384  // pipe capacity; a power of 2, in whole pages
 
@@ -0,0 +1,63 @@
+// PCI configuration space access, using configuration
+// mechanism #1 (I/O ports 0xCF8 and 0xCFC).
+// Only bus 0 is scanned, which is where QEMU and Bochs
+// put their devices.
+
+#include "types.h"
+#include "defs.h"
+#include "x86.h"
+
+#define PCI_CONFADDR  0xCF8
+#define PCI_CONFDATA  0xCFC
+
+#define PCI_NDEV      32
+#define PCI_NFUNC     8
+
+static uint
+pciaddr(int dev, int func, int off)
+{
+  return 0x80000000 | (dev << 11) | (func << 8) | (off & ~3);
+}
+
+// Read the 32-bit configuration register at offset off
+// of function func of device dev on bus 0.
+uint
+pciread(int dev, int func, int off)
+{
+  outl(PCI_CONFADDR, pciaddr(dev, func, off));
+  return inl(PCI_CONFDATA);
+}
+
+void
+pciwrite(int dev, int func, int off, uint v)
+{
+  outl(PCI_CONFADDR, pciaddr(dev, func, off));
+  outl(PCI_CONFDATA, v);
+}
+
+// Find the first function whose configuration register at
+// offset off, masked with mask, equals val: offset 0x00 holds
+// the vendor and device IDs, 0x08 the class code.  On success,
+// set *devp and *funcp and return 0; otherwise return -1.
+int
+pcifind(int off, uint mask, uint val, int *devp, int *funcp)
+{
+  int dev, func, nfunc;
+
+  for(dev = 0; dev < PCI_NDEV; dev++){
+    if((pciread(dev, 0, 0x00) & 0xffff) == 0xffff)
+      continue;  // no device
+    // Bit 7 of the header type marks a multi-function device.
+    nfunc = (pciread(dev, 0, 0x0c) & 0x800000) ? PCI_NFUNC : 1;
+    for(func = 0; func < nfunc; func++){
+      if((pciread(dev, func, 0x00) & 0xffff) == 0xffff)
+        continue;
+      if((pciread(dev, func, off) & mask) == val){
+        *devp = dev;
+        *funcp = func;
+        return 0;
+      }
+    }
+  }
+  return -1;
+}
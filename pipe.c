@@ -7,33 +7,76 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "fcntl.h"
 
-#define PIPESIZE 512
+// The buffer is a ring of PIPESIZE bytes held in separately
+// allocated pages; nread and nwrite count bytes and wrap
+// around cleanly because PIPESIZE is a power of 2.
+//
+// Whole, page-aligned pages are handed over rather than copied
+// when the ring position is page-aligned too (see pipegift()):
+// the writer's page goes into the ring, copy-on-write, and the
+// reader trades its own page for the ring's.  So a ring page
+// may be shared, and is replaced before it is written into.
+#define NPIPEPAGE (PIPESIZE / PGSIZE)
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *page[NPIPEPAGE];
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int nrsleep;    // readers sleeping on nread
+  int nwsleep;    // writers sleeping on nwrite
+  uint wneed;     // fewest bytes a sleeping writer has left
+  int rbusy;      // pipedrain() is reading with lock released
+  int wbusy;      // pipefill() is writing with lock released
+  struct pollwait *pollq;  // poll() callers on either end
 };
 
+static struct kmcache *pipecache;
+
+void
+pipeinit(void)
+{
+  if(PIPESIZE % PGSIZE != 0 || (PIPESIZE & (PIPESIZE-1)) != 0)
+    panic("pipeinit: PIPESIZE");
+  pipecache = kmcreate("pipe", sizeof(struct pipe));
+}
+
+static void
+pipefree(struct pipe *p)
+{
+  int i;
+
+  for(i = 0; i < NPIPEPAGE; i++)
+    if(p->page[i])
+      kfree(p->page[i]);
+  kmfree(pipecache, p);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
   struct pipe *p;
+  int i;
 
   p = 0;
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((p = (struct pipe*)kalloc()) == 0)
+  if((p = kmalloc(pipecache)) == 0)
     goto bad;
+  memset(p, 0, sizeof(*p));
+  for(i = 0; i < NPIPEPAGE; i++)
+    if((p->page[i] = kalloc()) == 0)
+      goto bad;
   p->readopen = 1;
   p->writeopen = 1;
   p->nwrite = 0;
   p->nread = 0;
+  p->wneed = PIPESIZE/2;
   initlock(&p->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -48,7 +91,7 @@ pipealloc(struct file **f0, struct file **f1)
 //PAGEBREAK: 20
  bad:
   if(p)
-    kfree((char*)p);
+    pipefree(p);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -67,55 +110,333 @@ pipeclose(struct pipe *p, int writable)
     p->readopen = 0;
     wakeup(&p->nwrite);
   }
+  pollwakeup(&p->pollq);
   if(p->readopen == 0 && p->writeopen == 0){
     release(&p->lock);
-    kfree((char*)p);
+    pipefree(p);
   } else
     release(&p->lock);
 }
 
+// Return the memory at byte count off in the ring, to read
+// or to write; or 0 if out of memory for a private copy of a
+// page handed over by pipegift().
+static char*
+pipemem(struct pipe *p, uint off, int write)
+{
+  char **pp, *mem;
+
+  off %= PIPESIZE;
+  pp = &p->page[off / PGSIZE];
+  if(write && krefcount(*pp) > 1){
+    // Unread data may still share the page with where this
+    // write goes, when the ring is nearly full.
+    if((mem = kalloc()) == 0)
+      return 0;
+    memmove(mem, *pp, PGSIZE);
+    kfree(*pp);
+    *pp = mem;
+  }
+  return *pp + off % PGSIZE;
+}
+
+// Copy up to n bytes into or out of the ring at byte count off,
+// stopping at the end of a page.  Returns the bytes copied, or
+// -1 if out of memory.
+static int
+pipecopy(struct pipe *p, uint off, char *addr, int n, int write)
+{
+  char *mem;
+  int m;
+
+  if((mem = pipemem(p, off, write)) == 0)
+    return -1;
+  m = PGSIZE - off % PGSIZE;
+  if(m > n)
+    m = n;
+  if(write ? copyuser(mem, addr, m) : copyuser(addr, mem, m))
+    return -1;
+  return m;
+}
+
+// Move the page of user memory at addr into the ring at byte
+// count off, or out of it, without copying, if both are page
+// aligned and the page is the process's own.  The caller has
+// made sure the ring has room or data for the whole page.
+// Returns 1 if it did, 0 if the page must be copied.
+static int
+pipegift(struct pipe *p, uint off, char *addr, int write)
+{
+  char **pp, *mem;
+
+  if(off % PGSIZE || (uint)addr % PGSIZE)
+    return 0;
+  pp = &p->page[(off % PIPESIZE) / PGSIZE];
+  if(write){
+    if((mem = uvmshare((uint)addr)) == 0)
+      return 0;
+    kfree(*pp);
+  } else if((mem = uvmexchange((uint)addr, *pp)) == 0)
+    return 0;
+  *pp = mem;
+  return 1;
+}
+
 //PAGEBREAK: 40
+// Sleepers are only woken when they may make progress in bulk:
+// readers once the writer has filled the pipe or is done, and
+// writers once half the pipe is free, or room for all that one
+// of them has left to write, which may be less.
 int
 pipewrite(struct pipe *p, char *addr, int n)
 {
-  int i;
+  int i, m;
 
+  if(uvmprefault((uint)addr, n, 0) < 0)  // no faulting with p->lock held
+    return -1;
   acquire(&p->lock);
-  for(i = 0; i < n; i++){
-    while(p->nwrite == p->nread + PIPESIZE){  //DOC: pipewrite-full
+  for(i = 0; i < n; i += m){
+    while(p->wbusy || p->nwrite == p->nread + PIPESIZE){  //DOC: pipewrite-full
       if(p->readopen == 0 || myproc()->killed){
         release(&p->lock);
+        uvmunpin();
         return -1;
       }
-      wakeup(&p->nread);
+      if(p->nrsleep)
+        wakeup(&p->nread);
+      pollwakeup(&p->pollq);
+      if(n - i < p->wneed)
+        p->wneed = n - i;
+      // Unpinned while asleep, so the rest of addr may be
+      // swapped out meanwhile; fault it in again after.
+      uvmunpin();
+      p->nwsleep++;
       sleep(&p->nwrite, &p->lock);  //DOC: pipewrite-sleep
+      p->nwsleep--;
+      release(&p->lock);
+      if(uvmprefault((uint)addr + i, n - i, 0) < 0)
+        return -1;
+      acquire(&p->lock);
+    }
+    m = p->nread + PIPESIZE - p->nwrite;
+    if(m > n - i)
+      m = n - i;
+    if(m >= PGSIZE && pipegift(p, p->nwrite, addr + i, 1))
+      m = PGSIZE;
+    else if((m = pipecopy(p, p->nwrite, addr + i, m, 1)) < 0){
+      release(&p->lock);
+      uvmunpin();
+      return -1;
     }
-    p->data[p->nwrite++ % PIPESIZE] = addr[i];
+    p->nwrite += m;
   }
-  wakeup(&p->nread);  //DOC: pipewrite-wakeup1
+  if(p->nrsleep)
+    wakeup(&p->nread);  //DOC: pipewrite-wakeup1
+  pollwakeup(&p->pollq);
   release(&p->lock);
+  uvmunpin();
+  myproc()->ru.pipeout += n;
   return n;
 }
 
+// Wake the writers if reading has freed as much as pipewrite()
+// waits for.  Those that must sleep again set wneed anew.
+static void
+wakewriters(struct pipe *p)
+{
+  if(p->nwsleep && PIPESIZE - (p->nwrite - p->nread) >= p->wneed){
+    p->wneed = PIPESIZE/2;
+    wakeup(&p->nwrite);
+  }
+}
+
 int
 piperead(struct pipe *p, char *addr, int n)
 {
-  int i;
+  int i, m;
 
-  acquire(&p->lock);
-  while(p->nread == p->nwrite && p->writeopen){  //DOC: pipe-empty
+  for(;;){
+    if(uvmprefault((uint)addr, n, 1) < 0)  // no faulting with p->lock held
+      return -1;
+    acquire(&p->lock);
+    if(!p->rbusy && (p->nread != p->nwrite || !p->writeopen))  //DOC: pipe-empty
+      break;
+    uvmunpin();  // while asleep, as in pipewrite()
     if(myproc()->killed){
       release(&p->lock);
       return -1;
     }
+    p->nrsleep++;
     sleep(&p->nread, &p->lock); //DOC: piperead-sleep
+    p->nrsleep--;
+    release(&p->lock);
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(p->nread == p->nwrite)
+  for(i = 0; i < n && p->nread != p->nwrite; i += m){  //DOC: piperead-copy
+    m = p->nwrite - p->nread;
+    if(m > n - i)
+      m = n - i;
+    if(m >= PGSIZE && pipegift(p, p->nread, addr + i, 0))
+      m = PGSIZE;
+    else if((m = pipecopy(p, p->nread, addr + i, m, 0)) < 0)
       break;
-    addr[i] = p->data[p->nread++ % PIPESIZE];
+    p->nread += m;
   }
-  wakeup(&p->nwrite);  //DOC: piperead-wakeup
+  wakewriters(p);  //DOC: piperead-wakeup
+  pollwakeup(&p->pollq);
   release(&p->lock);
+  uvmunpin();
+  myproc()->ru.pipein += i;
   return i;
 }
+
+//PAGEBREAK: 40
+// Splice: move data between an inode and the pipe ring directly,
+// without a user buffer.  readi() and writei() may sleep, so the
+// lock is released around them; rbusy/wbusy keep other readers or
+// writers off the ring meanwhile.  Readers never look past p->nwrite,
+// and writers never overwrite unread bytes, so the chunk being filled
+// or drained is left alone.
+
+// Fill the pipe with up to n bytes read from file f.
+// Waits for room like pipewrite(); stops early at end of file.
+// Returns the number of bytes moved, or -1.
+int
+pipefill(struct pipe *p, struct file *f, int n)
+{
+  int i, m, r;
+  uint off;
+  char *mem;
+
+  r = 0;
+  acquire(&p->lock);
+  for(i = 0; i < n; ){
+    while(p->wbusy || p->nwrite == p->nread + PIPESIZE){
+      if(p->readopen == 0 || myproc()->killed){
+        release(&p->lock);
+        return -1;
+      }
+      if(p->nrsleep)
+        wakeup(&p->nread);
+      pollwakeup(&p->pollq);
+      if(n - i < p->wneed)
+        p->wneed = n - i;
+      p->nwsleep++;
+      sleep(&p->nwrite, &p->lock);
+      p->nwsleep--;
+    }
+    m = p->nread + PIPESIZE - p->nwrite;
+    if(m > n - i)
+      m = n - i;
+    off = p->nwrite % PIPESIZE;
+    if(m > PGSIZE - off % PGSIZE)
+      m = PGSIZE - off % PGSIZE;
+    if((mem = pipemem(p, off, 1)) == 0){
+      r = -1;
+      break;
+    }
+    p->wbusy = 1;
+    release(&p->lock);
+
+    ilock(f->ip);
+    if((r = readi(f->ip, mem, f->off, m)) > 0)
+      f->off += r;
+    iunlock(f->ip);
+
+    acquire(&p->lock);
+    p->wbusy = 0;
+    if(r > 0)
+      p->nwrite += r;
+    if(p->nwsleep)
+      wakeup(&p->nwrite);
+    if(r <= 0)
+      break;
+    i += r;
+  }
+  if(p->nrsleep)
+    wakeup(&p->nread);
+  pollwakeup(&p->pollq);
+  release(&p->lock);
+  myproc()->ru.pipeout += i;
+  return r < 0 && i == 0 ? -1 : i;
+}
+
+// Drain up to n bytes from the pipe into file f.
+// Waits for data like piperead(), then moves what is there.
+// Returns the number of bytes moved, or -1.
+int
+pipedrain(struct pipe *p, struct file *f, int n)
+{
+  int i, m, r;
+  uint off;
+
+  acquire(&p->lock);
+  while(p->rbusy || (p->nread == p->nwrite && p->writeopen)){
+    if(myproc()->killed){
+      release(&p->lock);
+      return -1;
+    }
+    p->nrsleep++;
+    sleep(&p->nread, &p->lock);
+    p->nrsleep--;
+  }
+  r = 0;
+  for(i = 0; i < n && p->nread != p->nwrite; ){
+    m = p->nwrite - p->nread;
+    if(m > n - i)
+      m = n - i;
+    off = p->nread % PIPESIZE;
+    if(m > PGSIZE - off % PGSIZE)
+      m = PGSIZE - off % PGSIZE;
+    p->rbusy = 1;
+    release(&p->lock);
+
+    m = begin_write(m);
+    ilock(f->ip);
+    if((r = writei(f->ip, p->page[off / PGSIZE] + off % PGSIZE, f->off, m)) > 0)
+      f->off += r;
+    iunlock(f->ip);
+    end_write(m);
+
+    acquire(&p->lock);
+    p->rbusy = 0;
+    if(r > 0){
+      p->nread += r;
+      i += r;
+    }
+    if(p->nrsleep)
+      wakeup(&p->nread);
+    if(r != m)
+      break;
+  }
+  wakewriters(p);
+  pollwakeup(&p->pollq);
+  release(&p->lock);
+  myproc()->ru.pipein += i;
+  return r < 0 && i == 0 ? -1 : i;
+}
+
+// Which of events the read or write end of p is ready for;
+// see filepoll().
+int
+pipepoll(struct pipe *p, int writable, int events, struct pollwait *w)
+{
+  int r;
+
+  r = 0;
+  acquire(&p->lock);
+  if(writable){
+    if(p->readopen == 0)
+      r = POLLERR;
+    else if(p->nwrite != p->nread + PIPESIZE)
+      r = events & POLLOUT;
+  } else {
+    if(p->nread != p->nwrite)
+      r = events & POLLIN;
+    if(p->writeopen == 0)
+      r |= POLLHUP;
+  }
+  if(r == 0 && w)
+    pollregister(&p->pollq, &p->lock, w);
+  release(&p->lock);
+  return r;
+}
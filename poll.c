@@ -0,0 +1,94 @@
+// poll(): wait for any of several files to be ready.
+//
+// A pipe or device that isn't ready puts the caller's struct
+// pollwait on its wait queue (pollregister()), and calls
+// pollwakeup() on the queue whenever reading or writing it may
+// have become possible.  The caller sleeps in pollsleep() unless
+// such a wakeup came meanwhile, then takes its entries off the
+// queues and looks again.  See filepoll() for the files that
+// are always ready.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "mmu.h"
+#include "proc.h"
+
+// Put w on wait queue q.  Caller holds lk, which protects q.
+void
+pollregister(struct pollwait **q, struct spinlock *lk, struct pollwait *w)
+{
+  if(w->q)
+    panic("pollregister");
+  w->q = q;
+  w->lk = lk;
+  w->next = *q;
+  *q = w;
+}
+
+static void
+pollunregister(struct pollwait *w)
+{
+  struct pollwait **pp;
+
+  if(w->q == 0)
+    return;
+  acquire(w->lk);
+  for(pp = w->q; *pp != w; pp = &(*pp)->next)
+    ;
+  *pp = w->next;
+  release(w->lk);
+  w->q = 0;
+}
+
+// Wait until f[i] is ready for fds[i].events, for some i < n,
+// or for timeout ticks if timeout is not negative.  f[i] is 0 if
+// fds[i].fd is negative, which is skipped, or not open.  Sets
+// each fds[i].revents and returns how many are non-zero: 0 if
+// the time ran out, or -1 if killed.
+int
+poll(struct file **f, struct pollfd *fds, int n, int timeout)
+{
+  struct pollwait w[NPOLL];
+  struct proc *p = myproc();
+  int i, nready, wait;
+
+  memset(w, 0, sizeof(w));
+  for(i = 0; i < n; i++)
+    w[i].proc = p;
+  if(timeout > 0)
+    timerset(timeout);
+  for(;;){
+    p->pollready = 0;
+    wait = timeout < 0 || (timeout > 0 && (int)(ticks - p->wakeat) < 0);
+    nready = 0;
+    for(i = 0; i < n; i++){
+      if(f[i])
+        fds[i].revents = filepoll(f[i], fds[i].events,
+                                  wait && nready == 0 ? &w[i] : 0);
+      else
+        fds[i].revents = fds[i].fd < 0 ? 0 : POLLNVAL;
+      if(fds[i].revents)
+        nready++;
+    }
+    if(nready > 0 || !wait)
+      break;
+    pollsleep(timeout > 0);
+    for(i = 0; i < n; i++)
+      pollunregister(&w[i]);
+    if(p->killed){
+      nready = -1;
+      break;
+    }
+  }
+  for(i = 0; i < n; i++)
+    pollunregister(&w[i]);
+  if(timeout > 0)
+    timercancel();
+  return nready;
+}
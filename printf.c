@@ -2,12 +2,6 @@
 #include "stat.h"
 #include "user.h"
 
-static void
-putc(int fd, char c)
-{
-  write(fd, &c, 1);
-}
-
 static void
 printint(int fd, int xx, int base, int sgn)
 {
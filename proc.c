@@ -6,13 +6,99 @@
 #include "x86.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "traps.h"
+#include "vdso.h"
+#include "trace.h"
+
+// Process structures are allocated as needed, up to NPROC.
+// Every process is on a pid hash chain, from allocproc() until
+// wait() frees it, and on its parent's list of children.
+// Sleeping processes are kept on hashed wait queues, so that
+// wakeup() only looks at processes sleeping on chans that hash
+// alike.  All of these are protected by ptable.lock.
+#define NPIDHASH 251
+#define NSLEEPQ 61
 
 struct {
   struct spinlock lock;
-  struct proc proc[NPROC];
+  int nproc;
+  struct proc *pidhash[NPIDHASH];
+  struct proc *sleepq[NSLEEPQ];
 } ptable;
 
+static struct kmcache *proccache;
+static struct kmcache *vmcache;
+
+static struct proc**
+pidhash(int pid)
+{
+  return &ptable.pidhash[(uint)pid % NPIDHASH];
+}
+
+static struct proc**
+sleepq(void *chan)
+{
+  return &ptable.sleepq[((uint)chan >> 2) % NSLEEPQ];
+}
+
+// Take p, which is SLEEPING, off its wait queue.
+static void
+unsleep(struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = sleepq(p->chan); *pp; pp = &(*pp)->cnext){
+    if(*pp == p){
+      *pp = p->cnext;
+      p->cnext = 0;
+      return;
+    }
+  }
+  panic("unsleep");
+}
+
+// Per-CPU queues of RUNNABLE processes, so that schedulers
+// don't have to scan (and lock) the whole process table.
+// A process is on exactly one queue while it is RUNNABLE
+// and on none otherwise.  Lock order: ptable.lock first,
+// then a queue's lock.
+//
+// Each queue has NPRIO levels, and the scheduler runs the
+// first process of the highest non-empty level.  By default
+// every process is on level 0, which is round robin with a
+// one-tick quantum.  With MLFQ, a process that uses up its
+// level's quantum of 1<<prio ticks moves down a level, so that
+// interactive processes, which sleep before then, stay above
+// CPU-bound ones; every BOOSTTICKS, each queued process is put
+// back on its top level, so none starves.  nice() lowers that
+// top level.
+struct level {
+  struct proc *head;
+  struct proc *tail;
+};
+
+struct runq {
+  struct spinlock lock;
+  struct level level[NPRIO];
+  int len;
+  uint boosted;  // ticks at the last boost
+  uint nsteal;   // processes this CPU took from peers
+  uint nstolen;  // processes peers took from this CPU
+};
+
+#ifdef MLFQ
+#define TOPPRIO(p) ((p)->nice)
+#else
+#define TOPPRIO(p) 0
+#endif
+
+static struct runq runqs[NCPU];
+
 static struct proc *initproc;
+static int swtchstat;  // stats.c counter of context switches
 
 int nextpid = 1;
 extern void forkret(void);
@@ -23,7 +109,14 @@ static void wakeup1(void *chan);
 void
 pinit(void)
 {
+  int i;
+
   initlock(&ptable.lock, "ptable");
+  swtchstat = statalloc("cswitch", 1);
+  proccache = kmcreate("proc", sizeof(struct proc));
+  vmcache = kmcreate("vmspace", sizeof(struct vmspace));
+  for(i = 0; i < NCPU; i++)
+    initlock(&runqs[i].lock, "runq");
 }
 
 // Must be called with interrupts disabled
@@ -37,19 +130,17 @@ cpuid() {
 struct cpu*
 mycpu(void)
 {
-  int apicid, i;
-  
+  struct cpu *c;
+
   if(readeflags()&FL_IF)
     panic("mycpu called with interrupts enabled\n");
-  
-  apicid = lapicid();
-  // APIC IDs are not guaranteed to be contiguous. Maybe we should have
-  // a reverse map, or reserve a register to store &cpus[i].
-  for (i = 0; i < ncpu; ++i) {
-    if (cpus[i].apicid == apicid)
-      return &cpus[i];
-  }
-  panic("unknown apicid\n");
+
+  // APIC IDs are not guaranteed to be contiguous, so look the
+  // cpu up in the reverse map; it is not written after boot
+  // and needs no lock.
+  if((c = apiccpu[lapicid()]) == 0)
+    panic("unknown apicid\n");
+  return c;
 }
 
 // Disable interrupts so that we are not rescheduled
@@ -65,9 +156,162 @@ myproc(void) {
   return p;
 }
 
+// Wake a halted CPU for the process just queued on rq, which
+// belongs to c: c itself, or else an idle peer to steal it.
+// Pairs with idle(): the queue is updated before c->idle is
+// read here, and c->idle set before idle() reads the queues.
+static void
+kick(struct runq *rq, struct cpu *c)
+{
+  struct cpu *me = mycpu();
+
+  if(c->idle){
+    if(c != me)
+      lapicipi(c->apicid, T_IRQ0 + IRQ_WAKE);
+    return;
+  }
+  if(rq->len < STEALMIN)
+    return;
+  for(c = cpus; c < &cpus[ncpu]; c++){
+    if(c != me && c->idle){
+      lapicipi(c->apicid, T_IRQ0 + IRQ_WAKE);
+      return;
+    }
+  }
+}
+
+// Append p to its level of rq.  Caller must hold rq->lock.
+static void
+enqueue(struct runq *rq, struct proc *p)
+{
+  struct level *l = &rq->level[p->prio];
+
+  p->rqnext = 0;
+  if(l->tail)
+    l->tail->rqnext = p;
+  else
+    l->head = p;
+  l->tail = p;
+}
+
+#ifdef MLFQ
+// Put every process queued on rq back on its top level.
+// Caller must hold rq->lock.
+static void
+boost(struct runq *rq)
+{
+  struct level *l;
+  struct proc *p, *next;
+
+  rq->boosted = ticks;
+  for(l = &rq->level[1]; l < &rq->level[NPRIO]; l++){
+    p = l->head;
+    l->head = l->tail = 0;
+    for(; p; p = next){
+      next = p->rqnext;
+      if(p->prio > p->nice){
+        p->prio = p->nice;
+        p->used = 0;
+      }
+      enqueue(rq, p);
+    }
+  }
+}
+#endif
+
+// Mark p RUNNABLE and append it to the run queue of
+// the CPU it last ran on.  Caller must hold ptable.lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *rq;
+
+  if(!holding(&ptable.lock))
+    panic("setrunnable");
+  p->state = RUNNABLE;
+  rq = &runqs[p->cpu];
+  acquire(&rq->lock);
+  enqueue(rq, p);
+  rq->len++;
+  release(&rq->lock);
+  kick(rq, &cpus[p->cpu]);
+}
+
+// Remove and return the process at the head of rq,
+// or 0 if rq is empty.
+static struct proc*
+runqpop(struct runq *rq)
+{
+  struct level *l;
+  struct proc *p;
+
+  acquire(&rq->lock);
+#ifdef MLFQ
+  if(ticks - rq->boosted >= BOOSTTICKS)
+    boost(rq);
+#endif
+  p = 0;
+  for(l = rq->level; l < &rq->level[NPRIO]; l++){
+    if((p = l->head) != 0){
+      l->head = p->rqnext;
+      if(l->head == 0)
+        l->tail = 0;
+      p->rqnext = 0;
+      rq->len--;
+      break;
+    }
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// Called by an idle CPU whose own queue is empty: take the
+// longest-waiting process from the longest peer queue that
+// holds at least STEALMIN processes.  Queue lengths are sampled
+// without locking, so an idle CPU only touches a peer's lock
+// when there looks to be work there, and it steals at most one
+// process per call.  Busy CPUs never steal, so a process keeps
+// running where it last ran unless some CPU has nothing to do.
+static struct proc*
+steal(struct runq *self)
+{
+  struct runq *rq, *victim;
+  struct proc *p;
+  int best;
+
+  victim = 0;
+  best = STEALMIN - 1;
+  for(rq = runqs; rq < &runqs[ncpu]; rq++){
+    if(rq != self && rq->len > best){
+      victim = rq;
+      best = rq->len;
+    }
+  }
+  if(victim == 0 || (p = runqpop(victim)) == 0)
+    return 0;
+  __sync_fetch_and_add(&victim->nstolen, 1);
+  self->nsteal++;
+  return p;
+}
+
+// Free p, which is off the run queues and its parent's list.
+// Caller must hold ptable.lock.
+static void
+freeproc(struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = pidhash(p->pid); *pp != p; pp = &(*pp)->pidnext)
+    ;
+  *pp = p->pidnext;
+  ptable.nproc--;
+  p->state = UNUSED;
+  kmfree(proccache, p);
+}
+
 //PAGEBREAK: 32
-// Look in the process table for an UNUSED proc.
-// If found, change state to EMBRYO and initialize
+// Allocate a proc, unless there are NPROC already.
+// If that works, set its state to EMBRYO and initialize
 // state required to run in the kernel.
 // Otherwise return 0.
 static struct proc*
@@ -76,24 +320,30 @@ allocproc(void)
   struct proc *p;
   char *sp;
 
-  acquire(&ptable.lock);
-
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == UNUSED)
-      goto found;
-
-  release(&ptable.lock);
-  return 0;
+  if((p = kmalloc(proccache)) == 0)
+    return 0;
+  memset(p, 0, sizeof(*p));
+  p->fpucpu = -1;
 
-found:
+  acquire(&ptable.lock);
+  if(ptable.nproc == NPROC){
+    release(&ptable.lock);
+    kmfree(proccache, p);
+    return 0;
+  }
+  ptable.nproc++;
   p->state = EMBRYO;
   p->pid = nextpid++;
-
+  p->cpu = cpuid();
+  p->pidnext = *pidhash(p->pid);
+  *pidhash(p->pid) = p;
   release(&ptable.lock);
 
   // Allocate kernel stack.
   if((p->kstack = kalloc()) == 0){
-    p->state = UNUSED;
+    acquire(&ptable.lock);
+    freeproc(p);
+    release(&ptable.lock);
     return 0;
   }
   sp = p->kstack + KSTACKSIZE;
@@ -115,6 +365,51 @@ found:
   return p;
 }
 
+// Allocate an empty vmspace with one reference, or return 0.
+static struct vmspace*
+vmalloc(void)
+{
+  struct vmspace *vm;
+
+  if((vm = kmalloc(vmcache)) == 0)
+    return 0;
+  memset(vm, 0, sizeof(*vm));
+  vm->ref = 1;
+  return vm;
+}
+
+// If p shares its vmspace with threads, give p an empty one of
+// its own and return 1, for exec().  Return 0 if p's was not
+// shared, -1 if out of memory.
+int
+vmunshare(struct proc *p)
+{
+  struct vmspace *vm;
+
+  if((vm = vmalloc()) == 0)
+    return -1;
+  acquire(&ptable.lock);
+  if(p->vm->ref == 1){
+    release(&ptable.lock);
+    kmfree(vmcache, vm);
+    return 0;
+  }
+  p->vm->ref--;
+  p->vm = vm;
+  release(&ptable.lock);
+  return 1;
+}
+
+// Give back a process that fork() could not finish making.
+static void
+unalloc(struct proc *p)
+{
+  kfree(p->kstack);
+  acquire(&ptable.lock);
+  freeproc(p);
+  release(&ptable.lock);
+}
+
 //PAGEBREAK: 32
 // Set up first user process.
 void
@@ -126,10 +421,11 @@ userinit(void)
   p = allocproc();
   
   initproc = p;
-  if((p->pgdir = setupkvm()) == 0)
+  if((p->vm = vmalloc()) == 0 || (p->pgdir = setupkvm()) == 0 ||
+     (p->fdt = fdtalloc(0)) == 0)
     panic("userinit: out of memory?");
   inituvm(p->pgdir, _binary_initcode_start, (int)_binary_initcode_size);
-  p->sz = PGSIZE;
+  p->vm->sz = PGSIZE;
   memset(p->tf, 0, sizeof(*p->tf));
   p->tf->cs = (SEG_UCODE << 3) | DPL_USER;
   p->tf->ds = (SEG_UDATA << 3) | DPL_USER;
@@ -148,30 +444,90 @@ userinit(void)
   // because the assignment might not be atomic.
   acquire(&ptable.lock);
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&ptable.lock);
 }
 
+// Start a kernel thread running fn(), which must not return.
+// It has no user memory and runs on the kernel's page table.
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0 || (p->vm = vmalloc()) == 0 ||
+     (p->pgdir = setupkvm()) == 0)
+    panic("kthread");
+  p->vm->sz = 0;
+  p->parent = 0;
+
+  // Make forkret() "return" to fn instead of trapret.
+  *(uint*)(p->context + 1) = (uint)fn;
+
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+  setrunnable(p);
+  release(&ptable.lock);
+}
+
+// Wait for, then take, the right to change p's vmspace,
+// which p's threads share.
+void
+vmlock(struct proc *p)
+{
+  acquire(&ptable.lock);
+  while(p->vm->busy)
+    sleep(p->vm, &ptable.lock);
+  p->vm->busy = 1;
+  release(&ptable.lock);
+}
+
+void
+vmunlock(struct proc *p)
+{
+  acquire(&ptable.lock);
+  p->vm->busy = 0;
+  wakeup1(p->vm);
+  release(&ptable.lock);
+}
+
 // Grow current process's memory by n bytes.
-// Return 0 on success, -1 on failure.
+// Return the old size on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint sz, oldsz;
   struct proc *curproc = myproc();
 
-  sz = curproc->sz;
+  // Growing just moves sz: pagefault() allocates the new
+  // pages when they are first touched.
+  vmlock(curproc);
+  sz = oldsz = curproc->vm->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
-      return -1;
+    if(sz + n < sz || sz + n > mmapbase(curproc))
+      goto bad;
+    sz += n;
   } else if(n < 0){
-    if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
-      return -1;
+    if(sz + n > sz || sz + n == 0)
+      goto bad;
+    sz += n;
+    // Shrink sz first, so that pagefault() won't fill in
+    // what deallocuvm() frees.
+    acquire(ptlock(curproc->pgdir));
+    curproc->vm->sz = sz;
+    curproc->vm->gen++;
+    release(ptlock(curproc->pgdir));
+    deallocuvm(curproc->pgdir, oldsz, sz);
   }
-  curproc->sz = sz;
-  switchuvm(curproc);
-  return 0;
+  curproc->vm->sz = sz;
+  vmunlock(curproc);
+  return oldsz;
+
+bad:
+  vmunlock(curproc);
+  return -1;
 }
 
 // Create a new process copying p as the parent.
@@ -190,23 +546,43 @@ fork(void)
   }
 
   // Copy process state from proc.
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
-    kfree(np->kstack);
-    np->kstack = 0;
-    np->state = UNUSED;
+  if((np->fdt = fdtalloc(curproc->fdt)) == 0){
+    unalloc(np);
+    return -1;
+  }
+  if((np->vm = vmalloc()) == 0){
+    fdtclose(np->fdt);
+    unalloc(np);
+    return -1;
+  }
+  vmlock(curproc);  // against a thread's sbrk() or mmap()
+  while((np->pgdir = copyuvm(curproc->pgdir)) == 0 && swapout() > 0)
+    ;
+  if(np->pgdir == 0){
+    vmunlock(curproc);
+    kmfree(vmcache, np->vm);
+    fdtclose(np->fdt);
+    unalloc(np);
     return -1;
   }
-  np->sz = curproc->sz;
+  np->vm->sz = curproc->vm->sz;
+  fpufork(np);
+  np->nice = curproc->nice;
+  np->prio = TOPPRIO(np);
+  np->ring = curproc->ring;
   np->parent = curproc;
   *np->tf = *curproc->tf;
 
   // Clear %eax so that fork returns 0 in the child.
   np->tf->eax = 0;
 
-  for(i = 0; i < NOFILE; i++)
-    if(curproc->ofile[i])
-      np->ofile[i] = filedup(curproc->ofile[i]);
   np->cwd = idup(curproc->cwd);
+  for(i = 0; i < NVMA; i++){
+    np->vm->vma[i] = curproc->vm->vma[i];
+    if(np->vm->vma[i].ip)
+      idup(np->vm->vma[i].ip);
+  }
+  vmunlock(curproc);
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
@@ -214,8 +590,59 @@ fork(void)
 
   acquire(&ptable.lock);
 
-  np->state = RUNNABLE;
+  np->sibling = curproc->child;
+  curproc->child = np;
+  setrunnable(np);
+
+  release(&ptable.lock);
+
+  return pid;
+}
+
+// Create a thread: a child process that shares the current
+// process's memory and page table, and starts by calling
+// fn(arg) on the stack at [stack, stack+PGSIZE), and shares
+// the file table too.  fn must not return; the thread exits with
+// exit(), and join() waits for it.  Returns the thread's pid.
+int
+clone(uint fn, uint arg, uint stack)
+{
+  int pid;
+  uint sp, ustack[2];
+  struct proc *np;
+  struct proc *curproc = myproc();
+
+  // Push fn's argument and a fake return PC.
+  sp = stack + PGSIZE - sizeof(ustack);
+  ustack[0] = 0xffffffff;
+  ustack[1] = arg;
+  if(copyuser((char*)sp, ustack, sizeof(ustack)) < 0)
+    return -1;
+
+  if((np = allocproc()) == 0)
+    return -1;
+  np->pgdir = curproc->pgdir;
+  np->nice = curproc->nice;
+  np->prio = TOPPRIO(np);
+  np->parent = curproc;
+  np->thread = 1;
+  np->ustack = stack;
+  *np->tf = *curproc->tf;
+  np->tf->eip = fn;
+  np->tf->esp = sp;
 
+  np->fdt = fdtdup(curproc->fdt);
+  np->cwd = idup(curproc->cwd);
+  safestrcpy(np->name, curproc->name, sizeof(curproc->name));
+
+  pid = np->pid;
+
+  acquire(&ptable.lock);
+  np->vm = curproc->vm;
+  np->vm->ref++;
+  np->sibling = curproc->child;
+  curproc->child = np;
+  setrunnable(np);
   release(&ptable.lock);
 
   return pid;
@@ -229,23 +656,31 @@ exit(void)
 {
   struct proc *curproc = myproc();
   struct proc *p;
-  int fd;
+  int last;
 
   if(curproc == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(fd = 0; fd < NOFILE; fd++){
-    if(curproc->ofile[fd]){
-      fileclose(curproc->ofile[fd]);
-      curproc->ofile[fd] = 0;
-    }
-  }
+  // Close all open files, unless threads still share them.
+  fdtclose(curproc->fdt);
+  curproc->fdt = 0;
 
+  // The last thread to leave the memory unmaps it; whoever
+  // waits for that thread frees the page table.  The others
+  // let go of it now.
+  acquire(&ptable.lock);
+  last = --curproc->vm->ref == 0;
+  release(&ptable.lock);
+  if(last)
+    vmasync(curproc);
   begin_op();
   iput(curproc->cwd);
+  if(last)
+    vmafree(curproc->vm->vma);
   end_op();
   curproc->cwd = 0;
+  if(!last)
+    curproc->vm = 0;
 
   acquire(&ptable.lock);
 
@@ -253,12 +688,14 @@ exit(void)
   wakeup1(curproc->parent);
 
   // Pass abandoned children to init.
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-    if(p->parent == curproc){
-      p->parent = initproc;
-      if(p->state == ZOMBIE)
-        wakeup1(initproc);
-    }
+  while((p = curproc->child) != 0){
+    curproc->child = p->sibling;
+    p->parent = initproc;
+    p->thread = 0;  // init wait()s for it
+    p->sibling = initproc->child;
+    initproc->child = p;
+    if(p->state == ZOMBIE)
+      wakeup1(initproc);
   }
 
   // Jump into the scheduler, never to return.
@@ -267,35 +704,57 @@ exit(void)
   panic("zombie exit");
 }
 
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
-int
-wait(void)
+// Add b's counters to a's.
+static void
+ruadd(struct rusage *a, struct rusage *b)
 {
-  struct proc *p;
+  a->utime += b->utime;
+  a->stime += b->stime;
+  a->nswtch += b->nswtch;
+  a->nbread += b->nbread;
+  a->nbwrite += b->nbwrite;
+  a->pipein += b->pipein;
+  a->pipeout += b->pipeout;
+  a->npage += b->npage;
+}
+
+// Wait for a child that exited, a thread if thread is set and
+// else a process, and free it.  Return its pid, and set *stack
+// to the stack clone() was given.  Return -1 if there are no
+// such children.
+static int
+reap(int thread, uint *stack)
+{
+  struct proc *p, **pp;
   int havekids, pid;
+  pde_t *pgdir;
+  struct vmspace *vm;
   struct proc *curproc = myproc();
   
   acquire(&ptable.lock);
   for(;;){
-    // Scan through table looking for exited children.
+    // Scan through children looking for exited ones.
     havekids = 0;
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->parent != curproc)
+    for(pp = &curproc->child; (p = *pp) != 0; pp = &p->sibling){
+      if(p->thread != thread)
         continue;
       havekids = 1;
       if(p->state == ZOMBIE){
         // Found one.
         pid = p->pid;
+        *stack = p->ustack;
+        ruadd(&curproc->cru, &p->ru);
+        ruadd(&curproc->cru, &p->cru);
         kfree(p->kstack);
-        p->kstack = 0;
-        freevm(p->pgdir);
-        p->pid = 0;
-        p->parent = 0;
-        p->name[0] = 0;
-        p->killed = 0;
-        p->state = UNUSED;
+        pgdir = p->pgdir;
+        vm = p->vm;  // 0 unless p was the last user
+        *pp = p->sibling;
+        freeproc(p);
         release(&ptable.lock);
+        if(vm){
+          freevm(pgdir);  // may wait for other CPUs; see freevm()
+          kmfree(vmcache, vm);
+        }
         return pid;
       }
     }
@@ -311,6 +770,65 @@ wait(void)
   }
 }
 
+// Wait for a child process to exit and return its pid.
+// Return -1 if this process has no children.
+int
+wait(void)
+{
+  uint stack;
+
+  return reap(0, &stack);
+}
+
+// Wait for a thread made by clone() to exit and return its
+// pid, and set *stack to the stack it was given so that the
+// caller can free it.  Return -1 if there are no threads.
+int
+join(uint *stack)
+{
+  return reap(1, stack);
+}
+
+// Nothing to run: halt until an interrupt, with the timer
+// armed only for the next sleepticks() deadline, if any.
+// Not if freevm() wants the page table unloaded first.
+static void
+idle(struct cpu *c, struct runq *self)
+{
+  struct runq *rq;
+  uint n;
+
+  xchg(&c->idle, 1);  // a full barrier, before looking again
+  n = timerexpire();
+  cli();
+  for(rq = runqs; rq < &runqs[ncpu]; rq++)
+    if(rq->len >= (rq == self ? 1 : STEALMIN))
+      break;
+  if(rq == &runqs[ncpu] && !c->dropuvm){  // see freevm()
+    lapictimer(n);
+    stihlt();
+  }
+  c->idle = 0;
+  sti();
+}
+
+// Make p, just taken off a run queue, the process running on c.
+// Caller must hold ptable.lock, and then swtch() to p.
+static void
+run(struct cpu *c, struct proc *p)
+{
+  if(p->state != RUNNABLE)
+    panic("run: queued proc not runnable");
+  c->proc = p;
+  p->cpu = c - cpus;
+  resumeuvm(p);
+  p->state = RUNNING;
+  vdso->cpu[p->cpu].pid = p->pid;
+  vdso->cpu[p->cpu].nswtch++;
+  lapictimer(1);  // a fresh quantum
+  trace(TR_SWITCH, p->pid, 0);
+}
+
 //PAGEBREAK: 42
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
@@ -324,34 +842,50 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  struct runq *rq = &runqs[c - cpus];
   c->proc = 0;
   
   for(;;){
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->state != RUNNABLE)
-        continue;
-
-      // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
-      // before jumping back to us.
-      c->proc = p;
-      switchuvm(p);
-      p->state = RUNNING;
-
-      swtch(&(c->scheduler), p->context);
+    // The last process's page table stays loaded, so that
+    // running it again need not flush the TLB, until
+    // freevm() asks for it.
+    if(c->dropuvm){
+      cli();
       switchkvm();
+      c->dropuvm = 0;
+      sti();
+    }
 
-      // Process is done running for now.
-      // It should have changed its p->state before coming back.
-      c->proc = 0;
+    // Take the next process off this CPU's run queue,
+    // or failing that, off a busier CPU's queue.
+    // With nothing to do, zero a page for kzalloc() before
+    // halting.
+    if((p = runqpop(rq)) == 0 && (p = steal(rq)) == 0){
+      if(!kprezero())
+        idle(c, rq);
+      continue;
     }
-    release(&ptable.lock);
 
+    // The process may still be on its way out of another
+    // CPU (e.g. woken before that CPU's scheduler dropped
+    // ptable.lock); acquiring the lock waits for that.
+    acquire(&ptable.lock);
+
+    // Switch to chosen process.  It is the process's job
+    // to release ptable.lock and then reacquire it
+    // before jumping back to us.  It may switch to others
+    // directly (see sched()) before one comes back here.
+    run(c, p);
+    swtch(&(c->scheduler), p->context);
+    vdso->cpu[c - cpus].pid = 0;
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&ptable.lock);
   }
 }
 
@@ -362,11 +896,18 @@ scheduler(void)
 // be proc->intena and proc->ncli, but that would
 // break in the few places where a lock is held but
 // there's no process.
+//
+// If this CPU's run queue has a process, switch straight to it
+// (or carry on, if it is this one), rather than through the
+// scheduler, which would cost a second swtch().  Only when the
+// queue is empty does the scheduler run, to steal or idle.
 void
 sched(void)
 {
   int intena;
   struct proc *p = myproc();
+  struct proc *next;
+  struct cpu *c;
 
   if(!holding(&ptable.lock))
     panic("sched ptable.lock");
@@ -377,16 +918,78 @@ sched(void)
   if(readeflags()&FL_IF)
     panic("sched interruptible");
   intena = mycpu()->intena;
-  swtch(&p->context, mycpu()->scheduler);
+  trace(TR_SWITCHOUT, p->pid, p->state);
+  p->ru.nswtch++;
+  statinc(swtchstat);
+  fpuswitch(p);
+  c = mycpu();
+  if((next = runqpop(&runqs[c - cpus])) != 0){
+    run(c, next);
+    if(next != p){
+      // As if from the scheduler: a new process's forkret()
+      // takes its interrupt state from intena.
+      c->intena = 1;
+      swtch(&p->context, next->context);
+    }
+  } else
+    swtch(&p->context, c->scheduler);
   mycpu()->intena = intena;
 }
 
+// Called on each clock tick while the current process runs.
+// Returns 1 if it should give up the CPU.
+int
+schedtick(void)
+{
+#ifdef MLFQ
+  struct proc *p = myproc();
+  struct level *l;
+  struct runq *rq;
+
+  if(++p->used >= 1<<p->prio){
+    p->used = 0;
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    return 1;
+  }
+  // Make way for a higher level process queued here.
+  // (Peeking without the lock: the next tick will see it.)
+  rq = &runqs[p->cpu];
+  for(l = rq->level; l < &rq->level[p->prio]; l++)
+    if(l->head)
+      return 1;
+  return 0;
+#else
+  return 1;
+#endif
+}
+
+// Add incr to the current process's nice value, which with
+// MLFQ is the highest queue level it may run at.  Returns
+// the new value.
+int
+nice(int incr)
+{
+  struct proc *p = myproc();
+
+  p->nice += incr;
+  if(p->nice < 0)
+    p->nice = 0;
+  if(p->nice > NPRIO-1)
+    p->nice = NPRIO-1;
+  if(p->prio < TOPPRIO(p)){
+    p->prio = TOPPRIO(p);
+    p->used = 0;
+  }
+  return p->nice;
+}
+
 // Give up the CPU for one scheduling round.
 void
 yield(void)
 {
   acquire(&ptable.lock);  //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  setrunnable(myproc());
   sched();
   release(&ptable.lock);
 }
@@ -407,6 +1010,7 @@ forkret(void)
     first = 0;
     iinit(ROOTDEV);
     initlog(ROOTDEV);
+    swapinit(ROOTDEV);
   }
 
   // Return to "caller", actually trapret (see allocproc).
@@ -438,6 +1042,8 @@ sleep(void *chan, struct spinlock *lk)
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->cnext = *sleepq(chan);
+  *sleepq(chan) = p;
 
   sched();
 
@@ -457,11 +1063,16 @@ sleep(void *chan, struct spinlock *lk)
 static void
 wakeup1(void *chan)
 {
-  struct proc *p;
-
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+  struct proc **pp, *p;
+
+  for(pp = sleepq(chan); (p = *pp) != 0; ){
+    if(p->chan == chan){
+      *pp = p->cnext;
+      p->cnext = 0;
+      setrunnable(p);
+    } else
+      pp = &p->cnext;
+  }
 }
 
 // Wake up all processes sleeping on chan.
@@ -473,6 +1084,197 @@ wakeup(void *chan)
   release(&ptable.lock);
 }
 
+// Page replacement for swapout(): the clock hand goes through
+// the processes in pid order and, in each, through its pages
+// (see uvmswapscan()).  Only processes that are not running
+// are looked at, so that changing their page tables needs no
+// TLB shootdown: bumping nrun makes resumeuvm() reload cr3.
+// Threads sharing memory are passed over for the same reason,
+// and pinned processes because they may use their memory with
+// spinlocks held, when a fault could not sleep to swap it in.
+#define SWAPSCAN 8192  // most pages to look at per call
+
+static int swappid;    // process the hand is in
+static uint swapva;    // and where
+
+static int
+swappable(struct proc *p)
+{
+  return (p->state == RUNNABLE || p->state == SLEEPING) &&
+         p->vm && p->vm->ref == 1 && !p->vm->busy && !p->pinned;
+}
+
+// Return the swappable process with the least pid above pid.
+// Caller holds ptable.lock.
+static struct proc*
+swapnext(int pid)
+{
+  struct proc *p, *best;
+  int i;
+
+  best = 0;
+  for(i = 0; i < NPIDHASH; i++)
+    for(p = ptable.pidhash[i]; p; p = p->pidnext)
+      if(p->pid > pid && (best == 0 || p->pid < best->pid) && swappable(p))
+        best = p;
+  return best;
+}
+
+// Take a user page for swapout() to write out, replacing its
+// PTE with swpte.  Returns its kernel address, or 0 if none.
+char*
+swappick(uint swpte)
+{
+  struct proc *p;
+  char *mem;
+  int scan, laps;
+
+  scan = SWAPSCAN;
+  laps = 0;
+  acquire(&ptable.lock);
+  while(scan > 0){
+    p = swapnext(swappid - 1);
+    if(p == 0 || (p->pid == swappid && swapva >= VDSO))
+      p = swapnext(swappid);
+    if(p == 0){
+      // Past the last process: go round again, twice at most,
+      // since the first lap may only clear accessed bits.
+      if(swappid == 0 || ++laps > 2)
+        break;
+      swappid = 0;
+      continue;
+    }
+    if(p->pid != swappid){
+      swappid = p->pid;
+      swapva = 0;
+    }
+    if((mem = uvmswapscan(p->pgdir, &swapva, &scan, swpte)) != 0){
+      p->nrun++;
+      release(&ptable.lock);
+      return mem;
+    }
+  }
+  release(&ptable.lock);
+  return 0;
+}
+
+// Futexes.  A thread waits for the int at user address addr
+// to change by sleeping on addr itself, which as a user address
+// is no kernel sleeper's chan, and futexwake() there only wakes
+// threads of its own vmspace.  The int's page may move: a fork()
+// makes it copy-on-write again.  Processes that share the page
+// by MAP_SHARED may map it at different addresses, so a futex
+// in such a page, which is never copied or swapped, is keyed by
+// the int's kernel address instead, for any process.
+// Returns the chan, and *kp the int for futexwait() to read,
+// with ptlock(pgdir) held; or 0.
+static void*
+futexkey(uint addr, int **kp)
+{
+  int *k, shared;
+
+  if(addr == 0 || (k = uvmfutex(addr, &shared)) == 0)
+    return 0;  // 0 is no chan
+  if(kp)
+    *kp = k;
+  return shared ? (void*)k : (void*)addr;
+}
+
+// Does a sleeper on futex chan belong to the futex of the
+// current process it was found with futexkey()?
+static int
+futexmatch(struct proc *p, void *chan)
+{
+  return p->chan == chan &&
+    ((uint)chan >= KERNBASE || p->vm == myproc()->vm);
+}
+
+// If the int at addr holds val, sleep until futexwake().
+// Return 0 when woken, -1 if the int didn't hold val.
+// The check and the sleep are atomic with respect to
+// futexwake(), both being done with ptable.lock held;
+// the page lock keeps the int's page from being freed
+// while it is read.
+int
+futexwait(uint addr, int val)
+{
+  struct proc *curproc = myproc();
+  void *chan;
+  int *k, v;
+
+  if((chan = futexkey(addr, &k)) == 0)
+    return -1;
+  acquire(&ptable.lock);
+  v = *(volatile int*)k;
+  release(ptlock(curproc->pgdir));
+  if(v != val){
+    release(&ptable.lock);
+    return -1;
+  }
+  sleep(chan, &ptable.lock);
+  release(&ptable.lock);
+  return 0;
+}
+
+// Wake up to n threads waiting at addr.
+// Return the number woken.
+int
+futexwake(uint addr, int n)
+{
+  struct proc **pp, *p;
+  void *chan;
+  int woken;
+
+  if((chan = futexkey(addr, 0)) == 0)
+    return -1;
+  release(ptlock(myproc()->pgdir));
+  woken = 0;
+  acquire(&ptable.lock);
+  for(pp = sleepq(chan); woken < n && (p = *pp) != 0; ){
+    if(futexmatch(p, chan)){
+      *pp = p->cnext;
+      p->cnext = 0;
+      setrunnable(p);
+      woken++;
+    } else
+      pp = &p->cnext;
+  }
+  release(&ptable.lock);
+  return woken;
+}
+
+// Wake the poll() callers on wait queue q; see poll.c.
+// Caller holds the queue's lock.
+void
+pollwakeup(struct pollwait **q)
+{
+  struct pollwait *w;
+
+  if(*q == 0)
+    return;
+  acquire(&ptable.lock);
+  for(w = *q; w; w = w->next){
+    w->proc->pollready = 1;
+    wakeup1(&w->proc->wakeat);
+  }
+  release(&ptable.lock);
+}
+
+// Sleep in poll() until pollwakeup(), or, if timed, until the
+// time set with timerset(), which wakes the same chan.  Checked
+// with ptable.lock held, so neither can be missed.
+void
+pollsleep(int timed)
+{
+  struct proc *p = myproc();
+
+  acquire(&ptable.lock);
+  if(!p->pollready && !p->killed &&
+     !(timed && (int)(ticks - p->wakeat) >= 0))
+    sleep(&p->wakeat, &ptable.lock);
+  release(&ptable.lock);
+}
+
 // Kill the process with the given pid.
 // Process won't exit until it returns
 // to user space (see trap in trap.c).
@@ -482,12 +1284,14 @@ kill(int pid)
   struct proc *p;
 
   acquire(&ptable.lock);
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+  for(p = *pidhash(pid); p; p = p->pidnext){
     if(p->pid == pid){
       p->killed = 1;
       // Wake process from sleep if necessary.
-      if(p->state == SLEEPING)
-        p->state = RUNNABLE;
+      if(p->state == SLEEPING){
+        unsleep(p);
+        setrunnable(p);
+      }
       release(&ptable.lock);
       return 0;
     }
@@ -511,24 +1315,32 @@ procdump(void)
   [RUNNING]   "run   ",
   [ZOMBIE]    "zombie"
   };
-  int i;
+  int i, h;
   struct proc *p;
+  struct runq *rq;
   char *state;
   uint pc[10];
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-    if(p->state == UNUSED)
-      continue;
-    if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
-      state = states[p->state];
-    else
-      state = "???";
-    cprintf("%d %s %s", p->pid, state, p->name);
-    if(p->state == SLEEPING){
-      getcallerpcs((uint*)p->context->ebp+2, pc);
-      for(i=0; i<10 && pc[i] != 0; i++)
-        cprintf(" %p", pc[i]);
+  for(rq = runqs; rq < &runqs[ncpu]; rq++)
+    cprintf("cpu%d: runq %d steal %d stolen %d\n",
+            (int)(rq - runqs), rq->len, rq->nsteal, rq->nstolen);
+
+  for(h = 0; h < NPIDHASH; h++){
+    for(p = ptable.pidhash[h]; p; p = p->pidnext){
+      if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
+        state = states[p->state];
+      else
+        state = "???";
+      cprintf("%d %s %s pri %d ut %d st %d sw %d br %d bw %d pi %d po %d pg %d",
+              p->pid, state, p->name, p->prio, p->ru.utime, p->ru.stime,
+              p->ru.nswtch, p->ru.nbread, p->ru.nbwrite, p->ru.pipein,
+              p->ru.pipeout, p->ru.npage);
+      if(p->state == SLEEPING){
+        getcallerpcs((uint*)p->context->ebp+2, pc);
+        for(i=0; i<10 && pc[i] != 0; i++)
+          cprintf(" %p", pc[i]);
+      }
+      cprintf("\n");
     }
-    cprintf("\n");
   }
 }
@@ -1,3 +1,5 @@
+#include "rusage.h"  // for struct proc
+
 // Per-CPU state
 struct cpu {
   uchar apicid;                // Local APIC ID
@@ -8,10 +10,22 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  pde_t *pgdir;                // User page table loaded in cr3, or 0
+  struct proc *uvmproc;        // Process that pgdir was loaded for
+  uint uvmnrun;                // ... and its nrun at the time
+  volatile int dropuvm;        // freevm() wants pgdir unloaded
+  pde_t *tlbpgdir;             // Shootdown this CPU asked for: pgdir,
+  uint tlbstart, tlbend;       // ... user range,
+  volatile uint tlbwait;       // ... and CPUs yet to do it (bits)
+  volatile uint idle;          // Halted in scheduler; wake with an IPI
+  struct proc *fpuowner;       // Process whose FPU state was loaded last
+  uint stat[NSTAT];            // Event counters; see stats.c
+  uint entrystack[128];        // sysenter's, until sysentry leaves it
 };
 
 extern struct cpu cpus[NCPU];
 extern int ncpu;
+extern struct cpu *apiccpu[256];  // by APIC ID; read-only after mpinit
 
 //PAGEBREAK: 17
 // Saved registers for kernel context switches.
@@ -32,23 +46,75 @@ struct context {
   uint eip;
 };
 
+// A region of user memory whose pages are filled in when first
+// touched: an ELF segment or an mmap().  Pages are read from
+// ip up to filesz and zero-filled past it.  Unused if end is 0.
+struct vma {
+  uint start;                  // First address, page-aligned
+  uint end;                    // Last address + 1
+  struct inode *ip;            // Backing file, 0 if anonymous
+  uint off;                    // File offset of start
+  uint filesz;                 // Bytes of the region backed by ip
+  int prot;                    // PROT_ bits
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+};
+
+// The user memory of a process, which threads made by clone()
+// share along with its page table.  growproc(), mmap() and
+// munmap() change it between vmlock() and vmunlock(), and
+// store sz and the vmas with ptlock(pgdir) held too, as
+// pagefault() looks them up under that alone.
+struct vmspace {
+  int ref;                     // Processes using it; ptable.lock
+  int busy;                    // Held by vmlock(); ptable.lock
+  uint sz;                     // Size of process memory (bytes)
+  uint gen;                    // Bumped when memory is unmapped
+  int nfill;                   // pagefault()s using a vma copy
+  struct vma vma[NVMA];        // ELF segments and mappings
+};
+
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
 struct proc {
-  uint sz;                     // Size of process memory (bytes)
+  struct vmspace *vm;          // User memory
   pde_t* pgdir;                // Page table
   char *kstack;                // Bottom of kernel stack for this process
   enum procstate state;        // Process state
   int pid;                     // Process ID
   struct proc *parent;         // Parent process
+  struct proc *child;          // First of this process's children
+  struct proc *sibling;        // Next child of the parent
+  struct proc *pidnext;        // Next in the pid hash chain
   struct trapframe *tf;        // Trap frame for current syscall
   struct context *context;     // swtch() here to run process
   void *chan;                  // If non-zero, sleeping on chan
+  struct proc *cnext;          // Next on chan's wait queue
   int killed;                  // If non-zero, have been killed
-  struct file *ofile[NOFILE];  // Open files
+  struct fdtable *fdt;         // Open files
+  struct file *callf[2];       // Held until the system call returns
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  int cpu;                     // CPU whose run queue we go on
+  struct proc *rqnext;         // Next process on that run queue
+  uint nrun;                   // Times scheduled
+  int prio;                    // Run queue level, 0 highest
+  int nice;                    // Highest level allowed, from nice()
+  uint used;                   // Ticks run at this level
+  int thread;                  // Made by clone(), for join()
+  int pinned;                  // uvmprefault()s in effect; no swapping
+  uint onfault;                // Where trap() resumes a failed copyuser()
+  uint ustack;                 // Stack clone() was given
+  struct ring *ring;           // Registered system call ring, or 0
+  int *sysargs;                // Arguments of a batched call, or 0
+  struct rusage ru;            // Resources used
+  struct rusage cru;           // ... by waited-for children
+  int fpuused;                 // fpu holds FPU state
+  int fpucpu;                  // CPU whose registers hold it too, or -1
+  uchar fpu[512+16];           // fxsave area, once 16-byte aligned
+  uint wakeat;                 // Tick sleepticks() waits for
+  struct proc *tnext;          // Next in the timer queue
+  int pollready;               // A pollwakeup() came while in poll()
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -56,3 +122,7 @@ struct proc {
 //   original data and bss
 //   fixed-size stack
 //   expandable heap
+//   ...
+//   mmap()ed regions, growing down from KERNBASE
+// Pages are allocated, or read in from the vma they belong to,
+// when they are first touched (see pagefault() in vm.c).
@@ -0,0 +1,47 @@
+// Profile a command: prof cmd [arg ...]
+// Runs cmd with the sampling profiler on and prints one
+// line per sample, for profsym.pl to symbolize on the host:
+//   prof cpu pid name k|u eip [caller ...]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "prof.h"
+
+#define NSAMP 64
+
+struct profsample s[NSAMP];
+
+// Print a batch of samples.
+int
+put(void *buf, int n)
+{
+  struct profsample *s = buf;
+  int i, j;
+
+  for(i = 0; i < n; i++){
+    printf(1, "prof %d %d %s %s %x", s[i].cpu, s[i].pid, s[i].name,
+           s[i].user ? "u" : "k", s[i].eip);
+    for(j = 0; j < NPROFPC && s[i].pc[j]; j++)
+      printf(1, " %x", s[i].pc[j]);
+    printf(1, "\n");
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int lost;
+
+  if(argc < 2){
+    printf(2, "usage: prof cmd [arg ...]\n");
+    exit();
+  }
+  lost = ringrun((int(*)(int, void*, int))profile, s, NSAMP, put, argv+1);
+  if(lost < 0)
+    printf(2, "prof: cannot start profiler\n");
+  if(lost > 0)
+    printf(2, "prof: %d samples lost\n", lost);
+  exit();
+}
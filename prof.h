@@ -0,0 +1,18 @@
+// Sampling profiler: what the profile() system call returns.
+
+#define NPROFPC 8      // kernel call stack depth kept per sample
+#define NPROFSAMP 256  // samples kept per cpu; must be a power of 2
+
+// profile() commands
+#define PROF_STOP  0  // stop sampling
+#define PROF_START 1  // discard old samples and start sampling
+#define PROF_READ  2  // drain samples; -1 once stopped and drained
+
+struct profsample {
+  uint eip;           // interrupted pc
+  uint pc[NPROFPC];   // kernel callers of eip, 0-terminated
+  int pid;            // 0 if the cpu was idle
+  uchar cpu;
+  uchar user;         // eip is a user address
+  char name[16];      // process name, to find its symbols
+};
@@ -0,0 +1,63 @@
+// Sampling CPU profiler.
+//
+// While profiling is on, each CPU's timer interrupt records
+// where it interrupted, and the kernel call stack if that was
+// in the kernel, into the CPU's own ring (see cpuring.c).
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "cpuring.h"
+#include "prof.h"
+
+static struct profsample samp[NCPU][NPROFSAMP];
+static struct cpuring profring;
+
+void
+profinit(void)
+{
+  cpuringinit(&profring, "prof", samp, sizeof(samp[0][0]), NPROFSAMP);
+}
+
+// Record a sample for this CPU's timer interrupt.
+void
+profsample(struct trapframe *tf)
+{
+  struct profsample *s;
+  struct proc *p;
+  uint *ebp;
+  int i;
+
+  if((s = cpuringput(&profring)) == 0)
+    return;
+  s->eip = tf->eip;
+  s->cpu = cpuid();
+  s->user = (tf->cs & 3) == DPL_USER;
+  p = myproc();
+  s->pid = p ? p->pid : 0;
+  safestrcpy(s->name, p ? p->name : "idle", sizeof(s->name));
+  // Walk the interrupted kernel code's frame pointers.
+  i = 0;
+  if(!s->user){
+    for(ebp = (uint*)tf->ebp; i < NPROFPC; i++){
+      if(ebp < (uint*)KERNBASE || ebp == (uint*)0xffffffff)
+        break;
+      s->pc[i] = ebp[1];
+      ebp = (uint*)ebp[0];
+    }
+  }
+  for(; i < NPROFPC; i++)
+    s->pc[i] = 0;
+  cpuringpush(&profring);
+}
+
+int
+profile(int cmd, struct profsample *s, int n)
+{
+  return cpuringctl(&profring, cmd, (char*)s, n);
+}
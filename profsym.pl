@@ -0,0 +1,68 @@
+#!/usr/bin/perl -w
+
+# Symbolize the output of the prof command.
+#   perl profsym.pl < console.log
+# Kernel samples are looked up in kernel.sym and user samples
+# in name.sym, both as made by the Makefile.  Prints the
+# functions sampled most, and for the kernel also counts each
+# function once per sample it appears in the call stack of.
+
+use strict;
+
+my %syms;  # file => [sorted [addr, name]]
+
+sub load {
+    my ($file) = @_;
+    return $syms{$file} if exists $syms{$file};
+    my @s;
+    if(open(my $f, "<", $file)){
+        while(<$f>){
+            my ($addr, $name) = split;
+            next unless defined $name && $name !~ /\.c$|\.S$/;
+            push @s, [hex($addr), $name];
+        }
+        close($f);
+    }
+    @s = sort { $a->[0] <=> $b->[0] } @s;
+    return $syms{$file} = \@s;
+}
+
+sub lookup {
+    my ($file, $pc) = @_;
+    my $s = load($file);
+    my ($lo, $hi) = (0, scalar(@$s) - 1);
+    return sprintf("%s:%x", $file, $pc) if $hi < 0 || $pc < $s->[0][0];
+    while($lo < $hi){
+        my $mid = int(($lo + $hi + 1) / 2);
+        if($s->[$mid][0] <= $pc){ $lo = $mid; } else { $hi = $mid - 1; }
+    }
+    return $s->[$lo][1];
+}
+
+my (%self, %incl, $n);
+while(<>){
+    next unless /^prof (\d+) (\d+) (\S+) ([ku]) ([0-9a-f]+)((?: [0-9a-f]+)*)/;
+    my ($name, $mode, $eip, @pcs) = ($3, $4, hex($5), map { hex } split(' ', $6));
+    my $file = $mode eq "k" ? "kernel.sym" : "$name.sym";
+    my $f = lookup($file, $eip);
+    my $where = $mode eq "k" ? $f : "$name:$f";
+    $self{$where}++;
+    $n++;
+    next if $mode eq "u";
+    my %seen = ($f => 1);
+    $incl{$f}++;
+    foreach my $pc (@pcs){
+        my $g = lookup($file, $pc - 1);  # the call, not the return
+        $incl{$g}++ unless $seen{$g}++;
+    }
+}
+die "no samples\n" unless $n;
+
+printf("%d samples\n\n%7s %6s  %s\n", $n, "self", "%", "function");
+foreach my $k (sort { $self{$b} <=> $self{$a} } keys %self){
+    printf("%7d %5.1f%%  %s\n", $self{$k}, 100 * $self{$k} / $n, $k);
+}
+printf("\n%7s %6s  %s\n", "kernel", "%", "function, with callees");
+foreach my $k (sort { $incl{$b} <=> $incl{$a} } keys %incl){
+    printf("%7d %5.1f%%  %s\n", $incl{$k}, 100 * $incl{$k} / $n, $k);
+}
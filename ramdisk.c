@@ -0,0 +1,151 @@
+// RAM disk: block device RAMDEV, kept in kernel memory and
+// formatted with an empty file system at boot, which init mounts
+// on /tmp (see mount() in fs.c).  Its requests never wait for the
+// IDE disk, and it is not logged.
+//
+// The disk's pages come from kalloc() when balloc() first hands
+// out a block in them, and go back when bfree() frees the last
+// one; running out of memory looks like running out of blocks.
+// Unwritten blocks read as zeros.  readi() and
+// writei() move the data of regular files on it straight to and
+// from ramdiskblock(), so a temporary file's data skips the
+// buffer cache as well as the log: the fs is a tmpfs.  Inodes,
+// directories and the other metadata still go through bread().
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "stat.h"
+
+#define RDINODES  200
+#define BPP       (PGSIZE/BSIZE)  // blocks per page
+
+static struct spinlock rdlock;  // protects rdpage[]
+static char *rdpage[(RAMDISKSIZE + BPP - 1) / BPP];
+
+// Return the memory holding block b, allocating its page if
+// alloc is set; else 0 if the block has never been written,
+// or there is no memory for its page.
+uchar*
+ramdiskblock(uint b, int alloc)
+{
+  char **pp, *p;
+
+  if(b >= RAMDISKSIZE)
+    panic("ramdiskblock: block out of range");
+  pp = &rdpage[b / BPP];
+  acquire(&rdlock);
+  if(*pp == 0 && alloc)
+    *pp = kzalloc();
+  p = *pp;
+  release(&rdlock);
+  if(p == 0)
+    return 0;
+  return (uchar*)p + (b % BPP) * BSIZE;
+}
+
+// Free the page holding block b if no block in it is in use
+// any more; map is b's block of the free bit map.
+void
+ramdiskfree(uint b, uchar *map)
+{
+  uint i;
+  char *p;
+
+  b -= b % BPP;
+  for(i = b; i < b + BPP; i++)
+    if(map[(i % BPB)/8] & (1 << (i % 8)))
+      return;
+  acquire(&rdlock);
+  p = rdpage[b / BPP];
+  rdpage[b / BPP] = 0;
+  release(&rdlock);
+  if(p)
+    kfree(p);
+}
+
+static uchar*
+rdblock(uint b)
+{
+  uchar *p;
+
+  if((p = ramdiskblock(b, 1)) == 0)
+    panic("ramdiskinit: out of memory");
+  return p;
+}
+
+// Allocate the disk and write an empty file system to it:
+// [ boot block | super block | inode blocks | free bit map | data ],
+// with no log, and a root directory in the first data block.
+void
+ramdiskinit(void)
+{
+  struct superblock *sb;
+  struct dinode *dip;
+  struct dirent *de;
+  uint i, nmeta;
+
+  initlock(&rdlock, "ramdisk");
+  sb = (struct superblock*)rdblock(1);
+  sb->size = RAMDISKSIZE;
+  sb->ninodes = RDINODES;
+  sb->nlog = 0;
+  sb->logstart = 2;
+  sb->inodestart = 2;
+  sb->bmapstart = 2 + RDINODES/IPB + 1;
+  sb->bsize = BSIZE;
+  nmeta = sb->bmapstart + RAMDISKSIZE/BPB + 1;
+  sb->nblocks = RAMDISKSIZE - nmeta;
+
+  // The metadata and the root directory's block are in use,
+  // and never freed, so always have their pages.
+  for(i = 0; i <= nmeta; i++){
+    rdblock(i);
+    rdblock(BBLOCK(i, (*sb)))[(i % BPB)/8] |= 1 << (i % 8);
+  }
+
+  dip = (struct dinode*)rdblock(IBLOCK(ROOTINO, (*sb))) + ROOTINO % IPB;
+  dip->type = T_DIR;
+  dip->nlink = 1;
+  dip->size = 2*sizeof(*de);
+  dip->addrs[0] = nmeta;
+
+  de = (struct dirent*)rdblock(nmeta);
+  de[0].inum = ROOTINO;
+  safestrcpy(de[0].name, ".", DIRSIZ);
+  de[1].inum = ROOTINO;  // fs.c maps ".." to the mount point's
+  safestrcpy(de[1].name, "..", DIRSIZ);
+}
+
+// Sync buf with the RAM disk, like iderw().
+void
+ramdiskrw(struct buf *b)
+{
+  uchar *p;
+
+  if(!holdingsleep(&b->lock))
+    panic("ramdiskrw: buf not locked");
+  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
+    panic("ramdiskrw: nothing to do");
+
+  p = ramdiskblock(b->blockno, b->flags & B_DIRTY);
+  if(p == 0 && (b->flags & B_DIRTY))
+    panic("ramdiskrw: out of memory");  // balloc() got it the page
+  if(b->flags & B_DIRTY){
+    b->flags &= ~B_DIRTY;
+    memmove(p, b->data, BSIZE);
+  } else if(p)
+    memmove(b->data, p, BSIZE);
+  else
+    memset(b->data, 0, BSIZE);
+  b->flags |= B_VALID;
+  if(b->flags & B_ASYNC){
+    b->flags &= ~B_ASYNC;
+    bdone(b);
+  }
+}
@@ -0,0 +1,25 @@
+// Batched system calls.  User space queues calls in a ring it
+// registers with ringsetup(), then submits them with ringenter();
+// the kernel posts each result to the completion queue.
+// The user advances sqtail and cqhead, the kernel sqhead and
+// cqtail; indexes run freely and are taken mod NRINGENT.
+
+#define NRINGENT 32  // entries in each queue
+
+struct sqe {
+  int num;      // SYS_ number
+  int arg[5];   // arguments, as they would be passed
+  uint tag;     // copied to the completion
+};
+
+struct cqe {
+  int ret;      // result of the call
+  uint tag;
+};
+
+struct ring {
+  uint sqhead, sqtail;
+  uint cqhead, cqtail;
+  struct sqe sq[NRINGENT];
+  struct cqe cq[NRINGENT];
+};
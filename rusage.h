@@ -0,0 +1,15 @@
+// Resources used by a process, as returned by getrusage().
+
+#define RUSAGE_SELF     0
+#define RUSAGE_CHILDREN 1  // waited-for children, and theirs
+
+struct rusage {
+  uint utime;     // clock ticks running in user mode
+  uint stime;     // clock ticks running in the kernel
+  uint nswtch;    // context switches
+  uint nbread;    // blocks read through the buffer cache
+  uint nbwrite;   // blocks written through it
+  uint pipein;    // bytes read from pipes
+  uint pipeout;   // bytes written to pipes
+  uint npage;     // pages allocated
+};
@@ -0,0 +1,159 @@
+// Reader-writer locks and sequence locks.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "rwlock.h"
+
+void
+initrwlock(struct rwspinlock *lk, char *name)
+{
+  lk->cnt = 0;
+  lk->name = name;
+  lk->cpu = 0;
+}
+
+void
+racquire(struct rwspinlock *lk)
+{
+  pushcli();
+  for(;;){
+    while(*(volatile uint*)&lk->cnt & RW_WRITER)
+      pause();
+    if((__sync_fetch_and_add(&lk->cnt, 1) & RW_WRITER) == 0)
+      break;
+    // A writer got in first; back out and wait.
+    __sync_fetch_and_sub(&lk->cnt, 1);
+  }
+  __sync_synchronize();
+}
+
+void
+rrelease(struct rwspinlock *lk)
+{
+  __sync_synchronize();
+  __sync_fetch_and_sub(&lk->cnt, 1);
+  popcli();
+}
+
+void
+wacquire(struct rwspinlock *lk)
+{
+  pushcli();
+  if(lk->cpu == mycpu())
+    panic("wacquire");
+  // Claim the writer bit, then wait for readers to leave.
+  while(__sync_fetch_and_or(&lk->cnt, RW_WRITER) & RW_WRITER)
+    pause();
+  while(*(volatile uint*)&lk->cnt != RW_WRITER)
+    pause();
+  __sync_synchronize();
+  lk->cpu = mycpu();
+}
+
+void
+wrelease(struct rwspinlock *lk)
+{
+  if(lk->cpu != mycpu())
+    panic("wrelease");
+  lk->cpu = 0;
+  __sync_synchronize();
+  // Not a plain store: readers may be briefly counted in.
+  __sync_fetch_and_and(&lk->cnt, ~RW_WRITER);
+  popcli();
+}
+
+void
+initrwsleeplock(struct rwsleeplock *lk, char *name)
+{
+  initlock(&lk->lk, "rw sleep lock");
+  lk->name = name;
+  lk->readers = 0;
+  lk->writer = 0;
+  lk->wwait = 0;
+}
+
+void
+racquiresleep(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  while(lk->writer || lk->wwait)
+    sleep(lk, &lk->lk);
+  lk->readers++;
+  release(&lk->lk);
+}
+
+void
+rreleasesleep(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(--lk->readers == 0)
+    wakeup(lk);
+  release(&lk->lk);
+}
+
+void
+wacquiresleep(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  lk->wwait++;
+  while(lk->writer || lk->readers)
+    sleep(lk, &lk->lk);
+  lk->wwait--;
+  lk->writer = myproc()->pid;
+  release(&lk->lk);
+}
+
+void
+wreleasesleep(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  lk->writer = 0;
+  wakeup(lk);
+  release(&lk->lk);
+}
+
+void
+seqinit(struct seqlock *sl)
+{
+  sl->seq = 0;
+}
+
+// Begin a read section; returns the sequence to pass to seqretry().
+uint
+seqbegin(struct seqlock *sl)
+{
+  uint s;
+
+  while((s = *(volatile uint*)&sl->seq) & 1)
+    pause();
+  __sync_synchronize();
+  return s;
+}
+
+// Did a writer run since seqbegin() returned s?
+int
+seqretry(struct seqlock *sl, uint s)
+{
+  __sync_synchronize();
+  return *(volatile uint*)&sl->seq != s;
+}
+
+void
+seqwrite(struct seqlock *sl)
+{
+  sl->seq++;
+  __sync_synchronize();
+}
+
+void
+seqwritedone(struct seqlock *sl)
+{
+  __sync_synchronize();
+  sl->seq++;
+}
@@ -0,0 +1,33 @@
+// Reader-writer locks: any number of readers, or one writer.
+// A waiting writer keeps new readers out, so writers are not
+// starved.  rwspinlock spins and, like a spinlock, keeps
+// interrupts off while held; rwsleeplock sleeps, like a
+// sleeplock.
+
+#define RW_WRITER 0x80000000
+
+struct rwspinlock {
+  uint cnt;          // Readers, plus RW_WRITER if a writer holds or wants it
+  char *name;        // Name of lock.
+  struct cpu *cpu;   // The cpu holding it for writing.
+};
+
+struct rwsleeplock {
+  struct spinlock lk; // spinlock protecting this lock
+  int readers;       // Readers holding it
+  int writer;        // Pid of the writer holding it, or 0
+  int wwait;         // Writers waiting for it
+  char *name;        // Name of lock.
+};
+
+// Sequence lock, for data read far more often than written.
+// Writers, serialized by some other lock, make seq odd while
+// they update; readers retry if it was odd or has changed:
+//
+//   do {
+//     s = seqbegin(&sl);
+//     ... read ...
+//   } while(seqretry(&sl, s));
+struct seqlock {
+  uint seq;
+};
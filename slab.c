@@ -0,0 +1,200 @@
+// Slab allocator for fixed-size kernel objects, on top of kalloc().
+//
+// Each object cache carves pages ("slabs") into objects of one
+// size; a header at the start of each page keeps the slab's free
+// objects.  In front of the slabs, each CPU has a magazine of up
+// to NMAG free objects, so that kmalloc() and kmfree() usually
+// touch no lock; magazines are filled from and emptied to the
+// slabs NMAG/2 objects at a time.  Empty slabs go back to kalloc(),
+// except the last one of a cache.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+
+#define NKMCACHE  16  // number of object caches
+#define NMAG      16  // objects per per-CPU magazine
+
+struct obj {
+  struct obj *next;
+};
+
+struct slab {
+  struct slab *next;
+  struct obj *free;   // free objects in this slab
+  int nfree;
+};
+
+struct kmcache {
+  struct spinlock lock;  // protects everything but mag
+  char *name;
+  uint size;      // bytes per object
+  uint perslab;   // objects per slab
+  struct slab *slabs;
+  uint nslab;
+  uint nout;      // objects handed out of the slabs
+
+  struct {
+    int n;
+    void *obj[NMAG];
+  } mag[NCPU];    // used with interrupts off, on its own CPU
+};
+
+static struct {
+  struct spinlock lock;
+  struct kmcache cache[NKMCACHE];
+  int n;
+} kmtable;
+
+// Create a cache of objects of size bytes.
+struct kmcache*
+kmcreate(char *name, uint size)
+{
+  struct kmcache *c;
+
+  if(kmtable.n == 0)
+    initlock(&kmtable.lock, "kmtable");  // first call is from main()
+  size = (size + 7) & ~7;
+  if(size < sizeof(struct obj) || size > PGSIZE - sizeof(struct slab))
+    panic("kmcreate: size");
+
+  acquire(&kmtable.lock);
+  if(kmtable.n == NKMCACHE)
+    panic("kmcreate: too many caches");
+  c = &kmtable.cache[kmtable.n++];
+  release(&kmtable.lock);
+
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - sizeof(struct slab)) / size;
+  return c;
+}
+
+// Allocate a slab for c and put it on c's list.
+// Caller holds c->lock.
+static struct slab*
+slaballoc(struct kmcache *c)
+{
+  struct slab *s;
+  struct obj *o;
+  char *p;
+  int i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->free = 0;
+  p = (char*)(s + 1);
+  for(i = 0; i < c->perslab; i++, p += c->size){
+    o = (struct obj*)p;
+    o->next = s->free;
+    s->free = o;
+  }
+  s->nfree = c->perslab;
+  s->next = c->slabs;
+  c->slabs = s;
+  c->nslab++;
+  return s;
+}
+
+// Move up to NMAG/2 objects from c's slabs into magazine m.
+static void
+fill(struct kmcache *c, int m)
+{
+  struct slab *s;
+  struct obj *o;
+
+  acquire(&c->lock);
+  while(c->mag[m].n < NMAG/2){
+    for(s = c->slabs; s && s->nfree == 0; s = s->next)
+      ;
+    if(s == 0 && (s = slaballoc(c)) == 0)
+      break;
+    o = s->free;
+    s->free = o->next;
+    s->nfree--;
+    c->nout++;
+    c->mag[m].obj[c->mag[m].n++] = o;
+  }
+  release(&c->lock);
+}
+
+// Return NMAG/2 objects from magazine m to c's slabs.
+static void
+flush(struct kmcache *c, int m)
+{
+  struct slab *s, **sp;
+  struct obj *o;
+
+  acquire(&c->lock);
+  while(c->mag[m].n > NMAG/2){
+    o = c->mag[m].obj[--c->mag[m].n];
+    s = (struct slab*)PGROUNDDOWN((uint)o);
+    o->next = s->free;
+    s->free = o;
+    s->nfree++;
+    c->nout--;
+    if(s->nfree == c->perslab && c->nslab > 1){
+      for(sp = &c->slabs; *sp != s; sp = &(*sp)->next)
+        ;
+      *sp = s->next;
+      c->nslab--;
+      kfree((char*)s);
+    }
+  }
+  release(&c->lock);
+}
+
+// Allocate an object from c.
+// Returns 0 if out of memory.
+void*
+kmalloc(struct kmcache *c)
+{
+  void *o;
+  int m;
+
+  pushcli();
+  m = cpuid();
+  if(c->mag[m].n == 0)
+    fill(c, m);
+  o = 0;
+  if(c->mag[m].n > 0)
+    o = c->mag[m].obj[--c->mag[m].n];
+  popcli();
+  return o;
+}
+
+// Free object o, which came from kmalloc(c).
+void
+kmfree(struct kmcache *c, void *o)
+{
+  int m;
+
+  pushcli();
+  m = cpuid();
+  if(c->mag[m].n == NMAG)
+    flush(c, m);
+  c->mag[m].obj[c->mag[m].n++] = o;
+  popcli();
+}
+
+// Print per-cache usage to the console, for ^P.
+// Takes no locks, so as to be usable when the machine is wedged.
+void
+kmdump(void)
+{
+  struct kmcache *c;
+  int i, inmag;
+
+  for(c = kmtable.cache; c < &kmtable.cache[kmtable.n]; c++){
+    inmag = 0;
+    for(i = 0; i < ncpu; i++)
+      inmag += c->mag[i].n;
+    cprintf("%s: %d bytes, %d slabs, %d in use, %d free\n",
+            c->name, c->size, c->nslab, c->nout - inmag,
+            c->nslab*c->perslab - c->nout + inmag);
+  }
+}
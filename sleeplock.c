@@ -1,4 +1,11 @@
 // Sleeping locks
+//
+// Adaptive: a process that finds the lock held spins for a
+// while first if the holder is running on another CPU, since
+// it is likely to release the lock soon (e.g. a buffer after a
+// cache hit), and sleeping would cost both of them a trip
+// through the scheduler.  It sleeps if the holder is not
+// running, or not done within SLEEPSPIN pause()s.
 
 #include "types.h"
 #include "defs.h"
@@ -17,17 +24,53 @@ initsleeplock(struct sleeplock *lk, char *name)
   lk->name = name;
   lk->locked = 0;
   lk->pid = 0;
+  lk->owner = 0;
+  lk->stat = lockclass(name, 1);
+}
+
+// Wait, without lk->lk, while lk is held by a process that is
+// running on another CPU; not long, and maybe not until it is
+// free.  Without lk->lk, owner may be stale; its proc is still
+// kernel memory, which at worst misleads us into sleeping.
+static void
+spinwait(struct sleeplock *lk)
+{
+  struct proc *me, *p;
+  int i;
+
+  me = myproc();
+  for(i = 0; i < SLEEPSPIN; i++){
+    p = *(struct proc *volatile *)&lk->owner;
+    if(!*(volatile uint*)&lk->locked || p == 0 || p == me ||
+       *(volatile enum procstate*)&p->state != RUNNING)
+      return;
+    pause();
+  }
 }
 
 void
 acquiresleep(struct sleeplock *lk)
 {
+  uint pcs[10];
+  uint64 t0, wait;
+
   acquire(&lk->lk);
-  while (lk->locked) {
-    sleep(lk, &lk->lk);
+  wait = 0;
+  if(lk->locked){
+    t0 = rdtsc();
+    release(&lk->lk);
+    spinwait(lk);
+    acquire(&lk->lk);
+    while (lk->locked) {
+      sleep(lk, &lk->lk);
+    }
+    wait = rdtsc() - t0 + 1;
   }
   lk->locked = 1;
   lk->pid = myproc()->pid;
+  lk->owner = myproc();
+  getcallerpcs(&lk, pcs);
+  lockstatrecord(lk->stat, mycpu(), pcs[0], wait);
   release(&lk->lk);
 }
 
@@ -37,6 +80,7 @@ releasesleep(struct sleeplock *lk)
   acquire(&lk->lk);
   lk->locked = 0;
   lk->pid = 0;
+  lk->owner = 0;
   wakeup(lk);
   release(&lk->lk);
 }
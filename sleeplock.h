@@ -6,5 +6,7 @@ struct sleeplock {
   // For debugging:
   char *name;        // Name of lock.
   int pid;           // Process holding lock
+  struct proc *owner;  // ... and the proc, for acquiresleep() to spin
+  struct lockclass *stat;  // Contention statistics; see lockprof.c
 };
 
@@ -13,8 +13,14 @@ void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
+#ifdef XCHGLOCKS
   lk->locked = 0;
+#else
+  lk->next = 0;
+  lk->owner = 0;
+#endif
   lk->cpu = 0;
+  lk->stat = lockclass(name, 0);
 }
 
 // Acquire the lock.
@@ -24,13 +30,36 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  uint64 t0, wait;
+#ifndef XCHGLOCKS
+  uint ticket;
+#endif
+
   pushcli(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
+  wait = 0;
+#ifdef XCHGLOCKS
   // The xchg is atomic.
-  while(xchg(&lk->locked, 1) != 0)
-    ;
+  if(xchg(&lk->locked, 1) != 0){
+    t0 = rdtsc();
+    while(xchg(&lk->locked, 1) != 0)
+      pause();
+    wait = rdtsc() - t0 + 1;
+  }
+#else
+  // Take a ticket, atomically, and wait for it to come up.
+  // Waiters only read lk->owner, so the cache line is
+  // shared until the release.
+  ticket = __sync_fetch_and_add(&lk->next, 1);
+  if(*(volatile uint*)&lk->owner != ticket){
+    t0 = rdtsc();
+    while(*(volatile uint*)&lk->owner != ticket)
+      pause();
+    wait = rdtsc() - t0 + 1;
+  }
+#endif
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,6 +69,7 @@ acquire(struct spinlock *lk)
   // Record info about lock acquisition for debugging.
   lk->cpu = mycpu();
   getcallerpcs(&lk, lk->pcs);
+  lockstatrecord(lk->stat, lk->cpu, lk->pcs[0], wait);
 }
 
 // Release the lock.
@@ -59,10 +89,16 @@ release(struct spinlock *lk)
   // stores; __sync_synchronize() tells them both not to.
   __sync_synchronize();
 
+#ifdef XCHGLOCKS
   // Release the lock, equivalent to lk->locked = 0.
   // This code can't use a C assignment, since it might
   // not be atomic. A real OS would use C atomics here.
   asm volatile("movl $0, %0" : "+m" (lk->locked) : );
+#else
+  // Serve the next ticket.  Only the holder writes lk->owner,
+  // so this needn't be a locked instruction.
+  asm volatile("incl %0" : "+m" (lk->owner) : );
+#endif
 
   popcli();
 }
@@ -91,7 +127,11 @@ holding(struct spinlock *lock)
 {
   int r;
   pushcli();
+#ifdef XCHGLOCKS
   r = lock->locked && lock->cpu == mycpu();
+#else
+  r = lock->next != lock->owner && lock->cpu == mycpu();
+#endif
   popcli();
   return r;
 }
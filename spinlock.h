@@ -1,11 +1,19 @@
-// Mutual exclusion lock.
+// Mutual exclusion lock.  By default a ticket lock, which
+// CPUs get in the order they asked; build with XCHGLOCKS for
+// the plain test-and-set lock.
 struct spinlock {
+#ifdef XCHGLOCKS
   uint locked;       // Is the lock held?
+#else
+  uint next;         // Next ticket to hand out
+  uint owner;        // Ticket now holding the lock
+#endif
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
   uint pcs[10];      // The call stack (an array of program counters)
                      // that locked the lock.
+  struct lockclass *stat;  // Contention statistics; see lockprof.c
 };
 
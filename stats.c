@@ -0,0 +1,123 @@
+// Per-CPU event counters, for watching hot-path rates.
+//
+// A subsystem registers a set of counters by name with
+// statalloc() when it starts, and counts an event with
+// statinc(), a plain add to the current CPU's copy in struct
+// cpu: no lock, no atomic and no shared cache line.  Reading
+// the stats device sums each counter over cpus[] and returns
+// an array of struct statent.  Counter 0 is never handed out,
+// so an id that is still 0 counts harmlessly.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "stats.h"
+
+#define NSTATSET 32
+
+static struct {
+  struct spinlock lock;
+  int nset;
+  int next;  // first unused counter
+  struct {
+    char *name;
+    int first, n;
+  } set[NSTATSET];
+} stable;
+
+// Return the first of n counters called name, registering them
+// if need be; or 0, which counts nothing, if there is no room.
+int
+statalloc(char *name, int n)
+{
+  int i, first;
+
+  acquire(&stable.lock);
+  first = 0;
+  for(i = 0; i < stable.nset; i++)
+    if(strncmp(stable.set[i].name, name, 16) == 0 && stable.set[i].n == n){
+      first = stable.set[i].first;
+      goto out;
+    }
+  if(stable.nset == NSTATSET || stable.next + n > NSTAT)
+    goto out;
+  first = stable.next;
+  stable.next += n;
+  stable.set[stable.nset].name = name;
+  stable.set[stable.nset].first = first;
+  stable.set[stable.nset].n = n;
+  stable.nset++;
+out:
+  release(&stable.lock);
+  return first;
+}
+
+// Count an event on counter id.
+void
+statinc(int id)
+{
+  uint eflags;
+
+  // Interrupts off, so that we stay on this CPU.
+  eflags = readeflags();
+  cli();
+  mycpu()->stat[id]++;
+  if(eflags & FL_IF)
+    sti();
+}
+
+// Read the stats device: bytes off to off+n of the array of
+// struct statent, made afresh for each read.  Sets are only
+// ever added, so the first nset can be read without the lock,
+// which must not be held while dst may fault.
+static int
+statsread(struct inode *ip, char *dst, uint off, int n)
+{
+  struct statent e;
+  uint pos, start, m;
+  int s, i, c, id, tot, nset;
+
+  acquire(&stable.lock);
+  nset = stable.nset;
+  release(&stable.lock);
+  tot = 0;
+  pos = 0;
+  for(s = 0; s < nset; s++){
+    for(i = 0; i < stable.set[s].n; i++, pos += sizeof(e)){
+      if(pos + sizeof(e) <= off)
+        continue;
+      if(tot == n)
+        return tot;
+      memset(&e, 0, sizeof(e));
+      safestrcpy(e.name, stable.set[s].name, sizeof(e.name));
+      e.i = i;
+      e.n = stable.set[s].n;
+      id = stable.set[s].first + i;
+      for(c = 0; c < ncpu; c++)
+        e.count += cpus[c].stat[id];
+      start = pos < off ? off - pos : 0;
+      m = sizeof(e) - start;
+      if(m > n - tot)
+        m = n - tot;
+      if(copyuser(dst + tot, (char*)&e + start, m) < 0)
+        return -1;
+      tot += m;
+    }
+  }
+  return tot;
+}
+
+void
+statinit(void)
+{
+  initlock(&stable.lock, "stats");
+  stable.next = 1;
+  devsw[STATS].read = statsread;
+}
@@ -0,0 +1,9 @@
+// Per-CPU event counters, as read from the stats device
+// (see stats.c): one struct statent per counter.
+
+struct statent {
+  char name[16];
+  int i;       // index in its set, e.g. the system call number
+  int n;       // counters in the set
+  uint count;  // events so far, summed over CPUs
+};
@@ -19,6 +19,11 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+  // Skip equal words, then find the differing byte.
+  while(n >= 4 && *(uint*)s1 == *(uint*)s2){
+    s1 += 4, s2 += 4;
+    n -= 4;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -37,13 +42,22 @@ memmove(void *dst, const void *src, uint n)
   s = src;
   d = dst;
   if(s < d && s + n > d){
+    // d overlaps the end of s: copy backwards,
+    // the odd bytes at the top first, then words.
+    // Not with std and rep movsl: an interrupt in
+    // between would run the kernel with DF set.
     s += n;
     d += n;
-    while(n-- > 0)
+    for(; n % 4; n--)
       *--d = *--s;
-  } else
-    while(n-- > 0)
-      *d++ = *s++;
+    for(; n > 0; n -= 4){
+      s -= 4, d -= 4;
+      *(uint*)d = *(const uint*)s;
+    }
+  } else {
+    movsl(d, s, n/4);
+    movsb(d + (n & ~3), s + (n & ~3), n % 4);
+  }
 
   return dst;
 }
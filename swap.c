@@ -0,0 +1,143 @@
+// Swap space: SWAPSIZE blocks after the file system on the root
+// disk (see mkfs.c), used as page-sized slots.
+//
+// When user memory runs out, swapout() takes pages that
+// swappick() chooses and writes each to a free slot.  The page's
+// PTE keeps its permissions but records the slot instead of the
+// page, with PTE_SWAP in place of PTE_P, and pagefault() calls
+// swapin() to read it back, and maps it.  fork() shares slots between parent
+// and child, so slots are reference counted.
+//
+// Slots are read and written through the buffer cache.  A slot
+// is busy until its page is on disk, and swapin() waits for
+// that, in case a process faults on the page meanwhile.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+
+#define BPP       (PGSIZE/BSIZE)  // blocks per slot
+#define NSLOT     (SWAPSIZE/BPP)
+#define SWAPBATCH 8               // pages swapout() writes
+
+static struct {
+  struct spinlock lock;
+  uint start;            // first block
+  int nslot;
+  ushort ref[NSLOT];     // swapped-out PTEs naming each slot
+  uchar busy[NSLOT];     // being written by swapout()
+} swap;
+
+#define SLOT(pte) (PTE_ADDR(pte) >> PTXSHIFT)
+
+// Find the swap area of dev.  An image without one has nswap 0.
+void
+swapinit(int dev)
+{
+  struct superblock sb;
+
+  initlock(&swap.lock, "swap");
+  readsb(dev, &sb);
+  swap.start = sb.swapstart;
+  swap.nslot = sb.nswap / BPP;
+  if(swap.nslot > NSLOT)
+    swap.nslot = NSLOT;
+}
+
+// Write up to SWAPBATCH pages out to swap to free their memory.
+// Returns how many.  The caller must not hold spinlocks.
+int
+swapout(void)
+{
+  char *mem;
+  struct buf *b;
+  int n, s, i;
+
+  for(n = 0; n < SWAPBATCH; n++){
+    acquire(&swap.lock);
+    for(s = 0; s < swap.nslot && (swap.ref[s] || swap.busy[s]); s++)
+      ;
+    if(s == swap.nslot){
+      release(&swap.lock);
+      break;
+    }
+    swap.ref[s] = 1;
+    swap.busy[s] = 1;
+    release(&swap.lock);
+
+    if((mem = swappick(s << PTXSHIFT | PTE_SWAP)) == 0){
+      acquire(&swap.lock);
+      swap.ref[s] = 0;
+      swap.busy[s] = 0;
+      release(&swap.lock);
+      break;
+    }
+    for(i = 0; i < BPP; i++){
+      b = bget(ROOTDEV, swap.start + s*BPP + i);
+      memmove(b->data, mem + i*BSIZE, BSIZE);
+      bwrite(b);
+      bdiscard(b);
+    }
+    kfree(mem);
+
+    acquire(&swap.lock);
+    swap.busy[s] = 0;
+    wakeup(&swap.busy[s]);
+    release(&swap.lock);
+  }
+  return n;
+}
+
+// Read the page that PTE_SWAP entry pte names into a new page
+// and return it, or 0 if out of memory.  The caller maps it and
+// calls swapfree(), unless another thread sharing the page
+// table did so meanwhile.
+char*
+swapin(pte_t pte)
+{
+  char *mem;
+  struct buf *b;
+  uint s;
+  int i;
+
+  s = SLOT(pte);
+  while((mem = kalloc()) == 0)
+    if(swapout() == 0)
+      return 0;
+
+  acquire(&swap.lock);
+  while(swap.busy[s])
+    sleep(&swap.busy[s], &swap.lock);
+  release(&swap.lock);
+  for(i = 0; i < BPP; i++){
+    b = bread(ROOTDEV, swap.start + s*BPP + i);
+    memmove(mem + i*BSIZE, b->data, BSIZE);
+    bdiscard(b);
+  }
+  return mem;
+}
+
+// Another PTE names the slot of PTE_SWAP entry pte.
+void
+swapdup(pte_t pte)
+{
+  acquire(&swap.lock);
+  swap.ref[SLOT(pte)]++;
+  release(&swap.lock);
+}
+
+// PTE_SWAP entry pte no longer names its slot.
+void
+swapfree(pte_t pte)
+{
+  acquire(&swap.lock);
+  if(swap.ref[SLOT(pte)]-- == 0)
+    panic("swapfree");
+  release(&swap.lock);
+}
@@ -6,8 +6,11 @@
 #include "proc.h"
 #include "x86.h"
 #include "syscall.h"
+#include "ring.h"
+#include "trace.h"
 
-// User code makes a system call with INT T_SYSCALL.
+// User code makes a system call with sysenter or INT T_SYSCALL,
+// or queues it in a ring for ringenter().
 // System call number in %eax.
 // Arguments on the stack, from the user call to the C
 // library system call function. The saved user %esp points
@@ -17,69 +20,120 @@
 int
 fetchint(uint addr, int *ip)
 {
-  struct proc *curproc = myproc();
+  uint end;
 
-  if(addr >= curproc->sz || addr+4 > curproc->sz)
+  end = uvmend(myproc(), addr);
+  if(end == 0 || end - addr < 4)
     return -1;
-  *ip = *(int*)(addr);
-  return 0;
+  return copyuser(ip, (void*)addr, sizeof(*ip));
 }
 
-// Fetch the nul-terminated string at addr from the current process.
-// Doesn't actually copy the string - just sets *pp to point at it.
-// Returns length of string, not including nul.
+// Copy the nul-terminated string at addr from the current process
+// into buf, at most max bytes with the nul.  Another thread may
+// change or unmap it meanwhile, so the kernel only uses the copy.
+// Returns length of string, not including nul, or -1.
 int
-fetchstr(uint addr, char **pp)
+fetchstr(uint addr, char *buf, int max)
 {
-  char *s, *ep;
-  struct proc *curproc = myproc();
+  char *s;
+  uint a, m, end;
 
-  if(addr >= curproc->sz)
-    return -1;
-  *pp = (char*)addr;
-  ep = (char*)curproc->sz;
-  for(s = *pp; s < ep; s++){
-    if(*s == 0)
-      return s - *pp;
+  for(a = addr; a - addr < max; a += m){
+    if(a < addr || (end = uvmend(myproc(), a)) == 0)
+      return -1;
+    // A page at a time: the string's pages are all mapped.
+    m = PGSIZE - a % PGSIZE;
+    if(m > max - (a - addr))
+      m = max - (a - addr);
+    if(m > end - a)
+      m = end - a;
+    if(copyuser(buf + (a - addr), (char*)a, m) < 0)
+      return -1;
+    for(s = buf + (a - addr); s < buf + (a - addr) + m; s++)
+      if(*s == 0)
+        return s - buf;
   }
   return -1;
 }
 
 // Fetch the nth 32-bit system call argument.
+// Batched calls take theirs from the ring, which
+// ringenter() has already checked.
 int
 argint(int n, int *ip)
 {
-  return fetchint((myproc()->tf->esp) + 4 + 4*n, ip);
+  struct proc *curproc = myproc();
+
+  if(curproc->sysargs){
+    if(n < 0 || n >= NELEM(((struct sqe*)0)->arg))
+      return -1;
+    *ip = curproc->sysargs[n];
+    return 0;
+  }
+  return fetchint((curproc->tf->esp) + 4 + 4*n, ip);
 }
 
 // Fetch the nth word-sized system call argument as a pointer
 // to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
+// lies within the process address space: its heap or mappings.
 int
 argptr(int n, char **pp, int size)
 {
   int i;
-  struct proc *curproc = myproc();
+  uint end;
  
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  end = uvmend(myproc(), (uint)i);
+  if(size < 0 || end == 0 || end - (uint)i < size)
     return -1;
   *pp = (char*)i;
   return 0;
 }
 
-// Fetch the nth word-sized system call argument as a string pointer.
-// Check that the pointer is valid and the string is nul-terminated.
-// (There is no shared writable memory, so the string can't change
-// between this check and being used by the kernel.)
+// Fetch the nth word-sized system call argument as a string pointer,
+// and copy the string into buf, at most max bytes with the nul.
+// Returns the string's length, or -1 if the pointer is bad or the
+// string doesn't fit.
 int
-argstr(int n, char **pp)
+argstr(int n, char *buf, int max)
 {
   int addr;
   if(argint(n, &addr) < 0)
     return -1;
-  return fetchstr(addr, pp);
+  return fetchstr(addr, buf, max);
+}
+
+// Keep the reference f until the current system call returns,
+// for argfd(): threads share the file table, so the descriptor
+// alone doesn't keep the file open.
+void
+callhold(struct file *f)
+{
+  struct proc *curproc = myproc();
+  int i;
+
+  for(i = 0; i < NELEM(curproc->callf); i++){
+    if(curproc->callf[i] == 0){
+      curproc->callf[i] = f;
+      return;
+    }
+  }
+  panic("callhold");
+}
+
+// Drop the references callhold() kept.
+static void
+callrelease(struct proc *p)
+{
+  int i;
+
+  for(i = 0; i < NELEM(p->callf); i++){
+    if(p->callf[i]){
+      fileclose(p->callf[i]);
+      p->callf[i] = 0;
+    }
+  }
 }
 
 extern int sys_chdir(void);
@@ -103,6 +157,28 @@ extern int sys_unlink(void);
 extern int sys_wait(void);
 extern int sys_write(void);
 extern int sys_uptime(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_splice(void);
+extern int sys_ringsetup(void);
+extern int sys_ringenter(void);
+extern int sys_lockstat(void);
+extern int sys_profile(void);
+extern int sys_ktrace(void);
+extern int sys_getrusage(void);
+extern int sys_nice(void);
+extern int sys_mount(void);
+extern int sys_readv(void);
+extern int sys_writev(void);
+extern int sys_pread(void);
+extern int sys_pwrite(void);
+extern int sys_fsync(void);
+extern int sys_sync(void);
+extern int sys_clone(void);
+extern int sys_join(void);
+extern int sys_futex_wait(void);
+extern int sys_futex_wake(void);
+extern int sys_poll(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -126,8 +202,115 @@ static int (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_splice]  sys_splice,
+[SYS_ringsetup] sys_ringsetup,
+[SYS_ringenter] sys_ringenter,
+[SYS_lockstat] sys_lockstat,
+[SYS_profile] sys_profile,
+[SYS_ktrace]  sys_ktrace,
+[SYS_getrusage] sys_getrusage,
+[SYS_nice]    sys_nice,
+[SYS_mount]   sys_mount,
+[SYS_readv]   sys_readv,
+[SYS_writev]  sys_writev,
+[SYS_pread]   sys_pread,
+[SYS_pwrite]  sys_pwrite,
+[SYS_fsync]   sys_fsync,
+[SYS_sync]    sys_sync,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_poll]    sys_poll,
 };
 
+static int sysstat;  // first of the per-call counters
+
+void
+syscallinit(void)
+{
+  sysstat = statalloc("syscall", NELEM(syscalls));
+}
+
+// Calls that may not be batched, because they change the
+// address space, the trap frame or the ring.
+static char nobatch[NELEM(syscalls)] = {
+[SYS_fork]    1,
+[SYS_clone]   1,
+[SYS_exit]    1,
+[SYS_exec]    1,
+[SYS_sbrk]    1,
+[SYS_mmap]    1,
+[SYS_munmap]  1,
+[SYS_ringsetup] 1,
+[SYS_ringenter] 1,
+};
+
+// Register the ring at addr for ringenter().
+int
+sys_ringsetup(void)
+{
+  char *r;
+
+  if(argptr(0, &r, sizeof(struct ring)) < 0 || (uint)r % 4 != 0)
+    return -1;
+  myproc()->ring = (struct ring*)r;
+  return 0;
+}
+
+// Run up to n queued calls, stopping early if the completion
+// queue fills.  Returns the number run, or -1.  The ring is
+// user memory, which a thread may change or unmap meanwhile:
+// each index and entry is copied in or out with copyuser(),
+// and calls take their arguments from the kernel's copy.
+int
+sys_ringenter(void)
+{
+  struct proc *curproc = myproc();
+  struct ring *r;
+  struct sqe e;
+  struct cqe c;
+  uint idx[4];  // sqhead, sqtail, cqhead, cqtail
+  uint end;
+  int n, i, num;
+
+  r = curproc->ring;
+  if(argint(0, &n) < 0 || r == 0)
+    return -1;
+  // sbrk() or munmap() may have taken it away since ringsetup().
+  end = uvmend(curproc, (uint)r);
+  if(end == 0 || end - (uint)r < sizeof(*r))
+    return -1;
+  for(i = 0; i < n; i++){
+    if(copyuser(idx, &r->sqhead, sizeof(idx)) < 0)
+      return -1;
+    if(idx[0] == idx[1] || idx[3] - idx[2] >= NRINGENT || curproc->killed)
+      break;
+    if(copyuser(&e, &r->sq[idx[0] % NRINGENT], sizeof(e)) < 0)
+      return -1;
+    num = e.num;
+    if(num > 0 && num < NELEM(syscalls) && syscalls[num] && !nobatch[num]){
+      statinc(sysstat + num);
+      curproc->sysargs = e.arg;
+      c.ret = syscalls[num]();
+      curproc->sysargs = 0;
+      callrelease(curproc);
+    } else
+      c.ret = -1;
+    c.tag = e.tag;
+    if(copyuser(&r->cq[idx[3] % NRINGENT], &c, sizeof(c)) < 0)
+      return -1;
+    idx[0]++;
+    idx[3]++;
+    if(copyuser(&r->cqtail, &idx[3], sizeof(idx[3])) < 0 ||
+       copyuser(&r->sqhead, &idx[0], sizeof(idx[0])) < 0)
+      return -1;
+  }
+  return i;
+}
+
 void
 syscall(void)
 {
@@ -136,7 +319,11 @@ syscall(void)
 
   num = curproc->tf->eax;
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
+    trace(TR_SYSCALL, num, 0);
+    statinc(sysstat + num);
     curproc->tf->eax = syscalls[num]();
+    callrelease(curproc);
+    trace(TR_SYSRET, num, curproc->tf->eax);
   } else {
     cprintf("%d %s: unknown sys call %d\n",
             curproc->pid, curproc->name, num);
@@ -20,3 +20,25 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_mmap   22
+#define SYS_munmap 23
+#define SYS_splice 24
+#define SYS_ringsetup 25
+#define SYS_ringenter 26
+#define SYS_lockstat 27
+#define SYS_profile 28
+#define SYS_ktrace 29
+#define SYS_getrusage 30
+#define SYS_nice   31
+#define SYS_mount  32
+#define SYS_readv  33
+#define SYS_writev 34
+#define SYS_pread  35
+#define SYS_pwrite 36
+#define SYS_fsync  37
+#define SYS_sync   38
+#define SYS_clone  39
+#define SYS_join   40
+#define SYS_futex_wait 41
+#define SYS_futex_wake 42
+#define SYS_poll   43
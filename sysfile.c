@@ -18,6 +18,8 @@
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
+// The file stays open until the system call returns, even if
+// another thread closes fd meanwhile.
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
@@ -26,8 +28,9 @@ argfd(int n, int *pfd, struct file **pf)
 
   if(argint(n, &fd) < 0)
     return -1;
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if((f = fdget(myproc()->fdt, fd)) == 0)
     return -1;
+  callhold(f);
   if(pfd)
     *pfd = fd;
   if(pf)
@@ -37,19 +40,15 @@ argfd(int n, int *pfd, struct file **pf)
 
 // Allocate a file descriptor for the given file.
 // Takes over file reference from caller on success.
+// Like argfd(), keeps the file open until the call returns.
 static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *curproc = myproc();
 
-  for(fd = 0; fd < NOFILE; fd++){
-    if(curproc->ofile[fd] == 0){
-      curproc->ofile[fd] = f;
-      return fd;
-    }
-  }
-  return -1;
+  if((fd = fdput(myproc()->fdt, f)) >= 0)
+    callhold(filedup(f));
+  return fd;
 }
 
 int
@@ -60,9 +59,10 @@ sys_dup(void)
 
   if(argfd(0, 0, &f) < 0)
     return -1;
-  if((fd=fdalloc(f)) < 0)
+  if((fd=fdalloc(filedup(f))) < 0){
+    fileclose(f);
     return -1;
-  filedup(f);
+  }
   return fd;
 }
 
@@ -90,6 +90,91 @@ sys_write(void)
   return filewrite(f, p, n);
 }
 
+// Fetch the buffer list of readv() and writev(), arguments 1
+// and 2, into iov[MAXIOV].  Check that each buffer lies within
+// the process address space.  Returns the number of buffers.
+static int
+argiov(struct iovec *iov)
+{
+  struct proc *curproc = myproc();
+  char *p;
+  int i, n;
+  uint b, len, tot, end;
+
+  if(argint(2, &n) < 0 || n < 0 || n > MAXIOV ||
+     argptr(1, &p, n*sizeof(*iov)) < 0)
+    return -1;
+  if(copyuser(iov, p, n*sizeof(*iov)) < 0)
+    return -1;
+  tot = 0;
+  for(i = 0; i < n; i++){
+    b = (uint)iov[i].iov_base;
+    len = iov[i].iov_len;
+    end = uvmend(curproc, b);
+    if(end == 0 || len > end - b || len > 0x7fffffff - tot)
+      return -1;
+    tot += len;
+  }
+  return n;
+}
+
+int
+sys_readv(void)
+{
+  struct file *f;
+  struct iovec iov[MAXIOV];
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || (n = argiov(iov)) < 0)
+    return -1;
+  return filereadv(f, iov, n, -1);
+}
+
+int
+sys_writev(void)
+{
+  struct file *f;
+  struct iovec iov[MAXIOV];
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || (n = argiov(iov)) < 0)
+    return -1;
+  return filewritev(f, iov, n, -1);
+}
+
+// Read at an offset, leaving the file's offset alone.
+int
+sys_pread(void)
+{
+  struct file *f;
+  struct iovec iov;
+  int n, off;
+  char *p;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0 ||
+     argint(3, &off) < 0 || off < 0)
+    return -1;
+  iov.iov_base = p;
+  iov.iov_len = n;
+  return filereadv(f, &iov, 1, off);
+}
+
+int
+sys_pwrite(void)
+{
+  struct file *f;
+  struct iovec iov;
+  int n, off;
+  char *p;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0 ||
+     argint(3, &off) < 0 || off < 0)
+    return -1;
+  iov.iov_base = p;
+  iov.iov_len = n;
+  return filewritev(f, &iov, 1, off);
+}
+
 int
 sys_close(void)
 {
@@ -98,7 +183,8 @@ sys_close(void)
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
+  if(fdclear(myproc()->fdt, fd, f) < 0)  // another thread closed it
+    return -1;
   fileclose(f);
   return 0;
 }
@@ -107,21 +193,23 @@ int
 sys_fstat(void)
 {
   struct file *f;
-  struct stat *st;
+  struct stat *st, kst;
 
   if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
     return -1;
-  return filestat(f, st);
+  if(filestat(f, &kst) < 0)
+    return -1;
+  return copyuser(st, &kst, sizeof(kst));
 }
 
 // Create the path new as a link to the same inode as old.
 int
 sys_link(void)
 {
-  char name[DIRSIZ], *new, *old;
+  char name[DIRSIZ], new[MAXPATH], old[MAXPATH];
   struct inode *dp, *ip;
 
-  if(argstr(0, &old) < 0 || argstr(1, &new) < 0)
+  if(argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
     return -1;
 
   begin_op();
@@ -186,10 +274,10 @@ sys_unlink(void)
 {
   struct inode *ip, *dp;
   struct dirent de;
-  char name[DIRSIZ], *path;
+  char name[DIRSIZ], path[MAXPATH];
   uint off;
 
-  if(argstr(0, &path) < 0)
+  if(argstr(0, path, MAXPATH) < 0)
     return -1;
 
   begin_op();
@@ -210,7 +298,7 @@ sys_unlink(void)
 
   if(ip->nlink < 1)
     panic("unlink: nlink < 1");
-  if(ip->type == T_DIR && !isdirempty(ip)){
+  if(ip->type == T_DIR && (!isdirempty(ip) || mounted(ip))){
     iunlockput(ip);
     goto bad;
   }
@@ -218,6 +306,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcenter(dp->dev, dp->inum, name, 0, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -271,26 +360,39 @@ create(char *path, short type, short major, short minor)
     iupdate(dp);
     // No ip->nlink++ for ".": avoid cyclic ref count.
     if(dirlink(ip, ".", ip->inum) < 0 || dirlink(ip, "..", dp->inum) < 0)
-      panic("create dots");
+      goto full;
   }
 
   if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+    goto full;
 
   iunlockput(dp);
 
   return ip;
+
+full:
+  // The disk has no block for a directory entry: drop ip
+  // again, which iput() frees.
+  if(type == T_DIR){
+    dp->nlink--;
+    iupdate(dp);
+  }
+  ip->nlink = 0;
+  iupdate(ip);
+  iunlockput(ip);
+  iunlockput(dp);
+  return 0;
 }
 
 int
 sys_open(void)
 {
-  char *path;
+  char path[MAXPATH];
   int fd, omode;
   struct file *f;
   struct inode *ip;
 
-  if(argstr(0, &path) < 0 || argint(1, &omode) < 0)
+  if(argstr(0, path, MAXPATH) < 0 || argint(1, &omode) < 0)
     return -1;
 
   begin_op();
@@ -307,39 +409,90 @@ sys_open(void)
       return -1;
     }
     ilock(ip);
-    if(ip->type == T_DIR && omode != O_RDONLY){
+    if(ip->type == T_DIR && (omode & (O_WRONLY|O_RDWR))){
       iunlockput(ip);
       end_op();
       return -1;
     }
   }
 
-  if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
-    if(f)
-      fileclose(f);
+  if((f = filealloc()) == 0){
     iunlockput(ip);
     end_op();
     return -1;
   }
-  iunlock(ip);
-  end_op();
-
+  // Set f up before fdalloc() lets other threads at it.
   f->type = FD_INODE;
   f->ip = ip;
   f->off = 0;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  f->direct = (omode & O_DIRECT) != 0;
+  fd = fdalloc(f);
+  iunlock(ip);
+  end_op();
+  if(fd < 0)
+    fileclose(f);
   return fd;
 }
 
+int
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filesync(f);
+}
+
+int
+sys_sync(void)
+{
+  log_sync();
+  return 0;
+}
+
+// poll(fds, nfds, timeout): timeout is in ticks, as for
+// sleep(), or negative to wait as long as it takes.
+int
+sys_poll(void)
+{
+  struct pollfd *ufds, fds[NPOLL];
+  struct file *f[NPOLL];
+  int nfds, timeout, i, fd, r;
+
+  if(argint(1, &nfds) < 0 || nfds < 0 || nfds > NPOLL ||
+     argptr(0, (void*)&ufds, nfds*sizeof(*ufds)) < 0 ||
+     argint(2, &timeout) < 0)
+    return -1;
+  if(copyuser(fds, ufds, nfds*sizeof(*ufds)) < 0)
+    return -1;
+  for(i = 0; i < nfds; i++){
+    fd = fds[i].fd;
+    f[i] = 0;
+    // Hold a reference, in case another thread closes fd.
+    f[i] = fdget(myproc()->fdt, fd);
+  }
+  r = poll(f, fds, nfds, timeout);
+  for(i = 0; i < nfds; i++)
+    if(f[i])
+      fileclose(f[i]);
+  if(copyuser(ufds, fds, nfds*sizeof(*ufds)) < 0)
+    return -1;
+  return r;
+}
+
 int
 sys_mkdir(void)
 {
-  char *path;
+  char path[MAXPATH];
   struct inode *ip;
 
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
   begin_op();
-  if(argstr(0, &path) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
+  if((ip = create(path, T_DIR, 0, 0)) == 0){
     end_op();
     return -1;
   }
@@ -352,14 +505,15 @@ int
 sys_mknod(void)
 {
   struct inode *ip;
-  char *path;
+  char path[MAXPATH];
   int major, minor;
 
-  begin_op();
-  if((argstr(0, &path)) < 0 ||
+  if(argstr(0, path, MAXPATH) < 0 ||
      argint(1, &major) < 0 ||
-     argint(2, &minor) < 0 ||
-     (ip = create(path, T_DEV, major, minor)) == 0){
+     argint(2, &minor) < 0)
+    return -1;
+  begin_op();
+  if((ip = create(path, T_DEV, major, minor)) == 0){
     end_op();
     return -1;
   }
@@ -371,12 +525,14 @@ sys_mknod(void)
 int
 sys_chdir(void)
 {
-  char *path;
+  char path[MAXPATH];
   struct inode *ip;
   struct proc *curproc = myproc();
   
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
   begin_op();
-  if(argstr(0, &path) < 0 || (ip = namei(path)) == 0){
+  if((ip = namei(path)) == 0){
     end_op();
     return -1;
   }
@@ -393,36 +549,71 @@ sys_chdir(void)
   return 0;
 }
 
+// Mount the file system on block device dev at a directory.
+int
+sys_mount(void)
+{
+  char path[MAXPATH];
+  int dev, r;
+  struct inode *ip;
+
+  if(argstr(0, path, MAXPATH) < 0 || argint(1, &dev) < 0 || dev < 0)
+    return -1;
+  begin_op();
+  if((ip = namei(path)) == 0){
+    end_op();
+    return -1;
+  }
+  ilock(ip);
+  r = mount(ip, dev);
+  iunlockput(ip);
+  end_op();
+  return r;
+}
+
 int
 sys_exec(void)
 {
-  char *path, *argv[MAXARG];
-  int i;
+  char path[MAXPATH], *argv[MAXARG], *args;
+  int i, n, m, r;
   uint uargv, uarg;
 
-  if(argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0){
+  if(argstr(0, path, MAXPATH) < 0 || argint(1, (int*)&uargv) < 0){
     return -1;
   }
+  // The strings go on one page; exec() copies them onto
+  // the new stack's, so they couldn't take more anyway.
+  if((args = kalloc()) == 0)
+    return -1;
   memset(argv, 0, sizeof(argv));
+  n = 0;
   for(i=0;; i++){
     if(i >= NELEM(argv))
-      return -1;
+      goto bad;
     if(fetchint(uargv+4*i, (int*)&uarg) < 0)
-      return -1;
+      goto bad;
     if(uarg == 0){
       argv[i] = 0;
       break;
     }
-    if(fetchstr(uarg, &argv[i]) < 0)
-      return -1;
+    argv[i] = args + n;
+    if((m = fetchstr(uarg, argv[i], PGSIZE - n)) < 0)
+      goto bad;
+    n += m + 1;
   }
-  return exec(path, argv);
+  r = exec(path, argv);
+  kfree(args);
+  return r;
+
+bad:
+  kfree(args);
+  return -1;
 }
 
 int
 sys_pipe(void)
 {
-  int *fd;
+  int *fd, fdk[2];
   struct file *rf, *wf;
   int fd0, fd1;
 
@@ -432,13 +623,62 @@ sys_pipe(void)
     return -1;
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
-    if(fd0 >= 0)
-      myproc()->ofile[fd0] = 0;
-    fileclose(rf);
+    if(fd0 < 0 || fdclear(myproc()->fdt, fd0, rf) == 0)
+      fileclose(rf);
     fileclose(wf);
     return -1;
   }
-  fd[0] = fd0;
-  fd[1] = fd1;
+  fdk[0] = fd0;
+  fdk[1] = fd1;
+  if(copyuser(fd, fdk, sizeof(fdk)) < 0){
+    // Unless another thread has closed them already.
+    if(fdclear(myproc()->fdt, fd0, rf) == 0)
+      fileclose(rf);
+    if(fdclear(myproc()->fdt, fd1, wf) == 0)
+      fileclose(wf);
+    return -1;
+  }
   return 0;
 }
+
+int
+sys_mmap(void)
+{
+  int addr, len, prot, flags, off;
+  struct file *f;
+
+  // The address hint (argument 0) is ignored.
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argint(5, &off) < 0 || len <= 0 || off < 0)
+    return -1;
+  if(flags & MAP_ANON)
+    return mmap(len, prot, flags, 0, 0);
+  if(argfd(4, 0, &f) < 0 || f->type != FD_INODE || f->ip->type != T_FILE)
+    return -1;
+  if(!f->readable)
+    return -1;
+  if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+  return mmap(len, prot, flags, f->ip, off);
+}
+
+int
+sys_munmap(void)
+{
+  int addr, len;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || len <= 0)
+    return -1;
+  return munmap(addr, len);
+}
+
+int
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0 || argint(2, &n) < 0)
+    return -1;
+  return filesplice(in, out, n);
+}
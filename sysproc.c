@@ -6,6 +6,11 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "lockstat.h"
+#include "prof.h"
+#include "trace.h"
+#include "spinlock.h"
+#include "rwlock.h"
 
 int
 sys_fork(void)
@@ -26,6 +31,54 @@ sys_wait(void)
   return wait();
 }
 
+int
+sys_clone(void)
+{
+  int fn, arg;
+  char *stack;
+
+  if(argint(0, &fn) < 0 || argint(1, &arg) < 0 ||
+     argptr(2, &stack, PGSIZE) < 0)
+    return -1;
+  return clone(fn, arg, (uint)stack);
+}
+
+int
+sys_join(void)
+{
+  char *p;
+  uint stack;
+  int pid;
+
+  if(argptr(0, &p, sizeof(uint)) < 0)
+    return -1;
+  if((pid = join(&stack)) >= 0 && copyuser(p, &stack, sizeof(stack)) < 0)
+    return -1;
+  return pid;
+}
+
+int
+sys_futex_wait(void)
+{
+  int addr, val;
+
+  // futexkey() checks that addr is mapped user memory.
+  if(argint(0, &addr) < 0 || addr % sizeof(int) != 0 || argint(1, &val) < 0)
+    return -1;
+  return futexwait(addr, val);
+}
+
+int
+sys_futex_wake(void)
+{
+  int addr, n;
+
+  // futexkey() checks that addr is mapped user memory.
+  if(argint(0, &addr) < 0 || addr % sizeof(int) != 0 || argint(1, &n) < 0)
+    return -1;
+  return futexwake(addr, n);
+}
+
 int
 sys_kill(void)
 {
@@ -42,6 +95,16 @@ sys_getpid(void)
   return myproc()->pid;
 }
 
+int
+sys_nice(void)
+{
+  int incr;
+
+  if(argint(0, &incr) < 0)
+    return -1;
+  return nice(incr);
+}
+
 int
 sys_sbrk(void)
 {
@@ -50,8 +113,9 @@ sys_sbrk(void)
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
+  // growproc() returns the old size, which a sibling
+  // thread's sbrk() may have changed since we could look.
+  if((addr = growproc(n)) < 0)
     return -1;
   return addr;
 }
@@ -60,21 +124,10 @@ int
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
-  if(argint(0, &n) < 0)
+  if(argint(0, &n) < 0 || n < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  return sleepticks(n);
 }
 
 // return how many clock tick interrupts have occurred
@@ -82,10 +135,80 @@ sys_sleep(void)
 int
 sys_uptime(void)
 {
-  uint xticks;
+  uint xticks, s;
 
-  acquire(&tickslock);
-  xticks = ticks;
-  release(&tickslock);
+  do {
+    s = seqbegin(&tickseq);
+    xticks = ticks;
+  } while(seqretry(&tickseq, s));
   return xticks;
 }
+
+// Copy lock statistics into an array of n struct lockstat,
+// or reset them if the array is 0.
+int
+sys_lockstat(void)
+{
+  char *st;
+  int n;
+
+  if(argint(0, (int*)&st) < 0 || argint(1, &n) < 0 ||
+     n < 0 || n > NLOCKCLASS)  // else n*sizeof(struct lockstat) could wrap
+    return -1;
+  if(st == 0)
+    return lockstatread(0, 0);
+  if(argptr(0, &st, n*sizeof(struct lockstat)) < 0)
+    return -1;
+  return lockstatread((struct lockstat*)st, n);
+}
+
+// Copy the resources used by this process, or by its
+// waited-for children, to a struct rusage.
+int
+sys_getrusage(void)
+{
+  struct rusage *ru;
+  int who;
+
+  if(argint(0, &who) < 0 || argptr(1, (char**)&ru, sizeof(*ru)) < 0)
+    return -1;
+  if(who == RUSAGE_SELF)
+    return copyuser(ru, &myproc()->ru, sizeof(*ru));
+  if(who == RUSAGE_CHILDREN)
+    return copyuser(ru, &myproc()->cru, sizeof(*ru));
+  return -1;
+}
+
+// Control the sampling profiler; see prof.h.
+int
+sys_profile(void)
+{
+  char *s;
+  int cmd, n;
+
+  s = 0;
+  if(argint(0, &cmd) < 0 || argint(2, &n) < 0 || n < 0)
+    return -1;
+  if(n > NCPU*NPROFSAMP)  // all the rings hold; and n*sizeof can't wrap
+    n = NCPU*NPROFSAMP;
+  if(cmd == PROF_READ && argptr(1, &s, n*sizeof(struct profsample)) < 0)
+    return -1;
+  return profile(cmd, (struct profsample*)s, n);
+}
+
+// Control event tracing; see trace.h.
+int
+sys_ktrace(void)
+{
+  char *r;
+  int cmd, n;
+
+  r = 0;
+  if(argint(0, &cmd) < 0 || argint(2, &n) < 0 || n < 0)
+    return -1;
+  if(n > NCPU*NTRACEREC)  // all the rings hold; and n*sizeof can't wrap
+    n = NCPU*NTRACEREC;
+  if(cmd == TRACE_READ && argptr(1, &r, n*sizeof(struct tracerec)) < 0)
+    return -1;
+  return ktrace(cmd, (struct tracerec*)r, n);
+}
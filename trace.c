@@ -0,0 +1,55 @@
+// Kernel event tracing.
+//
+// trace() appends a timestamped record to the current CPU's
+// ring (see cpuring.c).
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "cpuring.h"
+#include "trace.h"
+
+static struct tracerec rec[NCPU][NTRACEREC];
+static struct cpuring tracering;
+
+void
+traceinit(void)
+{
+  cpuringinit(&tracering, "trace", rec, sizeof(rec[0][0]), NTRACEREC);
+}
+
+// Record event ev with arguments a and b.
+void
+trace(int ev, uint a, uint b)
+{
+  struct tracerec *r;
+  struct cpu *c;
+
+  if(!tracering.on)
+    return;
+  pushcli();
+  if((r = cpuringput(&tracering)) == 0){
+    popcli();
+    return;
+  }
+  c = mycpu();
+  r->tsc = rdtsc();
+  r->ev = ev;
+  r->cpu = c - cpus;
+  r->pid = c->proc ? c->proc->pid : 0;
+  r->a = a;
+  r->b = b;
+  cpuringpush(&tracering);
+  popcli();
+}
+
+int
+ktrace(int cmd, struct tracerec *r, int n)
+{
+  return cpuringctl(&tracering, cmd, (char*)r, n);
+}
@@ -0,0 +1,31 @@
+// Kernel event tracing: records as returned by ktrace().
+
+#define NTRACEREC 1024  // records kept per cpu; must be a power of 2
+
+// Events, and what a and b hold.
+#define TR_SYSCALL   1  // syscall entry: number
+#define TR_SYSRET    2  // syscall exit: number, return value
+#define TR_SWITCH    3  // scheduler runs pid
+#define TR_SWITCHOUT 4  // pid gave up the cpu: new state
+#define TR_BREAD     5  // bread: block, 1 if it was cached
+#define TR_BWRITE    6  // bwrite or bawrite: block
+#define TR_DISKSTART 7  // iderw queued: block, 1 for a write
+#define TR_DISKDONE  8  // disk finished: block, 1 for a write
+#define TR_BEGINOP   9  // begin_op admitted: outstanding ops
+#define TR_ENDOP    10  // end_op: outstanding ops left
+#define TR_KALLOC   11  // kalloc: page
+#define TR_KFREE    12  // kfree: page
+
+// ktrace() commands
+#define TRACE_STOP  0  // stop tracing; returns records lost
+#define TRACE_START 1  // discard old records and start tracing
+#define TRACE_READ  2  // drain records; -1 once stopped and drained
+
+struct tracerec {
+  uint64 tsc;         // rdtsc() when it happened
+  uchar ev;           // TR_*
+  uchar cpu;
+  ushort pad;
+  int pid;            // current process, or 0
+  uint a, b;
+};
@@ -6,13 +6,18 @@
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
+#include "vdso.h"
 #include "spinlock.h"
+#include "rwlock.h"
 
 // Interrupt descriptor table (shared by all CPUs).
 struct gatedesc idt[256];
 extern uint vectors[];  // in vectors.S: array of 256 entry pointers
 struct spinlock tickslock;
 uint ticks;
+struct seqlock tickseq;  // lets readers of ticks skip tickslock
+static struct proc *timerq;  // processes in sleepticks(), soonest first
+static int faultstat;  // stats.c counter of page faults
 
 void
 tvinit(void)
@@ -24,6 +29,8 @@ tvinit(void)
   SETGATE(idt[T_SYSCALL], 1, SEG_KCODE<<3, vectors[T_SYSCALL], DPL_USER);
 
   initlock(&tickslock, "time");
+  faultstat = statalloc("pagefault", 1);
+  seqinit(&tickseq);
 }
 
 void
@@ -32,34 +39,166 @@ idtinit(void)
   lidt(idt, sizeof(idt));
 }
 
+// Bring ticks up to date with the clock.
+// Caller must hold tickslock.
+static void
+clockupdate(void)
+{
+  uint t;
+
+  t = lapicticks();
+  if((int)(t - ticks) > 0){
+    seqwrite(&tickseq);
+    ticks = t;
+    vdso->ticks = t;
+    seqwritedone(&tickseq);
+  }
+}
+
+// Wake the processes in sleepticks() whose time has come.
+// Returns the ticks until the next is due, or 0 if none waits.
+uint
+timerexpire(void)
+{
+  struct proc *p;
+  uint n;
+
+  acquire(&tickslock);
+  clockupdate();
+  while((p = timerq) != 0 && (int)(ticks - p->wakeat) >= 0){
+    timerq = p->tnext;
+    p->tnext = 0;
+    wakeup(&p->wakeat);
+  }
+  n = timerq ? timerq->wakeat - ticks : 0;
+  release(&tickslock);
+  return n;
+}
+
+static void
+timerdel(struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = &timerq; *pp; pp = &(*pp)->tnext){
+    if(*pp == p){
+      *pp = p->tnext;
+      p->tnext = 0;
+      return;
+    }
+  }
+}
+
+// Queue p to be woken n ticks from now.
+// Caller must hold tickslock.
+static void
+timeradd(struct proc *p, uint n)
+{
+  struct proc **pp;
+
+  clockupdate();
+  p->wakeat = ticks + n;
+  for(pp = &timerq; *pp && (int)((*pp)->wakeat - p->wakeat) <= 0;
+      pp = &(*pp)->tnext)
+    ;
+  p->tnext = *pp;
+  *pp = p;
+}
+
+// Arrange for wakeup(&myproc()->wakeat) in n ticks,
+// unless timercancel() is called first.
+void
+timerset(uint n)
+{
+  acquire(&tickslock);
+  timeradd(myproc(), n);
+  release(&tickslock);
+}
+
+void
+timercancel(void)
+{
+  acquire(&tickslock);
+  timerdel(myproc());
+  release(&tickslock);
+}
+
+// Sleep for n ticks.  Returns -1 if killed meanwhile.
+int
+sleepticks(uint n)
+{
+  struct proc *p = myproc();
+
+  acquire(&tickslock);
+  timeradd(p, n);
+  while((int)(ticks - p->wakeat) < 0){
+    if(p->killed){
+      timerdel(p);
+      release(&tickslock);
+      return -1;
+    }
+    sleep(&p->wakeat, &tickslock);
+  }
+  timerdel(p);
+  release(&tickslock);
+  return 0;
+}
+
+// System call, from int $T_SYSCALL by way of trap(),
+// or directly from sysentry in trapasm.S.
+void
+systrap(struct trapframe *tf)
+{
+  if(myproc()->killed)
+    exit();
+  myproc()->tf = tf;
+  syscall();
+  if(myproc()->killed)
+    exit();
+}
+
 //PAGEBREAK: 41
 void
 trap(struct trapframe *tf)
 {
   if(tf->trapno == T_SYSCALL){
-    if(myproc()->killed)
-      exit();
-    myproc()->tf = tf;
-    syscall();
-    if(myproc()->killed)
-      exit();
+    systrap(tf);
+    return;
+  }
+  if(tf->trapno == T_DEBUG && (tf->cs&3) == 0 &&
+     tf->eip >= (uint)sysentry && tf->eip <= (uint)sysentryflags){
+    // A single step into sysenter by a user with TF set,
+    // on the entry stack, which has room for little more.
+    tf->eflags &= ~FL_TF;
     return;
   }
 
   switch(tf->trapno){
   case T_IRQ0 + IRQ_TIMER:
-    if(cpuid() == 0){
-      acquire(&tickslock);
-      ticks++;
-      wakeup(&ticks);
-      release(&tickslock);
+    profsample(tf);
+    if(myproc()){
+      if((tf->cs&3) == DPL_USER)
+        myproc()->ru.utime++;
+      else
+        myproc()->ru.stime++;
     }
+    timerexpire();
+    // Another quantum if running a process; an idle
+    // CPU arms the timer itself, in the scheduler.
+    if(myproc())
+      lapictimer(1);
     lapiceoi();
     break;
-  case T_IRQ0 + IRQ_IDE:
-    ideintr();
+  case T_IRQ0 + IRQ_WAKE:
     lapiceoi();
     break;
+  case T_IRQ0 + IRQ_TLB:
+    tlbintr();
+    lapiceoi();
+    break;
+  case T_DEVICE:
+    fpufault();
+    break;
   case T_IRQ0 + IRQ_IDE+1:
     // Bochs generates spurious IDE1 interrupts.
     break;
@@ -78,8 +217,30 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_PGFLT:
+    // The kernel also faults when it touches user memory that
+    // is not yet there or copy-on-write, e.g. in readi().
+    statinc(faultstat);
+    if(myproc() && pagefault(myproc(), rcr2(), tf->err) == 0)
+      break;
+    if(myproc() && (tf->cs&3) == 0 && rcr2() < KERNBASE &&
+       myproc()->onfault){
+      // A copyuser() the fault can't be satisfied for:
+      // fail the copy, and the process when it returns.
+      myproc()->killed = 1;
+      tf->eip = myproc()->onfault;
+      break;
+    }
+    // fall through
+
   //PAGEBREAK: 13
   default:
+    // The disk's IRQ depends on which driver is linked in.
+    if(tf->trapno == T_IRQ0 + ideirq){
+      ideintr();
+      lapiceoi();
+      break;
+    }
     if(myproc() == 0 || (tf->cs&3) == 0){
       // In kernel, it must be our mistake.
       cprintf("unexpected trap %d from cpu %d eip %x (cr2=0x%x)\n",
@@ -103,7 +264,7 @@ trap(struct trapframe *tf)
   // Force process to give up CPU on clock tick.
   // If interrupts were on while locks held, would need to check nlock.
   if(myproc() && myproc()->state == RUNNING &&
-     tf->trapno == T_IRQ0+IRQ_TIMER)
+     tf->trapno == T_IRQ0+IRQ_TIMER && schedtick())
     yield();
 
   // Check if the process has been killed since we yielded
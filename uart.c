@@ -1,4 +1,9 @@
 // Intel 8250 serial port (UART).
+//
+// Output goes into a ring buffer, which uartstart() feeds to the
+// transmit FIFO whenever it has room; the transmit-holding-register
+// empty interrupt calls it again as the FIFO drains.  So writers
+// don't wait for the line unless the ring is full.
 
 #include "types.h"
 #include "defs.h"
@@ -13,16 +18,32 @@
 #include "x86.h"
 
 #define COM1    0x3f8
+#define IIR     2       // interrupt identification register
+#define IIR_NONE 0x01   //   no interrupt pending
+#define LSR     5       // line status register
+#define LSR_RX  0x01    //   receive data ready
+#define LSR_TX  0x20    //   transmit FIFO empty
+#define TXFIFO  16
+#define TXBUF   1024    // power of 2
 
 static int uart;    // is there a uart?
 
+static struct {
+  struct spinlock lock;
+  char buf[TXBUF];
+  uint r;   // bytes sent to the UART
+  uint w;   // bytes put in buf
+} tx;
+
 void
 uartinit(void)
 {
   char *p;
 
-  // Turn off the FIFO
-  outb(COM1+2, 0);
+  initlock(&tx.lock, "uart");
+
+  // Turn on and clear the FIFOs; interrupt on each received byte.
+  outb(COM1+2, 0x07);
 
   // 9600 baud, 8 data bits, 1 stop bit, parity off.
   outb(COM1+3, 0x80);    // Unlock divisor
@@ -30,7 +51,7 @@ uartinit(void)
   outb(COM1+1, 0);
   outb(COM1+3, 0x03);    // Lock divisor, 8 data bits.
   outb(COM1+4, 0);
-  outb(COM1+1, 0x01);    // Enable receive interrupts.
+  outb(COM1+1, 0x03);    // Enable receive and transmit interrupts.
 
   // If status is 0xFF, no serial port.
   if(inb(COM1+5) == 0xFF)
@@ -48,16 +69,60 @@ uartinit(void)
     uartputc(*p);
 }
 
+// If the transmit FIFO is empty, refill it from the ring.
+// Caller holds tx.lock.
+static void
+uartstart(void)
+{
+  int i;
+
+  if(tx.r == tx.w || !(inb(COM1+LSR) & LSR_TX))
+    return;
+  for(i = 0; i < TXFIFO && tx.r != tx.w; i++)
+    outb(COM1+0, tx.buf[tx.r++ % TXBUF]);
+}
+
 void
-uartputc(int c)
+uartwrite(char *s, int n)
 {
   int i;
 
   if(!uart)
     return;
-  for(i = 0; i < 128 && !(inb(COM1+5) & 0x20); i++)
-    microdelay(10);
-  outb(COM1+0, c);
+  acquire(&tx.lock);
+  for(i = 0; i < n; i++){
+    while(tx.w == tx.r + TXBUF){
+      // Full: wait for the line, as there may be no interrupt
+      // to come (e.g. this CPU is printing with them off).
+      uartstart();
+      pause();
+    }
+    tx.buf[tx.w++ % TXBUF] = s[i];
+  }
+  uartstart();
+  release(&tx.lock);
+}
+
+void
+uartputc(int c)
+{
+  char ch;
+
+  ch = c;
+  uartwrite(&ch, 1);
+}
+
+// Send whatever is buffered, waiting for the line.  For panic(),
+// which can't count on interrupts or on tx.lock being free.
+void
+uartflush(void)
+{
+  if(!uart)
+    return;
+  while(tx.r != tx.w){
+    uartstart();
+    pause();
+  }
 }
 
 static int
@@ -65,13 +130,22 @@ uartgetc(void)
 {
   if(!uart)
     return -1;
-  if(!(inb(COM1+5) & 0x01))
+  if(!(inb(COM1+LSR) & LSR_RX))
     return -1;
   return inb(COM1+0);
 }
 
+// Serve causes until IIR shows none left: the IRQ is edge
+// triggered, so one left pending would never interrupt again.
+// Reading IIR acknowledges a transmit interrupt, reading the
+// data a receive one.
 void
 uartintr(void)
 {
-  consoleintr(uartgetc);
+  while(!(inb(COM1+IIR) & IIR_NONE)){
+    consoleintr(uartgetc);
+    acquire(&tx.lock);
+    uartstart();
+    release(&tx.lock);
+  }
 }
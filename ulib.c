@@ -3,6 +3,9 @@
 #include "fcntl.h"
 #include "user.h"
 #include "x86.h"
+#include "param.h"
+#include "vdso.h"
+#include "prof.h"
 
 char*
 strcpy(char *s, const char *t)
@@ -33,13 +36,81 @@ strlen(const char *s)
   return n;
 }
 
+// Moves of at least SSEMIN bytes use SSE2, if the CPU has it
+// (see vdso.h).  That is only worth the trap that turns the FPU
+// on for the process (see the kernel's fpu.c) for big moves.
+// User programs are compiled without SSE, so the xmm registers
+// need not be saved around these.
+#define SSEMIN 1024
+
+static int
+havesse2(void)
+{
+  return ((struct vdso*)VDSO)->hwcap & HWCAP_SSE2;
+}
+
+// Copy n bytes, a multiple of 64, forwards, 64 at a time.
+static void
+ssecopy(char *d, const char *s, uint n)
+{
+  for(; n > 0; n -= 64, d += 64, s += 64)
+    asm volatile("movdqu (%1), %%xmm0\n\t"
+                 "movdqu 16(%1), %%xmm1\n\t"
+                 "movdqu 32(%1), %%xmm2\n\t"
+                 "movdqu 48(%1), %%xmm3\n\t"
+                 "movdqu %%xmm0, (%0)\n\t"
+                 "movdqu %%xmm1, 16(%0)\n\t"
+                 "movdqu %%xmm2, 32(%0)\n\t"
+                 "movdqu %%xmm3, 48(%0)"
+                 : : "r" (d), "r" (s) : "memory");
+}
+
+// Fill n bytes, a multiple of 64, with the 16 bytes at pat.
+static void
+ssefill(char *d, const void *pat, uint n)
+{
+  asm volatile("movdqu (%0), %%xmm0" : : "r" (pat) : "memory");
+  for(; n > 0; n -= 64, d += 64)
+    asm volatile("movdqu %%xmm0, (%0)\n\t"
+                 "movdqu %%xmm0, 16(%0)\n\t"
+                 "movdqu %%xmm0, 32(%0)\n\t"
+                 "movdqu %%xmm0, 48(%0)"
+                 : : "r" (d) : "memory");
+}
+
 void*
 memset(void *dst, int c, uint n)
 {
-  stosb(dst, c, n);
+  uint pat[4], m;
+
+  if(n >= SSEMIN && havesse2()){
+    c &= 0xFF;
+    pat[0] = pat[1] = pat[2] = pat[3] = (c<<24)|(c<<16)|(c<<8)|c;
+    m = n & ~63;
+    ssefill(dst, pat, m);
+    stosb((char*)dst + m, c, n - m);
+  } else
+    stosb(dst, c, n);
   return dst;
 }
 
+int
+memcmp(const void *v1, const void *v2, uint n)
+{
+  const uchar *s1, *s2;
+
+  s1 = v1;
+  s2 = v2;
+  while(n >= 4 && *(uint*)s1 == *(uint*)s2){
+    s1 += 4, s2 += 4;
+    n -= 4;
+  }
+  for(; n > 0; n--, s1++, s2++)
+    if(*s1 != *s2)
+      return *s1 - *s2;
+  return 0;
+}
+
 char*
 strchr(const char *s, char c)
 {
@@ -49,16 +120,106 @@ strchr(const char *s, char c)
   return 0;
 }
 
+// Output is buffered per fd, and written when a buffer fills,
+// at a newline, and before the process reads with gets(),
+// closes the fd, forks, execs or exits.
+#define NOUTBUF   16    // fds buffered; as the kernel's NOFILE
+#define OUTBUFSZ  512
+
+static struct {
+  int n;
+  char buf[OUTBUFSZ];
+} outbuf[NOUTBUF];
+
+// Write out fd's buffered output, or every fd's if fd is -1.
+void
+fflush(int fd)
+{
+  int i;
+
+  if(fd == -1){
+    for(i = 0; i < NOUTBUF; i++)
+      fflush(i);
+    return;
+  }
+  if(fd < 0 || fd >= NOUTBUF || outbuf[fd].n == 0)
+    return;
+  write(fd, outbuf[fd].buf, outbuf[fd].n);
+  outbuf[fd].n = 0;
+}
+
+// Write c to fd through its buffer.
+void
+putc(int fd, char c)
+{
+  if(fd < 0 || fd >= NOUTBUF){
+    write(fd, &c, 1);
+    return;
+  }
+  outbuf[fd].buf[outbuf[fd].n++] = c;
+  if(c == '\n' || outbuf[fd].n == OUTBUFSZ)
+    fflush(fd);
+}
+
+static int mypid;  // getpid(), once known
+static int threaded;  // thread_create() has been called
+
+int
+fork(void)
+{
+  int pid;
+
+  fflush(-1);  // else the child would write it too
+  if((pid = _fork()) == 0)
+    mypid = 0;
+  return pid;
+}
+
+int
+exit(void)
+{
+  fflush(-1);
+  _exit();
+}
+
+int
+close(int fd)
+{
+  fflush(fd);
+  return _close(fd);
+}
+
+int
+exec(char *path, char **argv)
+{
+  fflush(-1);
+  return _exec(path, argv);
+}
+
+// gets() reads standard input a buffer at a time, so programs
+// using it should not also read fd 0 with read().
+static struct {
+  int n, i;
+  char buf[512];
+} inbuf;
+
 char*
 gets(char *buf, int max)
 {
-  int i, cc;
+  int i;
   char c;
 
+  fflush(-1);  // e.g. a prompt
   for(i=0; i+1 < max; ){
-    cc = read(0, &c, 1);
-    if(cc < 1)
-      break;
+    if(inbuf.i == inbuf.n){
+      inbuf.i = 0;
+      inbuf.n = read(0, inbuf.buf, sizeof(inbuf.buf));
+      if(inbuf.n < 1){
+        inbuf.n = 0;
+        break;
+      }
+    }
+    c = inbuf.buf[inbuf.i++];
     buf[i++] = c;
     if(c == '\n' || c == '\r')
       break;
@@ -97,10 +258,187 @@ memmove(void *vdst, const void *vsrc, int n)
 {
   char *dst;
   const char *src;
+  int m;
 
   dst = vdst;
   src = vsrc;
-  while(n-- > 0)
-    *dst++ = *src++;
+  if(n <= 0)
+    return vdst;
+  if(src < dst && src + n > dst){
+    // dst overlaps the end of src: copy backwards.
+    dst += n;
+    src += n;
+    while(n-- > 0)
+      *--dst = *--src;
+    return vdst;
+  }
+  m = 0;
+  if(n >= SSEMIN && havesse2())
+    ssecopy(dst, src, m = n & ~63);
+  movsl(dst + m, src + m, (n - m) / 4);
+  movsb(dst + (n & ~3), src + (n & ~3), n % 4);
   return vdst;
 }
+
+// Threads.  thread_create() runs fn(arg) in a new thread, on a
+// stack from malloc(), and thread_join() waits for one to end
+// and frees its stack.  A thread ends by returning from fn or
+// calling exit().
+#define TSTACK 4096  // clone() takes a page of stack
+
+struct tstart {
+  void (*fn)(void*);
+  void *arg;
+};
+
+static void
+tstart(void *a)
+{
+  struct tstart *t = a;
+
+  t->fn(t->arg);
+  exit();
+}
+
+int
+thread_create(void (*fn)(void*), void *arg)
+{
+  struct tstart *t;
+  int pid;
+
+  if((t = malloc(sizeof(*t) + TSTACK)) == 0)
+    return -1;
+  t->fn = fn;
+  t->arg = arg;
+  fflush(-1);  // else the thread could write it too
+  threaded = 1;
+  if((pid = clone(tstart, t, t + 1)) < 0)
+    free(t);
+  return pid;
+}
+
+int
+thread_join(void)
+{
+  void *stack;
+  int pid;
+
+  if((pid = join(&stack)) >= 0)
+    free((struct tstart*)stack - 1);
+  return pid;
+}
+
+// Mutexes and condition variables, after Drepper, "Futexes Are
+// Tricky".  A mutex is 0 if unlocked, 1 if locked, and 2 if
+// locked with threads perhaps waiting, so that taking and
+// releasing an uncontended mutex doesn't enter the kernel.
+void
+mutex_lock(struct mutex *m)
+{
+  int c;
+
+  if((c = __sync_val_compare_and_swap(&m->v, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = xchg((uint*)&m->v, 2);
+  while(c != 0){
+    futex_wait(&m->v, 2);
+    c = xchg((uint*)&m->v, 2);
+  }
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__sync_fetch_and_sub(&m->v, 1) != 1){
+    m->v = 0;
+    futex_wake(&m->v, 1);
+  }
+}
+
+// Release m, wait for cond_signal() or cond_broadcast(),
+// and take m again.  Wakeups may be spurious.
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+  int seq;
+
+  seq = c->seq;
+  mutex_unlock(m);
+  futex_wait(&c->seq, seq);
+  // As in mutex_lock(), but leave m contended: other
+  // threads woken with us may be waiting for it.
+  while(xchg((uint*)&m->v, 2) != 0)
+    futex_wait(&m->v, 2);
+}
+
+void
+cond_signal(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 0x7fffffff);
+}
+
+// Read from the kernel's vdso page; see vdso.h.
+int
+uptime(void)
+{
+  return ((struct vdso*)VDSO)->ticks;
+}
+
+// The vdso page can't hold a per-process pid,
+// so ask the kernel once and remember; but threads
+// share the memory it would be remembered in.
+int
+getpid(void)
+{
+  if(threaded)
+    return _getpid();
+  if(mypid == 0)
+    mypid = _getpid();
+  return mypid;
+}
+
+// Run argv[0] with the kernel recording into the per-CPU rings
+// that ctl controls: profile() or ktrace(), whose commands have
+// the same numbers.  A child drains the rings, up to nrec
+// records at a time, into buf and passes each batch to
+// put(buf, n), until recording stops and they are empty or put
+// returns -1.  Returns the records lost, or -1.
+int
+ringrun(int (*ctl)(int, void*, int), void *buf, int nrec,
+        int (*put)(void*, int), char **argv)
+{
+  int n, pid, drainer, lost, w;
+
+  if(ctl(PROF_START, 0, 0) < 0)
+    return -1;
+  if((drainer = fork()) == 0){
+    while((n = ctl(PROF_READ, buf, nrec)) >= 0){
+      if(n == 0)
+        sleep(1);
+      else if(put(buf, n) < 0)
+        break;
+    }
+    exit();
+  }
+  if((pid = fork()) == 0){
+    exec(argv[0], argv);
+    printf(2, "exec %s failed\n", argv[0]);
+    exit();
+  }
+  while((w = wait()) >= 0 && w != pid)
+    if(w == drainer)
+      drainer = 0;
+  lost = ctl(PROF_STOP, 0, 0);
+  while(drainer && (w = wait()) >= 0 && w != drainer)
+    ;
+  return lost;
+}
@@ -3,7 +3,10 @@
 #include "user.h"
 #include "param.h"
 
-// Memory allocator by Kernighan and Ritchie,
+// Memory allocator.  Small blocks come from per-size-class free
+// lists, refilled a page at a time and freed in O(1); they are
+// never merged back.  Larger blocks, and the pages for the small
+// lists, come from the allocator by Kernighan and Ritchie,
 // The C programming Language, 2nd ed.  Section 8.7.
 
 typedef long Align;
@@ -18,11 +21,20 @@ union header {
 
 typedef union header Header;
 
+#define NCLASS   8           // small classes hold 16<<i bytes, header included
+#define SMALL    0x80000000  // s.size of a small block: SMALL|class
+#define CHUNK    4096        // bytes carved up per small class refill
+#define MINCORE  8192        // min units to sbrk() for large blocks
+
+// malloc() and free() may be called from several threads.
+static struct mutex lock;
+
 static Header base;
 static Header *freep;
+static Header *freelist[NCLASS];
 
-void
-free(void *ap)
+static void
+bigfree(void *ap)
 {
   Header *bp, *p;
 
@@ -49,19 +61,19 @@ morecore(uint nu)
   char *p;
   Header *hp;
 
-  if(nu < 4096)
-    nu = 4096;
+  if(nu < MINCORE)
+    nu = MINCORE;
   p = sbrk(nu * sizeof(Header));
   if(p == (char*)-1)
     return 0;
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  bigfree((void*)(hp + 1));
   return freep;
 }
 
-void*
-malloc(uint nbytes)
+static void*
+bigmalloc(uint nbytes)
 {
   Header *p, *prevp;
   uint nunits;
@@ -88,3 +100,65 @@ malloc(uint nbytes)
         return 0;
   }
 }
+
+// Fill the free list of class c from a fresh CHUNK.
+static int
+refill(int c)
+{
+  char *p;
+  Header *hp;
+  uint sz, i;
+
+  if((p = bigmalloc(CHUNK)) == 0)
+    return -1;
+  sz = 16 << c;
+  for(i = 0; i + sz <= CHUNK; i += sz){
+    hp = (Header*)(p + i);
+    hp->s.ptr = freelist[c];
+    freelist[c] = hp;
+  }
+  return 0;
+}
+
+void*
+malloc(uint nbytes)
+{
+  Header *p;
+  int c;
+
+  for(c = 0; c < NCLASS; c++)
+    if(nbytes + sizeof(Header) <= (16 << c))
+      break;
+  mutex_lock(&lock);
+  if(c == NCLASS){
+    p = bigmalloc(nbytes);
+    mutex_unlock(&lock);
+    return p;
+  }
+  if(freelist[c] == 0 && refill(c) < 0){
+    mutex_unlock(&lock);
+    return 0;
+  }
+  p = freelist[c];
+  freelist[c] = p->s.ptr;
+  p->s.size = SMALL | c;
+  mutex_unlock(&lock);
+  return (void*)(p + 1);
+}
+
+void
+free(void *ap)
+{
+  Header *bp;
+  int c;
+
+  bp = (Header*)ap - 1;
+  mutex_lock(&lock);
+  if(bp->s.size & SMALL){
+    c = bp->s.size & ~SMALL;
+    bp->s.ptr = freelist[c];
+    freelist[c] = bp;
+  } else
+    bigfree(ap);
+  mutex_unlock(&lock);
+}
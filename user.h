@@ -1,5 +1,21 @@
 struct stat;
 struct rtcdate;
+struct ring;
+struct lockstat;
+struct profsample;
+struct tracerec;
+struct rusage;
+struct iovec;
+struct pollfd;
+
+// ulib.c mutexes and condition variables; zero to initialize.
+struct mutex {
+  volatile int v;
+};
+
+struct cond {
+  volatile int seq;
+};
 
 // system calls
 int fork(void);
@@ -23,6 +39,34 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int splice(int, int, int);
+int ringsetup(struct ring*);
+int ringenter(int);
+int lockstat(struct lockstat*, int);
+int profile(int, struct profsample*, int);
+int ktrace(int, struct tracerec*, int);
+int getrusage(int, struct rusage*);
+int nice(int);
+int mount(char*, int);
+int readv(int, struct iovec*, int);
+int writev(int, struct iovec*, int);
+int pread(int, void*, int, int);
+int pwrite(int, const void*, int, int);
+int fsync(int);
+int sync(void);
+int clone(void(*)(void*), void*, void*);
+int join(void**);
+int futex_wait(volatile int*, int);
+int futex_wake(volatile int*, int);
+int poll(struct pollfd*, int, int);
+int _fork(void);
+int _exit(void) __attribute__((noreturn));
+int _close(int);
+int _exec(char*, char**);
+int _getpid(void);
+int _uptime(void);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -31,9 +75,20 @@ void *memmove(void*, const void*, int);
 char* strchr(const char*, char c);
 int strcmp(const char*, const char*);
 void printf(int, const char*, ...);
+void fflush(int);
+void putc(int, char);
 char* gets(char*, int max);
 uint strlen(const char*);
 void* memset(void*, int, uint);
+int memcmp(const void*, const void*, uint);
 void* malloc(uint);
 void free(void*);
 int atoi(const char*);
+int thread_create(void(*)(void*), void*);
+int thread_join(void);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
+int ringrun(int(*)(int, void*, int), void*, int, int(*)(void*, int), char**);
@@ -184,6 +184,10 @@ writetest(void)
   printf(stdout, "small file test ok\n");
 }
 
+// Enough blocks to need the double-indirect block,
+// yet few enough to fit on the disk.
+#define BIGFILE (NDIRECT + NINDIRECT + 2*NINDIRECT)
+
 void
 writetest1(void)
 {
@@ -197,7 +201,7 @@ writetest1(void)
     exit();
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGFILE; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, 512) != 512){
       printf(stdout, "error: write big file failed\n", i);
@@ -217,7 +221,7 @@ writetest1(void)
   for(;;){
     i = read(fd, buf, 512);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != BIGFILE){
         printf(stdout, "read only %d blocks from big", n);
         exit();
       }
@@ -354,6 +358,108 @@ pipe1(void)
   printf(1, "pipe1 ok\n");
 }
 
+// Whole, aligned pages written to a pipe are handed over
+// rather than copied (see pipegift() in pipe.c).  The reader
+// must get them as they were when written, whatever the
+// writer does to its pages after, and whether or not the
+// reader's own page is still copy-on-write shared with them.
+char gpage[5][4096] __attribute__((aligned(4096)));
+
+static int
+gcheck(char *p, int n, int seed)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    if(p[i] != (char)(i * 7 + seed))
+      return -1;
+  return 0;
+}
+
+static void
+gfill(char *p, int n, int seed)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    p[i] = i * 7 + seed;
+}
+
+void
+pipegift(void)
+{
+  int fds[2], pid;
+
+  printf(1, "pipe gift test\n");
+  if(pipe(fds) != 0){
+    printf(1, "pipe() failed\n");
+    exit();
+  }
+
+  gfill(gpage[0], 4096, 1);
+  memset(gpage[1], 0, 4096);
+  if(write(fds[1], gpage[0], 4096) != 4096){
+    printf(1, "pipe gift: write failed\n");
+    exit();
+  }
+  memset(gpage[0], 0, 4096);
+  if(read(fds[0], gpage[1], 4096) != 4096 || gcheck(gpage[1], 4096, 1) < 0){
+    printf(1, "pipe gift: got the page as changed after write\n");
+    exit();
+  }
+
+  // The child reads into its copy-on-write copy of the page
+  // its parent writes.
+  gfill(gpage[0], 4096, 2);
+  if((pid = fork()) < 0){
+    printf(1, "fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    close(fds[1]);
+    if(read(fds[0], gpage[0], 4096) != 4096 || gcheck(gpage[0], 4096, 2) < 0)
+      printf(1, "pipe gift: shared reader page wrong\n");
+    exit();
+  }
+  if(write(fds[1], gpage[0], 4096) != 4096){
+    printf(1, "pipe gift: write failed\n");
+    exit();
+  }
+  gfill(gpage[0], 4096, 3);
+  wait();
+  if(gcheck(gpage[0], 4096, 3) < 0){
+    printf(1, "pipe gift: writer's page changed\n");
+    exit();
+  }
+
+  // Fill the pipe with handed-over pages, read a little, and
+  // write into the freed start of the first, whose rest is unread.
+  gfill(gpage[0], 4*4096, 4);
+  if(write(fds[1], gpage[0], 4*4096) != 4*4096){
+    printf(1, "pipe gift: write failed\n");
+    exit();
+  }
+  if(read(fds[0], gpage[4], 100) != 100 || gcheck(gpage[4], 100, 4) < 0){
+    printf(1, "pipe gift: short read wrong\n");
+    exit();
+  }
+  gfill(gpage[4], 100, 5);
+  if(write(fds[1], gpage[4], 100) != 100){
+    printf(1, "pipe gift: write failed\n");
+    exit();
+  }
+  memset(gpage[0], 0, 5*4096);
+  if(read(fds[0], gpage[0] + 100, 4*4096) != 4*4096 ||
+     gcheck(gpage[0] + 100, 4*4096 - 100, 4 + 100*7) < 0 ||
+     gcheck(gpage[0] + 4*4096, 100, 5) < 0){
+    printf(1, "pipe gift: unread data lost\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  printf(1, "pipe gift test OK\n");
+}
+
 // meant to be run w/ at most two CPUs
 void
 preempt(void)
@@ -1373,6 +1479,265 @@ iref(void)
   printf(1, "empty file name OK\n");
 }
 
+// The RAM disk mounted on /tmp: files on it, links that can't
+// cross from one disk to the other, .. out of the mount point,
+// and a full disk failing writes rather than the kernel.
+void
+tmpfstest(void)
+{
+  struct stat st, rst;
+  int fd, n, tot;
+
+  printf(1, "tmpfs test\n");
+  unlink("/tmp/tf");
+  if((fd = open("/tmp/tf", O_CREATE|O_RDWR)) < 0){
+    printf(1, "create /tmp/tf failed\n");
+    exit();
+  }
+  memset(buf, 't', 1000);
+  if(write(fd, buf, 1000) != 1000){
+    printf(1, "write /tmp/tf failed\n");
+    exit();
+  }
+  close(fd);
+  memset(buf, 0, 1000);
+  if((fd = open("/tmp/tf", O_RDONLY)) < 0 || read(fd, buf, 2000) != 1000 ||
+     buf[0] != 't' || buf[999] != 't'){
+    printf(1, "read /tmp/tf failed\n");
+    exit();
+  }
+  if(fstat(fd, &st) < 0 || st.dev != RAMDEV){
+    printf(1, "/tmp/tf not on the RAM disk\n");
+    exit();
+  }
+  close(fd);
+
+  if(link("/tmp/tf", "tflink") == 0 || link("README", "/tmp/tflink") == 0){
+    printf(1, "link across disks succeeded\n");
+    exit();
+  }
+  if(link("/tmp/tf", "/tmp/tf2") != 0 || unlink("/tmp/tf") != 0){
+    printf(1, "link in /tmp failed\n");
+    exit();
+  }
+  if(open("/tmp/tf", O_RDONLY) >= 0 || (fd = open("/tmp/tf2", O_RDONLY)) < 0){
+    printf(1, "/tmp/tf2 not a link to /tmp/tf\n");
+    exit();
+  }
+  close(fd);
+  if(unlink("/tmp/tf2") != 0){
+    printf(1, "unlink /tmp/tf2 failed\n");
+    exit();
+  }
+
+  if(mkdir("/tmp/td") != 0 || chdir("/tmp/td") != 0){
+    printf(1, "mkdir /tmp/td failed\n");
+    exit();
+  }
+  if((fd = open("../..", O_RDONLY)) < 0 || fstat(fd, &st) < 0){
+    printf(1, "open /tmp/td/../.. failed\n");
+    exit();
+  }
+  close(fd);
+  if((fd = open("/", O_RDONLY)) < 0 || fstat(fd, &rst) < 0){
+    printf(1, "open / failed\n");
+    exit();
+  }
+  close(fd);
+  if(st.dev != rst.dev || st.ino != rst.ino){
+    printf(1, "/tmp/.. isn't /\n");
+    exit();
+  }
+  if(chdir("/") != 0 || unlink("/tmp/td") != 0){
+    printf(1, "unlink /tmp/td failed\n");
+    exit();
+  }
+
+  if((fd = open("/tmp/full", O_CREATE|O_RDWR)) < 0){
+    printf(1, "create /tmp/full failed\n");
+    exit();
+  }
+  memset(buf, 'f', sizeof(buf));
+  for(tot = 0; (n = write(fd, buf, sizeof(buf))) == sizeof(buf); tot += n)
+    if(tot > RAMDISKSIZE*BSIZE){
+      printf(1, "wrote more than the RAM disk holds\n");
+      exit();
+    }
+  close(fd);
+  if(tot < RAMDISKSIZE*BSIZE/2){
+    printf(1, "RAM disk full after %d bytes\n", tot);
+    exit();
+  }
+  if(unlink("/tmp/full") != 0){
+    printf(1, "unlink /tmp/full failed\n");
+    exit();
+  }
+  if((fd = open("/tmp/full", O_CREATE|O_RDWR)) < 0 ||
+     write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf(1, "RAM disk still full after unlink\n");
+    exit();
+  }
+  close(fd);
+  unlink("/tmp/full");
+  printf(1, "tmpfs test OK\n");
+}
+
+// poll() on pipes and the console: ready at once, not until
+// the timeout, and when the other end of a pipe is closed.
+void
+polltest(void)
+{
+  struct pollfd fds[3];
+  int p[2], pid, t0;
+  char c;
+
+  printf(1, "poll test\n");
+  if(pipe(p) != 0){
+    printf(1, "pipe() failed\n");
+    exit();
+  }
+  fds[0].fd = p[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = p[1];
+  fds[1].events = POLLOUT;
+  fds[2].fd = 1;
+  fds[2].events = POLLOUT;
+  if(poll(fds, 3, 0) != 2 || fds[0].revents != 0 ||
+     fds[1].revents != POLLOUT || fds[2].revents != POLLOUT){
+    printf(1, "poll: wrong fds ready for an empty pipe and the console\n");
+    exit();
+  }
+  if(write(p[1], "x", 1) != 1 || poll(fds, 1, 0) != 1 ||
+     fds[0].revents != POLLIN){
+    printf(1, "poll: pipe with data not readable\n");
+    exit();
+  }
+  read(p[0], &c, 1);
+
+  t0 = uptime();
+  if(poll(fds, 1, 2) != 0 || fds[0].revents != 0){
+    printf(1, "poll: empty pipe readable\n");
+    exit();
+  }
+  if(uptime() - t0 < 2){
+    printf(1, "poll returned before the timeout\n");
+    exit();
+  }
+
+  fds[1].fd = -1;  // skipped
+  fds[2].fd = NOFILE - 1;
+  fds[2].events = POLLIN;
+  if(poll(fds + 1, 2, 0) != 1 || fds[1].revents != 0 ||
+     fds[2].revents != POLLNVAL){
+    printf(1, "poll: wrong revents for a closed fd\n");
+    exit();
+  }
+
+  if((pid = fork()) == 0){
+    sleep(2);
+    exit();  // so closing the last write end
+  }
+  close(p[1]);
+  if(poll(fds, 1, -1) != 1 || fds[0].revents != POLLHUP){
+    printf(1, "poll: not woken by the writer closing\n");
+    exit();
+  }
+  wait();
+  close(p[0]);
+  printf(1, "poll test OK\n");
+}
+
+// readv(), writev(), pread() and pwrite(): buffers that
+// straddle a block boundary, an empty buffer, and the file
+// offset that only the first two move.
+void
+iovtest(void)
+{
+  struct iovec iov[3];
+  struct stat st;
+  char *a, *b, c;
+  int fd, i;
+
+  printf(1, "iov test\n");
+  a = buf;
+  b = buf + 4096;
+  unlink("iovfile");
+  if((fd = open("iovfile", O_CREATE|O_RDWR)) < 0){
+    printf(1, "open iovfile failed\n");
+    exit();
+  }
+  memset(a, 'a', 100);
+  memset(a + 100, 'b', 400);
+  memset(a + 500, 'c', 300);
+  if(write(fd, a, 100) != 100){
+    printf(1, "write iovfile failed\n");
+    exit();
+  }
+  iov[0].iov_base = a + 100;
+  iov[0].iov_len = 400;
+  iov[1].iov_base = a;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = a + 500;
+  iov[2].iov_len = 300;  // to 800, across the end of block 0
+  if(writev(fd, iov, 3) != 700){
+    printf(1, "writev failed\n");
+    exit();
+  }
+
+  if(pread(fd, b, 800, 0) != 800 || memcmp(a, b, 800) != 0){
+    printf(1, "pread didn't read what writev wrote\n");
+    exit();
+  }
+  if(write(fd, "z", 1) != 1 || pread(fd, &c, 1, 800) != 1 || c != 'z'){
+    printf(1, "pread moved the file offset\n");
+    exit();
+  }
+  if(pwrite(fd, "Q", 1, 511) != 1 || write(fd, "y", 1) != 1){
+    printf(1, "pwrite failed\n");
+    exit();
+  }
+  a[511] = 'Q';
+  if(fstat(fd, &st) < 0 || st.size != 802){
+    printf(1, "pwrite moved the file offset\n");
+    exit();
+  }
+  close(fd);
+
+  if((fd = open("iovfile", O_RDONLY)) < 0){
+    printf(1, "open iovfile failed\n");
+    exit();
+  }
+  memset(b, 0, 1024);
+  iov[0].iov_base = b;
+  iov[0].iov_len = 505;
+  iov[1].iov_base = b + 505;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = b + 505;
+  iov[2].iov_len = 10;  // 505 to 515
+  if(readv(fd, iov, 3) != 515){
+    printf(1, "readv failed\n");
+    exit();
+  }
+  for(i = 0; i < 515; i++){
+    if(b[i] != a[i]){
+      printf(1, "readv: wrong byte at %d\n", i);
+      exit();
+    }
+  }
+  iov[0].iov_len = 1024;
+  if(readv(fd, iov, 1) != 802 - 515 || b[802 - 515 - 1] != 'y'){
+    printf(1, "readv didn't read on from the offset\n");
+    exit();
+  }
+  if(readv(fd, iov, 1) != 0){
+    printf(1, "readv past the end read\n");
+    exit();
+  }
+  close(fd);
+  unlink("iovfile");
+  printf(1, "iov test OK\n");
+}
+
 // test that fork fails gracefully
 // the forktest binary also does this, but it runs out of proc entries first.
 // inside the bigger usertests binary, we run out of memory first.
@@ -1383,7 +1748,7 @@ forktest(void)
 
   printf(1, "fork test\n");
 
-  for(n=0; n<1000; n++){
+  for(n=0; n<NPROC+100; n++){
     pid = fork();
     if(pid < 0)
       break;
@@ -1391,8 +1756,8 @@ forktest(void)
       exit();
   }
 
-  if(n == 1000){
-    printf(1, "fork claimed to work 1000 times!\n");
+  if(n == NPROC+100){
+    printf(1, "fork claimed to work %d times!\n", n);
     exit();
   }
 
@@ -1411,6 +1776,243 @@ forktest(void)
   printf(1, "fork test OK\n");
 }
 
+// clone() and join(): a thread shares memory and the file
+// table; join() returns its pid and stack.
+volatile int tshared;
+char tstack[2][4096] __attribute__((aligned(4096)));
+
+void
+tset(void *arg)
+{
+  tshared = (int)arg;
+  exit();
+}
+
+void
+twrite(void *arg)
+{
+  if(write((int)arg, "x", 1) != 1)
+    printf(1, "clone: thread write failed\n");
+  exit();
+}
+
+void
+tclose(void *arg)
+{
+  close((int)arg);
+  exit();
+}
+
+void
+tlast(void *arg)
+{
+  sleep(2);  // for the thread that made this one to exit
+  tshared = 3;
+  if(write((int)arg, "y", 1) != 1)
+    printf(1, "clone: last thread write failed\n");
+  exit();
+}
+
+void
+clonetest(void)
+{
+  int pid, fds[2];
+  void *stack;
+  char c;
+
+  printf(1, "clone test\n");
+
+  tshared = 0;
+  if((pid = clone(tset, (void*)7, tstack[0])) < 0){
+    printf(1, "clone failed\n");
+    exit();
+  }
+  if(join(&stack) != pid || stack != tstack[0]){
+    printf(1, "join returned the wrong thread\n");
+    exit();
+  }
+  if(tshared != 7){
+    printf(1, "clone: memory not shared\n");
+    exit();
+  }
+  if(join(&stack) != -1){
+    printf(1, "join with no threads succeeded\n");
+    exit();
+  }
+
+  if(pipe(fds) != 0){
+    printf(1, "pipe() failed\n");
+    exit();
+  }
+  if((pid = clone(twrite, (void*)fds[1], tstack[0])) < 0 ||
+     join(&stack) != pid){
+    printf(1, "clone failed\n");
+    exit();
+  }
+  if(read(fds[0], &c, 1) != 1 || c != 'x'){
+    printf(1, "clone: open files not shared\n");
+    exit();
+  }
+  if((pid = clone(tclose, (void*)fds[1], tstack[0])) < 0 ||
+     join(&stack) != pid){
+    printf(1, "clone failed\n");
+    exit();
+  }
+  if(write(fds[1], "x", 1) != -1){
+    printf(1, "clone: file table not shared\n");
+    exit();
+  }
+  close(fds[0]);
+
+  // The thread outlives the one that made it, in memory that
+  // must stay until the last thread exits.
+  if(pipe(fds) != 0){
+    printf(1, "pipe() failed\n");
+    exit();
+  }
+  if((pid = fork()) == 0){
+    close(fds[0]);
+    if(clone(tlast, (void*)fds[1], tstack[0]) < 0)
+      printf(1, "clone failed\n");
+    exit();
+  }
+  close(fds[1]);
+  if(wait() != pid){
+    printf(1, "wait failed\n");
+    exit();
+  }
+  if(read(fds[0], &c, 1) != 1 || c != 'y' || read(fds[0], &c, 1) != 0){
+    printf(1, "clone: last thread didn't finish\n");
+    exit();
+  }
+  close(fds[0]);
+
+  printf(1, "clone test OK\n");
+}
+
+// Two threads fault in the same fresh pages at once; both
+// writes must land in the one page each address gets.
+#define NTPAGE 16
+volatile int tgo;
+char *tmem;
+
+void
+tfault(void *arg)
+{
+  int i, k;
+
+  k = (int)arg;
+  while(!tgo)
+    ;
+  for(i = 0; i < NTPAGE; i++)
+    tmem[i*4096 + k] = k + 1;
+  exit();
+}
+
+void
+threadfault(void)
+{
+  void *stack;
+  int i;
+
+  printf(1, "thread fault test\n");
+  tmem = sbrk(NTPAGE*4096);
+  tgo = 0;
+  if(clone(tfault, (void*)0, tstack[0]) < 0 ||
+     clone(tfault, (void*)1, tstack[1]) < 0){
+    printf(1, "clone failed\n");
+    exit();
+  }
+  tgo = 1;
+  if(join(&stack) < 0 || join(&stack) < 0){
+    printf(1, "join failed\n");
+    exit();
+  }
+  for(i = 0; i < NTPAGE; i++){
+    if(tmem[i*4096] != 1 || tmem[i*4096 + 1] != 2){
+      printf(1, "thread fault: lost a write to page %d\n", i);
+      exit();
+    }
+  }
+  sbrk(-NTPAGE*4096);
+  printf(1, "thread fault test OK\n");
+}
+
+// futex_wait() and futex_wake(), and the mutexes built on them.
+#define NTCOUNT 2000
+volatile int tfutex;
+volatile int tcount;
+struct mutex tmutex;
+
+void
+twaiter(void *arg)
+{
+  while(tfutex == 0)
+    futex_wait(&tfutex, 0);
+  exit();
+}
+
+void
+tcounter(void *arg)
+{
+  int i, j, c;
+
+  for(i = 0; i < NTCOUNT; i++){
+    mutex_lock(&tmutex);
+    c = tcount;
+    for(j = 0; j < 10; j++)  // widen the window for a lost update
+      ;
+    tcount = c + 1;
+    mutex_unlock(&tmutex);
+  }
+  exit();
+}
+
+void
+futextest(void)
+{
+  int n;
+
+  printf(1, "futex test\n");
+
+  tfutex = 0;
+  if((n = futex_wake(&tfutex, 1)) != 0){
+    printf(1, "futex_wake with no waiters woke %d\n", n);
+    exit();
+  }
+  if(futex_wait(&tfutex, 1) != -1){
+    printf(1, "futex_wait slept on the wrong value\n");
+    exit();
+  }
+  if(thread_create(twaiter, 0) < 0){
+    printf(1, "thread_create failed\n");
+    exit();
+  }
+  sleep(2);  // for it to wait
+  tfutex = 1;
+  futex_wake(&tfutex, 1);
+  if(thread_join() < 0){
+    printf(1, "futex waiter didn't wake\n");
+    exit();
+  }
+
+  tcount = 0;
+  if(thread_create(tcounter, 0) < 0 || thread_create(tcounter, 0) < 0){
+    printf(1, "thread_create failed\n");
+    exit();
+  }
+  if(thread_join() < 0 || thread_join() < 0){
+    printf(1, "thread_join failed\n");
+    exit();
+  }
+  if(tcount != 2*NTCOUNT){
+    printf(1, "mutex: count %d, not %d\n", tcount, 2*NTCOUNT);
+    exit();
+  }
+
+  printf(1, "futex test OK\n");
+}
+
 void
 sbrktest(void)
 {
@@ -1781,18 +2383,25 @@ main(int argc, char *argv[])
 
   mem();
   pipe1();
+  pipegift();
   preempt();
   exitwait();
+  polltest();
 
   rmdot();
   fourteen();
   bigfile();
+  iovtest();
+  tmpfstest();
   subdir();
   linktest();
   unlinkread();
   dirfile();
   iref();
   forktest();
+  clonetest();
+  threadfault();
+  futextest();
   bigdir(); // slow
 
   uio();
@@ -0,0 +1,16 @@
+// A read-only page that the kernel maps into every process at
+// VDSO, so that user code can read these without a system call.
+
+#define VDSO 0x7FFFF000  // KERNBASE - PGSIZE
+
+#define HWCAP_SSE2 0x1   // SSE2, with its state saved across switches
+
+struct vdso {
+  uint ticks;            // as returned by uptime()
+  int ncpu;
+  uint hwcap;            // HWCAP_ bits
+  struct {
+    int pid;             // process running on the CPU, or 0
+    uint nswtch;         // processes switched to
+  } cpu[NCPU];
+};
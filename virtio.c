@@ -0,0 +1,288 @@
+// Driver for a virtio block device (legacy PCI interface), as
+// provided by QEMU's virtio-blk-pci.  It replaces ide.c in
+// kernelvirtio and offers the same interface to bio.c; see
+// make qemu-virtio.  Unlike the IDE disk, the device can work
+// on many requests at once, so iderw() only queues a request
+// and, unless it is asynchronous, sleeps until it completes.
+//
+// http://docs.oasis-open.org/virtio/virtio/v1.0/virtio-v1.0.html
+// (section 4.1.4.8 describes the legacy interface).
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "traps.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "trace.h"
+
+#define VIRTIO_VENDOR     0x1af4
+#define VIRTIO_BLK_DEVICE 0x1001  // transitional virtio-blk
+
+// Legacy virtio registers, relative to BAR0 (an I/O BAR).
+#define VIRTIO_GUEST_FEATURES  0x04
+#define VIRTIO_QUEUE_PFN       0x08
+#define VIRTIO_QUEUE_SIZE      0x0c
+#define VIRTIO_QUEUE_SELECT    0x0e
+#define VIRTIO_QUEUE_NOTIFY    0x10
+#define VIRTIO_STATUS          0x12
+#define VIRTIO_ISR             0x13
+
+// Device status bits.
+#define VIRTIO_ACK        1
+#define VIRTIO_DRIVER     2
+#define VIRTIO_DRIVER_OK  4
+
+#define SECTOR_SIZE   512
+#define NDESC         256  // most descriptors we have room for
+
+// Virtqueue layout, in one physically contiguous area: the
+// descriptor table and available ring, then, on the next page
+// boundary, the used ring.
+struct vdesc {
+  uint addr;
+  uint addrhi;
+  uint len;
+  ushort flags;
+  ushort next;
+};
+#define VDESC_NEXT   1  // chained with next
+#define VDESC_WRITE  2  // device writes (vs reads)
+
+struct vavail {
+  ushort flags;
+  ushort idx;
+  ushort ring[];
+};
+
+struct vusedelem {
+  uint id;   // head of the completed descriptor chain
+  uint len;
+};
+
+struct vused {
+  ushort flags;
+  ushort idx;
+  struct vusedelem ring[];
+};
+
+#define VRING_AVAIL(n) (16*(n) + 6 + 2*(n))
+#define VRING_USED(n)  (6 + 8*(n))
+#define VRING_SIZE(n)  (PGROUNDUP(VRING_AVAIL(n)) + PGROUNDUP(VRING_USED(n)))
+
+// Request header, read by the device.
+struct vblkreq {
+  uint type;
+  uint reserved;
+  uint sector;
+  uint sectorhi;
+};
+#define VIRTIO_BLK_T_IN   0  // read
+#define VIRTIO_BLK_T_OUT  1  // write
+
+static struct spinlock vlock;
+static ushort iobase;
+static int qsize;
+static volatile struct vdesc *desc;
+static volatile struct vavail *avail;
+static volatile struct vused *used;
+static ushort usedidx;   // how far we have looked in used->ring
+
+// Each request uses three descriptors: header, data, status.
+// Per-request state is kept by the index of the first.
+static struct {
+  struct vblkreq req;
+  uchar status;
+  struct buf *b;
+} info[NDESC];
+static char freedesc[NDESC];
+static int nfree;
+static int reqstat;  // stats.c counter of requests
+
+static uchar vring[VRING_SIZE(NDESC)] __attribute__((aligned(PGSIZE)));
+
+int ideirq;
+
+void
+ideinit(void)
+{
+  int dev, func, i;
+  uint bar;
+
+  initlock(&vlock, "virtio");
+  reqstat = statalloc("virtio.req", 1);
+  if(pcifind(0x00, 0xffffffff, (VIRTIO_BLK_DEVICE<<16)|VIRTIO_VENDOR,
+             &dev, &func) < 0)
+    panic("virtio: no block device");
+  bar = pciread(dev, func, 0x10);
+  if((bar & 1) == 0)
+    panic("virtio: BAR0 not I/O");
+  iobase = bar & 0xfffc;
+  pciwrite(dev, func, 0x04, pciread(dev, func, 0x04) | 0x5);  // I/O + master
+  ideirq = pciread(dev, func, 0x3c) & 0xff;
+
+  // Reset, then tell the device we know how to drive it.
+  // We need none of its optional features.
+  outb(iobase+VIRTIO_STATUS, 0);
+  outb(iobase+VIRTIO_STATUS, VIRTIO_ACK);
+  outb(iobase+VIRTIO_STATUS, VIRTIO_ACK|VIRTIO_DRIVER);
+  outl(iobase+VIRTIO_GUEST_FEATURES, 0);
+
+  outw(iobase+VIRTIO_QUEUE_SELECT, 0);
+  qsize = inw(iobase+VIRTIO_QUEUE_SIZE);
+  if(qsize == 0 || qsize > NDESC)
+    panic("virtio: bad queue size");
+  desc = (volatile struct vdesc*)vring;
+  avail = (volatile struct vavail*)(vring + 16*qsize);
+  used = (volatile struct vused*)(vring + PGROUNDUP(VRING_AVAIL(qsize)));
+  for(i = 0; i < qsize; i++)
+    freedesc[i] = 1;
+  nfree = qsize;
+  outl(iobase+VIRTIO_QUEUE_PFN, V2P(vring) >> 12);
+
+  outb(iobase+VIRTIO_STATUS, VIRTIO_ACK|VIRTIO_DRIVER|VIRTIO_DRIVER_OK);
+  ioapicenable(ideirq, ncpu - 1);
+}
+
+// Allocate a descriptor.  Caller must hold vlock.
+static int
+allocdesc(void)
+{
+  int i;
+
+  for(i = 0; i < qsize; i++){
+    if(freedesc[i]){
+      freedesc[i] = 0;
+      nfree--;
+      return i;
+    }
+  }
+  panic("virtio: no descriptors");
+}
+
+// Free the descriptor chain starting at i.
+// Caller must hold vlock.
+static void
+freechain(int i)
+{
+  for(;;){
+    freedesc[i] = 1;
+    nfree++;
+    if((desc[i].flags & VDESC_NEXT) == 0)
+      break;
+    i = desc[i].next;
+  }
+  wakeup(&freedesc);
+}
+
+static void
+setdesc(int i, void *addr, uint len, int flags, int next)
+{
+  desc[i].addr = V2P(addr);
+  desc[i].addrhi = 0;
+  desc[i].len = len;
+  desc[i].flags = flags;
+  desc[i].next = next;
+}
+
+// Interrupt handler.
+void
+ideintr(void)
+{
+  struct buf *b;
+  int id;
+
+  acquire(&vlock);
+
+  // Reading the ISR acknowledges the interrupt.
+  inb(iobase+VIRTIO_ISR);
+  __sync_synchronize();
+
+  while(usedidx != used->idx){
+    id = used->ring[usedidx % qsize].id;
+    b = info[id].b;
+    info[id].b = 0;
+    if(info[id].status != 0)
+      panic("virtio: request failed");
+
+    trace(TR_DISKDONE, b->blockno, (b->flags & B_DIRTY) != 0);
+    // Wake process waiting for this buf, or release
+    // it if nobody is waiting (read-ahead, bawrite).
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->flags & B_ASYNC){
+      b->flags &= ~B_ASYNC;
+      bdone(b);
+    } else
+      wakeup(b);
+    freechain(id);
+    usedidx++;
+  }
+
+  release(&vlock);
+}
+
+//PAGEBREAK!
+// Sync buf with disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// If B_ASYNC is set, return without waiting; ideintr() releases
+// the buf when the transfer is done.
+void
+iderw(struct buf *b)
+{
+  int d0, d1, d2;
+
+  if(!holdingsleep(&b->lock))
+    panic("iderw: buf not locked");
+  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
+    panic("iderw: nothing to do");
+  if(b->dev != 1)
+    panic("iderw: request not for disk 1");
+
+  acquire(&vlock);
+  statinc(reqstat);
+
+  while(nfree < 3)
+    sleep(&freedesc, &vlock);
+  d0 = allocdesc();
+  d1 = allocdesc();
+  d2 = allocdesc();
+
+  info[d0].req.type = (b->flags & B_DIRTY) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  info[d0].req.reserved = 0;
+  info[d0].req.sector = b->blockno * (BSIZE/SECTOR_SIZE);
+  info[d0].req.sectorhi = 0;
+  info[d0].status = 0xff;  // device writes 0 on success
+  info[d0].b = b;
+  setdesc(d0, &info[d0].req, sizeof(info[d0].req), VDESC_NEXT, d1);
+  setdesc(d1, b->data, BSIZE,
+          VDESC_NEXT | ((b->flags & B_DIRTY) ? 0 : VDESC_WRITE), d2);
+  setdesc(d2, &info[d0].status, 1, VDESC_WRITE, 0);
+
+  // Publish the descriptors before the ring entry,
+  // and the ring entry before the index.
+  avail->ring[avail->idx % qsize] = d0;
+  __sync_synchronize();
+  avail->idx++;
+  __sync_synchronize();
+  trace(TR_DISKSTART, b->blockno, (b->flags & B_DIRTY) != 0);
+  outw(iobase+VIRTIO_QUEUE_NOTIFY, 0);
+
+  // Wait for request to finish.
+  if(b->flags & B_ASYNC){
+    release(&vlock);
+    return;
+  }
+  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
+    sleep(b, &vlock);
+  }
+
+  release(&vlock);
+}
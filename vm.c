@@ -5,11 +5,34 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "spinlock.h"
 #include "elf.h"
+#include "vdso.h"
+#include "fcntl.h"
+#include "traps.h"
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
 
+#define TLBMAX 32  // most pages a shootdown invlpg()s
+struct vdso *vdso;  // mapped at VDSO in every process
+
+// Threads share a page table, and may fault on the same page at
+// once.  A page table's lock, one of a few hashed by its
+// address, serializes installing and changing its user PTEs:
+// pagefault() and the others re-check a PTE under it before
+// they change it, having done anything that may sleep first.
+// It also guards the vmspace's sz and vmas against pagefault();
+// see struct vmspace.
+#define NPTLOCK 64
+static struct spinlock ptlocks[NPTLOCK];
+
+struct spinlock*
+ptlock(pde_t *pgdir)
+{
+  return &ptlocks[((uint)pgdir / PGSIZE) % NPTLOCK];
+}
+
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
 void
@@ -27,6 +50,19 @@ seginit(void)
   c->gdt[SEG_UCODE] = SEG(STA_X|STA_R, 0, 0xffffffff, DPL_USER);
   c->gdt[SEG_UDATA] = SEG(STA_W, 0, 0xffffffff, DPL_USER);
   lgdt(c->gdt, sizeof(c->gdt));
+
+  // System calls by sysenter.  The CPU loads esp from the MSR;
+  // point it at the top of this CPU's entry stack, a real one,
+  // as sysenter keeps the user's TF and a single-step trap may
+  // push a frame there before sysentry clears it.  The top word
+  // holds the address of the TSS esp0, which switchuvm() keeps
+  // at the current process's kernel stack, for sysentry to load.
+  // sysexit returns to SEG_UCODE and SEG_UDATA, which must
+  // follow SEG_KCODE and SEG_KDATA as they do.
+  c->entrystack[NELEM(c->entrystack)-1] = (uint)&c->ts.esp0;
+  wrmsr(MSR_SYSENTER_CS, SEG_KCODE<<3);
+  wrmsr(MSR_SYSENTER_ESP, (uint)&c->entrystack[NELEM(c->entrystack)-1]);
+  wrmsr(MSR_SYSENTER_EIP, (uint)sysentry);
 }
 
 // Return the address of the PTE in page table pgdir
@@ -42,10 +78,9 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
   if(*pde & PTE_P){
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
   } else {
-    if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
-      return 0;
     // Make sure all those PTE_P bits are zero.
-    memset(pgtab, 0, PGSIZE);
+    if(!alloc || (pgtab = (pte_t*)kzalloc()) == 0)
+      return 0;
     // The permissions here are overly generous, but they can
     // be further restricted by the permissions in the page table
     // entries, if necessary.
@@ -92,13 +127,14 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 //   KERNBASE..KERNBASE+EXTMEM: mapped to 0..EXTMEM (for I/O space)
 //   KERNBASE+EXTMEM..data: mapped to EXTMEM..V2P(data)
 //                for the kernel's instructions and r/o data
-//   data..KERNBASE+PHYSTOP: mapped to V2P(data)..PHYSTOP,
+//   data..KERNBASE+phystop: mapped to V2P(data)..phystop,
 //                                  rw data + free physical memory
 //   0xfe000000..0: mapped direct (devices such as ioapic)
 //
 // The kernel allocates physical memory for its heap and for user memory
-// between V2P(end) and the end of physical memory (PHYSTOP)
-// (directly addressable from end..P2V(PHYSTOP)).
+// between V2P(end) and the end of physical memory (phystop, which
+// kinit1() finds), directly addressable from end..P2V(phystop).
+// That leaves room for up to PHYSTOP bytes of memory.
 
 // This table defines the kernel's mappings, which are present in
 // every process's page table.
@@ -110,10 +146,38 @@ static struct kmap {
 } kmap[] = {
  { (void*)KERNBASE, 0,             EXTMEM,    PTE_W}, // I/O space
  { (void*)KERNLINK, V2P(KERNLINK), V2P(data), 0},     // kern text+rodata
- { (void*)data,     V2P(data),     PHYSTOP,   PTE_W}, // kern data+memory
+ { (void*)data,     V2P(data),     0,         PTE_W}, // kern data+memory; phystop
  { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
 };
 
+// Like mappages(), but for kernel mappings: use 4MB pages
+// for the parts that cover whole, aligned 4MB of va and pa.
+// Fewer pages mean fewer TLB misses, and every new page table
+// needs far fewer page table pages for the kernel part.
+static int
+kmappages(pde_t *pgdir, char *va, uint size, uint pa, int perm)
+{
+  uint n;
+
+  while(size > 0){
+    if((uint)va % BIGPGSIZE == 0 && pa % BIGPGSIZE == 0 &&
+       size >= BIGPGSIZE){
+      if(pgdir[PDX(va)] & PTE_P)
+        panic("remap");
+      pgdir[PDX(va)] = pa | perm | PTE_P | PTE_PS;
+      n = BIGPGSIZE;
+    } else {
+      if(mappages(pgdir, va, PGSIZE, pa, perm) < 0)
+        return -1;
+      n = PGSIZE;
+    }
+    va += n;
+    pa += n;
+    size -= n;
+  }
+  return 0;
+}
+
 // Set up kernel part of a page table.
 pde_t*
 setupkvm(void)
@@ -121,17 +185,30 @@ setupkvm(void)
   pde_t *pgdir;
   struct kmap *k;
 
-  if((pgdir = (pde_t*)kalloc()) == 0)
+  if((pgdir = (pde_t*)kzalloc()) == 0)
     return 0;
-  memset(pgdir, 0, PGSIZE);
   if (P2V(PHYSTOP) > (void*)DEVSPACE)
     panic("PHYSTOP too high");
   for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
-    if(mappages(pgdir, k->virt, k->phys_end - k->phys_start,
-                (uint)k->phys_start, k->perm) < 0) {
+    if(kmappages(pgdir, k->virt, k->phys_end - k->phys_start,
+                 (uint)k->phys_start, k->perm | PTE_G) < 0) {
       freevm(pgdir);
       return 0;
     }
+
+  // The vdso page, read-only to the user.  The first call, from
+  // kvmalloc(), allocates it; each mapping holds a reference,
+  // which freevm() drops.
+  if(vdso == 0){
+    if((vdso = (struct vdso*)kalloc()) == 0)
+      panic("setupkvm: vdso");
+    memset(vdso, 0, PGSIZE);
+  }
+  if(mappages(pgdir, (char*)VDSO, PGSIZE, V2P(vdso), PTE_U) < 0){
+    freevm(pgdir);
+    return 0;
+  }
+  kref((char*)vdso);
   return pgdir;
 }
 
@@ -140,16 +217,40 @@ setupkvm(void)
 void
 kvmalloc(void)
 {
+  int i;
+
+  for(i = 0; i < NPTLOCK; i++)
+    initlock(&ptlocks[i], "pgdir");
+  kmap[2].phys_end = phystop;  // kern data+memory
   kpgdir = setupkvm();
   switchkvm();
 }
 
-// Switch h/w page table register to the kernel-only page table,
-// for when no process is running.
+// Switch h/w page table register to the kernel-only page table.
+// The kernel's mappings are global (PTE_G) and the same in every
+// page table, so loading cr3 only flushes user mappings.
 void
 switchkvm(void)
 {
   lcr3(V2P(kpgdir));   // switch to the kernel page table
+  if(ncpu > 0)
+    mycpu()->pgdir = 0;
+}
+
+// Point this CPU's TSS at p's kernel stack.
+// Caller must have interrupts disabled.
+static void
+settss(struct proc *p)
+{
+  mycpu()->gdt[SEG_TSS] = SEG16(STS_T32A, &mycpu()->ts,
+                                sizeof(mycpu()->ts)-1, 0);
+  mycpu()->gdt[SEG_TSS].s = 0;
+  mycpu()->ts.ss0 = SEG_KDATA << 3;
+  mycpu()->ts.esp0 = (uint)p->kstack + KSTACKSIZE;
+  // setting IOPL=0 in eflags *and* iomb beyond the tss segment limit
+  // forbids I/O instructions (e.g., inb and outb) from user space
+  mycpu()->ts.iomb = (ushort) 0xFFFF;
+  ltr(SEG_TSS << 3);
 }
 
 // Switch TSS and h/w page table to correspond to process p.
@@ -164,16 +265,116 @@ switchuvm(struct proc *p)
     panic("switchuvm: no pgdir");
 
   pushcli();
-  mycpu()->gdt[SEG_TSS] = SEG16(STS_T32A, &mycpu()->ts,
-                                sizeof(mycpu()->ts)-1, 0);
-  mycpu()->gdt[SEG_TSS].s = 0;
-  mycpu()->ts.ss0 = SEG_KDATA << 3;
-  mycpu()->ts.esp0 = (uint)p->kstack + KSTACKSIZE;
-  // setting IOPL=0 in eflags *and* iomb beyond the tss segment limit
-  // forbids I/O instructions (e.g., inb and outb) from user space
-  mycpu()->ts.iomb = (ushort) 0xFFFF;
-  ltr(SEG_TSS << 3);
+  settss(p);
+  // Set pgdir first, for tlbflush(): a shootdown either sees
+  // it, or its PTE changes are done before the lcr3.
+  mycpu()->pgdir = p->pgdir;
   lcr3(V2P(p->pgdir));  // switch to process's address space
+  mycpu()->uvmproc = p;
+  mycpu()->uvmnrun = p->nrun;
+  popcli();
+}
+
+// Like switchuvm(), for the scheduler, but skip loading cr3,
+// which flushes the TLB, if p's page table is still loaded
+// from when p last ran on this CPU and p has not run on
+// another CPU since, nor has a thread sharing it.  (Without
+// a vmspace, p is a thread on its way out of exit().)
+void
+resumeuvm(struct proc *p)
+{
+  struct cpu *c;
+
+  pushcli();
+  c = mycpu();
+  if(c->pgdir == p->pgdir && c->uvmproc == p && c->uvmnrun == p->nrun &&
+     p->vm && p->vm->ref == 1){
+    p->nrun++;
+    c->uvmnrun = p->nrun;
+    settss(p);
+  } else {
+    p->nrun++;
+    switchuvm(p);
+  }
+  popcli();
+}
+
+// TLB shootdown.  After changing or removing PTEs of user
+// addresses [start, end) in pgdir, tlbflush() invalidates them
+// in the TLB of every CPU that is running pgdir: itself, and
+// others by an IPI, which it waits for.  A CPU that has pgdir
+// loaded but is idle in the scheduler is left alone (lazy
+// shootdown): resumeuvm() reloads cr3 anyway when the process
+// it resumes shares its memory or has run elsewhere since.
+// Each CPU has one request of its own in flight at most, in
+// its struct cpu, and while waiting serves others' requests,
+// so that two CPUs shooting at each other can't deadlock.
+// The caller must not hold ptlock(pgdir): a thread of pgdir
+// spinning for it with interrupts off could not answer.
+// Ranges of at most TLBMAX pages are invalidated with invlpg,
+// bigger ones by reloading cr3.
+
+static void
+tlbflushlocal(pde_t *pgdir, uint start, uint end)
+{
+  uint a;
+
+  if(mycpu()->pgdir != pgdir)
+    return;  // cr3 was reloaded since
+  if(end - start > TLBMAX*PGSIZE){
+    lcr3(V2P(pgdir));
+    return;
+  }
+  for(a = PGROUNDDOWN(start); a < end; a += PGSIZE)
+    invlpg((char*)a);
+}
+
+// Do the shootdowns other CPUs have asked this one for.
+// Called with interrupts disabled.
+void
+tlbintr(void)
+{
+  struct cpu *c;
+  uint me;
+
+  me = 1 << (mycpu() - cpus);
+  for(c = cpus; c < &cpus[ncpu]; c++){
+    if(c->tlbwait & me){
+      tlbflushlocal(c->tlbpgdir, c->tlbstart, c->tlbend);
+      __sync_fetch_and_and(&c->tlbwait, ~me);
+    }
+  }
+}
+
+void
+tlbflush(pde_t *pgdir, uint start, uint end)
+{
+  struct cpu *c, *me;
+  uint mask;
+
+  if(start >= end)
+    return;
+  pushcli();
+  me = mycpu();
+  tlbflushlocal(pgdir, start, end);
+  me->tlbpgdir = pgdir;
+  me->tlbstart = start;
+  me->tlbend = end;
+  __sync_synchronize();  // PTE changes before reading c->pgdir
+  mask = 0;
+  for(c = cpus; c < &cpus[ncpu]; c++)
+    if(c != me && c->pgdir == pgdir && c->proc)
+      mask |= 1 << (c - cpus);
+  if(mask){
+    me->tlbwait = mask;
+    for(c = cpus; c < &cpus[ncpu]; c++)
+      if(mask & (1 << (c - cpus)))
+        lapicipi(c->apicid, T_IRQ0 + IRQ_TLB);
+    while(me->tlbwait){
+      tlbintr();
+      pause();
+    }
+  }
   popcli();
 }
 
@@ -186,34 +387,25 @@ inituvm(pde_t *pgdir, char *init, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kzalloc();
   mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W|PTE_U);
   memmove(mem, init, sz);
 }
 
-// Load a program segment into pgdir.  addr must be page-aligned
-// and the pages from addr to addr+sz must already be mapped.
-int
-loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
+// Allocate a page of user memory, zeroed if zero is set,
+// swapping pages out to make room if need be.
+static char*
+uvmalloc(int zero)
 {
-  uint i, pa, n;
-  pte_t *pte;
+  char *mem;
 
-  if((uint) addr % PGSIZE != 0)
-    panic("loaduvm: addr must be page aligned");
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, addr+i, 0)) == 0)
-      panic("loaduvm: address should exist");
-    pa = PTE_ADDR(*pte);
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, P2V(pa), offset+i, n) != n)
-      return -1;
+  for(;;){
+    if((mem = zero ? kzalloc() : kalloc()) != 0)
+      return mem;
+    // swapout() sleeps, so not if the caller holds spinlocks.
+    if((!(readeflags() & FL_IF) && mycpu()->ncli > 0) || swapout() == 0)
+      return 0;
   }
-  return 0;
 }
 
 // Allocate page tables and physical memory to grow process from oldsz to
@@ -224,20 +416,19 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
   char *mem;
   uint a;
 
-  if(newsz >= KERNBASE)
+  if(newsz >= VDSO)
     return 0;
   if(newsz < oldsz)
     return oldsz;
 
   a = PGROUNDUP(oldsz);
   for(; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = uvmalloc(1);
     if(mem == 0){
       cprintf("allocuvm out of memory\n");
       deallocuvm(pgdir, newsz, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
       cprintf("allocuvm out of memory (2)\n");
       deallocuvm(pgdir, newsz, oldsz);
@@ -256,12 +447,19 @@ int
 deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 {
   pte_t *pte;
-  uint a, pa;
+  uint a, pa, start;
+  char *freed[TLBMAX];
+  int n;
 
   if(newsz >= oldsz)
     return oldsz;
 
-  a = PGROUNDUP(newsz);
+  // Threads on other CPUs may use a page until it is
+  // flushed from their TLBs, so free the pages in batches,
+  // each after a shootdown, made with ptlock released.
+  acquire(ptlock(pgdir));
+  n = 0;
+  a = start = PGROUNDUP(newsz);
   for(; a  < oldsz; a += PGSIZE){
     pte = walkpgdir(pgdir, (char*)a, 0);
     if(!pte)
@@ -270,26 +468,55 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       pa = PTE_ADDR(*pte);
       if(pa == 0)
         panic("kfree");
-      char *v = P2V(pa);
-      kfree(v);
+      *pte = 0;
+      freed[n++] = P2V(pa);
+      if(n == TLBMAX){
+        release(ptlock(pgdir));
+        tlbflush(pgdir, start, a + PGSIZE);
+        while(n > 0)
+          kfree(freed[--n]);
+        start = a + PGSIZE;
+        acquire(ptlock(pgdir));
+      }
+    } else if(*pte & PTE_SWAP){
+      swapfree(*pte);
       *pte = 0;
     }
   }
+  release(ptlock(pgdir));
+  if(n > 0){
+    tlbflush(pgdir, start, a);
+    while(n > 0)
+      kfree(freed[--n]);
+  }
   return newsz;
 }
 
 // Free a page table and all the physical memory pages
-// in the user part.
+// in the user part.  Idle CPUs may still have pgdir loaded,
+// so first ask them to drop it, waking any that are halted
+// (pairing with idle() as kick() does), and wait; the caller
+// must not hold spinlocks.
 void
 freevm(pde_t *pgdir)
 {
+  struct cpu *c;
   uint i;
 
   if(pgdir == 0)
     panic("freevm: no pgdir");
+  for(c = cpus; c < &cpus[ncpu]; c++){
+    if(*(pde_t* volatile*)&c->pgdir != pgdir)
+      continue;
+    xchg((uint*)&c->dropuvm, 1);  // a full barrier, before reading c->idle
+    if(c->idle)
+      lapicipi(c->apicid, T_IRQ0 + IRQ_WAKE);
+    while(*(pde_t* volatile*)&c->pgdir == pgdir)
+      pause();
+  }
   deallocuvm(pgdir, KERNBASE, 0);
   for(i = 0; i < NPDENTRIES; i++){
-    if(pgdir[i] & PTE_P){
+    if((pgdir[i] & (PTE_P|PTE_PS)) == PTE_P){
       char * v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
     }
@@ -311,39 +538,480 @@ clearpteu(pde_t *pgdir, char *uva)
 }
 
 // Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child.  The child shares the parent's pages;
+// writable ones become read-only copy-on-write in both, and
+// the first write to one copies it (see cowpage()), except
+// for pages of MAP_SHARED mappings, which stay shared.  Pages
+// the parent has not touched yet are left for the child to
+// fault in too.  pgdir must be the current page table.
 pde_t*
-copyuvm(pde_t *pgdir, uint sz)
+copyuvm(pde_t *pgdir)
 {
   pde_t *d;
   pte_t *pte;
   uint pa, i, flags;
-  char *mem;
 
   if((d = setupkvm()) == 0)
     return 0;
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
+  acquire(ptlock(pgdir));  // against threads' faults
+  for(i = 0; i < VDSO; i += PGSIZE){  // setupkvm() mapped the vdso
+    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0){
+      i = PGADDR(PDX(i) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
+    if(*pte & PTE_SWAP){
+      // Share the slot; neither will write to it again.
+      flags = *pte;
+      if((pte = walkpgdir(d, (void*)i, 1)) == 0)
+        goto bad;
+      *pte = flags;
+      swapdup(flags);
+      continue;
+    }
     if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
+      continue;
+    if((*pte & (PTE_W|PTE_SHARED)) == PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto bad;
-    memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
-      kfree(mem);
+    if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0)
       goto bad;
-    }
+    kref(P2V(pa));
   }
+  release(ptlock(pgdir));
+  tlbflush(pgdir, 0, VDSO);  // the parent's now read-only entries
   return d;
 
 bad:
+  release(ptlock(pgdir));
+  tlbflush(pgdir, 0, VDSO);
   freevm(d);
   return 0;
 }
 
+// Give the copy-on-write page at *pte, for va in pgdir, a
+// private, writable copy, or just make it writable if nobody
+// else shares it any more.  Returns 0 on success, or if another
+// thread changed the PTE first, and -1 if out of memory.
+static int
+cowpage(pde_t *pgdir, uint va, pte_t *pte)
+{
+  pte_t old;
+  uint pa;
+  char *mem;
+
+  old = *pte;
+  pa = PTE_ADDR(old);
+  mem = 0;
+  if(krefcount(P2V(pa)) > 1 && (mem = uvmalloc(0)) == 0)
+    return -1;
+
+  acquire(ptlock(pgdir));
+  if(*pte != old || (mem == 0 && krefcount(P2V(pa)) > 1)){
+    // Changed meanwhile; the caller's fault will retry.
+    release(ptlock(pgdir));
+    if(mem)
+      kfree(mem);
+    return 0;
+  }
+  if(krefcount(P2V(pa)) > 1){
+    memmove(mem, P2V(pa), PGSIZE);
+    *pte = V2P(mem) | ((PTE_FLAGS(old) | PTE_W) & ~PTE_COW);
+    release(ptlock(pgdir));
+    tlbflush(pgdir, va, va + PGSIZE);  // threads still read the old page
+    kfree(P2V(pa));
+    return 0;
+  }
+  // Threads with the read-only entry cached take a spurious
+  // fault on writing; see pagefault().
+  *pte = (old | PTE_W) & ~PTE_COW;
+  release(ptlock(pgdir));
+  if(mem)
+    kfree(mem);  // the sharer let go meanwhile
+  return 0;
+}
+
+// Find a page for address a, in vma v or (if v is 0) the heap.
+// If a falls in v's file data, use the page cache's page of
+// the file, else a fresh zeroed page.  Private file pages are
+// mapped copy-on-write.  Sets *perm to the PTE permissions to
+// map the page with.
+static char*
+fillpage(struct vma *v, uint a, int *perm)
+{
+  uint n;
+
+  *perm = PTE_U|PTE_W;
+  if(v){
+    *perm = PTE_U;
+    if(v->flags & MAP_SHARED)
+      *perm |= PTE_SHARED;
+    if(v->prot & PROT_WRITE)
+      *perm |= PTE_W;
+    if(a - v->start < v->filesz){
+      n = v->filesz - (a - v->start);
+      if(n > PGSIZE)
+        n = PGSIZE;
+      if(v->flags & MAP_PRIVATE)
+        *perm = PTE_U|PTE_COW;
+      return pcget(v->ip, v->off + (a - v->start), n);
+    }
+  }
+
+  return uvmalloc(1);
+}
+
+// Handle a fault at va of p in vma v, a copy, or the heap if v
+// is 0; gen is p->vm->gen when v was looked up.
+static int
+fault(struct proc *p, struct vma *v, uint va, uint err, uint gen)
+{
+  pte_t *pte, old;
+  char *mem;
+  uint a;
+  int perm, locked;
+
+  // Reading the swap space or a file sleeps, which a kernel
+  // copy made with a spinlock held can't; such a fault fails.
+  locked = !(readeflags() & FL_IF) && mycpu()->ncli > 0;
+  a = PGROUNDDOWN(va);
+  pte = walkpgdir(p->pgdir, (char*)a, 0);
+  if(pte && ((old = *pte) & PTE_SWAP)){
+    if(locked)
+      return -1;
+    if((mem = swapin(old)) == 0)
+      goto oom;
+    acquire(ptlock(p->pgdir));
+    if(*pte == old){
+      *pte = V2P(mem) | (PTE_FLAGS(old) & ~PTE_SWAP) | PTE_P;
+      swapfree(old);
+      mem = 0;
+    }
+    release(ptlock(p->pgdir));
+    if(mem)
+      kfree(mem);  // a thread sharing the page read it meanwhile
+    // Retry, in case this is also a write to a COW page.
+    return 0;
+  }
+  if(pte && (*pte & PTE_P)){
+    // Present: the only fault we fix is a write to a COW page,
+    // or to one another thread made writable since this CPU
+    // cached its PTE.
+    if((err & FEC_WR) && (*pte & (PTE_U|PTE_W)) == (PTE_U|PTE_W)){
+      invlpg((char*)a);
+      return 0;
+    }
+    if(!(err & FEC_WR) ||
+       (*pte & (PTE_U|PTE_COW)) != (PTE_U|PTE_COW))
+      return -1;
+    if(v && !(v->prot & PROT_WRITE))
+      return -1;
+    if(cowpage(p->pgdir, a, pte) < 0)
+      goto oom;
+    invlpg((char*)a);
+    return 0;
+  }
+
+  // Not touched yet.
+  if(locked && v && a - v->start < v->filesz)
+    return -1;
+  if((mem = fillpage(v, a, &perm)) == 0)
+    goto oom;
+  acquire(ptlock(p->pgdir));
+  if((pte = walkpgdir(p->pgdir, (char*)a, 1)) == 0){
+    release(ptlock(p->pgdir));
+    kfree(mem);
+    goto oom;
+  }
+  if(p->vm->gen != gen || (*pte & (PTE_P|PTE_SWAP))){
+    // Someone else filled it while we read, or unmapped it;
+    // a retry sees which.
+    release(ptlock(p->pgdir));
+    kfree(mem);
+    return 0;
+  }
+  *pte = V2P(mem) | perm | PTE_P;
+  release(ptlock(p->pgdir));
+  return 0;
+
+oom:
+  cprintf("pagefault: out of memory\n");
+  return -1;
+}
+
+// Handle a page fault at user address va of the current
+// process p; err is the fault's error code.  Returns 0 if the
+// faulting instruction can be restarted, -1 if the access was
+// in error.  A thread's munmap() or sbrk() may change the vmas
+// meanwhile, so fault() works on a copy of va's vma, and
+// munmap() waits for vm->nfill to drop to 0 before it lets go
+// of a vma's file.
+int
+pagefault(struct proc *p, uint va, uint err)
+{
+  struct vma *v, vma;
+  uint gen;
+  int r;
+
+  if(va >= KERNBASE)
+    return -1;
+  acquire(ptlock(p->pgdir));
+  gen = p->vm->gen;
+  v = vmalookup(p, va);
+  if(va >= p->vm->sz && v == 0){
+    release(ptlock(p->pgdir));
+    return -1;
+  }
+  if(v){
+    vma = *v;
+    v = &vma;
+    p->vm->nfill++;
+  }
+  release(ptlock(p->pgdir));
+
+  r = fault(p, v, va, err, gen);
+
+  if(v){
+    acquire(ptlock(p->pgdir));
+    if(--p->vm->nfill == 0)
+      wakeup(&p->vm->nfill);
+    release(ptlock(p->pgdir));
+  }
+  return r;
+}
+
+// Wait until no pagefault() of p's is using a copy of a vma,
+// after changing the vmas and before dropping a vma's file.
+void
+uvmfillwait(struct proc *p)
+{
+  acquire(ptlock(p->pgdir));
+  while(p->vm->nfill > 0)
+    sleep(&p->vm->nfill, ptlock(p->pgdir));
+  release(ptlock(p->pgdir));
+}
+
+// Return the end of the run of p's heap and mappings that
+// holds user address va, or 0 if va is in neither, for
+// checking system call pointers.
+uint
+uvmend(struct proc *p, uint va)
+{
+  struct vma *v;
+  uint end;
+
+  acquire(ptlock(p->pgdir));
+  for(end = va;;){
+    if(end < p->vm->sz)
+      end = p->vm->sz;
+    else if((v = vmalookup(p, end)) != 0)
+      end = v->end;
+    else
+      break;
+  }
+  release(ptlock(p->pgdir));
+  return end == va ? 0 : end;
+}
+
+// If the page at user address va is present and dirty, clear
+// its dirty bit and return its kernel address; else return 0.
+char*
+uvmdirty(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+
+  pte = walkpgdir(pgdir, (char*)va, 0);
+  if(pte == 0 || (*pte & (PTE_P|PTE_D)) != (PTE_P|PTE_D))
+    return 0;
+  *pte &= ~PTE_D;
+  tlbflush(pgdir, va, va + PGSIZE);  // else writes could skip setting it
+  return P2V(PTE_ADDR(*pte));
+}
+
+// Fault in the current process's pages in [va, va+n) ahead of
+// accessing them with a spinlock held, since reading a page
+// from its file sleeps.  For a write, also break COW.
+// The process is pinned in memory until uvmunpin(), which
+// the caller must do once it is done with the pages, and
+// before it sleeps for long.  Returns -1, not pinned, if a
+// page can't be faulted in.
+int
+uvmprefault(uint va, uint n, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  uint a;
+
+  p->pinned++;  // see swappick()
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if(pte && (*pte & PTE_SWAP) && pagefault(p, a, 0) < 0)
+      goto bad;
+    if(pte == 0 || !(*pte & PTE_P) || (write && (*pte & PTE_COW)))
+      if(pagefault(p, a, write ? FEC_WR : 0) < 0)
+        goto bad;
+  }
+  return 0;
+
+bad:
+  p->pinned--;
+  return -1;
+}
+
+// Undo a uvmprefault().
+void
+uvmunpin(void)
+{
+  myproc()->pinned--;
+}
+
+// For futexes: return the kernel address of the current
+// process's int at user address va, faulting its page in if
+// need be, with ptlock(pgdir) held so that the page stays put
+// until the caller releases it; and set *shared if the page is
+// MAP_SHARED.  Returns 0, the lock not held, if va isn't mapped.
+int*
+uvmfutex(uint va, int *shared)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+
+  if(va % sizeof(int))
+    return 0;
+  for(;;){
+    acquire(ptlock(p->pgdir));
+    pte = walkpgdir(p->pgdir, (char*)va, 0);
+    if(pte && (*pte & (PTE_P|PTE_U)) == (PTE_P|PTE_U)){
+      *shared = (*pte & PTE_SHARED) != 0;
+      return (int*)(P2V(PTE_ADDR(*pte)) + va % PGSIZE);
+    }
+    release(ptlock(p->pgdir));
+    if(uvmprefault(va, sizeof(int), 0) < 0)
+      return 0;
+    uvmunpin();  // it is checked again under the lock
+  }
+}
+
+// Copy n bytes from src to dst, either of which may be in the
+// current process's memory.  Returns -1 if a user page can't be
+// faulted in (out of memory, or not mapped after all), where a
+// plain memmove() would fault forever; trap() kills the process.
+int
+copyuser(void *dst, void *src, uint n)
+{
+  if(myproc() == 0){
+    memmove(dst, src, n);
+    return 0;
+  }
+  return ucopy(dst, src, n, &myproc()->onfault);
+}
+
+// Page handoff for pipes.  A private, writable page of the
+// current process, one not shared with anyone, can be traded
+// without copying it; only a process whose memory no other
+// thread shares does so, as nothing else changes its PTEs.
+static pte_t*
+uvmprivate(uint va)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+
+  if(va >= KERNBASE || va % PGSIZE || p->vm->ref != 1)
+    return 0;
+  pte = walkpgdir(p->pgdir, (char*)va, 0);
+  if(pte == 0 || (*pte & (PTE_P|PTE_U|PTE_W|PTE_SHARED)) != (PTE_P|PTE_U|PTE_W) ||
+     krefcount(P2V(PTE_ADDR(*pte))) != 1)
+    return 0;
+  return pte;
+}
+
+// Make the current process's page at va copy-on-write and
+// return it with a reference added, for the caller to read
+// later as it is now; or 0 if it can't be.  A page that is
+// copy-on-write already is shared as it is, unless it is a
+// file's, from the page cache, which writes to the file change.
+char*
+uvmshare(uint va)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+
+  if((pte = uvmprivate(va)) != 0){
+    *pte = (*pte & ~PTE_W) | PTE_COW;
+    tlbflush(p->pgdir, va, va + PGSIZE);
+  } else {
+    if(va >= KERNBASE || va % PGSIZE || p->vm->ref != 1)
+      return 0;
+    pte = walkpgdir(p->pgdir, (char*)va, 0);
+    v = vmalookup(p, va);
+    if(pte == 0 || (*pte & (PTE_P|PTE_U|PTE_COW)) != (PTE_P|PTE_U|PTE_COW) ||
+       (v && va - v->start < v->filesz))
+      return 0;
+  }
+  mem = P2V(PTE_ADDR(*pte));
+  kref(mem);
+  return mem;
+}
+
+// Map page mem, and the caller's reference to it, at va in
+// the current process, copy-on-write if others share it.
+// Returns the page that was there, and its reference, or 0
+// (leaving mem with the caller) if that page is not private.
+char*
+uvmexchange(uint va, char *mem)
+{
+  pte_t *pte;
+  char *old;
+  uint flags;
+
+  if((pte = uvmprivate(va)) == 0)
+    return 0;
+  old = P2V(PTE_ADDR(*pte));
+  flags = PTE_FLAGS(*pte);
+  if(krefcount(mem) > 1)
+    flags = (flags & ~PTE_W) | PTE_COW;
+  *pte = V2P(mem) | flags;
+  tlbflush(myproc()->pgdir, va, va + PGSIZE);
+  return old;
+}
+
+// Clock replacement for swapout(): look at the user pages of
+// pgdir from *va on, for at most *scan of them, and take the
+// first that has not been accessed since the last pass, giving
+// it PTE_SWAP entry swpte.  Pages shared with the page cache,
+// other processes or MAP_SHARED mappings are passed over.
+// Returns the page, or 0 with *va at VDSO or *scan at 0.
+// pgdir must not be in use.
+char*
+uvmswapscan(pde_t *pgdir, uint *va, int *scan, uint swpte)
+{
+  pte_t *pte;
+  char *mem;
+
+  for(; *va < VDSO && *scan > 0; *va += PGSIZE){
+    if((pte = walkpgdir(pgdir, (char*)*va, 0)) == 0){
+      *va = PGADDR(PDX(*va) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
+    if((*pte & (PTE_P|PTE_U|PTE_SHARED)) != (PTE_P|PTE_U))
+      continue;
+    (*scan)--;
+    if(*pte & PTE_A){
+      *pte &= ~PTE_A;
+      continue;
+    }
+    mem = P2V(PTE_ADDR(*pte));
+    if(krefcount(mem) != 1)
+      continue;
+    *pte = swpte | (*pte & (PTE_W|PTE_U|PTE_COW));
+    *va += PGSIZE;
+    return mem;
+  }
+  return 0;
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char*
@@ -352,7 +1020,7 @@ uva2ka(pde_t *pgdir, char *uva)
   pte_t *pte;
 
   pte = walkpgdir(pgdir, uva, 0);
-  if((*pte & PTE_P) == 0)
+  if(pte == 0 || (*pte & PTE_P) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
@@ -367,10 +1035,15 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
 {
   char *buf, *pa0;
   uint n, va0;
+  pte_t *pte;
 
   buf = (char*)p;
   while(len > 0){
     va0 = (uint)PGROUNDDOWN(va);
+    // Writing through the kernel mapping does not fault.
+    if(va0 < KERNBASE && (pte = walkpgdir(pgdir, (char*)va0, 0)) != 0 &&
+       (*pte & PTE_COW) && cowpage(pgdir, va0, pte) < 0)
+      return -1;
     pa0 = uva2ka(pgdir, (char*)va0);
     if(pa0 == 0)
       return -1;